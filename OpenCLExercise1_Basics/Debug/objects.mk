@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -ldl -lboost_system -lboost_filesystem -lOpenCL
+LIBS := -ldl -lboost_system -lboost_filesystem -lOpenCL -lboost_thread -lpthread
 
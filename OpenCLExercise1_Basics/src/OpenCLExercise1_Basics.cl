@@ -7,3 +7,26 @@ __kernel void kernel1 (__global const float* d_input, __global float* d_output)
 	size_t i = get_global_id(0);
 	d_output[i]=native_cos(d_input[i]);
 }
+
+// Kernels for the comparison of the device functions with the host math functions ("math" mode)
+#define MATH_KERNEL(name, function) \
+__kernel void name (__global const float* d_input, __global float* d_output) { \
+	size_t i = get_global_id(0); \
+	d_output[i] = function(d_input[i]); \
+}
+MATH_KERNEL(cosKernel, cos)
+MATH_KERNEL(cosNativeKernel, native_cos)
+MATH_KERNEL(cosHalfKernel, half_cos)
+MATH_KERNEL(sinKernel, sin)
+MATH_KERNEL(sinNativeKernel, native_sin)
+MATH_KERNEL(sinHalfKernel, half_sin)
+MATH_KERNEL(expKernel, exp)
+MATH_KERNEL(expNativeKernel, native_exp)
+MATH_KERNEL(expHalfKernel, half_exp)
+MATH_KERNEL(logKernel, log)
+MATH_KERNEL(logNativeKernel, native_log)
+MATH_KERNEL(logHalfKernel, half_log)
+
+// Launch latency of a kernel doing nothing ("bandwidth" mode)
+__kernel void emptyKernel () {
+}
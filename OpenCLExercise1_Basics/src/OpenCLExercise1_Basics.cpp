@@ -4,8 +4,10 @@
 
 // includes
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <Core/Assert.hpp>
+#include <Core/Error.hpp>
 #include <Core/Time.hpp>
 #include <OpenCL/cl-patched.hpp>
 #include <OpenCL/Program.hpp>
@@ -16,21 +18,879 @@
 #include <sstream>
 #include <iostream>
 #include <cmath>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+#include <map>
+
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 //////////////////////////////////////////////////////////////////////////////
-// CPU implementation
+// CPU implementation: vectorized math functions
 //////////////////////////////////////////////////////////////////////////////
+// cos, sin, exp and log are computed with a range reduction and a polynomial
+// (minimax for the relative error) whose degree depends on the accuracy
+// tier. Max errors measured against double precision ("math" mode, in ulp):
+//                          cos    sin    exp    log
+//   MATH_ACCURACY_LOW:     232    232   1642    564   half_ functions class
+//   MATH_ACCURACY_MEDIUM:  1.69   1.70   69.7   15.9
+//   MATH_ACCURACY_HIGH:    1.44   1.43   0.99   0.76  like the full precision built-ins
+// With AVX2 and FMA 8 values are computed at once, otherwise one. Results of
+// exp below FLT_MIN are flushed to zero, cos / sin of arguments beyond
+// mathTrigMaxArgument are computed with std::cos / std::sin.
+enum MathFunction { MATH_COS, MATH_SIN, MATH_EXP, MATH_LOG };
+enum MathAccuracy { MATH_ACCURACY_LOW, MATH_ACCURACY_MEDIUM, MATH_ACCURACY_HIGH };
+
+const char* mathFunctionName(MathFunction function) {
+	switch (function) {
+	case MATH_COS: return "cos";
+	case MATH_SIN: return "sin";
+	case MATH_EXP: return "exp";
+	default: return "log";
+	}
+}
+const char* mathAccuracyName(MathAccuracy accuracy) {
+	switch (accuracy) {
+	case MATH_ACCURACY_LOW: return "low";
+	case MATH_ACCURACY_MEDIUM: return "medium";
+	default: return "high";
+	}
+}
+
+// Polynomial coefficients, highest degree first, for every tier (low, medium, high)
+struct MathPolynomial {
+	int count;
+	float c[9];
+};
+// sin(r) = r + r^3 P(r^2), |r| <= pi/4
+const MathPolynomial mathSinPolynomials[3] = {
+	{ 2, { 8.1632827227e-03f, -1.6663390418e-01f } },
+	{ 3, { -1.9515283835e-04f, 8.3321607675e-03f, -1.6666654610e-01f } },
+	{ 4, { 2.7223659345e-06f, -1.9839849847e-04f, 8.3333309740e-03f, -1.6666667163e-01f } },
+};
+// cos(r) = 1 + r^2 P(r^2), |r| <= pi/4
+const MathPolynomial mathCosPolynomials[3] = {
+	{ 2, { 4.0458458284e-02f, -4.9976056014e-01f } },
+	{ 3, { -1.3591854092e-03f, 4.1655777090e-02f, -4.9999884747e-01f } },
+	{ 4, { 2.4383566016e-05f, -1.3886681633e-03f, 4.1666620357e-02f, -4.9999999694e-01f } },
+};
+// exp(r) = 1 + r + r^2 P(r), |r| <= ln(2) / 2
+const MathPolynomial mathExpPolynomials[3] = {
+	{ 2, { 1.6662816851e-01f, 5.0394108881e-01f } },
+	{ 3, { 4.1277735264e-02f, 1.6753514370e-01f, 5.0005116173e-01f } },
+	{ 6, { 1.9790337052e-04f, 1.3944648766e-03f, 8.3334970391e-03f, 4.1666295091e-02f, 1.6666665869e-01f, 5.0000000676e-01f } },
+};
+// log(1 + f) = f - f^2 / 2 + f^3 P(f), sqrt(1/2) - 1 <= f <= sqrt(2) - 1
+const MathPolynomial mathLogPolynomials[3] = {
+	{ 3, { 1.7324850878e-01f, -2.6461238997e-01f, 3.3567347665e-01f } },
+	{ 5, { 1.1781789094e-01f, -1.8407180672e-01f, 2.0442207051e-01f, -2.4943833155e-01f, 3.3320860132e-01f } },
+	{ 9, { 6.7466440977e-02f, -1.1675668667e-01f, 1.1888169565e-01f, -1.2405585982e-01f, 1.4219550816e-01f, -1.6667996012e-01f, 2.0002118758e-01f, -2.5000009597e-01f, 3.3333312602e-01f } },
+};
+
+// Range reduction constants: pi / 2 and ln(2) split into parts whose
+// products with small integers are exact (the last part of pi / 2 only
+// corrects the rounding of the third one)
+const float mathPiHalf1 = 1.5703125f;
+const float mathPiHalf2 = 4.837512969970703125e-4f;
+const float mathPiHalf3 = 7.54979012640433e-8f;
+const float mathPiHalf4 = -1.71512451000588e-15f;
+const float mathTwoOverPi = 0.636619772367581343f;
+const float mathTrigMaxArgument = 8192.0f;
+const float mathLn2Hi = 0.693359375f;
+const float mathLn2Lo = -2.12194440e-4f;
+const float mathLog2e = 1.44269504088896341f;
+
+// Operations on one value (MathOps<float>) or on 8 values (MathOps<MathAvx>),
+// the algorithms below are written for both
+template <typename V> struct MathOps;
+
+template <> struct MathOps<float> {
+	typedef float Vec;
+	typedef bool Mask;
+	typedef int Int;
+	static const std::size_t width = 1;
+	static Vec set(float c) { return c; }
+	static Vec load(const float* p) { return *p; }
+	static void store(float* p, Vec x) { *p = x; }
+	static Vec add(Vec a, Vec b) { return a + b; }
+	static Vec sub(Vec a, Vec b) { return a - b; }
+	static Vec mul(Vec a, Vec b) { return a * b; }
+	static Vec div(Vec a, Vec b) { return a / b; }
+	// The product of two floats is exact in double, so this rounds (almost) like a fused multiply-add
+	static Vec fma(Vec a, Vec b, Vec c) { return (float) ((double) a * b + c); }
+	static Vec abs(Vec a) { return std::fabs(a); }
+	static Int roundToInt(Vec a) { return a == a ? (int) std::floor(a + 0.5f) : 0; }
+	static Vec toFloat(Int a) { return (float) a; }
+	static Int andInt(Int a, int b) { return a & b; }
+	static Mask equalInt(Int a, int b) { return a == b; }
+	static Mask less(Vec a, Vec b) { return a < b; }
+	static Mask greater(Vec a, Vec b) { return a > b; }
+	static Mask equal(Vec a, Vec b) { return a == b; }
+	static Mask isNan(Vec a) { return a != a; }
+	static Mask maskOr(Mask a, Mask b) { return a || b; }
+	static bool any(Mask a) { return a; }
+	static Vec select(Mask m, Vec a, Vec b) { return m ? a : b; }
+	// a * 2^k
+	static Vec scale2(Vec a, Int k) { return std::ldexp(a, k); }
+	// Mantissa in [0.5, 1) and exponent of a positive normal value
+	static Vec frexp(Vec a, Vec& exponent) {
+		int e;
+		float m = std::frexp(a, &e);
+		exponent = (float) e;
+		return m;
+	}
+};
+
+#if defined(__AVX2__) && defined(__FMA__)
+struct MathAvx;
+template <> struct MathOps<MathAvx> {
+	typedef __m256 Vec;
+	typedef __m256 Mask;
+	typedef __m256i Int;
+	static const std::size_t width = 8;
+	static Vec set(float c) { return _mm256_set1_ps(c); }
+	static Vec load(const float* p) { return _mm256_loadu_ps(p); }
+	static void store(float* p, Vec x) { _mm256_storeu_ps(p, x); }
+	static Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+	static Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+	static Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+	static Vec div(Vec a, Vec b) { return _mm256_div_ps(a, b); }
+	static Vec fma(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); }
+	static Vec abs(Vec a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+	static Int roundToInt(Vec a) { return _mm256_cvtps_epi32(a); }
+	static Vec toFloat(Int a) { return _mm256_cvtepi32_ps(a); }
+	static Int andInt(Int a, int b) { return _mm256_and_si256(a, _mm256_set1_epi32(b)); }
+	static Mask equalInt(Int a, int b) { return _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, _mm256_set1_epi32(b))); }
+	static Mask less(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static Mask greater(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static Mask equal(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	static Mask isNan(Vec a) { return _mm256_cmp_ps(a, a, _CMP_UNORD_Q); }
+	static Mask maskOr(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+	static bool any(Mask a) { return _mm256_movemask_ps(a) != 0; }
+	static Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_ps(b, a, m); }
+	// a * 2^k by adding k to the exponent field (the result has to be normal)
+	static Vec scale2(Vec a, Int k) { return _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(a), _mm256_slli_epi32(k, 23))); }
+	static Vec frexp(Vec a, Vec& exponent) {
+		__m256i bits = _mm256_castps_si256(a);
+		exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+		return _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000)));
+	}
+};
+typedef MathOps<MathAvx> MathVectorOps;
+#else
+typedef MathOps<float> MathVectorOps;
+#endif
+const std::size_t mathVectorWidth = MathVectorOps::width;
+
+template <typename O> typename O::Vec mathPolynomial(typename O::Vec x, const MathPolynomial& p) {
+	typename O::Vec r = O::set(p.c[0]);
+	for (int i = 1; i < p.count; i++)
+		r = O::fma(r, x, O::set(p.c[i]));
+	return r;
+}
+
+// cos(x) (sine = false) or sin(x) for |x| <= mathTrigMaxArgument:
+// x = k * pi / 2 + r, the quadrant k mod 4 selects +-sin(r) or +-cos(r)
+template <typename O> typename O::Vec mathCosSin(typename O::Vec x, MathAccuracy accuracy, bool sine) {
+	typedef typename O::Vec Vec;
+	Vec ax = O::abs(x);
+	typename O::Int k = O::roundToInt(O::mul(ax, O::set(mathTwoOverPi)));
+	Vec kf = O::toFloat(k);
+	Vec r = O::fma(kf, O::set(-mathPiHalf1), ax);
+	r = O::fma(kf, O::set(-mathPiHalf2), r);
+	r = O::fma(kf, O::set(-mathPiHalf3), r);
+	r = O::fma(kf, O::set(-mathPiHalf4), r);
+	Vec z = O::mul(r, r);
+	Vec s = O::fma(O::mul(r, z), mathPolynomial<O>(z, mathSinPolynomials[accuracy]), r);
+	Vec c = O::fma(z, mathPolynomial<O>(z, mathCosPolynomials[accuracy]), O::set(1.0f));
+	// cos: quadrant 0..3 gives c, -s, -c, s; sin: s, c, -s, -c
+	typename O::Int quadrant = O::andInt(k, 3);
+	Vec result;
+	if (sine) {
+		result = O::select(O::equalInt(O::andInt(k, 1), 0), s, c);
+		result = O::select(O::equalInt(O::andInt(k, 2), 0), result, O::sub(O::set(0.0f), result));
+		// sin is odd
+		result = O::select(O::less(x, O::set(0.0f)), O::sub(O::set(0.0f), result), result);
+	} else {
+		result = O::select(O::equalInt(O::andInt(k, 1), 0), c, s);
+		result = O::select(O::maskOr(O::equalInt(quadrant, 1), O::equalInt(quadrant, 2)), O::sub(O::set(0.0f), result), result);
+	}
+	return result;
+}
+
+// exp(x) = 2^k * exp(r), x = k * ln(2) + r
+template <typename O> typename O::Vec mathExp(typename O::Vec x, MathAccuracy accuracy) {
+	typedef typename O::Vec Vec;
+	// Largest float below ln(FLT_MAX) and smallest float above ln(FLT_MIN),
+	// exp of all arguments in between is a normal float
+	const float maxArgument = 88.7228317f;
+	const float minArgument = -87.3365402f;
+	Vec xc = O::select(O::greater(x, O::set(maxArgument)), O::set(maxArgument), x);
+	xc = O::select(O::less(xc, O::set(minArgument)), O::set(minArgument), xc);
+	typename O::Int k = O::roundToInt(O::mul(xc, O::set(mathLog2e)));
+	Vec kf = O::toFloat(k);
+	Vec r = O::fma(kf, O::set(-mathLn2Hi), xc);
+	r = O::fma(kf, O::set(-mathLn2Lo), r);
+	Vec p = O::add(O::fma(O::mul(r, r), mathPolynomial<O>(r, mathExpPolynomials[accuracy]), r), O::set(1.0f));
+	Vec result = O::scale2(p, k);
+	result = O::select(O::greater(x, O::set(maxArgument)), O::set(std::numeric_limits<float>::infinity()), result);
+	result = O::select(O::less(x, O::set(minArgument)), O::set(0.0f), result);
+	return O::select(O::isNan(x), x, result);
+}
+
+// log(x) = e * ln(2) + log(1 + f), x = 2^e * (1 + f), sqrt(1/2) <= 1 + f < sqrt(2)
+template <typename O> typename O::Vec mathLog(typename O::Vec x, MathAccuracy accuracy) {
+	typedef typename O::Vec Vec;
+	// Subnormal values are scaled into the normal range first
+	typename O::Mask subnormal = O::less(x, O::set(std::numeric_limits<float>::min()));
+	Vec xs = O::select(subnormal, O::mul(x, O::set(8388608.0f)), x);
+	Vec e;
+	Vec m = O::frexp(xs, e);
+	e = O::select(subnormal, O::sub(e, O::set(23.0f)), e);
+	typename O::Mask small = O::less(m, O::set(0.707106781186547524f));
+	e = O::select(small, O::sub(e, O::set(1.0f)), e);
+	Vec f = O::sub(O::select(small, O::add(m, m), m), O::set(1.0f));
+	Vec z = O::mul(f, f);
+	Vec y = O::mul(O::mul(f, z), mathPolynomial<O>(f, mathLogPolynomials[accuracy]));
+	y = O::fma(e, O::set(mathLn2Lo), y);
+	y = O::fma(z, O::set(-0.5f), y);
+	Vec result = O::fma(e, O::set(mathLn2Hi), O::add(f, y));
+
+	result = O::select(O::equal(x, O::set(std::numeric_limits<float>::infinity())), x, result);
+	result = O::select(O::equal(x, O::set(0.0f)), O::set(-std::numeric_limits<float>::infinity()), result);
+	result = O::select(O::maskOr(O::less(x, O::set(0.0f)), O::isNan(x)), O::set(std::numeric_limits<float>::quiet_NaN()), result);
+	return result;
+}
+
+template <typename O> typename O::Vec mathEvaluate(typename O::Vec x, MathFunction function, MathAccuracy accuracy) {
+	switch (function) {
+	case MATH_COS: return mathCosSin<O>(x, accuracy, false);
+	case MATH_SIN: return mathCosSin<O>(x, accuracy, true);
+	case MATH_EXP: return mathExp<O>(x, accuracy);
+	default: return mathLog<O>(x, accuracy);
+	}
+}
+
+// mathEvaluate() for any argument: lanes with a trigonometric argument
+// beyond mathTrigMaxArgument are recomputed with std::cos / std::sin
+template <typename O> typename O::Vec mathEvaluateAny(typename O::Vec x, MathFunction function, MathAccuracy accuracy) {
+	typename O::Vec result = mathEvaluate<O>(x, function, accuracy);
+	if ((function == MATH_COS || function == MATH_SIN) && O::any(O::greater(O::abs(x), O::set(mathTrigMaxArgument)))) {
+		float xs[O::width], rs[O::width];
+		O::store(xs, x);
+		O::store(rs, result);
+		for (std::size_t j = 0; j < O::width; j++)
+			if (std::fabs(xs[j]) > mathTrigMaxArgument)
+				rs[j] = function == MATH_COS ? std::cos(xs[j]) : std::sin(xs[j]);
+		result = O::load(rs);
+	}
+	return result;
+}
+
+// Values [begin, end) of one thread
+void mathHostChunk(const float* h_input, float* h_output, std::size_t begin, std::size_t end, MathFunction function, MathAccuracy accuracy) {
+	typedef MathVectorOps O;
+	typedef MathOps<float> S;
+	std::size_t i = begin;
+	for (; i + O::width <= end; i += O::width)
+		O::store(h_output + i, mathEvaluateAny<O>(O::load(h_input + i), function, accuracy));
+	for (; i < end; i++)
+		h_output[i] = mathEvaluateAny<S>(h_input[i], function, accuracy);
+}
+
+// h_output[i] = function(h_input[i]) on threadCount threads
+void mathHost(MathFunction function, MathAccuracy accuracy, const std::vector<float>& h_input, std::vector<float>& h_output, std::size_t threadCount) {
+	std::size_t count = h_input.size();
+	// Chunk boundaries are multiples of 16 values (one cache line)
+	std::size_t chunk = ((count + threadCount - 1) / threadCount + 15) / 16 * 16;
+	boost::thread_group threads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		threads.create_thread(boost::bind(mathHostChunk, h_input.data(), h_output.data(), std::min(count, t * chunk), std::min(count, (t + 1) * chunk), function, accuracy));
+	threads.join_all();
+}
+
+std::size_t mathThreadCount() {
+	return std::max(1u, boost::thread::hardware_concurrency());
+}
+
 void calculateHost (const std::vector<float>& h_input, std::vector<float>& h_output) {
-	for (std::size_t i = 0; i < h_output.size (); i++)
-		h_output[i] = std::cos (h_input[i]);
+	mathHost(MATH_COS, MATH_ACCURACY_HIGH, h_input, h_output, mathThreadCount());
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Comparison of the host math functions with the device built-ins
+//////////////////////////////////////////////////////////////////////////////
+// Error of value in units of the last place of the float closest to the exact result
+double ulpError(float value, double exact) {
+	if (exact != exact)
+		return value != value ? 0 : std::numeric_limits<double>::infinity();
+	float rounded = (float) exact;
+	if (std::fabs(rounded) > std::numeric_limits<float>::max())
+		return value == rounded ? 0 : std::numeric_limits<double>::infinity();
+	double ulp;
+	if (rounded == 0) {
+		ulp = std::ldexp(1.0, -149);
+	} else {
+		int exponent;
+		std::frexp(rounded, &exponent);
+		ulp = std::ldexp(1.0, std::max(exponent, -125) - 24);
+	}
+	if (value != value)
+		return std::numeric_limits<double>::infinity();
+	return std::fabs(value - exact) / ulp;
+}
+
+double maxUlpError(const std::vector<float>& h_output, const std::vector<double>& h_exact) {
+	double maxError = 0;
+	for (std::size_t i = 0; i < h_output.size(); i++)
+		maxError = std::max(maxError, ulpError(h_output[i], h_exact[i]));
+	return maxError;
+}
+
+void printMathResult(const std::string& name, Core::TimeSpan time, std::size_t count, double maxError) {
+	std::cout << "  " << std::setiosflags(std::ios::left) << std::setw(28) << name << std::resetiosflags(std::ios::left)
+			<< std::setw(12) << time << std::setw(10) << std::setprecision(3) << (count / time.getSeconds() * 1e-9) << " GValues/s"
+			<< std::setw(12) << std::setprecision(5) << maxError << " ulp" << std::endl;
+}
+
+// Throughput and max ulp error (against double precision) of libm, the host
+// math functions of every tier and the device functions native_*, * and half_*
+int runMathComparison(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t count, std::size_t wgSize) {
+	std::size_t size = count * sizeof (float);
+	std::size_t threadCount = mathThreadCount();
+	std::vector<float> h_input (count), h_output (count);
+	std::vector<double> h_exact (count);
+	cl::Buffer d_input(context, CL_MEM_READ_WRITE, size);
+	cl::Buffer d_output(context, CL_MEM_READ_WRITE, size);
+	std::cout << count << " values, host functions on " << threadCount << " threads, " << mathVectorWidth << " values per vector" << std::endl;
+
+	for (int f = MATH_COS; f <= MATH_LOG; f++) {
+		MathFunction function = (MathFunction) f;
+		std::string name = mathFunctionName(function);
+		// cos / sin on [-100, 100], exp on [-80, 80], log on [2^-100, 2^100]
+		for (std::size_t i = 0; i < count; i++) {
+			double u = (double) rand() / RAND_MAX;
+			switch (function) {
+			case MATH_COS: case MATH_SIN: h_input[i] = (float) (200 * u - 100); h_exact[i] = function == MATH_COS ? std::cos((double) h_input[i]) : std::sin((double) h_input[i]); break;
+			case MATH_EXP: h_input[i] = (float) (160 * u - 80); h_exact[i] = std::exp((double) h_input[i]); break;
+			default: h_input[i] = (float) std::ldexp(1.0, (int) (200 * u) - 100) * (float) (1 + u); h_exact[i] = std::log((double) h_input[i]); break;
+			}
+		}
+		std::cout << name << ":" << std::endl;
+
+		// libm, one thread
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		for (std::size_t i = 0; i < count; i++) {
+			switch (function) {
+			case MATH_COS: h_output[i] = std::cos(h_input[i]); break;
+			case MATH_SIN: h_output[i] = std::sin(h_input[i]); break;
+			case MATH_EXP: h_output[i] = std::exp(h_input[i]); break;
+			default: h_output[i] = std::log(h_input[i]); break;
+			}
+		}
+		printMathResult("std::" + name + " (1 thread)", Core::getCurrentTime() - time1, count, maxUlpError(h_output, h_exact));
+
+		for (int a = MATH_ACCURACY_LOW; a <= MATH_ACCURACY_HIGH; a++) {
+			MathAccuracy accuracy = (MathAccuracy) a;
+			Core::TimeSpan time2 = Core::getCurrentTime();
+			mathHost(function, accuracy, h_input, h_output, threadCount);
+			printMathResult("host " + name + " (" + mathAccuracyName(accuracy) + ")", Core::getCurrentTime() - time2, count, maxUlpError(h_output, h_exact));
+		}
+
+		queue.enqueueWriteBuffer(d_input, true, 0, size, h_input.data());
+		const char* variants[3] = { "native_", "", "half_" };
+		const char* kernelSuffixes[3] = { "NativeKernel", "Kernel", "HalfKernel" };
+		for (int v = 0; v < 3; v++) {
+			cl::Kernel kernel(program, (name + kernelSuffixes[v]).c_str());
+			kernel.setArg<cl::Buffer>(0, d_input);
+			kernel.setArg<cl::Buffer>(1, d_output);
+			cl::Event event;
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(count), cl::NDRange(wgSize), NULL, &event);
+			queue.enqueueReadBuffer(d_output, true, 0, size, h_output.data());
+			printMathResult("device " + std::string(variants[v]) + name, OpenCL::getElapsedTime(event), count, maxUlpError(h_output, h_exact));
+		}
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Kernel fusion: elementwise expressions
+//////////////////////////////////////////////////////////////////////////////
+// An expression like cos(a) * b + c over arrays (fusedArray()) and float
+// constants is captured as a type, FusedExpr<...>, and evaluated in one pass:
+// on the device by a kernel generated from the expression and compiled once
+// per signature (FusedKernelCache, fusedDevice()), on the host by the
+// vectorized math functions (fusedHost()). Functions are cos, sin, exp and
+// log, operators +, -, * and /. Evaluating the same expression as a chain of
+// kernels writes and reads back every intermediate result.
+
+// Collects the kernel arguments while the expression is printed as OpenCL C.
+// Arrays become a0, a1, ... (the same buffer always gets the same name),
+// constants become kernel arguments c0, c1, ... so that their values are not
+// part of the signature.
+struct FusedSignature {
+	std::ostringstream expression;
+	std::vector<const cl::Buffer*> buffers;
+	std::vector<float> constants;
+
+	std::size_t buffer(const cl::Buffer* d_buffer) {
+		for (std::size_t i = 0; i < buffers.size(); i++)
+			if (buffers[i] == d_buffer)
+				return i;
+		buffers.push_back(d_buffer);
+		return buffers.size() - 1;
+	}
+};
+
+// Expression nodes. evaluate<O>(i) computes the values i, ..., i + O::width - 1
+// with the operations O, generate() appends the OpenCL C code.
+struct FusedArray {
+	const float* h_data;
+	const cl::Buffer* d_data;
+	FusedArray(const float* h_data, const cl::Buffer* d_data) : h_data(h_data), d_data(d_data) {}
+
+	template <typename O> typename O::Vec evaluate(std::size_t i) const { return O::load(h_data + i); }
+	void generate(FusedSignature& signature) const {
+		ASSERT(d_data != NULL);
+		signature.expression << "a" << signature.buffer(d_data);
+	}
+};
+
+struct FusedConstant {
+	float value;
+	explicit FusedConstant(float value) : value(value) {}
+
+	template <typename O> typename O::Vec evaluate(std::size_t) const { return O::set(value); }
+	void generate(FusedSignature& signature) const {
+		signature.expression << "c" << signature.constants.size();
+		signature.constants.push_back(value);
+	}
+};
+
+template <MathFunction F, typename E> struct FusedFunction {
+	E argument;
+	explicit FusedFunction(const E& argument) : argument(argument) {}
+
+	template <typename O> typename O::Vec evaluate(std::size_t i) const {
+		return mathEvaluateAny<O>(argument.template evaluate<O>(i), F, MATH_ACCURACY_HIGH);
+	}
+	void generate(FusedSignature& signature) const {
+		signature.expression << mathFunctionName(F) << "(";
+		argument.generate(signature);
+		signature.expression << ")";
+	}
+};
+
+template <char Op, typename L, typename R> struct FusedOperator {
+	L left;
+	R right;
+	FusedOperator(const L& left, const R& right) : left(left), right(right) {}
+
+	template <typename O> typename O::Vec evaluate(std::size_t i) const {
+		typename O::Vec a = left.template evaluate<O>(i), b = right.template evaluate<O>(i);
+		switch (Op) {
+		case '+': return O::add(a, b);
+		case '-': return O::sub(a, b);
+		case '*': return O::mul(a, b);
+		default: return O::div(a, b);
+		}
+	}
+	void generate(FusedSignature& signature) const {
+		signature.expression << "(";
+		left.generate(signature);
+		signature.expression << " " << Op << " ";
+		right.generate(signature);
+		signature.expression << ")";
+	}
+};
+
+// Wrapper which restricts the operators below to expressions
+template <typename E> struct FusedExpr {
+	E node;
+	explicit FusedExpr(const E& node) : node(node) {}
+};
+
+// An array with its values on the host (for fusedHost()) and on the device
+// (for fusedDevice()), both have at least as many values as the result
+FusedExpr<FusedArray> fusedArray(const std::vector<float>& h_data, const cl::Buffer& d_data) {
+	return FusedExpr<FusedArray>(FusedArray(h_data.data(), &d_data));
+}
+
+#define FUSED_FUNCTION(name, function) \
+	template <typename E> FusedExpr<FusedFunction<function, E> > name(const FusedExpr<E>& x) { \
+		return FusedExpr<FusedFunction<function, E> >(FusedFunction<function, E>(x.node)); \
+	}
+FUSED_FUNCTION(cos, MATH_COS)
+FUSED_FUNCTION(sin, MATH_SIN)
+FUSED_FUNCTION(exp, MATH_EXP)
+FUSED_FUNCTION(log, MATH_LOG)
+
+#define FUSED_OPERATOR(op, c) \
+	template <typename L, typename R> FusedExpr<FusedOperator<c, L, R> > operator op(const FusedExpr<L>& a, const FusedExpr<R>& b) { \
+		return FusedExpr<FusedOperator<c, L, R> >(FusedOperator<c, L, R>(a.node, b.node)); \
+	} \
+	template <typename L> FusedExpr<FusedOperator<c, L, FusedConstant> > operator op(const FusedExpr<L>& a, float b) { \
+		return FusedExpr<FusedOperator<c, L, FusedConstant> >(FusedOperator<c, L, FusedConstant>(a.node, FusedConstant(b))); \
+	} \
+	template <typename R> FusedExpr<FusedOperator<c, FusedConstant, R> > operator op(float a, const FusedExpr<R>& b) { \
+		return FusedExpr<FusedOperator<c, FusedConstant, R> >(FusedOperator<c, FusedConstant, R>(FusedConstant(a), b.node)); \
+	}
+FUSED_OPERATOR(+, '+')
+FUSED_OPERATOR(-, '-')
+FUSED_OPERATOR(*, '*')
+FUSED_OPERATOR(/, '/')
+
+// Compiled fused kernels by signature (the expression printed by generate())
+class FusedKernelCache {
+	cl::Context context;
+	std::vector<cl::Device> devices;
+	std::map<std::string, cl::Program> programs;
+
+public:
+	FusedKernelCache(const cl::Context& context, const std::vector<cl::Device>& devices) : context(context), devices(devices) {}
+
+	std::size_t size() const { return programs.size(); }
+
+	// Kernel fusedKernel(d_output, count, d_input0, ..., c0, ...) for the
+	// signature, the program is built on the first use
+	cl::Kernel kernel(const FusedSignature& signature) {
+		std::string expression = signature.expression.str();
+		std::map<std::string, cl::Program>::iterator it = programs.find(expression);
+		if (it == programs.end()) {
+			std::ostringstream source;
+			source << "__kernel void fusedKernel(__global float* d_output, uint count";
+			for (std::size_t i = 0; i < signature.buffers.size(); i++)
+				source << ", __global const float* d_input" << i;
+			for (std::size_t i = 0; i < signature.constants.size(); i++)
+				source << ", float c" << i;
+			source << ") {\n\tsize_t i = get_global_id(0);\n\tif (i >= count)\n\t\treturn;\n";
+			for (std::size_t i = 0; i < signature.buffers.size(); i++)
+				source << "\tfloat a" << i << " = d_input" << i << "[i];\n";
+			source << "\td_output[i] = " << expression << ";\n}\n";
+			std::string code = source.str();
+			std::vector<std::pair<const char*, std::size_t> > sources;
+			sources.push_back(std::make_pair(code.data(), code.length()));
+			cl::Program program(context, sources);
+			OpenCL::buildProgram(program, devices);
+			it = programs.insert(std::make_pair(expression, program)).first;
+		}
+		return cl::Kernel(it->second, "fusedKernel");
+	}
+};
+
+// d_output[i] = expression[i], i < count, with one kernel
+template <typename E> cl::Event fusedDevice(FusedKernelCache& cache, const cl::CommandQueue& queue, const FusedExpr<E>& expression, const cl::Buffer& d_output, std::size_t count, std::size_t wgSize) {
+	FusedSignature signature;
+	expression.node.generate(signature);
+	cl::Kernel kernel = cache.kernel(signature);
+	cl_uint arg = 0;
+	kernel.setArg<cl::Buffer>(arg++, d_output);
+	kernel.setArg<cl_uint>(arg++, (cl_uint) count);
+	for (std::size_t i = 0; i < signature.buffers.size(); i++)
+		kernel.setArg<cl::Buffer>(arg++, *signature.buffers[i]);
+	for (std::size_t i = 0; i < signature.constants.size(); i++)
+		kernel.setArg<cl_float>(arg++, signature.constants[i]);
+	cl::Event event;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange((count + wgSize - 1) / wgSize * wgSize), cl::NDRange(wgSize), NULL, &event);
+	return event;
+}
+
+// Values [begin, end) of one thread
+template <typename E> void fusedHostChunk(const E* expression, float* h_output, std::size_t begin, std::size_t end) {
+	typedef MathVectorOps O;
+	typedef MathOps<float> S;
+	std::size_t i = begin;
+	for (; i + O::width <= end; i += O::width)
+		O::store(h_output + i, expression->template evaluate<O>(i));
+	for (; i < end; i++)
+		h_output[i] = expression->template evaluate<S>(i);
+}
+
+// h_output[i] = expression[i] on threadCount threads
+template <typename E> void fusedHost(const FusedExpr<E>& expression, std::vector<float>& h_output, std::size_t threadCount) {
+	std::size_t count = h_output.size();
+	std::size_t chunk = ((count + threadCount - 1) / threadCount + 15) / 16 * 16;
+	boost::thread_group threads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		threads.create_thread(boost::bind(fusedHostChunk<E>, &expression.node, h_output.data(), std::min(count, t * chunk), std::min(count, (t + 1) * chunk)));
+	threads.join_all();
+}
+
+double maxAbsoluteError(const std::vector<float>& h_output, const std::vector<float>& h_reference) {
+	double maxError = 0;
+	for (std::size_t i = 0; i < h_output.size(); i++)
+		maxError = std::max(maxError, (double) std::fabs(h_output[i] - h_reference[i]));
+	return maxError;
+}
+
+void printFusionResult(const std::string& name, Core::TimeSpan time, std::size_t bytes, double maxError) {
+	std::cout << "  " << std::setiosflags(std::ios::left) << std::setw(28) << name << std::resetiosflags(std::ios::left)
+			<< std::setw(12) << time << std::setw(10) << std::setprecision(3) << (bytes / time.getSeconds() * 1e-9) << " GB/s"
+			<< std::setw(12) << std::setprecision(5) << maxError << " max error" << std::endl;
+}
+
+// out = cos(a) * b + c as one fused kernel / host pass and as a chain of
+// three, the reported bandwidth counts the bytes every variant moves
+int runFusion(const cl::Context& context, const std::vector<cl::Device>& devices, const cl::CommandQueue& queue, std::size_t count, std::size_t wgSize) {
+	std::size_t size = count * sizeof (float);
+	std::size_t threadCount = mathThreadCount();
+	std::vector<float> h_a (count), h_b (count), h_c (count), h_temp1 (count), h_temp2 (count), h_reference (count), h_output (count);
+	for (std::size_t i = 0; i < count; i++) {
+		h_a[i] = (float) (200.0 * rand() / RAND_MAX - 100);
+		h_b[i] = (float) rand() / RAND_MAX;
+		h_c[i] = (float) rand() / RAND_MAX;
+		h_reference[i] = (float) (std::cos((double) h_a[i]) * h_b[i] + h_c[i]);
+	}
+	cl::Buffer d_a(context, CL_MEM_READ_WRITE, size), d_b(context, CL_MEM_READ_WRITE, size), d_c(context, CL_MEM_READ_WRITE, size);
+	cl::Buffer d_temp1(context, CL_MEM_READ_WRITE, size), d_temp2(context, CL_MEM_READ_WRITE, size), d_output(context, CL_MEM_READ_WRITE, size);
+	queue.enqueueWriteBuffer(d_a, true, 0, size, h_a.data());
+	queue.enqueueWriteBuffer(d_b, true, 0, size, h_b.data());
+	queue.enqueueWriteBuffer(d_c, true, 0, size, h_c.data());
+	FusedExpr<FusedArray> a = fusedArray(h_a, d_a), b = fusedArray(h_b, d_b), c = fusedArray(h_c, d_c);
+	FusedExpr<FusedArray> temp1 = fusedArray(h_temp1, d_temp1), temp2 = fusedArray(h_temp2, d_temp2);
+	FusedKernelCache cache(context, devices);
+	std::cout << count << " values, host on " << threadCount << " threads" << std::endl;
+
+	// The first launches build the programs, the timed ones come from the cache
+	fusedDevice(cache, queue, cos(a) * b + c, d_output, count, wgSize).wait();
+	fusedDevice(cache, queue, cos(a), d_temp1, count, wgSize).wait();
+	fusedDevice(cache, queue, temp1 * b, d_temp2, count, wgSize).wait();
+	fusedDevice(cache, queue, temp2 + c, d_output, count, wgSize).wait();
+	std::cout << cache.size() << " fused kernels compiled" << std::endl;
+
+	cl::Event event = fusedDevice(cache, queue, cos(a) * b + c, d_output, count, wgSize);
+	queue.enqueueReadBuffer(d_output, true, 0, size, h_output.data());
+	printFusionResult("device fused", OpenCL::getElapsedTime(event), 4 * size, maxAbsoluteError(h_output, h_reference));
+
+	cl::Event event1 = fusedDevice(cache, queue, cos(a), d_temp1, count, wgSize);
+	cl::Event event2 = fusedDevice(cache, queue, temp1 * b, d_temp2, count, wgSize);
+	cl::Event event3 = fusedDevice(cache, queue, temp2 + c, d_output, count, wgSize);
+	queue.enqueueReadBuffer(d_output, true, 0, size, h_output.data());
+	printFusionResult("device chain of 3 kernels", OpenCL::getElapsedTime(event1) + OpenCL::getElapsedTime(event2) + OpenCL::getElapsedTime(event3),
+			8 * size, maxAbsoluteError(h_output, h_reference));
+
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	fusedHost(cos(a) * b + c, h_output, threadCount);
+	printFusionResult("host fused", Core::getCurrentTime() - time1, 4 * size, maxAbsoluteError(h_output, h_reference));
+
+	Core::TimeSpan time2 = Core::getCurrentTime();
+	fusedHost(cos(a), h_temp1, threadCount);
+	fusedHost(temp1 * b, h_temp2, threadCount);
+	fusedHost(temp2 + c, h_output, threadCount);
+	printFusionResult("host chain of 3 passes", Core::getCurrentTime() - time2, 8 * size, maxAbsoluteError(h_output, h_reference));
+
+	// Constants are kernel arguments: other values reuse the compiled kernel
+	std::size_t compiled = cache.size();
+	fusedDevice(cache, queue, exp(a * -0.05f) * 2.0f - log(b + 1.0f), d_output, count, wgSize);
+	fusedDevice(cache, queue, exp(a * -0.03f) * 3.0f - log(b + 2.0f), d_output, count, wgSize);
+	queue.enqueueReadBuffer(d_output, true, 0, size, h_output.data());
+	fusedHost(exp(a * -0.03f) * 3.0f - log(b + 2.0f), h_reference, threadCount);
+	std::cout << "exp(a * c0) * c1 - log(b + c2): " << (cache.size() - compiled) << " new kernel, max difference host / device "
+			<< maxAbsoluteError(h_output, h_reference) << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Memory bandwidth and launch latency benchmark
+//////////////////////////////////////////////////////////////////////////////
+// For every device of the context and every buffer size from 4 KB to 1 GB
+// (limited by CL_DEVICE_MAX_MEM_ALLOC_SIZE) the transfers host -> device and
+// device -> host are measured from pageable memory (std::vector), from pinned
+// memory (a mapped CL_MEM_ALLOC_HOST_PTR buffer) and through a mapping of the
+// device buffer, as well as copies on the device. The write mapping uses
+// CL_MAP_WRITE_INVALIDATE_REGION on OpenCL 1.2 devices; with CL_MAP_WRITE
+// (OpenCL 1.1) the runtime has to copy the old contents to the host first,
+// so there h2d_mapped includes that read-back. Times are host wall clock
+// times per operation including the wait for completion (what an offload has
+// to pay), averaged over several repetitions after one warm-up operation.
+// The bandwidth of a copy counts the bytes read and written.
+enum BenchmarkTransfer {
+	BENCHMARK_H2D_PAGEABLE, BENCHMARK_H2D_PINNED, BENCHMARK_H2D_MAPPED,
+	BENCHMARK_D2H_PAGEABLE, BENCHMARK_D2H_PINNED, BENCHMARK_D2H_MAPPED,
+	BENCHMARK_D2D_COPY
+};
+
+const char* benchmarkTransferName(BenchmarkTransfer transfer) {
+	switch (transfer) {
+	case BENCHMARK_H2D_PAGEABLE: return "h2d_pageable";
+	case BENCHMARK_H2D_PINNED: return "h2d_pinned";
+	case BENCHMARK_H2D_MAPPED: return "h2d_mapped";
+	case BENCHMARK_D2H_PAGEABLE: return "d2h_pageable";
+	case BENCHMARK_D2H_PINNED: return "d2h_pinned";
+	case BENCHMARK_D2H_MAPPED: return "d2h_mapped";
+	default: return "d2d_copy";
+	}
+}
+
+struct BenchmarkBuffers {
+	std::vector<char> h_pageable;
+	char* h_pinned;
+	cl::Buffer d_a;
+	cl::Buffer d_b;
+	cl_map_flags writeMapFlags; // for BENCHMARK_H2D_MAPPED
+};
+
+// CL_MAP_WRITE_INVALIDATE_REGION if the device (and the headers) support it,
+// CL_MAP_WRITE otherwise
+cl_map_flags benchmarkWriteMapFlags(const cl::Device& device) {
+#if defined(CL_VERSION_1_2)
+	// "OpenCL <major>.<minor> <vendor-specific information>"
+	std::string version = device.getInfo<CL_DEVICE_VERSION>();
+	int major = 0, minor = 0;
+	if (sscanf(version.c_str(), "OpenCL %d.%d", &major, &minor) == 2 && (major > 1 || (major == 1 && minor >= 2)))
+		return CL_MAP_WRITE_INVALIDATE_REGION;
+#endif
+	return CL_MAP_WRITE;
+}
+
+// One transfer of size bytes, returns after it has completed
+void benchmarkTransfer(const cl::CommandQueue& queue, BenchmarkTransfer transfer, BenchmarkBuffers& buffers, std::size_t size) {
+	void* mapped;
+	switch (transfer) {
+	case BENCHMARK_H2D_PAGEABLE:
+		queue.enqueueWriteBuffer(buffers.d_a, true, 0, size, buffers.h_pageable.data());
+		break;
+	case BENCHMARK_H2D_PINNED:
+		queue.enqueueWriteBuffer(buffers.d_a, true, 0, size, buffers.h_pinned);
+		break;
+	case BENCHMARK_H2D_MAPPED:
+		mapped = queue.enqueueMapBuffer(buffers.d_a, true, buffers.writeMapFlags, 0, size);
+		memcpy(mapped, buffers.h_pageable.data(), size);
+		queue.enqueueUnmapMemObject(buffers.d_a, mapped);
+		queue.finish();
+		break;
+	case BENCHMARK_D2H_PAGEABLE:
+		queue.enqueueReadBuffer(buffers.d_a, true, 0, size, buffers.h_pageable.data());
+		break;
+	case BENCHMARK_D2H_PINNED:
+		queue.enqueueReadBuffer(buffers.d_a, true, 0, size, buffers.h_pinned);
+		break;
+	case BENCHMARK_D2H_MAPPED:
+		mapped = queue.enqueueMapBuffer(buffers.d_a, true, CL_MAP_READ, 0, size);
+		memcpy(buffers.h_pageable.data(), mapped, size);
+		queue.enqueueUnmapMemObject(buffers.d_a, mapped);
+		queue.finish();
+		break;
+	default:
+		queue.enqueueCopyBuffer(buffers.d_a, buffers.d_b, 0, 0, size);
+		queue.finish();
+		break;
+	}
+}
+
+void printBenchmarkRow(std::ostream& out, const std::string& device, const std::string& test, std::size_t bytes, std::size_t repetitions, Core::TimeSpan time, std::size_t bytesMoved) {
+	double seconds = time.getSeconds() / repetitions;
+	out << "\"" << device << "\"," << test << "," << bytes << "," << repetitions << "," << seconds * 1e6 << ","
+			<< (bytesMoved == 0 ? 0.0 : bytesMoved / seconds * 1e-9) << std::endl;
+}
+
+// Transfers of every size on one device
+void benchmarkBandwidth(std::ostream& out, const cl::Context& context, const cl::CommandQueue& queue, const std::string& deviceName, std::size_t maxSize) {
+	cl_map_flags writeMapFlags = benchmarkWriteMapFlags(queue.getInfo<CL_QUEUE_DEVICE>());
+	for (std::size_t size = 4096; size <= maxSize; size *= 2) {
+		BenchmarkBuffers buffers;
+		buffers.h_pageable.resize(size, 1);
+		cl::Buffer pinned(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+		buffers.h_pinned = (char*) queue.enqueueMapBuffer(pinned, true, CL_MAP_READ | CL_MAP_WRITE, 0, size);
+		memset(buffers.h_pinned, 1, size);
+		buffers.d_a = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+		buffers.d_b = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+		buffers.writeMapFlags = writeMapFlags;
+
+		// About 256 MB per measurement
+		std::size_t repetitions = std::max<std::size_t>(3, std::min<std::size_t>(100, (256 << 20) / size));
+		for (int t = BENCHMARK_H2D_PAGEABLE; t <= BENCHMARK_D2D_COPY; t++) {
+			BenchmarkTransfer transfer = (BenchmarkTransfer) t;
+			benchmarkTransfer(queue, transfer, buffers, size);
+			Core::TimeSpan time1 = Core::getCurrentTime();
+			for (std::size_t r = 0; r < repetitions; r++)
+				benchmarkTransfer(queue, transfer, buffers, size);
+			Core::TimeSpan time = Core::getCurrentTime() - time1;
+			printBenchmarkRow(out, deviceName, benchmarkTransferName(transfer), size, repetitions, time, transfer == BENCHMARK_D2D_COPY ? 2 * size : size);
+		}
+
+		queue.enqueueUnmapMemObject(pinned, buffers.h_pinned);
+		queue.finish();
+	}
+}
+
+// Launches of an empty kernel with one work item:
+//   launch_latency:  enqueue and wait for the completion of every launch
+//   launch_queued:   time from CL_PROFILING_COMMAND_QUEUED to CL_PROFILING_COMMAND_END
+//   submission:      host time of one enqueueNDRangeKernel() call without waiting
+void benchmarkLaunch(std::ostream& out, const cl::CommandQueue& queue, const cl::Program& program, const std::string& deviceName) {
+	const std::size_t repetitions = 1000;
+	cl::Kernel kernel(program, "emptyKernel");
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1), cl::NDRange(1));
+	queue.finish();
+
+	Core::TimeSpan latency = Core::TimeSpan::fromSeconds(0);
+	Core::TimeSpan queued = Core::TimeSpan::fromSeconds(0);
+	for (std::size_t r = 0; r < repetitions; r++) {
+		cl::Event event;
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1), cl::NDRange(1), NULL, &event);
+		event.wait();
+		latency = latency + (Core::getCurrentTime() - time1);
+		queued = queued + Core::TimeSpan::fromSeconds((event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) * 1e-9);
+	}
+	printBenchmarkRow(out, deviceName, "launch_latency", 0, repetitions, latency, 0);
+	printBenchmarkRow(out, deviceName, "launch_queued", 0, repetitions, queued, 0);
+
+	Core::TimeSpan time2 = Core::getCurrentTime();
+	for (std::size_t r = 0; r < repetitions; r++)
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1), cl::NDRange(1));
+	Core::TimeSpan submission = Core::getCurrentTime() - time2;
+	queue.finish();
+	printBenchmarkRow(out, deviceName, "submission", 0, repetitions, submission, 0);
+}
+
+// CSV report for every device of the context, written to filename (or to
+// std::cout if filename is empty), sizes up to maxSize bytes
+int runBenchmark(const cl::Context& context, const std::string& filename, std::size_t maxSize) {
+	std::ofstream file;
+	if (!filename.empty()) {
+		file.open(filename.c_str());
+		Core::Error::check("open", file);
+	}
+	std::ostream& out = filename.empty() ? std::cout : file;
+	out << "device,test,bytes,repetitions,time_us,bandwidth_gb_s" << std::endl;
+
+	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+	cl::Program program = OpenCL::loadProgramSource(context, "src/OpenCLExercise1_Basics.cl");
+	OpenCL::buildProgram(program, devices);
+	for (std::size_t d = 0; d < devices.size(); d++) {
+		std::string deviceName = devices[d].getInfo<CL_DEVICE_NAME>();
+		cl::CommandQueue queue(context, devices[d], CL_QUEUE_PROFILING_ENABLE);
+		std::size_t deviceMaxSize = std::min<std::size_t>(maxSize, devices[d].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+		std::cerr << "Benchmarking '" << deviceName << "' up to " << deviceMaxSize << " bytes" << std::endl;
+		benchmarkLaunch(out, queue, program, deviceName);
+		benchmarkBandwidth(out, context, queue, deviceName, deviceMaxSize);
+	}
+	if (!filename.empty()) {
+		file.close();
+		Core::Error::check("close", file);
+		std::cout << "Wrote " << filename << std::endl;
+	}
+	return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // Main function
 //////////////////////////////////////////////////////////////////////////////
 int main(int argc, char** argv) {
+	// "bandwidth" without a file name writes the CSV report to std::cout, the
+	// messages about the platform and the device go to std::cerr then
+	bool csvToStdout = argc > 1 && std::string(argv[1]) == "bandwidth" && (argc < 3 || std::string(argv[2]).empty());
+	std::ostream& info = csvToStdout ? std::cerr : std::cout;
+
 	// Create a context
 	//cl::Context context(CL_DEVICE_TYPE_GPU);
 	std::vector<cl::Platform> platforms;
@@ -47,15 +907,15 @@ int main(int argc, char** argv) {
 		}
 	}
 	cl_context_properties prop[4] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[platformId] (), 0, 0 };
-	std::cout << "Using platform '" << platforms[platformId].getInfo<CL_PLATFORM_NAME>() << "' from '" << platforms[platformId].getInfo<CL_PLATFORM_VENDOR>() << "'" << std::endl;
+	info << "Using platform '" << platforms[platformId].getInfo<CL_PLATFORM_NAME>() << "' from '" << platforms[platformId].getInfo<CL_PLATFORM_VENDOR>() << "'" << std::endl;
 	cl::Context context(CL_DEVICE_TYPE_GPU, prop);
 
 	// Get the first device of the context
-	std::cout << "Context has " << context.getInfo<CL_CONTEXT_DEVICES>().size() << " devices" << std::endl;
+	info << "Context has " << context.getInfo<CL_CONTEXT_DEVICES>().size() << " devices" << std::endl;
 	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
 	std::vector<cl::Device> devices;
 	devices.push_back(device);
-	OpenCL::printDeviceInfo(std::cout, device);
+	OpenCL::printDeviceInfo(info, device);
 
 	// Create a command queue
 	cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
@@ -65,6 +925,10 @@ int main(int argc, char** argv) {
 	// Compile the source code. This is similar to program.build(devices) but will print more detailed error messages
 	OpenCL::buildProgram(program, devices);
 
+	// "bandwidth [file.csv] [max size in MB]": transfer bandwidth and launch latency of every device
+	if (argc > 1 && std::string(argv[1]) == "bandwidth")
+		return runBenchmark(context, argc > 2 ? argv[2] : "", (argc > 3 ? (std::size_t) atol(argv[3]) : 1024) << 20);
+
 	// Create a kernel object
 	cl::Kernel kernel1(program, "kernel1");
 
@@ -73,6 +937,13 @@ int main(int argc, char** argv) {
 	std::size_t count = wgSize * 100000; // Overall number of work items = Number of elements
 	std::size_t size = count * sizeof (float); // Size of data in bytes
 
+	// "math": compare the host math functions with the device built-ins
+	if (argc > 1 && std::string(argv[1]) == "math")
+		return runMathComparison(context, queue, program, count, wgSize);
+	// "fusion": fused elementwise expression against a chain of kernels
+	if (argc > 1 && std::string(argv[1]) == "fusion")
+		return runFusion(context, devices, queue, count, wgSize);
+
 	// Allocate space for input data and for output data from CPU and GPU on the host
 	std::vector<float> h_input (count);
 	std::vector<float> h_outputCpu (count);
@@ -83,8 +954,7 @@ int main(int argc, char** argv) {
 	cl::Buffer d_input(context, CL_MEM_READ_WRITE, size);
 	cl::Buffer d_output(context, CL_MEM_READ_WRITE, size);
 
-	// Initialize memory to 0xff (useful fGPU TIME :0.015017s
-or debugging because otherwise GPU memory will contain information from last execution)
+	// Initialize memory to 0xff (useful for debugging because otherwise GPU memory will contain information from last execution)
 	memset(h_input.data(), 255, size);
 	memset(h_outputCpu.data(), 255, size);
 	memset(h_outputGpu.data(), 255, size);
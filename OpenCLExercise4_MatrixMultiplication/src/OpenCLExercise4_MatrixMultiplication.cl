@@ -2,13 +2,395 @@
 #include <OpenCL/OpenCLKernel.hpp> // Hack to make syntax highlighting in Eclipse work
 #endif
 
-__kernel void matrixMulKernel1(/*...*/) {
-	//TODO
+__kernel void matrixMulKernel1(__global const float* d_inputA, __global const float* d_inputB, __global float* d_outputC, uint countAX_BY, uint countBX) {
+	size_t i = get_global_id(0);
+	size_t j = get_global_id(1);
+
+	float sum = 0;
+	for (uint k = 0; k < countAX_BY; k++)
+		sum += d_inputA[k + j * countAX_BY] * d_inputB[i + k * countBX];
+	d_outputC[i + j * countBX] = sum;
 }
 
 // The preprocessor constant WG_SIZE will contain the size of a work group in X/Y-direction
 
+// Tiled version: every work group loads WG_SIZE x WG_SIZE blocks of A and B into
+// local memory, countAX_BY has to be a multiple of WG_SIZE
+__attribute__((reqd_work_group_size(WG_SIZE, WG_SIZE, 1)))
+__kernel void matrixMulKernel2(__global const float* d_inputA, __global const float* d_inputB, __global float* d_outputC, uint countAX_BY, uint countBX) {
+	__local float l_A[WG_SIZE][WG_SIZE];
+	__local float l_B[WG_SIZE][WG_SIZE];
+	size_t i = get_global_id(0);
+	size_t j = get_global_id(1);
+	uint lx = get_local_id(0);
+	uint ly = get_local_id(1);
+
+	float sum = 0;
+	for (uint k0 = 0; k0 < countAX_BY; k0 += WG_SIZE) {
+		l_A[ly][lx] = d_inputA[(k0 + lx) + j * countAX_BY];
+		l_B[ly][lx] = d_inputB[i + (k0 + ly) * countBX];
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for (uint k = 0; k < WG_SIZE; k++)
+			sum += l_A[ly][k] * l_B[k][lx];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	d_outputC[i + j * countBX] = sum;
+}
+
+// Like matrixMulKernel2, but only sums over k in [kBegin, kEnd) (multiples of
+// WG_SIZE). If accumulate is set the result is added to C, so a product can be
+// computed panel by panel while later panels of B are still being uploaded.
+__attribute__((reqd_work_group_size(WG_SIZE, WG_SIZE, 1)))
+__kernel void matrixMulPanelKernel(__global const float* d_inputA, __global const float* d_inputB, __global float* d_outputC, uint countAX_BY, uint countBX, uint kBegin, uint kEnd, uint accumulate) {
+	__local float l_A[WG_SIZE][WG_SIZE];
+	__local float l_B[WG_SIZE][WG_SIZE];
+	size_t i = get_global_id(0);
+	size_t j = get_global_id(1);
+	uint lx = get_local_id(0);
+	uint ly = get_local_id(1);
+
+	float sum = 0;
+	for (uint k0 = kBegin; k0 < kEnd; k0 += WG_SIZE) {
+		l_A[ly][lx] = d_inputA[(k0 + lx) + j * countAX_BY];
+		l_B[ly][lx] = d_inputB[i + (k0 + ly) * countBX];
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for (uint k = 0; k < WG_SIZE; k++)
+			sum += l_A[ly][k] * l_B[k][lx];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (accumulate)
+		sum += d_outputC[i + j * countBX];
+	d_outputC[i + j * countBX] = sum;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Mixed precision: A and B stored as half, accumulation in float
+//////////////////////////////////////////////////////////////////////////////
+
+// vload_half / vstore_half are core functions, so storing half values does not
+// require cl_khr_fp16 (only arithmetic on half values would)
+__kernel void convertToHalfKernel(__global const float* d_input, __global half* d_output, uint count) {
+	size_t i = get_global_id(0);
+	if (i < count)
+		vstore_half_rte(d_input[i], i, d_output);
+}
+
+__kernel void convertToFloatKernel(__global const half* d_input, __global float* d_output, uint count) {
+	size_t i = get_global_id(0);
+	if (i < count)
+		d_output[i] = vload_half(i, d_input);
+}
+
+// Same tiling as matrixMulKernel2, the tiles are converted to float while loading
+__attribute__((reqd_work_group_size(WG_SIZE, WG_SIZE, 1)))
+__kernel void matrixMulHalfKernel(__global const half* d_inputA, __global const half* d_inputB, __global float* d_outputC, uint countAX_BY, uint countBX) {
+	__local float l_A[WG_SIZE][WG_SIZE];
+	__local float l_B[WG_SIZE][WG_SIZE];
+	size_t i = get_global_id(0);
+	size_t j = get_global_id(1);
+	uint lx = get_local_id(0);
+	uint ly = get_local_id(1);
+
+	float sum = 0;
+	for (uint k0 = 0; k0 < countAX_BY; k0 += WG_SIZE) {
+		l_A[ly][lx] = vload_half((k0 + lx) + j * countAX_BY, d_inputA);
+		l_B[ly][lx] = vload_half(i + (k0 + ly) * countBX, d_inputB);
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for (uint k = 0; k < WG_SIZE; k++)
+			sum += l_A[ly][k] * l_B[k][lx];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	d_outputC[i + j * countBX] = sum;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Batched GEMM: many small independent products C_i = A_i * B_i in one launch
+//////////////////////////////////////////////////////////////////////////////
+
+// Largest M / N handled by the tiled batched kernels (K is unrestricted)
+#ifndef BATCH_MAX_DIM
+#define BATCH_MAX_DIM 64
+#endif
+// Number of rows / columns of C computed by each work item of the tiled kernels
+#define BATCH_RPT ((BATCH_MAX_DIM + WG_SIZE - 1) / WG_SIZE)
+#define BATCH_TILE (BATCH_RPT * WG_SIZE)
+
+// Compute one product with a WG_SIZE x WG_SIZE work group. A and B are streamed
+// through local memory in slices of WG_SIZE columns / rows, each work item keeps
+// a BATCH_RPT x BATCH_RPT block of C in registers.
+void matrixMulBatchedTile(__global const float* d_A, __global const float* d_B, __global float* d_C, uint countM, uint countN, uint countK,
+		__local float (*l_A)[WG_SIZE + 1], __local float (*l_B)[BATCH_TILE + 1]) {
+	uint lx = get_local_id(0);
+	uint ly = get_local_id(1);
+
+	float sum[BATCH_RPT][BATCH_RPT];
+	for (uint r = 0; r < BATCH_RPT; r++)
+		for (uint c = 0; c < BATCH_RPT; c++)
+			sum[r][c] = 0;
+
+	for (uint k0 = 0; k0 < countK; k0 += WG_SIZE) {
+		for (uint r = 0; r < BATCH_RPT; r++) {
+			uint row = ly + r * WG_SIZE;
+			l_A[row][lx] = (row < countM && k0 + lx < countK) ? d_A[row * countK + k0 + lx] : 0;
+		}
+		for (uint c = 0; c < BATCH_RPT; c++) {
+			uint col = lx + c * WG_SIZE;
+			l_B[ly][col] = (k0 + ly < countK && col < countN) ? d_B[(k0 + ly) * countN + col] : 0;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for (uint k = 0; k < WG_SIZE; k++) {
+			float a[BATCH_RPT];
+			float b[BATCH_RPT];
+			for (uint r = 0; r < BATCH_RPT; r++)
+				a[r] = l_A[ly + r * WG_SIZE][k];
+			for (uint c = 0; c < BATCH_RPT; c++)
+				b[c] = l_B[k][lx + c * WG_SIZE];
+			for (uint r = 0; r < BATCH_RPT; r++)
+				for (uint c = 0; c < BATCH_RPT; c++)
+					sum[r][c] += a[r] * b[c];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	for (uint r = 0; r < BATCH_RPT; r++) {
+		uint row = ly + r * WG_SIZE;
+		for (uint c = 0; c < BATCH_RPT; c++) {
+			uint col = lx + c * WG_SIZE;
+			if (row < countM && col < countN)
+				d_C[row * countN + col] = sum[r][c];
+		}
+	}
+}
+
+// Strided batch: matrix i starts at element i * stride of the respective buffer
+__attribute__((reqd_work_group_size(WG_SIZE, WG_SIZE, 1)))
+__kernel void matrixMulBatchedKernel(__global const float* d_A, __global const float* d_B, __global float* d_C,
+		uint countM, uint countN, uint countK, uint strideA, uint strideB, uint strideC, uint batchCount) {
+	__local float l_A[BATCH_TILE][WG_SIZE + 1];
+	__local float l_B[WG_SIZE][BATCH_TILE + 1];
+
+	for (uint i = get_group_id(0); i < batchCount; i += get_num_groups(0))
+		matrixMulBatchedTile(d_A + (size_t) i * strideA, d_B + (size_t) i * strideB, d_C + (size_t) i * strideC, countM, countN, countK, l_A, l_B);
+}
+
+// Pointer-array batch: matrix i starts at element d_offsetsX[i] of the respective buffer
 __attribute__((reqd_work_group_size(WG_SIZE, WG_SIZE, 1)))
-__kernel void matrixMulKernel2(/*...*/) {
-	//TODO
+__kernel void matrixMulBatchedIndexedKernel(__global const float* d_A, __global const float* d_B, __global float* d_C,
+		uint countM, uint countN, uint countK, __global const uint* d_offsetsA, __global const uint* d_offsetsB, __global const uint* d_offsetsC, uint batchCount) {
+	__local float l_A[BATCH_TILE][WG_SIZE + 1];
+	__local float l_B[WG_SIZE][BATCH_TILE + 1];
+
+	for (uint i = get_group_id(0); i < batchCount; i += get_num_groups(0))
+		matrixMulBatchedTile(d_A + d_offsetsA[i], d_B + d_offsetsB[i], d_C + d_offsetsC[i], countM, countN, countK, l_A, l_B);
+}
+
+// Products with countM * countN <= WG_SIZE * WG_SIZE: every work item computes
+// one element of C, so one work group handles (WG_SIZE * WG_SIZE) / (countM * countN)
+// matrices at once. A and B of all these matrices are held in l_data (dynamic
+// local memory with room for matsPerGroup * (countM + countN) * countK floats).
+void matrixMulBatchedSmall(__global const float* d_A, __global const float* d_B, __global float* d_C,
+		uint countM, uint countN, uint countK, uint offsetA, uint offsetB, uint offsetC, bool valid, __local float* l_data) {
+	uint lid = get_local_id(0);
+	uint matsPerGroup = get_local_size(0) / (countM * countN);
+	uint slot = lid / (countM * countN);
+	uint element = lid % (countM * countN);
+	uint sizeA = countM * countK;
+	uint sizeB = countK * countN;
+	__local float* l_A = l_data;
+	__local float* l_B = l_data + matsPerGroup * sizeA;
+
+	// Every work item loads the part of its own matrix at its position in the slot
+	if (slot < matsPerGroup) {
+		for (uint j = element; j < sizeA; j += countM * countN)
+			l_A[slot * sizeA + j] = valid ? d_A[offsetA + j] : 0;
+		for (uint j = element; j < sizeB; j += countM * countN)
+			l_B[slot * sizeB + j] = valid ? d_B[offsetB + j] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (slot < matsPerGroup && valid) {
+		uint row = element / countN;
+		uint col = element % countN;
+		__local const float* a = l_A + slot * sizeA + row * countK;
+		__local const float* b = l_B + slot * sizeB + col;
+		float sum = 0;
+		for (uint k = 0; k < countK; k++)
+			sum += a[k] * b[k * countN];
+		d_C[offsetC + element] = sum;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+__attribute__((reqd_work_group_size(WG_SIZE * WG_SIZE, 1, 1)))
+__kernel void matrixMulBatchedSmallKernel(__global const float* d_A, __global const float* d_B, __global float* d_C,
+		uint countM, uint countN, uint countK, uint strideA, uint strideB, uint strideC, uint batchCount, __local float* l_data) {
+	uint matsPerGroup = get_local_size(0) / (countM * countN);
+	uint slot = get_local_id(0) / (countM * countN);
+
+	for (uint first = get_group_id(0) * matsPerGroup; first < batchCount; first += get_num_groups(0) * matsPerGroup) {
+		uint i = first + slot;
+		bool valid = slot < matsPerGroup && i < batchCount;
+		matrixMulBatchedSmall(d_A, d_B, d_C, countM, countN, countK,
+				valid ? i * strideA : 0, valid ? i * strideB : 0, valid ? i * strideC : 0, valid, l_data);
+	}
+}
+
+__attribute__((reqd_work_group_size(WG_SIZE * WG_SIZE, 1, 1)))
+__kernel void matrixMulBatchedSmallIndexedKernel(__global const float* d_A, __global const float* d_B, __global float* d_C,
+		uint countM, uint countN, uint countK, __global const uint* d_offsetsA, __global const uint* d_offsetsB, __global const uint* d_offsetsC, uint batchCount, __local float* l_data) {
+	uint matsPerGroup = get_local_size(0) / (countM * countN);
+	uint slot = get_local_id(0) / (countM * countN);
+
+	for (uint first = get_group_id(0) * matsPerGroup; first < batchCount; first += get_num_groups(0) * matsPerGroup) {
+		uint i = first + slot;
+		bool valid = slot < matsPerGroup && i < batchCount;
+		matrixMulBatchedSmall(d_A, d_B, d_C, countM, countN, countK,
+				valid ? d_offsetsA[i] : 0, valid ? d_offsetsB[i] : 0, valid ? d_offsetsC[i] : 0, valid, l_data);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sparse (CSR / ELL) matrix A times dense matrix B
+//////////////////////////////////////////////////////////////////////////////
+
+// Row per warp: the get_local_size(0) work items with the same get_global_id(1)
+// handle one row of A, every lane computes the columns lane, lane + warp size, ...
+// of this row of C. The lanes read the same nonzeros and consecutive entries of B.
+__kernel void sparseMatrixMulCsrKernel(__global const uint* d_rowPtr, __global const uint* d_colIdx, __global const float* d_values,
+		__global const float* d_inputB, __global float* d_outputC, uint countRows, uint countBX) {
+	uint row = get_global_id(1);
+	if (row >= countRows)
+		return;
+	uint begin = d_rowPtr[row];
+	uint end = d_rowPtr[row + 1];
+	for (uint i = get_local_id(0); i < countBX; i += get_local_size(0)) {
+		float sum = 0;
+		for (uint n = begin; n < end; n++)
+			sum += d_values[n] * d_inputB[d_colIdx[n] * countBX + i];
+		d_outputC[row * countBX + i] = sum;
+	}
+}
+
+// ELL: every row has exactly width entries (padded with zeros), entry e of
+// row r is stored at e * countRows + r
+__kernel void sparseMatrixMulEllKernel(__global const uint* d_colIdx, __global const float* d_values, uint width,
+		__global const float* d_inputB, __global float* d_outputC, uint countRows, uint countBX) {
+	uint row = get_global_id(1);
+	if (row >= countRows)
+		return;
+	for (uint i = get_local_id(0); i < countBX; i += get_local_size(0)) {
+		float sum = 0;
+		for (uint e = 0; e < width; e++)
+			sum += d_values[e * countRows + row] * d_inputB[d_colIdx[e * countRows + row] * countBX + i];
+		d_outputC[row * countBX + i] = sum;
+	}
+}
+
+// Merge path: the sequence of row ends (d_rowPtr[1 ...]) and nonzero indices
+// is merged and split into pieces of equal length, so every work group gets the
+// same amount of work regardless of the row lengths. Returns the number of rows
+// which have ended before the given diagonal of the merge.
+uint mergePathSearch(uint diagonal, __global const uint* d_rowPtr, uint countRows, uint countNonzeros) {
+	uint xMin = diagonal > countNonzeros ? diagonal - countNonzeros : 0;
+	uint xMax = min(diagonal, countRows);
+	while (xMin < xMax) {
+		uint pivot = (xMin + xMax) / 2;
+		if (d_rowPtr[pivot + 1] <= diagonal - pivot - 1)
+			xMin = pivot + 1;
+		else
+			xMax = pivot;
+	}
+	return xMin;
+}
+
+// Rows which end inside the piece of a work group are written to C (the first
+// one only with the part inside the piece), the partial sum of the row which
+// continues in the next piece is stored in d_carryValue / d_carryRow and
+// added by sparseMatrixMulFixupKernel.
+__kernel void sparseMatrixMulMergeKernel(__global const uint* d_rowPtr, __global const uint* d_colIdx, __global const float* d_values,
+		__global const float* d_inputB, __global float* d_outputC, __global uint* d_carryRow, __global float* d_carryValue,
+		uint countRows, uint countBX, uint itemsPerGroup) {
+	uint countNonzeros = d_rowPtr[countRows];
+	uint group = get_group_id(0);
+	uint diagonal0 = min(group * itemsPerGroup, countRows + countNonzeros);
+	uint diagonal1 = min(diagonal0 + itemsPerGroup, countRows + countNonzeros);
+	uint row0 = mergePathSearch(diagonal0, d_rowPtr, countRows, countNonzeros);
+	uint row1 = mergePathSearch(diagonal1, d_rowPtr, countRows, countNonzeros);
+	uint nonzero0 = diagonal0 - row0;
+	uint nonzero1 = diagonal1 - row1;
+
+	for (uint i = get_local_id(0); i < countBX; i += get_local_size(0)) {
+		uint n = nonzero0;
+		float sum = 0;
+		for (uint row = row0; row < row1; row++) {
+			for (; n < d_rowPtr[row + 1]; n++)
+				sum += d_values[n] * d_inputB[d_colIdx[n] * countBX + i];
+			d_outputC[row * countBX + i] = sum;
+			sum = 0;
+		}
+		for (; n < nonzero1; n++)
+			sum += d_values[n] * d_inputB[d_colIdx[n] * countBX + i];
+		d_carryValue[group * countBX + i] = sum;
+	}
+	if (get_local_id(0) == 0)
+		d_carryRow[group] = row1;
+}
+
+// Add the carries to C, one work item per column and merge group. A long row
+// may receive carries from several groups, which are consecutive because
+// d_carryRow is non-decreasing. Only the work item of the last of them adds
+// all of them (in order), so every element of C is written by one work item.
+__kernel void sparseMatrixMulFixupKernel(__global const uint* d_carryRow, __global const float* d_carryValue, __global float* d_outputC,
+		uint countRows, uint countBX, uint groupCount) {
+	uint i = get_global_id(0);
+	uint group = get_global_id(1);
+	if (i >= countBX || group >= groupCount)
+		return;
+	uint row = d_carryRow[group];
+	if (row >= countRows || (group + 1 < groupCount && d_carryRow[group + 1] == row))
+		return;
+	uint first = group;
+	while (first > 0 && d_carryRow[first - 1] == row)
+		first--;
+	float sum = d_outputC[row * countBX + i];
+	for (uint g = first; g <= group; g++)
+		sum += d_carryValue[g * countBX + i];
+	d_outputC[row * countBX + i] = sum;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Roofline microbenchmarks
+//////////////////////////////////////////////////////////////////////////////
+
+// Peak arithmetic rate: 8 independent chains of float4 multiply-adds, i.e.
+// 64 floating point operations per iteration and work item. The result is
+// written so that the compiler cannot remove the loop.
+__kernel void peakFlopsKernel(__global float* d_output, float value, uint iterations) {
+	float4 x0 = (float4)(get_global_id(0) * value, 1.0f, 2.0f, 3.0f);
+	float4 x1 = x0 + 1.0f, x2 = x0 + 2.0f, x3 = x0 + 3.0f;
+	float4 x4 = x0 + 4.0f, x5 = x0 + 5.0f, x6 = x0 + 6.0f, x7 = x0 + 7.0f;
+	const float4 m = (float4)(0.999f);
+	const float4 c = (float4)(0.001f);
+	for (uint i = 0; i < iterations; i++) {
+		x0 = mad(x0, m, c);
+		x1 = mad(x1, m, c);
+		x2 = mad(x2, m, c);
+		x3 = mad(x3, m, c);
+		x4 = mad(x4, m, c);
+		x5 = mad(x5, m, c);
+		x6 = mad(x6, m, c);
+		x7 = mad(x7, m, c);
+	}
+	float4 sum = x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7;
+	d_output[get_global_id(0)] = sum.x + sum.y + sum.z + sum.w;
+}
+
+// Peak memory bandwidth: plain copy, every work item reads and writes 16 bytes
+__kernel void copyBandwidthKernel(__global const float4* d_input, __global float4* d_output) {
+	size_t i = get_global_id(0);
+	d_output[i] = d_input[i];
 }
@@ -19,8 +19,16 @@
 #include <cmath>
 #include <iomanip>
 #include <sstream>
+#include <limits>
+#include <algorithm>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 
 extern "C" {
 #include <atlas/cblas.h>
@@ -67,13 +75,13 @@ void printPerformance(const std::string& name, Core::TimeSpan timeCalc, Core::Ti
 	printPerformance(name, timeCalc, Core::TimeSpan::fromSeconds(0), timeCpu, false);
 }
 
-bool compareMatrices(const std::vector<float>& matrix1, const std::string& matrix1N, const std::vector<float>& matrix2, const std::string& matrix2N, std::size_t countX, std::size_t countY) {
+// Values are accepted if they differ by at most absTolerance + relTolerance * |matrix1 value|
+bool compareMatrices(const std::vector<float>& matrix1, const std::string& matrix1N, const std::vector<float>& matrix2, const std::string& matrix2N, std::size_t countX, std::size_t countY, float absTolerance, float relTolerance) {
 	std::size_t errorCount = 0;
 	for (size_t j = 0; j < countY; j = j + 1) { //loop in the y-direction
 		for (size_t i = 0; i < countX; i = i + 1) { //loop in the x-direction
 			size_t index = i + j * countX;
-			// Allow small differences between results (due to rounding)
-			if (!(std::abs (matrix1[index] - matrix2[index]) <= 1e-2)) {
+			if (!(std::abs (matrix1[index] - matrix2[index]) <= absTolerance + relTolerance * std::abs (matrix1[index]))) {
 				if (errorCount < 15)
 					std::cout << "Result for " << i << "," << j << " is incorrect: " << matrix1N << " value is " << matrix1[index] << ", " << matrix2N << " value is " << matrix2[index] << std::endl;
 				else if (errorCount == 15)
@@ -88,6 +96,10 @@ bool compareMatrices(const std::vector<float>& matrix1, const std::string& matri
 	}
 	return true;
 }
+bool compareMatrices(const std::vector<float>& matrix1, const std::string& matrix1N, const std::vector<float>& matrix2, const std::string& matrix2N, std::size_t countX, std::size_t countY) {
+	// Allow small differences between results (due to rounding)
+	return compareMatrices(matrix1, matrix1N, matrix2, matrix2N, countX, countY, 1e-2, 0);
+}
 
 void dumpMatrix(const std::string& name, const std::vector<float>& matrix, std::size_t countX, std::size_t countY) {
 	std::cout << name << " =" << std::endl;
@@ -104,6 +116,1121 @@ void dumpMatrix(const std::string& name, const std::vector<float>& matrix, std::
 	std::cout << std::endl;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Mixed precision: A and B stored as half, accumulation in float
+//////////////////////////////////////////////////////////////////////////////
+// Conversion with round-to-nearest-even (same as vstore_half_rte on the device)
+cl_half floatToHalf(float value) {
+#ifdef __F16C__
+	return _cvtss_sh(value, 0);
+#else
+	cl_uint bits;
+	memcpy(&bits, &value, sizeof (bits));
+	cl_uint sign = (bits >> 16) & 0x8000;
+	int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+	cl_uint mantissa = bits & 0x7fffff;
+	if (((bits >> 23) & 0xff) == 0xff) // Inf / NaN
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	if (exponent >= 31) // Overflow
+		return sign | 0x7c00;
+	if (exponent <= 0) { // Denormal or zero
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		cl_uint result = mantissa >> shift;
+		cl_uint rest = mantissa & ((1u << shift) - 1);
+		cl_uint halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (result & 1)))
+			result++;
+		return sign | result;
+	}
+	cl_uint result = sign | (exponent << 10) | (mantissa >> 13);
+	cl_uint rest = mantissa & 0x1fff;
+	// A carry out of the mantissa correctly increments the exponent
+	if (rest > 0x1000 || (rest == 0x1000 && (result & 1)))
+		result++;
+	return result;
+#endif
+}
+float halfToFloat(cl_half value) {
+#ifdef __F16C__
+	return _cvtsh_ss(value);
+#else
+	cl_uint sign = (value >> 15) & 1;
+	cl_uint exponent = (value >> 10) & 0x1f;
+	cl_uint mantissa = value & 0x3ff;
+	float result;
+	if (exponent == 0)
+		result = std::ldexp((float) mantissa, -24);
+	else if (exponent == 31)
+		result = mantissa ? std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::infinity();
+	else
+		result = std::ldexp((float) (mantissa | 0x400), (int) exponent - 25);
+	return sign ? -result : result;
+#endif
+}
+
+void convertToHalfHost(const std::vector<float>& h_input, std::vector<cl_half>& h_output) {
+	std::size_t i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= h_input.size(); i += 8)
+		_mm_storeu_si128((__m128i*) &h_output[i], _mm256_cvtps_ph(_mm256_loadu_ps(&h_input[i]), 0));
+#endif
+	for (; i < h_input.size(); i++)
+		h_output[i] = floatToHalf(h_input[i]);
+}
+void convertToFloatHost(const std::vector<cl_half>& h_input, std::vector<float>& h_output) {
+	std::size_t i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= h_input.size(); i += 8)
+		_mm256_storeu_ps(&h_output[i], _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) &h_input[i])));
+#endif
+	for (; i < h_input.size(); i++)
+		h_output[i] = halfToFloat(h_input[i]);
+}
+
+// Row of C = sum over k of A[j][k] * row k of B. With F16C / AVX 8 values of B
+// are converted and accumulated at once.
+void matrixMulHalfHost(const std::vector<cl_half>& h_inputA, const std::vector<cl_half>& h_inputB, std::vector<float>& h_outputC, std::size_t countAX_BY, std::size_t countAY, std::size_t countBX) {
+	for (std::size_t j = 0; j < countAY; j++) {
+		float* c = &h_outputC[j * countBX];
+		for (std::size_t i = 0; i < countBX; i++)
+			c[i] = 0;
+		for (std::size_t k = 0; k < countAX_BY; k++) {
+			float a = halfToFloat(h_inputA[k + j * countAX_BY]);
+			const cl_half* b = &h_inputB[k * countBX];
+			std::size_t i = 0;
+#ifdef __F16C__
+			__m256 va = _mm256_set1_ps(a);
+			for (; i + 8 <= countBX; i += 8) {
+				__m256 vb = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (b + i)));
+				_mm256_storeu_ps(c + i, _mm256_add_ps(_mm256_loadu_ps(c + i), _mm256_mul_ps(va, vb)));
+			}
+#endif
+			for (; i < countBX; i++)
+				c[i] += a * halfToFloat(b[i]);
+		}
+	}
+}
+
+float maxAbsDifference(const std::vector<float>& matrix1, const std::vector<float>& matrix2) {
+	float maxDiff = 0;
+	for (std::size_t i = 0; i < matrix1.size(); i++)
+		maxDiff = std::max(maxDiff, std::abs(matrix1[i] - matrix2[i]));
+	return maxDiff;
+}
+
+// Run the half storage / float accumulation variant on the host and on the device.
+// Results are checked against a float product of the half-rounded inputs, the
+// deviation from the full precision result is only reported.
+bool runMatrixMulHalf(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize,
+		const std::vector<float>& h_inputA, const std::vector<float>& h_inputB, const std::vector<float>& h_outputCAtlas,
+		const cl::Buffer& d_inputA, const cl::Buffer& d_inputB, const cl::Buffer& d_outputC, Core::TimeSpan atlasTime,
+		std::size_t countAX_BY, std::size_t countAY, std::size_t countBX) {
+	std::size_t countA = h_inputA.size();
+	std::size_t countB = h_inputB.size();
+	std::size_t countC = h_outputCAtlas.size();
+	std::size_t sizeC = countC * sizeof (float);
+	bool hasFp16 = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp16") != std::string::npos;
+	std::cout << "Mixed precision (half storage, float accumulation), device " << (hasFp16 ? "supports" : "does not support") << " cl_khr_fp16" << std::endl;
+
+	std::vector<cl_half> h_inputAHalf (countA);
+	std::vector<cl_half> h_inputBHalf (countB);
+	std::vector<float> h_inputARounded (countA);
+	std::vector<float> h_inputBRounded (countB);
+	std::vector<float> h_outputCRounded (countC);
+	std::vector<float> h_outputCHalfCpu (countC);
+	std::vector<float> h_outputCHalfGpu (countC);
+
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	convertToHalfHost(h_inputA, h_inputAHalf);
+	convertToHalfHost(h_inputB, h_inputBHalf);
+	Core::TimeSpan convertTime = Core::getCurrentTime() - time1;
+	time1 = Core::getCurrentTime();
+	matrixMulHalfHost(h_inputAHalf, h_inputBHalf, h_outputCHalfCpu, countAX_BY, countAY, countBX);
+	Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
+	printPerformance("CPU half", cpuTime, convertTime, atlasTime);
+
+	// Reference: float product of exactly the values stored as half
+	convertToFloatHost(h_inputAHalf, h_inputARounded);
+	convertToFloatHost(h_inputBHalf, h_inputBRounded);
+	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, countAY, countBX, countAX_BY, 1.0, h_inputARounded.data(), countAX_BY, h_inputBRounded.data(), countBX, 0.0, h_outputCRounded.data(), countBX);
+	if (!compareMatrices(h_outputCRounded, "Reference", h_outputCHalfCpu, "CPU half", countBX, countAY, 1e-2, 1e-5))
+		return false;
+
+	// Convert on the device from the float inputs which are already there
+	cl::Buffer d_inputAHalf(context, CL_MEM_READ_WRITE, countA * sizeof (cl_half));
+	cl::Buffer d_inputBHalf(context, CL_MEM_READ_WRITE, countB * sizeof (cl_half));
+	cl::Kernel convertKernel(program, "convertToHalfKernel");
+	cl::Event convertA, convertB, execution, copyC;
+	convertKernel.setArg<cl::Buffer>(0, d_inputA);
+	convertKernel.setArg<cl::Buffer>(1, d_inputAHalf);
+	convertKernel.setArg<cl_uint>(2, countA);
+	queue.enqueueNDRangeKernel(convertKernel, cl::NullRange, cl::NDRange((countA + wgSize * wgSize - 1) / (wgSize * wgSize) * wgSize * wgSize), cl::NDRange(wgSize * wgSize), NULL, &convertA);
+	convertKernel.setArg<cl::Buffer>(0, d_inputB);
+	convertKernel.setArg<cl::Buffer>(1, d_inputBHalf);
+	convertKernel.setArg<cl_uint>(2, countB);
+	queue.enqueueNDRangeKernel(convertKernel, cl::NullRange, cl::NDRange((countB + wgSize * wgSize - 1) / (wgSize * wgSize) * wgSize * wgSize), cl::NDRange(wgSize * wgSize), NULL, &convertB);
+
+	// The device conversion has to produce exactly the same bits as the host conversion
+	std::vector<cl_half> h_check (countA);
+	queue.enqueueReadBuffer(d_inputAHalf, true, 0, countA * sizeof (cl_half), h_check.data());
+	if (h_check != h_inputAHalf) {
+		std::cout << "Device half conversion differs from host conversion" << std::endl;
+		return false;
+	}
+
+	memset(h_outputCHalfGpu.data(), 255, sizeC);
+	queue.enqueueWriteBuffer(d_outputC, true, 0, sizeC, h_outputCHalfGpu.data());
+	ASSERT (countAX_BY % wgSize == 0 && countAY % wgSize == 0 && countBX % wgSize == 0);
+	cl::Kernel halfKernel(program, "matrixMulHalfKernel");
+	halfKernel.setArg<cl::Buffer>(0, d_inputAHalf);
+	halfKernel.setArg<cl::Buffer>(1, d_inputBHalf);
+	halfKernel.setArg<cl::Buffer>(2, d_outputC);
+	halfKernel.setArg<cl_uint>(3, countAX_BY);
+	halfKernel.setArg<cl_uint>(4, countBX);
+	queue.enqueueNDRangeKernel(halfKernel, cl::NullRange, cl::NDRange(countBX, countAY), cl::NDRange(wgSize, wgSize), NULL, &execution);
+	queue.enqueueReadBuffer(d_outputC, true, 0, sizeC, h_outputCHalfGpu.data(), NULL, &copyC);
+	Core::TimeSpan gpuTime = OpenCL::getElapsedTime(execution);
+	Core::TimeSpan copyTime = OpenCL::getElapsedTime(convertA) + OpenCL::getElapsedTime(convertB) + OpenCL::getElapsedTime(copyC);
+	printPerformance("matrixMulHalfKernel", gpuTime, copyTime, atlasTime);
+	if (!compareMatrices(h_outputCRounded, "Reference", h_outputCHalfGpu, "GPU half", countBX, countAY, 1e-2, 1e-5))
+		return false;
+
+	std::cout << "Max. deviation from float inputs: CPU half " << maxAbsDifference(h_outputCAtlas, h_outputCHalfCpu) << ", GPU half " << maxAbsDifference(h_outputCAtlas, h_outputCHalfGpu) << std::endl;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Multi-device: row blocks of C are distributed over all devices of the context
+//////////////////////////////////////////////////////////////////////////////
+struct DeviceShare {
+	cl::Device device;
+	cl::CommandQueue queue;
+	cl::Kernel kernel;
+	cl::Buffer d_inputA;
+	cl::Buffer d_inputB;
+	cl::Buffer d_outputC;
+	std::size_t rowBegin;
+	std::size_t rowEnd;
+	double rowsPerSecond;
+	std::vector<cl::Event> kernelEvents;
+	cl::Event readEvent;
+};
+
+// Enqueue C[rowBegin, rowEnd) = A[rowBegin, rowEnd) * B without blocking. B is
+// sent in panels of panelRows rows and the product for panel p only waits for
+// the upload of panel p (and the product for panel p - 1), so on an out-of-order
+// queue the upload of the next panels overlaps the computation.
+void enqueueMatrixMulRows(DeviceShare& share, const std::vector<float>& h_inputA, const std::vector<float>& h_inputB, std::vector<float>& h_outputC,
+		std::size_t countAX_BY, std::size_t countBX, std::size_t wgSize, std::size_t panelRows) {
+	std::size_t rows = share.rowEnd - share.rowBegin;
+	share.kernelEvents.clear();
+	if (rows == 0)
+		return;
+	ASSERT (rows % wgSize == 0 && countAX_BY % wgSize == 0 && countBX % wgSize == 0 && panelRows % wgSize == 0);
+
+	cl::Event writeA;
+	share.queue.enqueueWriteBuffer(share.d_inputA, false, 0, rows * countAX_BY * sizeof (float), &h_inputA[share.rowBegin * countAX_BY], NULL, &writeA);
+	share.kernel.setArg<cl::Buffer>(0, share.d_inputA);
+	share.kernel.setArg<cl::Buffer>(1, share.d_inputB);
+	share.kernel.setArg<cl::Buffer>(2, share.d_outputC);
+	share.kernel.setArg<cl_uint>(3, countAX_BY);
+	share.kernel.setArg<cl_uint>(4, countBX);
+	for (std::size_t kBegin = 0; kBegin < countAX_BY; kBegin += panelRows) {
+		std::size_t kEnd = std::min(kBegin + panelRows, countAX_BY);
+		std::vector<cl::Event> waitFor(1, writeA);
+		waitFor.push_back(cl::Event());
+		share.queue.enqueueWriteBuffer(share.d_inputB, false, kBegin * countBX * sizeof (float), (kEnd - kBegin) * countBX * sizeof (float), &h_inputB[kBegin * countBX], NULL, &waitFor.back());
+		if (!share.kernelEvents.empty())
+			waitFor.push_back(share.kernelEvents.back());
+		share.kernel.setArg<cl_uint>(5, kBegin);
+		share.kernel.setArg<cl_uint>(6, kEnd);
+		share.kernel.setArg<cl_uint>(7, kBegin != 0);
+		share.kernelEvents.push_back(cl::Event());
+		share.queue.enqueueNDRangeKernel(share.kernel, cl::NullRange, cl::NDRange(countBX, rows), cl::NDRange(wgSize, wgSize), &waitFor, &share.kernelEvents.back());
+	}
+	std::vector<cl::Event> waitFor(1, share.kernelEvents.back());
+	share.queue.enqueueReadBuffer(share.d_outputC, false, 0, rows * countBX * sizeof (float), &h_outputC[share.rowBegin * countBX], &waitFor, &share.readEvent);
+	share.queue.flush();
+}
+
+// Split countRows into blocks (multiples of granularity) proportional to the given rates
+void partitionRows(const std::vector<double>& rates, std::size_t countRows, std::size_t granularity, std::vector<std::size_t>& boundaries) {
+	double total = 0;
+	for (std::size_t i = 0; i < rates.size(); i++)
+		total += rates[i];
+	boundaries.assign(rates.size() + 1, 0);
+	double sum = 0;
+	for (std::size_t i = 0; i < rates.size(); i++) {
+		sum += rates[i];
+		std::size_t blocks = (std::size_t) (countRows / granularity * (sum / total) + 0.5);
+		boundaries[i + 1] = std::max(boundaries[i], std::min(blocks * granularity, countRows));
+	}
+	boundaries[rates.size()] = countRows;
+}
+
+// Compute A * B on all devices of the context (and on the host CPU if useHost
+// is set), with the rows of C split according to a calibration run
+int runMultiDevice(const cl::Context& context, std::size_t wgSize, bool useHost,
+		const std::vector<float>& h_inputA, const std::vector<float>& h_inputB, const std::vector<float>& h_outputCAtlas, Core::TimeSpan atlasTime,
+		std::size_t countAX_BY, std::size_t countAY, std::size_t countBX) {
+	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+	cl::Program program = OpenCL::loadProgramSource(context, "src/OpenCLExercise4_MatrixMultiplication.cl");
+	OpenCL::buildProgram(program, devices, "-DWG_SIZE=" + boost::lexical_cast<std::string>(wgSize));
+	std::size_t panelRows = 8 * wgSize;
+	std::size_t calibrationRows = std::min(countAY, 8 * wgSize);
+	std::vector<float> h_outputC (h_outputCAtlas.size());
+
+	std::vector<DeviceShare> shares (devices.size());
+	for (std::size_t d = 0; d < devices.size(); d++) {
+		DeviceShare& share = shares[d];
+		share.device = devices[d];
+		// Out-of-order execution lets the panel uploads overlap the computation,
+		// the event dependencies keep the results correct without it.
+		cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+		if (share.device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+			properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		share.queue = cl::CommandQueue(context, share.device, properties);
+		share.kernel = cl::Kernel(program, "matrixMulPanelKernel");
+		share.d_inputA = cl::Buffer(context, CL_MEM_READ_ONLY, h_inputA.size() * sizeof (float));
+		share.d_inputB = cl::Buffer(context, CL_MEM_READ_ONLY, h_inputB.size() * sizeof (float));
+		share.d_outputC = cl::Buffer(context, CL_MEM_READ_WRITE, h_outputC.size() * sizeof (float));
+
+		// Calibration: kernel time for the first rows, the first run is a warm-up
+		share.rowBegin = 0;
+		share.rowEnd = calibrationRows;
+		for (int run = 0; run < 2; run++) {
+			enqueueMatrixMulRows(share, h_inputA, h_inputB, h_outputC, countAX_BY, countBX, wgSize, panelRows);
+			share.readEvent.wait();
+		}
+		Core::TimeSpan kernelTime(0);
+		for (std::size_t i = 0; i < share.kernelEvents.size(); i++)
+			kernelTime = kernelTime + OpenCL::getElapsedTime(share.kernelEvents[i]);
+		share.rowsPerSecond = calibrationRows / std::max(kernelTime.getSeconds(), 1e-6);
+		std::cout << "Device " << (d + 1) << " '" << share.device.getInfo<CL_DEVICE_NAME>() << "': " << share.rowsPerSecond << " rows/s" << std::endl;
+	}
+	double hostRowsPerSecond = 0;
+	if (useHost) {
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, calibrationRows, countBX, countAX_BY, 1.0, h_inputA.data(), countAX_BY, h_inputB.data(), countBX, 0.0, h_outputC.data(), countBX);
+		hostRowsPerSecond = calibrationRows / std::max((Core::getCurrentTime() - time1).getSeconds(), 1e-6);
+		std::cout << "Host CPU: " << hostRowsPerSecond << " rows/s" << std::endl;
+	}
+
+	// The host (if used) gets the last block
+	std::vector<double> rates;
+	for (std::size_t d = 0; d < shares.size(); d++)
+		rates.push_back(shares[d].rowsPerSecond);
+	if (useHost)
+		rates.push_back(hostRowsPerSecond);
+	std::vector<std::size_t> boundaries;
+	partitionRows(rates, countAY, wgSize, boundaries);
+
+	memset(h_outputC.data(), 255, h_outputC.size() * sizeof (float));
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	for (std::size_t d = 0; d < shares.size(); d++) {
+		shares[d].rowBegin = boundaries[d];
+		shares[d].rowEnd = boundaries[d + 1];
+		enqueueMatrixMulRows(shares[d], h_inputA, h_inputB, h_outputC, countAX_BY, countBX, wgSize, panelRows);
+	}
+	std::size_t hostBegin = boundaries[shares.size()];
+	if (useHost && hostBegin < countAY)
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, countAY - hostBegin, countBX, countAX_BY, 1.0, &h_inputA[hostBegin * countAX_BY], countAX_BY, h_inputB.data(), countBX, 0.0, &h_outputC[hostBegin * countBX], countBX);
+	for (std::size_t d = 0; d < shares.size(); d++)
+		if (shares[d].rowEnd > shares[d].rowBegin)
+			shares[d].readEvent.wait();
+	Core::TimeSpan overallTime = Core::getCurrentTime() - time1;
+
+	for (std::size_t d = 0; d < shares.size(); d++)
+		std::cout << "Device " << (d + 1) << ": rows " << shares[d].rowBegin << " - " << shares[d].rowEnd << std::endl;
+	if (useHost)
+		std::cout << "Host CPU: rows " << hostBegin << " - " << countAY << std::endl;
+	printPerformanceHeader();
+	printPerformance("Multi-device", overallTime, atlasTime);
+	if (!compareMatrices(h_outputCAtlas, "Atlas", h_outputC, "Multi-device", countBX, countAY))
+		return 1;
+
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Batched GEMM: many small independent products C_i = A_i * B_i
+//////////////////////////////////////////////////////////////////////////////
+// Largest M / N supported by the tiled batched kernels (BATCH_MAX_DIM in the .cl file)
+const std::size_t batchMaxDim = 64;
+
+// Strided batch: matrix i of A / B / C starts at element i * strideA / strideB / strideC
+void matrixMulBatchedHost(const float* h_A, const float* h_B, float* h_C, std::size_t countM, std::size_t countN, std::size_t countK, std::size_t strideA, std::size_t strideB, std::size_t strideC, std::size_t batchCount) {
+	for (std::size_t b = 0; b < batchCount; b++) {
+		const float* a = h_A + b * strideA;
+		const float* bm = h_B + b * strideB;
+		float* c = h_C + b * strideC;
+		// j-k-i order keeps the innermost loop contiguous in B and C
+		for (std::size_t j = 0; j < countM; j++) {
+			for (std::size_t i = 0; i < countN; i++)
+				c[i + j * countN] = 0;
+			for (std::size_t k = 0; k < countK; k++) {
+				float av = a[k + j * countK];
+				for (std::size_t i = 0; i < countN; i++)
+					c[i + j * countN] += av * bm[i + k * countN];
+			}
+		}
+	}
+}
+// Pointer-array batch: matrix i of A / B / C starts at h_A[i] / h_B[i] / h_C[i]
+void matrixMulBatchedHost(const std::vector<const float*>& h_A, const std::vector<const float*>& h_B, const std::vector<float*>& h_C, std::size_t countM, std::size_t countN, std::size_t countK) {
+	ASSERT (h_A.size() == h_C.size() && h_B.size() == h_C.size());
+	for (std::size_t b = 0; b < h_C.size(); b++)
+		matrixMulBatchedHost(h_A[b], h_B[b], h_C[b], countM, countN, countK, 0, 0, 0, 1);
+}
+
+// Returns true if the small-matrix kernels (several matrices per work group)
+// can be used and sets localSize to the amount of local memory they need.
+// Otherwise the tiled kernels (one matrix per work group at a time) are used.
+bool useBatchedSmallKernel(const cl::CommandQueue& queue, std::size_t wgSize, std::size_t countM, std::size_t countN, std::size_t countK, std::size_t& localSize) {
+	std::size_t groupSize = wgSize * wgSize;
+	if (countM * countN > groupSize)
+		return false;
+	std::size_t matsPerGroup = groupSize / (countM * countN);
+	localSize = matsPerGroup * (countM + countN) * countK * sizeof (float);
+	return localSize <= queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2;
+}
+void launchBatchedKernel(const cl::CommandQueue& queue, cl::Kernel& kernel, bool small, std::size_t wgSize, std::size_t countM, std::size_t countN, std::size_t localSize, std::size_t batchCount, cl::Event* event) {
+	kernel.setArg<cl_uint>(9, batchCount);
+	if (small) {
+		std::size_t groupSize = wgSize * wgSize;
+		std::size_t matsPerGroup = groupSize / (countM * countN);
+		std::size_t groups = (batchCount + matsPerGroup - 1) / matsPerGroup;
+		kernel.setArg(10, cl::Local(localSize));
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(groups * groupSize), cl::NDRange(groupSize), NULL, event);
+	} else {
+		ASSERT (countM <= batchMaxDim && countN <= batchMaxDim);
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(batchCount * wgSize, wgSize), cl::NDRange(wgSize, wgSize), NULL, event);
+	}
+}
+
+// Strided batch on the device, all matrices are computed by a single kernel launch
+void matrixMulBatchedDevice(const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize, const cl::Buffer& d_A, const cl::Buffer& d_B, const cl::Buffer& d_C, std::size_t countM, std::size_t countN, std::size_t countK, std::size_t strideA, std::size_t strideB, std::size_t strideC, std::size_t batchCount, cl::Event* event = NULL) {
+	std::size_t localSize = 0;
+	bool small = useBatchedSmallKernel(queue, wgSize, countM, countN, countK, localSize);
+	cl::Kernel kernel(program, small ? "matrixMulBatchedSmallKernel" : "matrixMulBatchedKernel");
+	kernel.setArg<cl::Buffer>(0, d_A);
+	kernel.setArg<cl::Buffer>(1, d_B);
+	kernel.setArg<cl::Buffer>(2, d_C);
+	kernel.setArg<cl_uint>(3, countM);
+	kernel.setArg<cl_uint>(4, countN);
+	kernel.setArg<cl_uint>(5, countK);
+	kernel.setArg<cl_uint>(6, strideA);
+	kernel.setArg<cl_uint>(7, strideB);
+	kernel.setArg<cl_uint>(8, strideC);
+	launchBatchedKernel(queue, kernel, small, wgSize, countM, countN, localSize, batchCount, event);
+}
+// Pointer-array batch on the device: d_offsetsX contains the element offset of every matrix in d_X
+void matrixMulBatchedDevice(const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize, const cl::Buffer& d_A, const cl::Buffer& d_B, const cl::Buffer& d_C, std::size_t countM, std::size_t countN, std::size_t countK, const cl::Buffer& d_offsetsA, const cl::Buffer& d_offsetsB, const cl::Buffer& d_offsetsC, std::size_t batchCount, cl::Event* event = NULL) {
+	std::size_t localSize = 0;
+	bool small = useBatchedSmallKernel(queue, wgSize, countM, countN, countK, localSize);
+	cl::Kernel kernel(program, small ? "matrixMulBatchedSmallIndexedKernel" : "matrixMulBatchedIndexedKernel");
+	kernel.setArg<cl::Buffer>(0, d_A);
+	kernel.setArg<cl::Buffer>(1, d_B);
+	kernel.setArg<cl::Buffer>(2, d_C);
+	kernel.setArg<cl_uint>(3, countM);
+	kernel.setArg<cl_uint>(4, countN);
+	kernel.setArg<cl_uint>(5, countK);
+	kernel.setArg<cl::Buffer>(6, d_offsetsA);
+	kernel.setArg<cl::Buffer>(7, d_offsetsB);
+	kernel.setArg<cl::Buffer>(8, d_offsetsC);
+	launchBatchedKernel(queue, kernel, small, wgSize, countM, countN, localSize, batchCount, event);
+}
+
+// Compare the batched implementations against a loop of cblas_sgemm calls
+int runBatchedGemm(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize) {
+	std::size_t dims[] = { 8, 16, 32, 64 };
+	for (std::size_t d = 0; d < sizeof (dims) / sizeof (*dims); d++) {
+		std::size_t countM = dims[d], countN = dims[d], countK = dims[d];
+		std::size_t batchCount = (1 << 22) / (countM * countN);
+		std::size_t strideA = countM * countK;
+		std::size_t strideB = countK * countN;
+		std::size_t strideC = countM * countN;
+		std::size_t sizeA = batchCount * strideA * sizeof (float);
+		std::size_t sizeB = batchCount * strideB * sizeof (float);
+		std::size_t sizeC = batchCount * strideC * sizeof (float);
+		std::cout << std::endl << "Batched GEMM: " << batchCount << " products of " << countM << "x" << countK << " * " << countK << "x" << countN << std::endl;
+
+		std::vector<float> h_inputA (batchCount * strideA);
+		std::vector<float> h_inputB (batchCount * strideB);
+		std::vector<float> h_outputCCpu (batchCount * strideC);
+		std::vector<float> h_outputCAtlas (batchCount * strideC);
+		std::vector<float> h_outputCGpu (batchCount * strideC);
+		for (std::size_t i = 0; i < h_inputA.size(); i++)
+			h_inputA[i] = (rand() % 100) / 5.0f - 10.0f;
+		for (std::size_t i = 0; i < h_inputB.size(); i++)
+			h_inputB[i] = (rand() % 100) / 5.0f - 10.0f;
+
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		matrixMulBatchedHost(h_inputA.data(), h_inputB.data(), h_outputCCpu.data(), countM, countN, countK, strideA, strideB, strideC, batchCount);
+		Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
+
+		time1 = Core::getCurrentTime();
+		for (std::size_t b = 0; b < batchCount; b++)
+			cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, countM, countN, countK, 1.0, h_inputA.data() + b * strideA, countK, h_inputB.data() + b * strideB, countN, 0.0, h_outputCAtlas.data() + b * strideC, countN);
+		Core::TimeSpan atlasTime = Core::getCurrentTime() - time1;
+
+		printPerformanceHeader();
+		printPerformance("CPU batched", cpuTime, atlasTime);
+		printPerformance("Atlas loop", atlasTime, atlasTime);
+		if (!compareMatrices(h_outputCCpu, "CPU", h_outputCAtlas, "Atlas", countN, batchCount * countM))
+			return 1;
+
+		cl::Buffer d_inputA(context, CL_MEM_READ_ONLY, sizeA);
+		cl::Buffer d_inputB(context, CL_MEM_READ_ONLY, sizeB);
+		cl::Buffer d_outputC(context, CL_MEM_READ_WRITE, sizeC);
+		cl::Event copyA, copyB, execution, copyC;
+		queue.enqueueWriteBuffer(d_inputA, true, 0, sizeA, h_inputA.data(), NULL, &copyA);
+		queue.enqueueWriteBuffer(d_inputB, true, 0, sizeB, h_inputB.data(), NULL, &copyB);
+
+		// Strided batch
+		memset(h_outputCGpu.data(), 255, sizeC);
+		queue.enqueueWriteBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data());
+		matrixMulBatchedDevice(queue, program, wgSize, d_inputA, d_inputB, d_outputC, countM, countN, countK, strideA, strideB, strideC, batchCount, &execution);
+		queue.enqueueReadBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data(), NULL, &copyC);
+		Core::TimeSpan copyTime = OpenCL::getElapsedTime(copyA) + OpenCL::getElapsedTime(copyB) + OpenCL::getElapsedTime(copyC);
+		printPerformance("GPU strided", OpenCL::getElapsedTime(execution), copyTime, atlasTime);
+		if (!compareMatrices(h_outputCCpu, "CPU", h_outputCGpu, "GPU", countN, batchCount * countM))
+			return 1;
+
+		// Pointer-array batch, C_i is stored in reverse order to make sure the offsets are used
+		std::vector<cl_uint> h_offsetsA (batchCount), h_offsetsB (batchCount), h_offsetsC (batchCount);
+		std::vector<const float*> h_ptrA (batchCount), h_ptrB (batchCount);
+		std::vector<float*> h_ptrC (batchCount);
+		std::vector<float> h_outputCCpuIndexed (batchCount * strideC);
+		for (std::size_t b = 0; b < batchCount; b++) {
+			h_offsetsA[b] = b * strideA;
+			h_offsetsB[b] = b * strideB;
+			h_offsetsC[b] = (batchCount - 1 - b) * strideC;
+			h_ptrA[b] = h_inputA.data() + h_offsetsA[b];
+			h_ptrB[b] = h_inputB.data() + h_offsetsB[b];
+			h_ptrC[b] = h_outputCCpuIndexed.data() + h_offsetsC[b];
+		}
+		time1 = Core::getCurrentTime();
+		matrixMulBatchedHost(h_ptrA, h_ptrB, h_ptrC, countM, countN, countK);
+		Core::TimeSpan cpuIndexedTime = Core::getCurrentTime() - time1;
+		printPerformance("CPU pointer-array", cpuIndexedTime, atlasTime);
+
+		std::size_t sizeOffsets = batchCount * sizeof (cl_uint);
+		cl::Buffer d_offsetsA(context, CL_MEM_READ_ONLY, sizeOffsets);
+		cl::Buffer d_offsetsB(context, CL_MEM_READ_ONLY, sizeOffsets);
+		cl::Buffer d_offsetsC(context, CL_MEM_READ_ONLY, sizeOffsets);
+		queue.enqueueWriteBuffer(d_offsetsA, true, 0, sizeOffsets, h_offsetsA.data());
+		queue.enqueueWriteBuffer(d_offsetsB, true, 0, sizeOffsets, h_offsetsB.data());
+		queue.enqueueWriteBuffer(d_offsetsC, true, 0, sizeOffsets, h_offsetsC.data());
+		memset(h_outputCGpu.data(), 255, sizeC);
+		queue.enqueueWriteBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data());
+		matrixMulBatchedDevice(queue, program, wgSize, d_inputA, d_inputB, d_outputC, countM, countN, countK, d_offsetsA, d_offsetsB, d_offsetsC, batchCount, &execution);
+		queue.enqueueReadBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data(), NULL, &copyC);
+		copyTime = OpenCL::getElapsedTime(copyA) + OpenCL::getElapsedTime(copyB) + OpenCL::getElapsedTime(copyC);
+		printPerformance("GPU pointer-array", OpenCL::getElapsedTime(execution), copyTime, atlasTime);
+		if (!compareMatrices(h_outputCCpuIndexed, "CPU", h_outputCGpu, "GPU", countN, batchCount * countM))
+			return 1;
+	}
+
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sparse matrix A (CSR / ELL) times dense matrix B
+//////////////////////////////////////////////////////////////////////////////
+// Compressed sparse row: the nonzeros of row j are values[rowPtr[j] ... rowPtr[j + 1]),
+// in columns colIdx[rowPtr[j] ... rowPtr[j + 1])
+struct CsrMatrix {
+	std::size_t countX, countY;
+	std::vector<cl_uint> rowPtr;
+	std::vector<cl_uint> colIdx;
+	std::vector<float> values;
+};
+
+// ELL: every row is padded to width entries (value 0, column 0). Entry e of
+// row j is stored at e * countY + j, so consecutive rows are adjacent in memory.
+struct EllMatrix {
+	std::size_t countX, countY, width;
+	std::vector<cl_uint> colIdx;
+	std::vector<float> values;
+};
+
+void denseToCsr(const std::vector<float>& h_input, std::size_t countX, std::size_t countY, CsrMatrix& csr) {
+	csr.countX = countX;
+	csr.countY = countY;
+	csr.rowPtr.resize(countY + 1);
+	csr.colIdx.clear();
+	csr.values.clear();
+	for (std::size_t j = 0; j < countY; j++) {
+		csr.rowPtr[j] = csr.values.size();
+		for (std::size_t i = 0; i < countX; i++) {
+			float value = h_input[i + j * countX];
+			if (value != 0) {
+				csr.colIdx.push_back(i);
+				csr.values.push_back(value);
+			}
+		}
+	}
+	csr.rowPtr[countY] = csr.values.size();
+}
+
+void csrToEll(const CsrMatrix& csr, EllMatrix& ell) {
+	ell.countX = csr.countX;
+	ell.countY = csr.countY;
+	ell.width = 0;
+	for (std::size_t j = 0; j < csr.countY; j++)
+		ell.width = std::max<std::size_t>(ell.width, csr.rowPtr[j + 1] - csr.rowPtr[j]);
+	ell.colIdx.assign(ell.width * ell.countY, 0);
+	ell.values.assign(ell.width * ell.countY, 0.0f);
+	for (std::size_t j = 0; j < csr.countY; j++) {
+		for (std::size_t n = csr.rowPtr[j]; n < csr.rowPtr[j + 1]; n++) {
+			std::size_t e = n - csr.rowPtr[j];
+			ell.colIdx[e * ell.countY + j] = csr.colIdx[n];
+			ell.values[e * ell.countY + j] = csr.values[n];
+		}
+	}
+}
+
+void denseToEll(const std::vector<float>& h_input, std::size_t countX, std::size_t countY, EllMatrix& ell) {
+	CsrMatrix csr;
+	denseToCsr(h_input, countX, countY, csr);
+	csrToEll(csr, ell);
+}
+
+// C[rowBegin, rowEnd) = A[rowBegin, rowEnd) * B. Each row of C is accumulated
+// as sum of value * (row colIdx of B), which the compiler vectorizes.
+void sparseMatrixMulRowsHost(const CsrMatrix* h_inputA, const std::vector<float>* h_inputB, std::vector<float>* h_outputC, std::size_t countBX, std::size_t rowBegin, std::size_t rowEnd) {
+	for (std::size_t j = rowBegin; j < rowEnd; j++) {
+		float* c = h_outputC->data() + j * countBX;
+		for (std::size_t i = 0; i < countBX; i++)
+			c[i] = 0;
+		for (std::size_t n = h_inputA->rowPtr[j]; n < h_inputA->rowPtr[j + 1]; n++) {
+			float a = h_inputA->values[n];
+			const float* b = h_inputB->data() + h_inputA->colIdx[n] * countBX;
+			for (std::size_t i = 0; i < countBX; i++)
+				c[i] += a * b[i];
+		}
+	}
+}
+
+// Multithreaded host version. The rows are split so that every thread gets the
+// same number of rows + nonzeros (the host equivalent of the merge path split).
+void sparseMatrixMulHost(const CsrMatrix& h_inputA, const std::vector<float>& h_inputB, std::vector<float>& h_outputC, std::size_t countBX, std::size_t threadCount) {
+	std::size_t countRows = h_inputA.countY;
+	std::size_t total = countRows + h_inputA.rowPtr[countRows];
+	boost::thread_group threads;
+	std::size_t rowBegin = 0;
+	for (std::size_t t = 0; t < threadCount; t++) {
+		std::size_t target = total * (t + 1) / threadCount;
+		std::size_t rowEnd = rowBegin;
+		while (rowEnd < countRows && rowEnd + h_inputA.rowPtr[rowEnd] < target)
+			rowEnd++;
+		if (t == threadCount - 1)
+			rowEnd = countRows;
+		threads.create_thread(boost::bind(sparseMatrixMulRowsHost, &h_inputA, &h_inputB, &h_outputC, countBX, rowBegin, rowEnd));
+		rowBegin = rowEnd;
+	}
+	threads.join_all();
+}
+
+// Device buffers of a CSR / ELL matrix
+struct SparseDeviceMatrix {
+	cl::Buffer d_rowPtr, d_colIdx, d_values;
+	cl::Buffer d_ellColIdx, d_ellValues;
+	std::size_t countRows, countNonzeros, ellWidth;
+};
+
+void uploadSparseMatrix(const cl::Context& context, const cl::CommandQueue& queue, const CsrMatrix& csr, const EllMatrix& ell, SparseDeviceMatrix& d_matrix) {
+	d_matrix.countRows = csr.countY;
+	d_matrix.countNonzeros = csr.values.size();
+	d_matrix.ellWidth = ell.width;
+	// Buffers must not be empty
+	std::size_t countNonzeros = std::max<std::size_t>(csr.values.size(), 1);
+	std::size_t countEll = std::max<std::size_t>(ell.values.size(), 1);
+	d_matrix.d_rowPtr = cl::Buffer(context, CL_MEM_READ_ONLY, csr.rowPtr.size() * sizeof (cl_uint));
+	d_matrix.d_colIdx = cl::Buffer(context, CL_MEM_READ_ONLY, countNonzeros * sizeof (cl_uint));
+	d_matrix.d_values = cl::Buffer(context, CL_MEM_READ_ONLY, countNonzeros * sizeof (float));
+	d_matrix.d_ellColIdx = cl::Buffer(context, CL_MEM_READ_ONLY, countEll * sizeof (cl_uint));
+	d_matrix.d_ellValues = cl::Buffer(context, CL_MEM_READ_ONLY, countEll * sizeof (float));
+	queue.enqueueWriteBuffer(d_matrix.d_rowPtr, true, 0, csr.rowPtr.size() * sizeof (cl_uint), csr.rowPtr.data());
+	if (csr.values.size() > 0) {
+		queue.enqueueWriteBuffer(d_matrix.d_colIdx, true, 0, csr.colIdx.size() * sizeof (cl_uint), csr.colIdx.data());
+		queue.enqueueWriteBuffer(d_matrix.d_values, true, 0, csr.values.size() * sizeof (float), csr.values.data());
+	}
+	if (ell.values.size() > 0) {
+		queue.enqueueWriteBuffer(d_matrix.d_ellColIdx, true, 0, ell.colIdx.size() * sizeof (cl_uint), ell.colIdx.data());
+		queue.enqueueWriteBuffer(d_matrix.d_ellValues, true, 0, ell.values.size() * sizeof (float), ell.values.data());
+	}
+}
+
+// Number of lanes working on one row of A and number of rows per work group
+const std::size_t spmmWarpSize = 32;
+const std::size_t spmmRowsPerGroup = 8;
+// Rows + nonzeros processed by one work group of the merge path kernel
+const std::size_t spmmMergeItemsPerGroup = 256;
+
+// Row-per-warp CSR kernel
+void sparseMatrixMulCsrDevice(const cl::CommandQueue& queue, const cl::Program& program, const SparseDeviceMatrix& d_inputA, const cl::Buffer& d_inputB, const cl::Buffer& d_outputC, std::size_t countBX, cl::Event* event) {
+	cl::Kernel kernel(program, "sparseMatrixMulCsrKernel");
+	kernel.setArg<cl::Buffer>(0, d_inputA.d_rowPtr);
+	kernel.setArg<cl::Buffer>(1, d_inputA.d_colIdx);
+	kernel.setArg<cl::Buffer>(2, d_inputA.d_values);
+	kernel.setArg<cl::Buffer>(3, d_inputB);
+	kernel.setArg<cl::Buffer>(4, d_outputC);
+	kernel.setArg<cl_uint>(5, d_inputA.countRows);
+	kernel.setArg<cl_uint>(6, countBX);
+	std::size_t countGroups = (d_inputA.countRows + spmmRowsPerGroup - 1) / spmmRowsPerGroup;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(spmmWarpSize, countGroups * spmmRowsPerGroup), cl::NDRange(spmmWarpSize, spmmRowsPerGroup), NULL, event);
+}
+
+void sparseMatrixMulEllDevice(const cl::CommandQueue& queue, const cl::Program& program, const SparseDeviceMatrix& d_inputA, const cl::Buffer& d_inputB, const cl::Buffer& d_outputC, std::size_t countBX, cl::Event* event) {
+	cl::Kernel kernel(program, "sparseMatrixMulEllKernel");
+	kernel.setArg<cl::Buffer>(0, d_inputA.d_ellColIdx);
+	kernel.setArg<cl::Buffer>(1, d_inputA.d_ellValues);
+	kernel.setArg<cl_uint>(2, d_inputA.ellWidth);
+	kernel.setArg<cl::Buffer>(3, d_inputB);
+	kernel.setArg<cl::Buffer>(4, d_outputC);
+	kernel.setArg<cl_uint>(5, d_inputA.countRows);
+	kernel.setArg<cl_uint>(6, countBX);
+	std::size_t countGroups = (d_inputA.countRows + spmmRowsPerGroup - 1) / spmmRowsPerGroup;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(spmmWarpSize, countGroups * spmmRowsPerGroup), cl::NDRange(spmmWarpSize, spmmRowsPerGroup), NULL, event);
+}
+
+// Merge path kernel followed by the carry fixup. d_carryRow / d_carryValue
+// must have room for (countRows + countNonzeros) / spmmMergeItemsPerGroup + 1
+// groups (countBX values per group).
+void sparseMatrixMulMergeDevice(const cl::CommandQueue& queue, const cl::Program& program, const SparseDeviceMatrix& d_inputA, const cl::Buffer& d_inputB, const cl::Buffer& d_outputC, const cl::Buffer& d_carryRow, const cl::Buffer& d_carryValue, std::size_t countBX, cl::Event* event, cl::Event* fixupEvent) {
+	std::size_t groupCount = (d_inputA.countRows + d_inputA.countNonzeros + spmmMergeItemsPerGroup - 1) / spmmMergeItemsPerGroup;
+	cl::Kernel kernel(program, "sparseMatrixMulMergeKernel");
+	kernel.setArg<cl::Buffer>(0, d_inputA.d_rowPtr);
+	kernel.setArg<cl::Buffer>(1, d_inputA.d_colIdx);
+	kernel.setArg<cl::Buffer>(2, d_inputA.d_values);
+	kernel.setArg<cl::Buffer>(3, d_inputB);
+	kernel.setArg<cl::Buffer>(4, d_outputC);
+	kernel.setArg<cl::Buffer>(5, d_carryRow);
+	kernel.setArg<cl::Buffer>(6, d_carryValue);
+	kernel.setArg<cl_uint>(7, d_inputA.countRows);
+	kernel.setArg<cl_uint>(8, countBX);
+	kernel.setArg<cl_uint>(9, spmmMergeItemsPerGroup);
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(groupCount * spmmWarpSize), cl::NDRange(spmmWarpSize), NULL, event);
+
+	cl::Kernel fixupKernel(program, "sparseMatrixMulFixupKernel");
+	fixupKernel.setArg<cl::Buffer>(0, d_carryRow);
+	fixupKernel.setArg<cl::Buffer>(1, d_carryValue);
+	fixupKernel.setArg<cl::Buffer>(2, d_outputC);
+	fixupKernel.setArg<cl_uint>(3, d_inputA.countRows);
+	fixupKernel.setArg<cl_uint>(4, countBX);
+	fixupKernel.setArg<cl_uint>(5, groupCount);
+	queue.enqueueNDRangeKernel(fixupKernel, cl::NullRange, cl::NDRange((countBX + spmmWarpSize - 1) / spmmWarpSize * spmmWarpSize, groupCount), cl::NDRange(spmmWarpSize, 1), NULL, fixupEvent);
+}
+
+// Density sweep: sparse A (countAY x countAX_BY) times dense B, compared
+// against dense cblas_sgemm on the same data. Reports the highest density at
+// which the sparse implementations are still faster than the dense product.
+int runSparseMatrixMul(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program) {
+	std::size_t countAX_BY = 2048;
+	std::size_t countAY = 2048;
+	std::size_t countBX = 256;
+	std::size_t countA = countAX_BY * countAY;
+	std::size_t countB = countBX * countAX_BY;
+	std::size_t countC = countBX * countAY;
+	std::size_t sizeB = countB * sizeof (float);
+	std::size_t sizeC = countC * sizeof (float);
+	std::size_t threadCount = std::max(1u, boost::thread::hardware_concurrency());
+	double densities[] = { 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5 };
+	std::size_t countDensities = sizeof (densities) / sizeof (*densities);
+
+	std::cout << std::endl << "Sparse * dense: " << countAY << "x" << countAX_BY << " * " << countAX_BY << "x" << countBX << ", " << threadCount << " host threads" << std::endl;
+
+	std::vector<float> h_inputA (countA);
+	std::vector<float> h_inputB (countB);
+	std::vector<float> h_outputCAtlas (countC);
+	std::vector<float> h_outputCCpu (countC);
+	std::vector<float> h_outputCGpu (countC);
+	for (std::size_t i = 0; i < countB; i++)
+		h_inputB[i] = (rand() % 100) / 5.0f - 10.0f;
+
+	cl::Buffer d_inputB(context, CL_MEM_READ_ONLY, sizeB);
+	cl::Buffer d_outputC(context, CL_MEM_READ_WRITE, sizeC);
+	std::size_t maxGroupCount = (countAY + countA + spmmMergeItemsPerGroup - 1) / spmmMergeItemsPerGroup;
+	cl::Buffer d_carryRow(context, CL_MEM_READ_WRITE, maxGroupCount * sizeof (cl_uint));
+	cl::Buffer d_carryValue(context, CL_MEM_READ_WRITE, maxGroupCount * countBX * sizeof (float));
+	queue.enqueueWriteBuffer(d_inputB, true, 0, sizeB, h_inputB.data());
+
+	// Highest density at which each implementation beats the dense product
+	const char* names[] = { "CPU CSR", "GPU CSR", "GPU ELL", "GPU merge" };
+	double crossover[] = { 0, 0, 0, 0 };
+
+	for (std::size_t d = 0; d < countDensities; d++) {
+		double density = densities[d];
+		for (std::size_t i = 0; i < countA; i++)
+			h_inputA[i] = rand() < density * RAND_MAX ? (rand() % 100 + 1) / 5.0f - 10.1f : 0.0f;
+
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		CsrMatrix csr;
+		denseToCsr(h_inputA, countAX_BY, countAY, csr);
+		Core::TimeSpan convertTime = Core::getCurrentTime() - time1;
+		EllMatrix ell;
+		csrToEll(csr, ell);
+		std::cout << std::endl << "Density " << density * 100 << "%: " << csr.values.size() << " nonzeros, ELL width " << ell.width << ", CSR conversion " << convertTime << std::endl;
+
+		time1 = Core::getCurrentTime();
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, countAY, countBX, countAX_BY, 1.0, h_inputA.data(), countAX_BY, h_inputB.data(), countBX, 0.0, h_outputCAtlas.data(), countBX);
+		Core::TimeSpan atlasTime = Core::getCurrentTime() - time1;
+
+		time1 = Core::getCurrentTime();
+		sparseMatrixMulHost(csr, h_inputB, h_outputCCpu, countBX, threadCount);
+		Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
+
+		printPerformanceHeader();
+		printPerformance("Atlas dense", atlasTime, atlasTime);
+		printPerformance(names[0], cpuTime, atlasTime);
+		if (!compareMatrices(h_outputCAtlas, "Atlas", h_outputCCpu, "CPU", countBX, countAY, 1e-2, 1e-5))
+			return 1;
+		if (cpuTime < atlasTime)
+			crossover[0] = density;
+
+		SparseDeviceMatrix d_inputA;
+		time1 = Core::getCurrentTime();
+		uploadSparseMatrix(context, queue, csr, ell, d_inputA);
+		Core::TimeSpan copyTime = Core::getCurrentTime() - time1;
+
+		for (int impl = 1; impl <= 3; impl++) {
+			memset(h_outputCGpu.data(), 255, sizeC);
+			queue.enqueueWriteBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data());
+			cl::Event execution, fixup, copyC;
+			if (impl == 1)
+				sparseMatrixMulCsrDevice(queue, program, d_inputA, d_inputB, d_outputC, countBX, &execution);
+			else if (impl == 2)
+				sparseMatrixMulEllDevice(queue, program, d_inputA, d_inputB, d_outputC, countBX, &execution);
+			else
+				sparseMatrixMulMergeDevice(queue, program, d_inputA, d_inputB, d_outputC, d_carryRow, d_carryValue, countBX, &execution, &fixup);
+			queue.enqueueReadBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data(), NULL, &copyC);
+			Core::TimeSpan gpuTime = OpenCL::getElapsedTime(execution);
+			if (impl == 3)
+				gpuTime = gpuTime + OpenCL::getElapsedTime(fixup);
+			printPerformance(names[impl], gpuTime, copyTime + OpenCL::getElapsedTime(copyC), atlasTime);
+			if (!compareMatrices(h_outputCAtlas, "Atlas", h_outputCGpu, "GPU", countBX, countAY, 1e-2, 1e-5))
+				return 1;
+			if (gpuTime < atlasTime)
+				crossover[impl] = density;
+		}
+	}
+
+	std::cout << std::endl << "Crossover against dense cblas_sgemm (highest density where sparse is faster):" << std::endl;
+	for (std::size_t impl = 0; impl < 4; impl++) {
+		std::cout << std::setw(12) << names[impl] << ": ";
+		if (crossover[impl] == 0)
+			std::cout << "never faster" << std::endl;
+		else
+			std::cout << crossover[impl] * 100 << "%" << std::endl;
+	}
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Roofline benchmark: measured peaks and all dense implementations over a size sweep
+//////////////////////////////////////////////////////////////////////////////
+// Peak floating point rate (GFLOP/s) and memory bandwidth (GB/s) of a processor
+struct RooflinePeak {
+	double gflops;
+	double gbps;
+};
+
+struct RooflineResult {
+	std::string implementation;
+	std::string target; // "cpu" or "gpu"
+	std::size_t countM, countN, countK;
+	double seconds;
+	double gflops;
+	double gbps;
+	double intensity; // FLOP per byte of compulsory traffic
+	double roofline; // min(peak GFLOP/s, intensity * peak GB/s)
+};
+
+// 8 independent chains of 8-wide multiply-adds (128 FLOP per iteration)
+void peakFlopsHostThread(std::size_t iterations, float* result) {
+#ifdef __AVX__
+	__m256 x0 = _mm256_set1_ps(*result), x1 = _mm256_set1_ps(1), x2 = _mm256_set1_ps(2), x3 = _mm256_set1_ps(3);
+	__m256 x4 = _mm256_set1_ps(4), x5 = _mm256_set1_ps(5), x6 = _mm256_set1_ps(6), x7 = _mm256_set1_ps(7);
+	__m256 m = _mm256_set1_ps(0.999f), c = _mm256_set1_ps(0.001f);
+	for (std::size_t i = 0; i < iterations; i++) {
+#ifdef __FMA__
+		x0 = _mm256_fmadd_ps(x0, m, c);
+		x1 = _mm256_fmadd_ps(x1, m, c);
+		x2 = _mm256_fmadd_ps(x2, m, c);
+		x3 = _mm256_fmadd_ps(x3, m, c);
+		x4 = _mm256_fmadd_ps(x4, m, c);
+		x5 = _mm256_fmadd_ps(x5, m, c);
+		x6 = _mm256_fmadd_ps(x6, m, c);
+		x7 = _mm256_fmadd_ps(x7, m, c);
+#else
+		x0 = _mm256_add_ps(_mm256_mul_ps(x0, m), c);
+		x1 = _mm256_add_ps(_mm256_mul_ps(x1, m), c);
+		x2 = _mm256_add_ps(_mm256_mul_ps(x2, m), c);
+		x3 = _mm256_add_ps(_mm256_mul_ps(x3, m), c);
+		x4 = _mm256_add_ps(_mm256_mul_ps(x4, m), c);
+		x5 = _mm256_add_ps(_mm256_mul_ps(x5, m), c);
+		x6 = _mm256_add_ps(_mm256_mul_ps(x6, m), c);
+		x7 = _mm256_add_ps(_mm256_mul_ps(x7, m), c);
+#endif
+	}
+	__m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(x0, x1), _mm256_add_ps(x2, x3)), _mm256_add_ps(_mm256_add_ps(x4, x5), _mm256_add_ps(x6, x7)));
+	float values[8];
+	_mm256_storeu_ps(values, sum);
+	*result = values[0] + values[1] + values[2] + values[3] + values[4] + values[5] + values[6] + values[7];
+#else
+	float x[64];
+	for (std::size_t j = 0; j < 64; j++)
+		x[j] = *result + j;
+	for (std::size_t i = 0; i < iterations; i++)
+		for (std::size_t j = 0; j < 64; j++)
+			x[j] = x[j] * 0.999f + 0.001f;
+	*result = 0;
+	for (std::size_t j = 0; j < 64; j++)
+		*result += x[j];
+#endif
+}
+
+void copyHostThread(const float* src, float* dst, std::size_t count) {
+	memcpy(dst, src, count * sizeof (float));
+}
+
+// Peak of the host: FMA loop and memcpy on all hardware threads
+RooflinePeak measureHostPeak() {
+	std::size_t threadCount = std::max(1u, boost::thread::hardware_concurrency());
+	RooflinePeak peak;
+
+	std::size_t iterations = 1 << 22;
+	std::vector<float> results (threadCount, 1.0f);
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	boost::thread_group flopThreads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		flopThreads.create_thread(boost::bind(peakFlopsHostThread, iterations, &results[t]));
+	flopThreads.join_all();
+	double seconds = (Core::getCurrentTime() - time1).getSeconds();
+	peak.gflops = 128.0 * iterations * threadCount / seconds * 1e-9;
+
+	// 128 MB per array, written once before so that no page faults are measured
+	std::size_t count = (128 << 20) / sizeof (float);
+	std::vector<float> src (count, 1.0f), dst (count, 0.0f);
+	std::size_t chunk = count / threadCount;
+	time1 = Core::getCurrentTime();
+	boost::thread_group copyThreads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		copyThreads.create_thread(boost::bind(copyHostThread, src.data() + t * chunk, dst.data() + t * chunk, t == threadCount - 1 ? count - t * chunk : chunk));
+	copyThreads.join_all();
+	seconds = (Core::getCurrentTime() - time1).getSeconds();
+	peak.gbps = 2.0 * count * sizeof (float) / seconds * 1e-9;
+	return peak;
+}
+
+RooflinePeak measureDevicePeak(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize) {
+	RooflinePeak peak;
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	std::size_t localSize = wgSize * wgSize;
+
+	std::size_t workItems = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 64 * localSize;
+	cl_uint iterations = 4096;
+	cl::Buffer d_output(context, CL_MEM_WRITE_ONLY, workItems * sizeof (float));
+	cl::Kernel flopsKernel(program, "peakFlopsKernel");
+	flopsKernel.setArg<cl::Buffer>(0, d_output);
+	flopsKernel.setArg<cl_float>(1, 1e-6f);
+	flopsKernel.setArg<cl_uint>(2, iterations);
+	cl::Event execution;
+	queue.enqueueNDRangeKernel(flopsKernel, cl::NullRange, cl::NDRange(workItems), cl::NDRange(localSize));
+	queue.enqueueNDRangeKernel(flopsKernel, cl::NullRange, cl::NDRange(workItems), cl::NDRange(localSize), NULL, &execution);
+	execution.wait();
+	peak.gflops = 64.0 * iterations * workItems / OpenCL::getElapsedTime(execution).getSeconds() * 1e-9;
+
+	std::size_t size = std::min<std::size_t>(256 << 20, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+	size = size / (localSize * 16) * (localSize * 16);
+	cl::Buffer d_src(context, CL_MEM_READ_ONLY, size);
+	cl::Buffer d_dst(context, CL_MEM_WRITE_ONLY, size);
+	cl::Kernel copyKernel(program, "copyBandwidthKernel");
+	copyKernel.setArg<cl::Buffer>(0, d_src);
+	copyKernel.setArg<cl::Buffer>(1, d_dst);
+	queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(size / 16), cl::NDRange(localSize));
+	queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(size / 16), cl::NDRange(localSize), NULL, &execution);
+	execution.wait();
+	peak.gbps = 2.0 * size / OpenCL::getElapsedTime(execution).getSeconds() * 1e-9;
+	return peak;
+}
+
+// Compulsory traffic: A and B read once (elementSize bytes per value), C written once
+RooflineResult makeRooflineResult(const std::string& implementation, const std::string& target, const RooflinePeak& peak, std::size_t countM, std::size_t countN, std::size_t countK, std::size_t elementSize, Core::TimeSpan time) {
+	RooflineResult result;
+	result.implementation = implementation;
+	result.target = target;
+	result.countM = countM;
+	result.countN = countN;
+	result.countK = countK;
+	result.seconds = time.getSeconds();
+	double flop = 2.0 * countM * countN * countK;
+	double bytes = (double) (countM * countK + countK * countN) * elementSize + (double) countM * countN * sizeof (float);
+	result.gflops = flop / result.seconds * 1e-9;
+	result.gbps = bytes / result.seconds * 1e-9;
+	result.intensity = flop / bytes;
+	result.roofline = std::min(peak.gflops, result.intensity * peak.gbps);
+	return result;
+}
+
+void printRooflineResult(const RooflineResult& result) {
+	std::ios::fmtflags flags = std::cout.flags();
+	std::streamsize precision = std::cout.precision();
+	std::cout << std::setiosflags(std::ios::left) << std::setw(22) << result.implementation << std::resetiosflags(std::ios::left)
+			<< std::setw(6) << result.countM
+			<< std::setw(12) << std::fixed << std::setprecision(6) << result.seconds
+			<< std::setw(10) << std::setprecision(2) << result.gflops
+			<< std::setw(10) << result.gbps
+			<< std::setw(8) << result.intensity
+			<< std::setw(8) << std::setprecision(1) << 100 * result.gflops / result.roofline << "%"
+			<< std::endl;
+	std::cout.flags(flags);
+	std::cout.precision(precision);
+}
+
+void writeRooflineCsv(const std::string& filename, const RooflinePeak& hostPeak, const RooflinePeak& devicePeak, const std::vector<RooflineResult>& results) {
+	std::ofstream stream(filename.c_str());
+	stream << "implementation,target,m,n,k,seconds,gflops,gbps,intensity,peak_gflops,peak_gbps,roofline_gflops,percent_of_roofline" << std::endl;
+	for (std::size_t i = 0; i < results.size(); i++) {
+		const RooflineResult& r = results[i];
+		const RooflinePeak& peak = r.target == "gpu" ? devicePeak : hostPeak;
+		stream << r.implementation << "," << r.target << "," << r.countM << "," << r.countN << "," << r.countK << ","
+				<< r.seconds << "," << r.gflops << "," << r.gbps << "," << r.intensity << ","
+				<< peak.gflops << "," << peak.gbps << "," << r.roofline << "," << 100 * r.gflops / r.roofline << std::endl;
+	}
+}
+
+void writeRooflineJson(const std::string& filename, const RooflinePeak& hostPeak, const RooflinePeak& devicePeak, const std::vector<RooflineResult>& results) {
+	std::ofstream stream(filename.c_str());
+	stream << "{" << std::endl;
+	stream << "  \"peak\": {" << std::endl;
+	stream << "    \"cpu\": { \"gflops\": " << hostPeak.gflops << ", \"gbps\": " << hostPeak.gbps << " }," << std::endl;
+	stream << "    \"gpu\": { \"gflops\": " << devicePeak.gflops << ", \"gbps\": " << devicePeak.gbps << " }" << std::endl;
+	stream << "  }," << std::endl;
+	stream << "  \"results\": [" << std::endl;
+	for (std::size_t i = 0; i < results.size(); i++) {
+		const RooflineResult& r = results[i];
+		stream << "    { \"implementation\": \"" << r.implementation << "\", \"target\": \"" << r.target << "\""
+				<< ", \"m\": " << r.countM << ", \"n\": " << r.countN << ", \"k\": " << r.countK
+				<< ", \"seconds\": " << r.seconds << ", \"gflops\": " << r.gflops << ", \"gbps\": " << r.gbps
+				<< ", \"intensity\": " << r.intensity << ", \"roofline_gflops\": " << r.roofline
+				<< ", \"percent_of_roofline\": " << 100 * r.gflops / r.roofline << " }" << (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	stream << "  ]" << std::endl;
+	stream << "}" << std::endl;
+}
+
+// Run a dense matmul kernel with the signature of matrixMulKernel1 (after one warm-up run)
+Core::TimeSpan runMatrixMulKernel(const cl::CommandQueue& queue, const cl::Program& program, const std::string& kernelName, std::size_t wgSize, const cl::Buffer& d_inputA, const cl::Buffer& d_inputB, const cl::Buffer& d_outputC, std::size_t countAX_BY, std::size_t countAY, std::size_t countBX) {
+	cl::Kernel kernel(program, kernelName.c_str());
+	kernel.setArg<cl::Buffer>(0, d_inputA);
+	kernel.setArg<cl::Buffer>(1, d_inputB);
+	kernel.setArg<cl::Buffer>(2, d_outputC);
+	kernel.setArg<cl_uint>(3, countAX_BY);
+	kernel.setArg<cl_uint>(4, countBX);
+	cl::Event execution;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(countBX, countAY), cl::NDRange(wgSize, wgSize));
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(countBX, countAY), cl::NDRange(wgSize, wgSize), NULL, &execution);
+	execution.wait();
+	return OpenCL::getElapsedTime(execution);
+}
+
+// Square matrices of all sizes, every result checked against cblas_sgemm.
+// Writes roofline.csv and roofline.json to the current directory.
+int runRoofline(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize) {
+	std::cout << std::endl << "Measuring peaks..." << std::endl;
+	RooflinePeak hostPeak = measureHostPeak();
+	RooflinePeak devicePeak = measureDevicePeak(context, queue, program, wgSize);
+	std::cout << "CPU: " << hostPeak.gflops << " GFLOP/s, " << hostPeak.gbps << " GB/s, ridge point " << hostPeak.gflops / hostPeak.gbps << " FLOP/byte" << std::endl;
+	std::cout << "GPU: " << devicePeak.gflops << " GFLOP/s, " << devicePeak.gbps << " GB/s, ridge point " << devicePeak.gflops / devicePeak.gbps << " FLOP/byte" << std::endl;
+
+	// The naive host implementation is only run up to this size
+	std::size_t maxCpuSize = 512;
+	std::size_t sizes[] = { 128, 256, 512, 1024, 2048 };
+	std::vector<RooflineResult> results;
+	std::cout << std::endl << std::setiosflags(std::ios::left) << std::setw(22) << "Implementation" << std::resetiosflags(std::ios::left)
+			<< std::setw(6) << "Size" << std::setw(12) << "Time [s]" << std::setw(10) << "GFLOP/s" << std::setw(10) << "GB/s"
+			<< std::setw(8) << "FLOP/B" << std::setw(9) << "Roofline" << std::endl;
+	for (std::size_t s = 0; s < sizeof (sizes) / sizeof (*sizes); s++) {
+		std::size_t n = sizes[s];
+		ASSERT (n % wgSize == 0);
+		std::size_t count = n * n;
+		std::size_t size = count * sizeof (float);
+		std::vector<float> h_inputA (count), h_inputB (count);
+		std::vector<float> h_outputCAtlas (count), h_outputC (count);
+		for (std::size_t i = 0; i < count; i++) {
+			h_inputA[i] = (rand() % 100) / 5.0f - 10.0f;
+			h_inputB[i] = (rand() % 100) / 5.0f - 10.0f;
+		}
+		// Tolerance grows with the length of the dot products (1e-2 / 1e-4 at n = 512)
+		float absTolerance = 2e-5f * n;
+		float relTolerance = 2e-7f * n;
+
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n, n, n, 1.0, h_inputA.data(), n, h_inputB.data(), n, 0.0, h_outputCAtlas.data(), n);
+		results.push_back(makeRooflineResult("Atlas", "cpu", hostPeak, n, n, n, sizeof (float), Core::getCurrentTime() - time1));
+		printRooflineResult(results.back());
+
+		if (n <= maxCpuSize) {
+			time1 = Core::getCurrentTime();
+			matrixMulHost(h_inputA, h_inputB, h_outputC, n, n, n);
+			results.push_back(makeRooflineResult("CPU", "cpu", hostPeak, n, n, n, sizeof (float), Core::getCurrentTime() - time1));
+			printRooflineResult(results.back());
+			if (!compareMatrices(h_outputCAtlas, "Atlas", h_outputC, "CPU", n, n, absTolerance, relTolerance))
+				return 1;
+		}
+
+		// Half storage: compared against the product of the rounded inputs
+		std::vector<cl_half> h_inputAHalf (count), h_inputBHalf (count);
+		std::vector<float> h_inputARounded (count), h_inputBRounded (count), h_outputCRounded (count);
+		convertToHalfHost(h_inputA, h_inputAHalf);
+		convertToHalfHost(h_inputB, h_inputBHalf);
+		convertToFloatHost(h_inputAHalf, h_inputARounded);
+		convertToFloatHost(h_inputBHalf, h_inputBRounded);
+		cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n, n, n, 1.0, h_inputARounded.data(), n, h_inputBRounded.data(), n, 0.0, h_outputCRounded.data(), n);
+		time1 = Core::getCurrentTime();
+		matrixMulHalfHost(h_inputAHalf, h_inputBHalf, h_outputC, n, n, n);
+		results.push_back(makeRooflineResult("CPU half", "cpu", hostPeak, n, n, n, sizeof (cl_half), Core::getCurrentTime() - time1));
+		printRooflineResult(results.back());
+		if (!compareMatrices(h_outputCRounded, "Reference", h_outputC, "CPU half", n, n, absTolerance, relTolerance))
+			return 1;
+
+		cl::Buffer d_inputA(context, CL_MEM_READ_ONLY, size);
+		cl::Buffer d_inputB(context, CL_MEM_READ_ONLY, size);
+		cl::Buffer d_inputAHalf(context, CL_MEM_READ_ONLY, count * sizeof (cl_half));
+		cl::Buffer d_inputBHalf(context, CL_MEM_READ_ONLY, count * sizeof (cl_half));
+		cl::Buffer d_outputC(context, CL_MEM_READ_WRITE, size);
+		queue.enqueueWriteBuffer(d_inputA, true, 0, size, h_inputA.data());
+		queue.enqueueWriteBuffer(d_inputB, true, 0, size, h_inputB.data());
+		queue.enqueueWriteBuffer(d_inputAHalf, true, 0, count * sizeof (cl_half), h_inputAHalf.data());
+		queue.enqueueWriteBuffer(d_inputBHalf, true, 0, count * sizeof (cl_half), h_inputBHalf.data());
+
+		for (int impl = 1; impl <= 3; impl++) {
+			std::string kernelName = impl == 3 ? "matrixMulHalfKernel" : "matrixMulKernel" + boost::lexical_cast<std::string> (impl);
+			Core::TimeSpan gpuTime = runMatrixMulKernel(queue, program, kernelName, wgSize, impl == 3 ? d_inputAHalf : d_inputA, impl == 3 ? d_inputBHalf : d_inputB, d_outputC, n, n, n);
+			results.push_back(makeRooflineResult(kernelName, "gpu", devicePeak, n, n, n, impl == 3 ? sizeof (cl_half) : sizeof (float), gpuTime));
+			printRooflineResult(results.back());
+			queue.enqueueReadBuffer(d_outputC, true, 0, size, h_outputC.data());
+			if (!compareMatrices(impl == 3 ? h_outputCRounded : h_outputCAtlas, "Reference", h_outputC, "GPU", n, n, absTolerance, relTolerance))
+				return 1;
+		}
+	}
+
+	writeRooflineCsv("roofline.csv", hostPeak, devicePeak, results);
+	writeRooflineJson("roofline.json", hostPeak, devicePeak, results);
+	std::cout << "Results written to roofline.csv and roofline.json" << std::endl;
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Main function
 //////////////////////////////////////////////////////////////////////////////
@@ -161,6 +1288,15 @@ int main(int argc, char** argv) {
 	// This will pass the value of wgSize as a preprocessor constant "WG_SIZE" to the OpenCL C compiler
 	OpenCL::buildProgram(program, devices, "-DWG_SIZE=" + boost::lexical_cast<std::string>(wgSize));
 
+	// Optional benchmark modes, selected by the second command line argument
+	std::string mode = argc < 3 ? "" : argv[2];
+	if (mode == "batched")
+		return runBatchedGemm(context, queue, program, wgSize);
+	if (mode == "spmm")
+		return runSparseMatrixMul(context, queue, program);
+	if (mode == "roofline")
+		return runRoofline(context, queue, program, wgSize);
+
 	// Allocate space for output data from CPU and GPU on the host
 	std::vector<float> h_inputA (countA);
 	std::vector<float> h_inputB (countB);
@@ -169,7 +1305,9 @@ int main(int argc, char** argv) {
 	std::vector<float> h_outputCGpu (countC);
 
 	// Allocate space for input and output data on the device
-	//TODO
+	cl::Buffer d_inputA(context, CL_MEM_READ_WRITE, sizeA);
+	cl::Buffer d_inputB(context, CL_MEM_READ_WRITE, sizeB);
+	cl::Buffer d_outputC(context, CL_MEM_READ_WRITE, sizeC);
 
 	// Initialize memory to 0xff (useful for debugging because otherwise GPU memory will contain information from last execution)
 	memset(h_inputA.data(), 255, sizeA);
@@ -177,7 +1315,9 @@ int main(int argc, char** argv) {
 	memset(h_outputCCpu.data(), 255, sizeC);
 	memset(h_outputCAtlas.data(), 255, sizeC);
 	memset(h_outputCGpu.data(), 255, sizeC);
-	//TODO: GPU
+	queue.enqueueWriteBuffer(d_inputA, true, 0, sizeA, h_inputA.data());
+	queue.enqueueWriteBuffer(d_inputB, true, 0, sizeB, h_inputB.data());
+	queue.enqueueWriteBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data());
 
 	//////// Generate input data ////////////////////////////////
 	// Use random input data
@@ -194,13 +1334,15 @@ int main(int argc, char** argv) {
 	*/
 
 	// Do calculation on the host side
+	Core::TimeSpan time1 = Core::getCurrentTime();
 	matrixMulHost(h_inputA, h_inputB, h_outputCCpu, countAX_BY, countAY, countBX);
+	Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
 
 	// Do calculation on using libatlas
+	time1 = Core::getCurrentTime();
 	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, countAY, countBX, countAX_BY, 1.0, h_inputA.data(), countAX_BY, h_inputB.data(), countBX, 0.0, h_outputCAtlas.data(), countCX);
+	Core::TimeSpan atlasTime = Core::getCurrentTime() - time1;
 
-	Core::TimeSpan cpuTime = Core::TimeSpan::fromSeconds(0); //TODO
-	Core::TimeSpan atlasTime = Core::TimeSpan::fromSeconds(0); //TODO
 	printPerformanceHeader();
 	printPerformance("CPU", cpuTime, atlasTime);
 	printPerformance("Atlas", atlasTime, atlasTime);
@@ -208,28 +1350,41 @@ int main(int argc, char** argv) {
 	if (!compareMatrices(h_outputCCpu, "CPU", h_outputCAtlas, "Atlas", countCX, countCY))
 		return 1;
 
+	// Split C over all devices of the context ("multi"), optionally including the host ("multi-cpu")
+	if (mode == "multi" || mode == "multi-cpu")
+		return runMultiDevice(context, wgSize, mode == "multi-cpu", h_inputA, h_inputB, h_outputCAtlas, atlasTime, countAX_BY, countAY, countBX);
+
 	// Copy input data to device
-	//TODO
+	cl::Event copyA, copyB;
+	queue.enqueueWriteBuffer(d_inputA, true, 0, sizeA, h_inputA.data(), NULL, &copyA);
+	queue.enqueueWriteBuffer(d_inputB, true, 0, sizeB, h_inputB.data(), NULL, &copyB);
 
 	// Iterate over all implementations (task 1 - 2)
-	for (int impl = 1; impl <= 1; impl++) {
+	for (int impl = 1; impl <= 2; impl++) {
 		// Reinitialize output memory to 0xff
 		memset(h_outputCGpu.data(), 255, sizeC);
-		//TODO
+		queue.enqueueWriteBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data());
 
 		// Create a kernel object
 		std::string kernelName = "matrixMulKernel" + boost::lexical_cast<std::string> (impl);
 		cl::Kernel matrixMulKernel(program, kernelName.c_str ());
 
 		// Launch kernel on the device
-		//TODO
+		cl::Event execution;
+		matrixMulKernel.setArg<cl::Buffer>(0, d_inputA);
+		matrixMulKernel.setArg<cl::Buffer>(1, d_inputB);
+		matrixMulKernel.setArg<cl::Buffer>(2, d_outputC);
+		matrixMulKernel.setArg<cl_uint>(3, countAX_BY);
+		matrixMulKernel.setArg<cl_uint>(4, countBX);
+		queue.enqueueNDRangeKernel(matrixMulKernel, cl::NullRange, cl::NDRange(countCX, countCY), cl::NDRange(wgSize, wgSize), NULL, &execution);
 
 		// Copy output data back to host
-		//TODO
+		cl::Event copyC;
+		queue.enqueueReadBuffer(d_outputC, true, 0, sizeC, h_outputCGpu.data(), NULL, &copyC);
 
 		// Print performance data
-		Core::TimeSpan gpuTime(0); //TODO
-		Core::TimeSpan copyTime(0); //TODO
+		Core::TimeSpan gpuTime = OpenCL::getElapsedTime(execution);
+		Core::TimeSpan copyTime = OpenCL::getElapsedTime(copyA) + OpenCL::getElapsedTime(copyB) + OpenCL::getElapsedTime(copyC);
 		printPerformance(kernelName, gpuTime, copyTime, atlasTime);
 
 		// Check whether results are correct
@@ -237,6 +1392,10 @@ int main(int argc, char** argv) {
 			return 1;
 	}
 
+	// Half precision storage with float accumulation
+	if (!runMatrixMulHalf(context, queue, program, wgSize, h_inputA, h_inputB, h_outputCAtlas, d_inputA, d_inputB, d_outputC, atlasTime, countAX_BY, countAY, countBX))
+		return 1;
+
 	std::cout << "Success" << std::endl;
 
 	//dumpMatrix ("A", h_inputA, countAX_BY, countAY);
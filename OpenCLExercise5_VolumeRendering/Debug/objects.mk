@@ -4,5 +4,5 @@
 
 USER_OBJS :=
 
-LIBS := -ldl -lboost_system -lboost_filesystem -lOpenCL -lhdf5 -lglut -lGLEW -lGL
+LIBS := -ldl -lboost_system -lboost_filesystem -lOpenCL -lhdf5 -lglut -lGLEW -lGL -lboost_thread -lpthread
 
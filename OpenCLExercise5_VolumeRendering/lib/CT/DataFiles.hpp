@@ -38,6 +38,14 @@
 #include <CT/CTFloat.hpp>
 
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 template <typename T>
 struct VolumeGen {
@@ -70,18 +78,106 @@ struct VolumeGen {
           values (x, y, z) *= factor;
   }
 
+  T scalingFactor () const {
+    return VolumeScalingFactor ? (T) *VolumeScalingFactor : (T) 1;
+  }
+
+  // Read access to the volume in the orientation of transformedTransposedVolume ()
+  // without a copy: the storage order is part of the strides of the view and the
+  // scaling factor is applied on every read. Use this when only a small part of
+  // the volume is sampled.
+  struct LazyVolume {
+    Math::ArrayView<const T, 3> view;
+    T factor;
+
+    LazyVolume (const Math::ArrayView<const T, 3>& view, T factor) : view (view), factor (factor) {
+    }
+
+    template <std::size_t n>
+    size_t size () const {
+      return view.template size<n> ();
+    }
+
+    T operator() (size_t x, size_t y, size_t z) const {
+      return view (x, y, z) * factor;
+    }
+  };
+
+  LazyVolume lazyTransformedVolume () const {
+    return LazyVolume (transposedUnscaledVolume (), scalingFactor ());
+  }
+
 private:
   struct NoopDeallocator {
     template <typename U>
     void operator() (const U& val) {
     }
   };
+
+  // Edge length of the tiles used when x is not the contiguous dimension of the source
+  static const size_t transposeTileSize = 16;
+
+  static void scaleRow (T* dst, const T* src, size_t count, T factor) {
+    for (size_t i = 0; i < count; i++)
+      dst[i] = src[i] * factor;
+  }
+
+  // Copies the slices [z0, z1) of src into dst (contiguous, x fastest) and
+  // multiplies every value by factor
+  static void copyScaledSlab (const Math::ArrayView<const T, 3>& src, T* dst, T factor, size_t z0, size_t z1) {
+    size_t countX = src.template size<0> ();
+    size_t countY = src.template size<1> ();
+    const char* base = (const char*) src.data ();
+    std::ptrdiff_t strideX = src.template strideBytes<0> ();
+    std::ptrdiff_t strideY = src.template strideBytes<1> ();
+    std::ptrdiff_t strideZ = src.template strideBytes<2> ();
+    if (strideX == (std::ptrdiff_t) sizeof (T)) {
+      // Rows are contiguous in the source as well
+      for (size_t z = z0; z < z1; z++)
+        for (size_t y = 0; y < countY; y++)
+          scaleRow (dst + countX * (y + countY * z), (const T*) (base + (std::ptrdiff_t) y * strideY + (std::ptrdiff_t) z * strideZ), countX, factor);
+      return;
+    }
+    // Copy cubic tiles so that the cache lines of the source are used
+    // completely before they are evicted, whatever the storage order is
+    for (size_t tz = z0; tz < z1; tz += transposeTileSize) {
+      size_t ez = std::min (tz + transposeTileSize, z1);
+      for (size_t ty = 0; ty < countY; ty += transposeTileSize) {
+        size_t ey = std::min (ty + transposeTileSize, countY);
+        for (size_t tx = 0; tx < countX; tx += transposeTileSize) {
+          size_t ex = std::min (tx + transposeTileSize, countX);
+          for (size_t z = tz; z < ez; z++) {
+            for (size_t y = ty; y < ey; y++) {
+              const char* srcRow = base + (std::ptrdiff_t) y * strideY + (std::ptrdiff_t) z * strideZ;
+              T* dstRow = dst + countX * (y + countY * z);
+              for (size_t x = tx; x < ex; x++)
+                dstRow[x] = *(const T*) (srcRow + (std::ptrdiff_t) x * strideX) * factor;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Fused copy and scale, the z slabs are distributed over all cores
+  static void copyScaled (const Math::ArrayView<const T, 3>& src, Math::Array<T, 3>& dst, T factor) {
+    dst.recreate (src.shape ());
+    size_t countZ = src.template size<2> ();
+    size_t threadCount = std::max (1u, boost::thread::hardware_concurrency ());
+    size_t slab = (countZ + threadCount - 1) / threadCount;
+    slab = std::max (transposeTileSize, (slab + transposeTileSize - 1) / transposeTileSize * transposeTileSize);
+    boost::thread_group threads;
+    for (size_t z0 = slab; z0 < countZ; z0 += slab)
+      threads.create_thread (boost::bind (&VolumeGen::copyScaledSlab, src, dst.data (), factor, z0, std::min (z0 + slab, countZ)));
+    copyScaledSlab (src, dst.data (), factor, 0, std::min (slab, countZ));
+    threads.join_all ();
+  }
 public:
-  // Rather slow (will transpose volume in memory)
+  // Transposes and scales the volume in a single pass over the data
   boost::shared_ptr<const Math::Array<T, 3> > transformedTransposedVolume (bool forceCopy = false) const {
     if (forceCopy || VolumeScalingFactor || VolumeStorageOrder) {
-      boost::shared_ptr<Math::Array<T, 3> > copyPtr = boost::make_shared<Math::Array<T, 3> > (transposedUnscaledVolume ());
-      scaleValues (copyPtr->view ());
+      boost::shared_ptr<Math::Array<T, 3> > copyPtr = boost::make_shared<Math::Array<T, 3> > ();
+      copyScaled (transposedUnscaledVolume (), *copyPtr, scalingFactor ());
       return copyPtr;
     } else {
       return boost::shared_ptr<const Math::Array<T, 3> > (&Volume, NoopDeallocator ());
@@ -92,8 +188,7 @@ public:
     if (forceCopy || VolumeScalingFactor) {
       //boost::shared_ptr<Math::Array<T, 3> > copyPtr = boost::make_shared<Math::Array<T, 3> > (Volume);
       boost::shared_ptr<std::pair<Math::Array<T, 3>, boost::scoped_ptr<Math::ArrayView<const T, 3> > > > copyPtr = boost::make_shared<std::pair<Math::Array<T, 3>, boost::scoped_ptr<Math::ArrayView<const T, 3> > > > ();
-      copyPtr->first.recreate (Volume);
-      scaleValues (copyPtr->first);
+      copyScaled (Volume.view (), copyPtr->first, scalingFactor ());
       copyPtr->second.reset (new Math::ArrayView<const T, 3> (transposeVolume (copyPtr->first.view ())));
       //return boost::shared_ptr<const Math::ArrayView<const T, 3> > (copyPtr, &copyPtr->view ()); // Only works if Array::view() returns a reference
       return boost::shared_ptr<const Math::ArrayView<const T, 3> > (copyPtr, copyPtr->second.get ());
@@ -112,6 +207,19 @@ public:
   HDF5_MATLAB_DECLARE_TYPE (VolumeGen, MEMBERS)
 #undef MEMBERS
 };
+
+#if defined(__AVX__)
+template <>
+inline void VolumeGen<float>::scaleRow (float* dst, const float* src, size_t count, float factor) {
+  __m256 factor8 = _mm256_set1_ps (factor);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_ps (dst + i, _mm256_mul_ps (_mm256_loadu_ps (src + i), factor8));
+  for (; i < count; i++)
+    dst[i] = src[i] * factor;
+}
+#endif
+
 typedef VolumeGen<CTFloat> Volume;
 
 template <typename T>
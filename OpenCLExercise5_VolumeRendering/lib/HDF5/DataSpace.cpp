@@ -52,4 +52,8 @@ namespace HDF5 {
   int DataSpace::getSimpleExtentNdims () const {
     return Exception::check ("H5Sget_simple_extent_ndims", H5Sget_simple_extent_ndims (handle ()));
   }
+
+  void DataSpace::selectHyperslab (H5S_seloper_t op, const hsize_t* start, const hsize_t* count, const hsize_t* stride, const hsize_t* block) const {
+    Exception::check ("H5Sselect_hyperslab", H5Sselect_hyperslab (handle (), op, start, stride, count, block));
+  }
 }
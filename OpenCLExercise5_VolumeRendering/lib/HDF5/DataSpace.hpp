@@ -80,6 +80,8 @@ namespace HDF5 {
     H5S_class_t getSimpleExtentType () const;
     void getSimpleExtentDims (hsize_t* dims, hsize_t* maxDims = NULL) const;
     int getSimpleExtentNdims () const;
+
+    void selectHyperslab (H5S_seloper_t op, const hsize_t* start, const hsize_t* count, const hsize_t* stride = NULL, const hsize_t* block = NULL) const;
   };
 }
 
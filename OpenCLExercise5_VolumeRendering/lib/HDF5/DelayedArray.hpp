@@ -59,6 +59,23 @@ namespace HDF5 {
       dataSet.write (ptr, getH5Type<T> ());
     }
 
+    // Read the block of count[0] x ... x count[N - 1] values starting at
+    // offset (fortran order, like the whole array) using a hyperslab
+    // selection, so that only this part of the data set is read
+    void readHyperslab (T* ptr, const std::size_t* offset, const std::size_t* count) const {
+      ASSERT (dataSet.isValid ());
+      hsize_t start[N], dims[N];
+      for (size_t i = 0; i < N; i++) {
+        ASSERT (offset[i] + count[i] <= size[i]);
+        start[N - 1 - i] = offset[i];
+        dims[N - 1 - i] = count[i];
+      }
+      HDF5::DataSpace fileSpace = dataSet.getSpace ();
+      fileSpace.selectHyperslab (H5S_SELECT_SET, start, dims);
+      HDF5::DataSpace memSpace = HDF5::DataSpace::createSimpleRank (N, dims);
+      dataSet.read (ptr, getH5Type<T> (), memSpace, fileSpace);
+    }
+
     template <typename Assert>
     bool checkDimensionsStrides (const Math::ArrayView<const T, N, Math::ArrayConfig, Assert>& array) const {
       ptrdiff_t stride = sizeof (T);
@@ -2,6 +2,302 @@
 #include <OpenCL/OpenCLKernel.hpp> // Hack to make syntax highlighting in Eclipse work
 #endif
 
-__kernel void renderKernel (   ) {
-	//TODO
+// Edge length of a macro cell in voxels (set by the host)
+#ifndef MACRO_CELL_SIZE
+#define MACRO_CELL_SIZE 4
+#endif
+
+// Edge length of a brick in voxels without its apron (set by the host)
+#ifndef BRICK_SIZE
+#define BRICK_SIZE 16
+#endif
+
+// Voxels of 0 before and after every level of the packed pyramid (set by
+// the host)
+#ifndef PYRAMID_PADDING
+#define PYRAMID_PADDING 3
+#endif
+
+// Render modes (same values as RenderMode on the host)
+#define RENDER_SUM 0
+#define RENDER_COMPOSITE 1
+
+// Filters (same values as SampleFilter on the host)
+#define FILTER_LINEAR 0
+#define FILTER_CUBIC 1
+
+// Blinn-Phong shading with a headlight (same values as on the host)
+#define SHADING_AMBIENT 0.3f
+#define SHADING_DIFFUSE 0.7f
+#define SHADING_SPECULAR 0.4f
+#define SHADING_SHININESS_SHIFT 4
+
+// Trilinear interpolation, outside of the volume the values are 0
+__constant sampler_t volumeSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_LINEAR;
+
+// Transfer function lookup table, values outside of its range get the first / last entry
+__constant sampler_t transferFunctionSampler = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+int intersectBox(float3 r_o, float3 r_d, float3 boxmin, float3 boxmax, float *tnear, float *tfar) {
+	// compute intersection of ray with all six bbox planes
+	float3 invR = (float3)(1.0f, 1.0f, 1.0f) / r_d;
+	float3 tbot = invR * (boxmin - r_o);
+	float3 ttop = invR * (boxmax - r_o);
+
+	// re-order intersections to find smallest and largest on each axis
+	float3 tmin = min(ttop, tbot);
+	float3 tmax = max(ttop, tbot);
+
+	// find the largest tmin and the smallest tmax
+	float largest_tmin = max(max(tmin.x, tmin.y), tmin.z);
+	float smallest_tmax = min(min(tmax.x, tmax.y), tmax.z);
+
+	*tnear = largest_tmin;
+	*tfar = smallest_tmax;
+
+	return smallest_tmax > largest_tmin;
+}
+
+// One 3D-DDA step: if the values of the macro cell of the given level
+// containing pos are all in [skipMin, skipThreshold], returns true and the
+// ray parameter tExit where the ray, marching towards larger t (forward) or
+// smaller t, leaves the cell. d_macroCells has the cells of level 0
+// (cellsX * cellsY * cellsZ) for FILTER_LINEAR and then for FILTER_CUBIC,
+// then those of level 1 (half as many per axis, rounded up), ... A cell of
+// level l has MACRO_CELL_SIZE << l voxels per axis.
+bool skipMacroCell(__global const float2* d_macroCells, uint cellsX, uint cellsY, uint cellsZ, float skipMin, float skipThreshold, int filter, int level, float3 pos, float3 eyeRay_o, float3 eyeRay_d, bool forward, float* tExit) {
+	int offset = 0;
+	int3 cells = (int3)(cellsX, cellsY, cellsZ);
+	for (int l = 0; l < level; l++) {
+		offset += 2 * cells.x * cells.y * cells.z;
+		cells = (cells + 1) / 2;
+	}
+	if (filter == FILTER_CUBIC)
+		offset += cells.x * cells.y * cells.z;
+	int cellSize = MACRO_CELL_SIZE << level;
+	int cx = clamp((int) pos.x / cellSize, 0, cells.x - 1);
+	int cy = clamp((int) pos.y / cellSize, 0, cells.y - 1);
+	int cz = clamp((int) pos.z / cellSize, 0, cells.z - 1);
+	float2 cell = d_macroCells[offset + cx + cells.x * (cy + cells.y * cz)];
+	if (!(cell.x >= skipMin && cell.y <= skipThreshold))
+		return false;
+	float3 cellMin = convert_float3((int3)(cx, cy, cz) * cellSize);
+	float3 exitPlane = cellMin + select((float3)(0), (float3)(cellSize), forward ? eyeRay_d > 0 : eyeRay_d <= 0);
+	float3 t = select((exitPlane - eyeRay_o) / eyeRay_d, (float3)(forward ? INFINITY : -INFINITY), eyeRay_d == 0);
+	*tExit = forward ? min(min(t.x, t.y), t.z) : max(max(t.x, t.y), t.z);
+	return true;
+}
+
+// Sample the volume at pos. When streaming (volumeSize.w != 0), d_input is
+// an atlas of bricks with an apron of one voxel, each (BRICK_SIZE + 2)^3
+// voxels, and d_brickTable gives the atlas slot of every brick of the
+// volume or -1 if the brick is not resident (sampled as 0).
+float sampleVolume(__read_only image3d_t d_input, __global const int* d_brickTable, int4 volumeSize, float3 pos) {
+	if (!volumeSize.w)
+		return read_imagef(d_input, volumeSampler, (float4)(pos, 0)).x;
+
+	// brick of the first of the 8 voxels and its position in the brick (the apron is at 0)
+	int3 bricks = (volumeSize.xyz + BRICK_SIZE - 1) / BRICK_SIZE;
+	int3 voxel = convert_int3_rtn(pos - 0.5f);
+	int3 brick = clamp(voxel / BRICK_SIZE, (int3)(0), bricks - 1);
+	int3 inBrick = voxel - brick * BRICK_SIZE + 1;
+	if (any(inBrick < 0) || any(inBrick > BRICK_SIZE))
+		return 0;
+	int slot = d_brickTable[brick.x + bricks.x * (brick.y + bricks.y * brick.z)];
+	if (slot < 0)
+		return 0;
+
+	int3 slots = get_image_dim(d_input).xyz / (BRICK_SIZE + 2);
+	int3 slotOrigin = (int3)(slot % slots.x, slot / slots.x % slots.y, slot / (slots.x * slots.y)) * (BRICK_SIZE + 2);
+	return read_imagef(d_input, volumeSampler, (float4)(pos + convert_float3(slotOrigin - brick * BRICK_SIZE + 1), 0)).x;
+}
+
+// Pyramid level for the sample at t (see lodLevel() on the host)
+int lodLevel(int lodLevels, float lodScale, int lodBias, float t) {
+	int level = lodBias;
+	float footprint = t * lodScale;
+	for (int l = 1; l < lodLevels; l++)
+		level += footprint >= (1 << l);
+	return min(level, lodLevels - 1);
+}
+
+// Sample level 0 (the volume) or level > 0 of the pyramid. d_pyramid has
+// the levels 1, 2, ... next to each other along x, with PYRAMID_PADDING
+// voxels of 0 before and after each of them.
+float sampleLevel(__read_only image3d_t d_input, __global const int* d_brickTable, int4 volumeSize, __read_only image3d_t d_pyramid, int level, float3 pos) {
+	if (level == 0)
+		return sampleVolume(d_input, d_brickTable, volumeSize, pos);
+	float originX = PYRAMID_PADDING;
+	for (int l = 1; l < level; l++)
+		originX += ((volumeSize.x + (1 << l) - 1) >> l) + PYRAMID_PADDING;
+	return read_imagef(d_pyramid, volumeSampler, (float4)(pos * (1.0f / (1 << level)) + (float3)(originX, 0, 0), 0)).x;
+}
+
+// Tricubic B-spline from 8 trilinear fetches of sampleLevel(): along each
+// axis the two fetches are moved so that the linear weights give the
+// B-spline weights w0 to w3 of the 4 voxels (see sampleCubic() on the host)
+float sampleCubic(__read_only image3d_t d_input, __global const int* d_brickTable, int4 volumeSize, __read_only image3d_t d_pyramid, int level, float3 pos) {
+	float scale = 1 << level;
+	float3 index = pos / scale - 0.5f;
+	float3 voxel = floor(index);
+	float3 f = index - voxel;
+	float3 f2 = f * f;
+	float3 f3 = f2 * f;
+	float3 w0 = (1 - 3 * f + 3 * f2 - f3) / 6;
+	float3 w1 = (4 - 6 * f2 + 3 * f3) / 6;
+	float3 w2 = (1 + 3 * f + 3 * f2 - 3 * f3) / 6;
+	float3 w3 = f3 / 6;
+	float3 g0 = w0 + w1;
+	float3 g1 = w2 + w3;
+	float3 p0 = (voxel + 0.5f + w1 / g0 - 1) * scale;
+	float3 p1 = (voxel + 0.5f + w3 / g1 + 1) * scale;
+	return g0.z * (g0.y * (g0.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p0.x, p0.y, p0.z)) + g1.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p1.x, p0.y, p0.z)))
+			+ g1.y * (g0.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p0.x, p1.y, p0.z)) + g1.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p1.x, p1.y, p0.z))))
+		+ g1.z * (g0.y * (g0.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p0.x, p0.y, p1.z)) + g1.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p1.x, p0.y, p1.z)))
+			+ g1.y * (g0.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p0.x, p1.y, p1.z)) + g1.x * sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, (float3)(p1.x, p1.y, p1.z))));
+}
+
+float sampleFiltered(__read_only image3d_t d_input, __global const int* d_brickTable, int4 volumeSize, __read_only image3d_t d_pyramid, int filter, int level, float3 pos) {
+	if (filter == FILTER_CUBIC)
+		return sampleCubic(d_input, d_brickTable, volumeSize, d_pyramid, level, pos);
+	return sampleLevel(d_input, d_brickTable, volumeSize, d_pyramid, level, pos);
+}
+
+// Central differences of the filtered samples one voxel of the level apart
+float3 sampleGradient(__read_only image3d_t d_input, __global const int* d_brickTable, int4 volumeSize, __read_only image3d_t d_pyramid, int filter, int level, float3 pos) {
+	float h = 1 << level;
+	return (float3)(sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos + (float3)(h, 0, 0)) - sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos - (float3)(h, 0, 0)),
+			sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos + (float3)(0, h, 0)) - sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos - (float3)(0, h, 0)),
+			sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos + (float3)(0, 0, h)) - sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos - (float3)(0, 0, h))) / (2 * h);
+}
+
+// Shade the color of a sample with the gradient as the normal, lit from
+// both sides (see shade() on the host)
+float4 shade(float4 value, float3 gradient, float3 eyeRay_d) {
+	float length2 = dot(gradient, gradient);
+	if (!(length2 > 0))
+		return value;
+	float cosine = fabs(dot(gradient, eyeRay_d)) / sqrt(length2 * dot(eyeRay_d, eyeRay_d));
+	float specular = cosine;
+	for (int i = 0; i < SHADING_SHININESS_SHIFT; i++)
+		specular *= specular;
+	return (float4)(value.xyz * (SHADING_AMBIENT + SHADING_DIFFUSE * cosine) + SHADING_SPECULAR * specular, value.w);
+}
+
+__kernel void renderKernel (__read_only image3d_t d_input, __global float4* d_output, __constant float* d_invViewMatrix, float tstep, float brightness,
+		__global const float2* d_macroCells, uint cellsX, uint cellsY, uint cellsZ, float skipThreshold,
+		int mode, __read_only image2d_t d_transferFunction, float transferFunctionMin, float transferFunctionMax, float terminationOpacity,
+		__global const int* d_brickTable, int4 volumeSize,
+		__read_only image3d_t d_pyramid, int lodLevels, float lodScale, int lodBias,
+		uint pixelStep, float jitter, int filter, int shading) {
+	// every pixelStep-th pixel in x and y, the samples are shifted by jitter * tstep
+	size_t x = get_global_id(0) * pixelStep;
+	size_t y = get_global_id(1) * pixelStep;
+	size_t outX = get_global_size(0) * pixelStep;
+	size_t outY = get_global_size(1) * pixelStep;
+
+	float u = (x / (float) (outX - 1))*2.0f-1.0f;
+	float v = (y / (float) (outY - 1))*2.0f-1.0f;
+
+	float3 boxMin = (float3)(0, 0, 0);
+	float3 boxMax = convert_float3(volumeSize.xyz);
+
+	// calculate eye ray in world space
+	float3 eyeRay_o = (float3)(d_invViewMatrix[3], d_invViewMatrix[7], d_invViewMatrix[11]);
+	float3 temp = normalize((float3)(u, v, -2.0f));
+	float3 eyeRay_d;
+	eyeRay_d.x = dot(temp, (float3)(d_invViewMatrix[0], d_invViewMatrix[1], d_invViewMatrix[2]));
+	eyeRay_d.y = dot(temp, (float3)(d_invViewMatrix[4], d_invViewMatrix[5], d_invViewMatrix[6]));
+	eyeRay_d.z = dot(temp, (float3)(d_invViewMatrix[8], d_invViewMatrix[9], d_invViewMatrix[10]));
+
+	// find intersection with box
+	float tnear, tfar;
+	int hit = intersectBox(eyeRay_o, eyeRay_d, boxMin, boxMax, &tnear, &tfar);
+	if (!hit) {
+		d_output[y * outX + x] = (float4)(0, 0, 0, mode == RENDER_SUM ? 1 : 0);
+		return;
+	}
+	if (tnear < 0.0f)
+		tnear = 0.0f;     // clamp to near plane
+
+	// RENDER_SUM skips values of magnitude at most skipThreshold,
+	// RENDER_COMPOSITE all values up to skipThreshold (transparent)
+	float skipMin = mode == RENDER_SUM ? -skipThreshold : -INFINITY;
+
+	if (mode == RENDER_SUM) {
+		// march along ray from back to front, accumulating color (a sample
+		// of level l stands for 2^l samples of level 0)
+		float sum = 0;
+		float step = tstep;
+		for (float t = tfar - jitter * tstep; t >= tnear; t -= step) {
+			float3 pos = eyeRay_o + eyeRay_d*t;
+			int level = lodLevel(lodLevels, lodScale, lodBias, t);
+			step = tstep * (1 << level);
+
+			// skip empty macro cells, the sample positions stay the same
+			float tExit;
+			if (skipMacroCell(d_macroCells, cellsX, cellsY, cellsZ, skipMin, skipThreshold, filter, level, pos, eyeRay_o, eyeRay_d, false, &tExit)) {
+				t -= (max(1.0f, ceil((t - tExit) / step)) - 1) * step;
+				continue;
+			}
+
+			float sample = sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos);
+			sum += level ? sample * (1 << level) : sample;
+		}
+
+		d_output[y * outX + x] = (float4)((float3)(sum * brightness), 1);
+		return;
+	}
+
+	// march along ray from front to back, compositing the samples mapped by
+	// the transfer function (emission-absorption)
+	float4 color = (float4)(0);
+	float step = tstep;
+	for (float t = tnear + jitter * tstep; t <= tfar; t += step) {
+		float3 pos = eyeRay_o + eyeRay_d*t;
+		int level = lodLevel(lodLevels, lodScale, lodBias, t);
+		step = tstep * (1 << level);
+
+		// skip transparent macro cells
+		float tExit;
+		if (skipMacroCell(d_macroCells, cellsX, cellsY, cellsZ, skipMin, skipThreshold, filter, level, pos, eyeRay_o, eyeRay_d, true, &tExit)) {
+			t += (max(1.0f, ceil((tExit - t) / step)) - 1) * step;
+			continue;
+		}
+
+		float sample = sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos);
+		float4 value = read_imagef(d_transferFunction, transferFunctionSampler, (float2)((sample - transferFunctionMin) / (transferFunctionMax - transferFunctionMin), 0.5f));
+		if (shading && value.w > 0)
+			value = shade(value, sampleGradient(d_input, d_brickTable, volumeSize, d_pyramid, filter, level, pos), eyeRay_d);
+
+		// opacity of 2^l samples of level 0
+		if (level) {
+			float transparency = 1 - value.w;
+			for (int l = 0; l < level; l++)
+				transparency *= transparency;
+			value.w = 1 - transparency;
+		}
+
+		// the sample is seen through the opacity in front of it
+		float weight = (1 - color.w) * value.w;
+		color += weight * (float4)(value.xyz, 1);
+
+		// early ray termination
+		if (color.w > terminationOpacity)
+			break;
+	}
+
+	d_output[y * outX + x] = color;
+}
+
+// Sampler benchmark: the value at each position and, with gradient != 0,
+// the length of the gradient added (see benchmarkSample() on the host)
+__kernel void benchmarkSamplerKernel (__read_only image3d_t d_input, __global const int* d_brickTable, int4 volumeSize, __read_only image3d_t d_pyramid,
+		__global const float4* d_positions, __global float* d_result, int filter, int gradient) {
+	size_t i = get_global_id(0);
+	float3 pos = d_positions[i].xyz;
+	float result = sampleFiltered(d_input, d_brickTable, volumeSize, d_pyramid, filter, 0, pos);
+	if (gradient)
+		result += length(sampleGradient(d_input, d_brickTable, volumeSize, d_pyramid, filter, 0, pos));
+	d_result[i] = result;
 }
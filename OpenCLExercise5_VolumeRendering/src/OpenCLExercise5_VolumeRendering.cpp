@@ -24,18 +24,42 @@
 #include <cmath>
 #include <iomanip>
 #include <sstream>
+#include <limits>
+#include <algorithm>
+#include <list>
+#include <deque>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 bool runCpu = true;
 bool runGpu = true;
 bool displayGpu = true;
 bool writeImages = false;
+bool checkResults = true;
+bool headless = false; // no OpenGL, render a camera path and write the images
+bool skipEmptySpace = true;
+bool useBricks = true;
+bool useLod = true;
+bool progressive = false;
+bool useShading = false;
+bool benchmark = false; // no OpenGL, measure the samples per second of the samplers
+bool selfTest = false; // check the transposed volume against lazyTransformedVolume()
 
 void keyboardGL(unsigned char key, int x, int y);
+void renderHeadless(std::size_t frames);
+void benchmarkSamplers(const cl::Program& program, std::size_t samples);
 void displayGL();
 void setIdle();
 void idleGL();
+void refineGL();
 
 //////////////////////////////////////////////////////////////////////////////
 // float3 implementation for CPU
@@ -81,11 +105,12 @@ inline float interp3_get(const float* data, std::size_t countX, std::size_t coun
 		return 0;
 	return data[x + countX * (y + countY * z)];
 }
+// Outside of the volume the values are 0, as with CLK_ADDRESS_CLAMP on the device
 inline float interp3(const float* data, std::size_t countX, std::size_t countY, std::size_t countZ, float3 pos) {
 	pos = pos - 0.5f;
-	int x = (int) pos.x;
-	int y = (int) pos.y;
-	int z = (int) pos.z;
+	int x = (int) std::floor(pos.x);
+	int y = (int) std::floor(pos.y);
+	int z = (int) std::floor(pos.z);
 	float alphaX = pos.x - x;
 	float alphaY = pos.y - y;
 	float alphaZ = pos.z - z;
@@ -99,6 +124,805 @@ inline float interp3(const float* data, std::size_t countX, std::size_t countY,
 		+ (alphaX) * (alphaY) * (alphaZ) * interp3_get (data, countX, countY, countZ, x+1, y+1, z+1);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Bricked volume layout for the host
+//////////////////////////////////////////////////////////////////////////////
+// With the linear layout x + countX * (y + countY * z) every step of a ray
+// along y or z touches new cache lines and pages. The bricked volume stores
+// bricks of brickSize^3 voxels, each with a one-voxel apron (brickStride^3
+// values, x fastest), so that all 8 voxels of a trilinear fetch are in the
+// same brick. Voxels of the apron outside of the volume are 0. The bricks
+// are stored in Z-order (Morton order) of their brick coordinates, so that
+// neighboring bricks are close in memory for every view direction.
+const std::size_t brickShift = 4;
+const std::size_t brickSize = 1 << brickShift;
+const std::size_t brickStride = brickSize + 2;
+const std::size_t brickVoxels = brickStride * brickStride * brickStride;
+
+struct BrickedVolume {
+	std::size_t countX, countY, countZ;
+	std::size_t bricksX, bricksY, bricksZ;
+	std::vector<int> brickOffset; // offset of brick bx + bricksX * (by + bricksY * bz) in data, -1 if missing (sampled as 0)
+	const float* data;
+	std::vector<float> storage; // data, unless the bricks are stored elsewhere (BrickCache)
+};
+
+// Interleave the lower 10 bits of x, y and z
+inline uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+	uint32_t code = 0;
+	for (int bit = 0; bit < 10; bit++)
+		code |= ((x >> bit) & 1) << (3 * bit) | ((y >> bit) & 1) << (3 * bit + 1) | ((z >> bit) & 1) << (3 * bit + 2);
+	return code;
+}
+
+void buildBrickedVolume(const float* data, std::size_t countX, std::size_t countY, std::size_t countZ, BrickedVolume& volume) {
+	volume.countX = countX;
+	volume.countY = countY;
+	volume.countZ = countZ;
+	volume.bricksX = (countX + brickSize - 1) / brickSize;
+	volume.bricksY = (countY + brickSize - 1) / brickSize;
+	volume.bricksZ = (countZ + brickSize - 1) / brickSize;
+	std::size_t brickCount = volume.bricksX * volume.bricksY * volume.bricksZ;
+	ASSERT(volume.bricksX <= 1024 && volume.bricksY <= 1024 && volume.bricksZ <= 1024);
+	ASSERT(brickCount * brickVoxels <= (std::size_t) std::numeric_limits<int>::max());
+
+	// storage slots in Z-order
+	std::vector<std::pair<uint32_t, std::size_t> > order(brickCount);
+	for (std::size_t bz = 0; bz < volume.bricksZ; bz++)
+		for (std::size_t by = 0; by < volume.bricksY; by++)
+			for (std::size_t bx = 0; bx < volume.bricksX; bx++) {
+				std::size_t brick = bx + volume.bricksX * (by + volume.bricksY * bz);
+				order[brick] = std::make_pair(mortonCode(bx, by, bz), brick);
+			}
+	std::sort(order.begin(), order.end());
+	volume.brickOffset.resize(brickCount);
+	for (std::size_t slot = 0; slot < brickCount; slot++)
+		volume.brickOffset[order[slot].second] = slot * brickVoxels;
+
+	volume.storage.resize(brickCount * brickVoxels);
+	volume.data = volume.storage.data();
+	for (std::size_t bz = 0; bz < volume.bricksZ; bz++) {
+		for (std::size_t by = 0; by < volume.bricksY; by++) {
+			for (std::size_t bx = 0; bx < volume.bricksX; bx++) {
+				float* brick = &volume.storage[volume.brickOffset[bx + volume.bricksX * (by + volume.bricksY * bz)]];
+				for (std::size_t lz = 0; lz < brickStride; lz++)
+					for (std::size_t ly = 0; ly < brickStride; ly++)
+						for (std::size_t lx = 0; lx < brickStride; lx++)
+							brick[lx + brickStride * (ly + brickStride * lz)] = interp3_get(data, countX, countY, countZ,
+									(int) (bx * brickSize + lx) - 1, (int) (by * brickSize + ly) - 1, (int) (bz * brickSize + lz) - 1);
+			}
+		}
+	}
+}
+
+// Same as interp3() on the linear layout
+inline float interp3(const BrickedVolume& volume, float3 pos) {
+	pos = pos - 0.5f;
+	int x = (int) std::floor(pos.x);
+	int y = (int) std::floor(pos.y);
+	int z = (int) std::floor(pos.z);
+	float alphaX = pos.x - x;
+	float alphaY = pos.y - y;
+	float alphaZ = pos.z - z;
+
+	// brick of voxel (x, y, z) and position in the brick (the apron is at 0)
+	int bx = x < 0 ? 0 : std::min((int) volume.bricksX - 1, x >> brickShift);
+	int by = y < 0 ? 0 : std::min((int) volume.bricksY - 1, y >> brickShift);
+	int bz = z < 0 ? 0 : std::min((int) volume.bricksZ - 1, z >> brickShift);
+	int lx = x - (bx << brickShift) + 1;
+	int ly = y - (by << brickShift) + 1;
+	int lz = z - (bz << brickShift) + 1;
+	// all 8 neighbors outside of the volume
+	if (lx < 0 || lx > (int) brickSize || ly < 0 || ly > (int) brickSize || lz < 0 || lz > (int) brickSize)
+		return 0;
+	int offset = volume.brickOffset[bx + volume.bricksX * (by + volume.bricksY * bz)];
+	if (offset < 0)
+		return 0;
+
+	const float* p = volume.data + offset + lx + brickStride * (ly + brickStride * lz);
+	const std::size_t dy = brickStride, dz = brickStride * brickStride;
+	return (1-alphaX) * (1-alphaY) * (1-alphaZ) * p[0]
+		+ (alphaX) * (1-alphaY) * (1-alphaZ) * p[1]
+		+ (1-alphaX) * (alphaY) * (1-alphaZ) * p[dy]
+		+ (alphaX) * (alphaY) * (1-alphaZ) * p[dy + 1]
+		+ (1-alphaX) * (1-alphaY) * (alphaZ) * p[dz]
+		+ (alphaX) * (1-alphaY) * (alphaZ) * p[dz + 1]
+		+ (1-alphaX) * (alphaY) * (alphaZ) * p[dz + dy]
+		+ (alphaX) * (alphaY) * (alphaZ) * p[dz + dy + 1];
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Empty space skipping: macro cells
+//////////////////////////////////////////////////////////////////////////////
+// The volume is divided into cells of macroCellSize^3 voxels. For every cell
+// the minimum and maximum of all voxels which are read by interp3() for a
+// position inside the cell (the cell plus one voxel on every side) are
+// stored. A ray leaves a cell whose values are all in [skipMin,
+// skipThreshold] with one 3D-DDA step instead of sampling it.
+// Every level l of the mip pyramid has its own cells of macroCellSize^3
+// voxels of level l (macroCellSize * 2^l voxels of level 0 per axis), as a
+// sample of level l interpolates the voxels of level l around it. The
+// B-spline of FILTER_CUBIC reads two voxels on every side, so every level
+// has a second set of cells for it.
+const std::size_t macroCellShift = 2;
+const std::size_t macroCellSize = 1 << macroCellShift;
+
+// FILTER_LINEAR: trilinear interpolation of the volume
+// FILTER_CUBIC: tricubic B-spline, evaluated with 8 trilinear fetches (the
+// values have to match FILTER_LINEAR / FILTER_CUBIC in the .cl file)
+enum SampleFilter {
+	FILTER_LINEAR = 0,
+	FILTER_CUBIC = 1
+};
+
+struct MacroCellGrid {
+	std::size_t cellsX, cellsY, cellsZ; // of level 0
+	std::size_t levelCount;
+	std::vector<std::size_t> levelOffset; // first cell of every level
+	std::vector<float> minMax; // (min, max) per cell, x fastest, level after level, FILTER_LINEAR before FILTER_CUBIC
+};
+
+// Number of cells of a level along an axis with cells cells on level 0
+inline std::size_t macroCellCount(std::size_t cells, int level) {
+	return (cells + (1 << level) - 1) >> level;
+}
+
+// First cell of a level for a filter
+inline std::size_t macroCellOffset(const MacroCellGrid& grid, int level, SampleFilter filter) {
+	return grid.levelOffset[level] + filter * macroCellCount(grid.cellsX, level) * macroCellCount(grid.cellsY, level) * macroCellCount(grid.cellsZ, level);
+}
+
+// Append the cells of the next level, whose voxels are data, for
+// FILTER_LINEAR (padded by one voxel) and FILTER_CUBIC (padded by two)
+void addMacroCellLevel(const float* data, std::size_t countX, std::size_t countY, std::size_t countZ, MacroCellGrid& grid) {
+	std::size_t cellsX = (countX + macroCellSize - 1) / macroCellSize;
+	std::size_t cellsY = (countY + macroCellSize - 1) / macroCellSize;
+	std::size_t cellsZ = (countZ + macroCellSize - 1) / macroCellSize;
+	ASSERT(cellsX == macroCellCount(grid.cellsX, grid.levelCount) && cellsY == macroCellCount(grid.cellsY, grid.levelCount) && cellsZ == macroCellCount(grid.cellsZ, grid.levelCount));
+	grid.levelOffset.push_back(grid.minMax.size() / 2);
+	grid.levelCount++;
+	for (std::size_t padding = 1; padding <= 2; padding++) {
+		std::size_t offset = grid.minMax.size() / 2;
+		grid.minMax.resize(2 * (offset + cellsX * cellsY * cellsZ));
+		for (std::size_t cz = 0; cz < cellsZ; cz++) {
+			for (std::size_t cy = 0; cy < cellsY; cy++) {
+				for (std::size_t cx = 0; cx < cellsX; cx++) {
+					float minValue = std::numeric_limits<float>::infinity();
+					float maxValue = -std::numeric_limits<float>::infinity();
+					for (std::size_t z = cz * macroCellSize < padding ? 0 : cz * macroCellSize - padding; z < std::min(countZ, (cz + 1) * macroCellSize + padding); z++) {
+						for (std::size_t y = cy * macroCellSize < padding ? 0 : cy * macroCellSize - padding; y < std::min(countY, (cy + 1) * macroCellSize + padding); y++) {
+							for (std::size_t x = cx * macroCellSize < padding ? 0 : cx * macroCellSize - padding; x < std::min(countX, (cx + 1) * macroCellSize + padding); x++) {
+								float value = data[x + countX * (y + countY * z)];
+								minValue = std::min(minValue, value);
+								maxValue = std::max(maxValue, value);
+							}
+						}
+					}
+					std::size_t cell = offset + cx + cellsX * (cy + cellsY * cz);
+					grid.minMax[2 * cell] = minValue;
+					grid.minMax[2 * cell + 1] = maxValue;
+				}
+			}
+		}
+	}
+}
+
+// The cells of level 0, see addMacroCellLevels() for the other levels
+void buildMacroCellGrid(const float* data, std::size_t countX, std::size_t countY, std::size_t countZ, MacroCellGrid& grid) {
+	grid.cellsX = (countX + macroCellSize - 1) / macroCellSize;
+	grid.cellsY = (countY + macroCellSize - 1) / macroCellSize;
+	grid.cellsZ = (countZ + macroCellSize - 1) / macroCellSize;
+	grid.levelCount = 0;
+	grid.levelOffset.clear();
+	grid.minMax.clear();
+	addMacroCellLevel(data, countX, countY, countZ, grid);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Level of detail: mip pyramid
+//////////////////////////////////////////////////////////////////////////////
+// Level l of the pyramid has ceil(count / 2^l) voxels per axis, each the mean
+// of the (up to 8) voxels of level l - 1 it covers, i.e. voxel (x, y, z) of
+// level l is centered at ((x, y, z) + 0.5) * 2^l in the coordinates of level
+// 0 (the volume itself). A ray samples level l with a step of tstep * 2^l.
+// The level of a sample is chosen from the footprint of a pixel at its
+// distance: floor(log2(footprint)) (the pixel covers at least 2^l voxels)
+// plus a bias which is > 0 while the view is rotating.
+const std::size_t lodLevelCount = 4; // including level 0
+
+struct MipPyramid {
+	std::size_t levelCount; // levels 1 to levelCount - 1 are in levels[]
+	std::size_t count[lodLevelCount][3];
+	std::vector<float> levels[lodLevelCount];
+};
+
+void downsampleSlices(const float* data, const std::size_t* count, float* level, const std::size_t* levelCount, std::size_t z0, std::size_t z1) {
+	for (std::size_t z = z0; z < z1; z++) {
+		for (std::size_t y = 0; y < levelCount[1]; y++) {
+			for (std::size_t x = 0; x < levelCount[0]; x++) {
+				float sum = 0;
+				int n = 0;
+				for (std::size_t k = 2 * z; k < std::min(count[2], 2 * z + 2); k++) {
+					for (std::size_t j = 2 * y; j < std::min(count[1], 2 * y + 2); j++) {
+						for (std::size_t i = 2 * x; i < std::min(count[0], 2 * x + 2); i++) {
+							sum += data[i + count[0] * (j + count[1] * k)];
+							n++;
+						}
+					}
+				}
+				level[x + levelCount[0] * (y + levelCount[1] * z)] = sum / n;
+			}
+		}
+	}
+}
+
+// The slices of every level are split among threadCount threads
+void buildMipPyramid(const float* data, std::size_t countX, std::size_t countY, std::size_t countZ, MipPyramid& pyramid, std::size_t threadCount) {
+	pyramid.count[0][0] = countX;
+	pyramid.count[0][1] = countY;
+	pyramid.count[0][2] = countZ;
+	pyramid.levelCount = 1;
+	for (std::size_t l = 1; l < lodLevelCount; l++) {
+		const std::size_t* count = pyramid.count[l - 1];
+		if (count[0] < 2 || count[1] < 2 || count[2] < 2)
+			break;
+		std::size_t* levelCount = pyramid.count[l];
+		for (int i = 0; i < 3; i++)
+			levelCount[i] = (count[i] + 1) / 2;
+		pyramid.levels[l].resize(levelCount[0] * levelCount[1] * levelCount[2]);
+		const float* source = l == 1 ? data : pyramid.levels[l - 1].data();
+		std::size_t threads = std::min(threadCount, levelCount[2]);
+		boost::thread_group group;
+		for (std::size_t t = 1; t < threads; t++)
+			group.create_thread(boost::bind(downsampleSlices, source, count, pyramid.levels[l].data(), levelCount, levelCount[2] * t / threads, levelCount[2] * (t + 1) / threads));
+		downsampleSlices(source, count, pyramid.levels[l].data(), levelCount, 0, levelCount[2] / threads);
+		group.join_all();
+		pyramid.levelCount = l + 1;
+	}
+}
+
+// The cells of the levels 1 to levelCount - 1 of the pyramid
+void addMacroCellLevels(const MipPyramid& pyramid, MacroCellGrid& grid) {
+	ASSERT(grid.levelCount == 1);
+	for (std::size_t l = 1; l < pyramid.levelCount; l++)
+		addMacroCellLevel(pyramid.levels[l].data(), pyramid.count[l][0], pyramid.count[l][1], pyramid.count[l][2], grid);
+}
+
+// Voxels of 0 before and after every level in the packed pyramid. The
+// B-spline of FILTER_CUBIC reads up to two voxels outside of a level and the
+// gradient one voxel more, so with three voxels the filtering of one level
+// never reads another level and sees 0 outside of it, as interp3() on the
+// host.
+const std::size_t pyramidPadding = 3;
+
+// Levels 1 to levelCount - 1 next to each other along x, separated by
+// pyramidPadding voxels of 0, as the image read by the kernel
+void packMipPyramid(const MipPyramid& pyramid, std::vector<float>& packed, std::size_t* size) {
+	size[0] = pyramidPadding;
+	size[1] = size[2] = 2; // an image with depth 1 is not a 3D image
+	for (std::size_t l = 1; l < pyramid.levelCount; l++) {
+		size[0] += pyramid.count[l][0] + pyramidPadding;
+		size[1] = std::max(size[1], pyramid.count[l][1]);
+		size[2] = std::max(size[2], pyramid.count[l][2]);
+	}
+	size[0] = std::max(size[0], (std::size_t) 2);
+	packed.assign(size[0] * size[1] * size[2], 0.0f);
+	std::size_t originX = pyramidPadding;
+	for (std::size_t l = 1; l < pyramid.levelCount; l++) {
+		const std::size_t* count = pyramid.count[l];
+		for (std::size_t z = 0; z < count[2]; z++)
+			for (std::size_t y = 0; y < count[1]; y++)
+				std::copy(&pyramid.levels[l][count[0] * (y + count[1] * z)], &pyramid.levels[l][count[0] * (y + count[1] * z)] + count[0], &packed[originX + size[0] * (y + size[1] * z)]);
+		originX += count[0] + pyramidPadding;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Out-of-core streaming
+//////////////////////////////////////////////////////////////////////////////
+// In streaming mode the volume is never loaded as a whole. Its bricks (with
+// apron, as in BrickedVolume) are read on demand from the HDF5 file using
+// hyperslab selections into an LRU cache with a fixed number of slots. A
+// loader thread first reads the bricks the current frame needs. It then
+// reads the bricks the next frame will need while the current frame is
+// rendered. Every frame samples a BrickedVolume whose table only contains
+// the bricks pinned for that frame. Bricks which don't fit into the cache
+// are sampled as 0. The device has its own cache of the same kind: an atlas
+// image of brick slots.
+
+// Reads bricks of a VolumeD in the orientation of transformedTransposedVolume()
+struct BrickReader {
+	boost::shared_ptr<VolumeD> volume;
+	std::size_t count[3]; // size after transposing
+	std::size_t bricks[3];
+
+	BrickReader(const boost::shared_ptr<VolumeD>& volume) : volume(volume) {
+		Math::Vector3<size_t> size = volume->getSize();
+		for (int i = 0; i < 3; i++) {
+			count[i] = size[i];
+			bricks[i] = (count[i] + brickSize - 1) / brickSize;
+		}
+	}
+
+	std::size_t brickCount() const {
+		return bricks[0] * bricks[1] * bricks[2];
+	}
+
+	// Read brick (bx + bricksX * (by + bricksY * bz)) with apron into data
+	// (brickVoxels values), buffer holds the values as stored in the file
+	void read(std::size_t brick, std::vector<CTFloat>& buffer, float* data) const {
+		std::size_t b[3] = { brick % bricks[0], brick / bricks[0] % bricks[1], brick / (bricks[0] * bricks[1]) };
+
+		// voxels lo to hi - 1 of the brick with apron are inside of the volume
+		std::size_t lo[3], hi[3];
+		for (int i = 0; i < 3; i++) {
+			lo[i] = b[i] * brickSize == 0 ? 0 : b[i] * brickSize - 1;
+			hi[i] = std::min(count[i], (b[i] + 1) * brickSize + 1);
+		}
+
+		// the same block in the data set, see Math::reorderDimensions()
+		std::size_t axis[3], offset[3], size[3];
+		bool mirrored[3];
+		for (int i = 0; i < 3; i++) {
+			int32_t order = volume->VolumeStorageOrder ? (*volume->VolumeStorageOrder)[i] : i + 1;
+			axis[i] = std::abs(order) - 1;
+			mirrored[i] = order < 0;
+			offset[axis[i]] = mirrored[i] ? volume->Volume.size[axis[i]] - hi[i] : lo[i];
+			size[axis[i]] = hi[i] - lo[i];
+		}
+		buffer.resize(size[0] * size[1] * size[2]);
+		volume->Volume.readHyperslab(buffer.data(), offset, size);
+
+		CTFloat factor = volume->VolumeScalingFactor ? (CTFloat) *volume->VolumeScalingFactor : 1;
+		std::fill(data, data + brickVoxels, 0.0f);
+		std::size_t v[3], s[3];
+		for (v[2] = lo[2]; v[2] < hi[2]; v[2]++) {
+			for (v[1] = lo[1]; v[1] < hi[1]; v[1]++) {
+				for (v[0] = lo[0]; v[0] < hi[0]; v[0]++) {
+					for (int i = 0; i < 3; i++)
+						s[axis[i]] = mirrored[i] ? hi[i] - 1 - v[i] : v[i] - lo[i];
+					data[(v[0] + 1 - b[0] * brickSize) + brickStride * ((v[1] + 1 - b[1] * brickSize) + brickStride * (v[2] + 1 - b[2] * brickSize))]
+						= buffer[s[0] + size[0] * (s[1] + size[1] * s[2])] * factor;
+				}
+			}
+		}
+	}
+};
+
+// Read the whole volume once, brick by brick, to get the macro cells (as
+// buildMacroCellGrid()), the maximum value and for every filter and brick
+// the minimum and maximum of the macro cells which contain positions
+// sampled from the brick
+void scanBricks(const BrickReader& reader, MacroCellGrid& grid, std::vector<float>& brickMinMax, float& maxValue) {
+	ASSERT(brickSize % macroCellSize == 0);
+	const std::size_t cellsPerBrick = brickSize / macroCellSize;
+	grid.cellsX = (reader.count[0] + macroCellSize - 1) / macroCellSize;
+	grid.cellsY = (reader.count[1] + macroCellSize - 1) / macroCellSize;
+	grid.cellsZ = (reader.count[2] + macroCellSize - 1) / macroCellSize;
+	grid.levelCount = 1; // there is no pyramid in streaming mode
+	grid.levelOffset.assign(1, 0);
+	const std::size_t cellCount = grid.cellsX * grid.cellsY * grid.cellsZ;
+	grid.minMax.resize(2 * 2 * cellCount);
+	maxValue = -std::numeric_limits<float>::infinity();
+
+	std::vector<CTFloat> buffer;
+	std::vector<float> data(brickVoxels);
+	for (std::size_t brick = 0; brick < reader.brickCount(); brick++) {
+		reader.read(brick, buffer, data.data());
+		std::size_t b[3] = { brick % reader.bricks[0], brick / reader.bricks[0] % reader.bricks[1], brick / (reader.bricks[0] * reader.bricks[1]) };
+		for (std::size_t cz = b[2] * cellsPerBrick; cz < std::min(grid.cellsZ, (b[2] + 1) * cellsPerBrick); cz++) {
+			for (std::size_t cy = b[1] * cellsPerBrick; cy < std::min(grid.cellsY, (b[1] + 1) * cellsPerBrick); cy++) {
+				for (std::size_t cx = b[0] * cellsPerBrick; cx < std::min(grid.cellsX, (b[0] + 1) * cellsPerBrick); cx++) {
+					float minValue = std::numeric_limits<float>::infinity();
+					float cellMax = -std::numeric_limits<float>::infinity();
+					for (std::size_t z = cz * macroCellSize == 0 ? 0 : cz * macroCellSize - 1; z < std::min(reader.count[2], (cz + 1) * macroCellSize + 1); z++) {
+						for (std::size_t y = cy * macroCellSize == 0 ? 0 : cy * macroCellSize - 1; y < std::min(reader.count[1], (cy + 1) * macroCellSize + 1); y++) {
+							for (std::size_t x = cx * macroCellSize == 0 ? 0 : cx * macroCellSize - 1; x < std::min(reader.count[0], (cx + 1) * macroCellSize + 1); x++) {
+								float value = data[(x + 1 - b[0] * brickSize) + brickStride * ((y + 1 - b[1] * brickSize) + brickStride * (z + 1 - b[2] * brickSize))];
+								minValue = std::min(minValue, value);
+								cellMax = std::max(cellMax, value);
+							}
+						}
+					}
+					std::size_t cell = cx + grid.cellsX * (cy + grid.cellsY * cz);
+					grid.minMax[2 * cell] = minValue;
+					grid.minMax[2 * cell + 1] = cellMax;
+					maxValue = std::max(maxValue, cellMax);
+				}
+			}
+		}
+	}
+
+	// The cells for FILTER_CUBIC need two voxels around the cell, but the
+	// bricks only have an apron of one voxel: they get the values of the
+	// cells for FILTER_LINEAR next to them as well
+	for (std::size_t cz = 0; cz < grid.cellsZ; cz++) {
+		for (std::size_t cy = 0; cy < grid.cellsY; cy++) {
+			for (std::size_t cx = 0; cx < grid.cellsX; cx++) {
+				float minValue = std::numeric_limits<float>::infinity();
+				float cellMax = -std::numeric_limits<float>::infinity();
+				for (std::size_t z = cz == 0 ? 0 : cz - 1; z < std::min(grid.cellsZ, cz + 2); z++) {
+					for (std::size_t y = cy == 0 ? 0 : cy - 1; y < std::min(grid.cellsY, cy + 2); y++) {
+						for (std::size_t x = cx == 0 ? 0 : cx - 1; x < std::min(grid.cellsX, cx + 2); x++) {
+							std::size_t cell = x + grid.cellsX * (y + grid.cellsY * z);
+							minValue = std::min(minValue, grid.minMax[2 * cell]);
+							cellMax = std::max(cellMax, grid.minMax[2 * cell + 1]);
+						}
+					}
+				}
+				std::size_t cell = cellCount + cx + grid.cellsX * (cy + grid.cellsY * cz);
+				grid.minMax[2 * cell] = minValue;
+				grid.minMax[2 * cell + 1] = cellMax;
+			}
+		}
+	}
+
+	// Samples taken from brick b are at positions b * brickSize + 0.5 to
+	// (b + 1) * brickSize + 0.5, i.e. in one more macro cell on every axis.
+	// With FILTER_CUBIC they are up to two voxels further away, i.e. in
+	// one more macro cell on the low side as well.
+	brickMinMax.resize(2 * 2 * reader.brickCount());
+	for (int filter = FILTER_LINEAR; filter <= FILTER_CUBIC; filter++) {
+		for (std::size_t brick = 0; brick < reader.brickCount(); brick++) {
+			std::size_t b[3] = { brick % reader.bricks[0], brick / reader.bricks[0] % reader.bricks[1], brick / (reader.bricks[0] * reader.bricks[1]) };
+			std::size_t lo[3];
+			for (int i = 0; i < 3; i++)
+				lo[i] = filter == FILTER_CUBIC && b[i] > 0 ? b[i] * cellsPerBrick - 1 : b[i] * cellsPerBrick;
+			float minValue = std::numeric_limits<float>::infinity();
+			float value = -std::numeric_limits<float>::infinity();
+			for (std::size_t cz = lo[2]; cz < std::min(grid.cellsZ, (b[2] + 1) * cellsPerBrick + 1); cz++) {
+				for (std::size_t cy = lo[1]; cy < std::min(grid.cellsY, (b[1] + 1) * cellsPerBrick + 1); cy++) {
+					for (std::size_t cx = lo[0]; cx < std::min(grid.cellsX, (b[0] + 1) * cellsPerBrick + 1); cx++) {
+						std::size_t cell = filter * cellCount + cx + grid.cellsX * (cy + grid.cellsY * cz);
+						minValue = std::min(minValue, grid.minMax[2 * cell]);
+						value = std::max(value, grid.minMax[2 * cell + 1]);
+					}
+				}
+			}
+			brickMinMax[2 * (filter * reader.brickCount() + brick)] = minValue;
+			brickMinMax[2 * (filter * reader.brickCount() + brick) + 1] = value;
+		}
+	}
+}
+
+// The bricks sampled by the rays of a frame with the given view matrix,
+// nearest first. A brick is left out if it is outside of the view frustum
+// or if all the macro cells sampled from it are skipped.
+void visibleBricks(const BrickReader& reader, const std::vector<float>& brickMinMax, SampleFilter filter, float skipMin, float skipThreshold, const float* invViewMatrix, std::vector<std::size_t>& bricks) {
+	// a ray goes through (u, v, -2) in camera coordinates with u, v in
+	// [-1, 1], i.e. the frustum is |x| <= -z / 2, |y| <= -z / 2, z <= 0
+	const float planes[5][3] = { { 1, 0, 0.5f }, { -1, 0, 0.5f }, { 0, 1, 0.5f }, { 0, -1, 0.5f }, { 0, 0, 1 } };
+	float eye[3] = { invViewMatrix[3], invViewMatrix[7], invViewMatrix[11] };
+	std::vector<std::pair<float, std::size_t> > visible;
+	for (std::size_t brick = 0; brick < reader.brickCount(); brick++) {
+		const float* minMax = &brickMinMax[2 * (filter * reader.brickCount() + brick)];
+		if (minMax[0] >= skipMin && minMax[1] <= skipThreshold)
+			continue;
+		std::size_t b[3] = { brick % reader.bricks[0], brick / reader.bricks[0] % reader.bricks[1], brick / (reader.bricks[0] * reader.bricks[1]) };
+
+		// corners of the region sampled from the brick (plus a margin) in camera coordinates
+		float margin = filter == FILTER_CUBIC ? 2 : 0;
+		float corners[8][3];
+		for (int corner = 0; corner < 8; corner++) {
+			float p[3];
+			for (int i = 0; i < 3; i++)
+				p[i] = (corner >> i & 1 ? (b[i] + 1) * (float) brickSize + 2 + margin : b[i] * (float) brickSize - 1 - margin) - eye[i];
+			for (int k = 0; k < 3; k++)
+				corners[corner][k] = invViewMatrix[k] * p[0] + invViewMatrix[4 + k] * p[1] + invViewMatrix[8 + k] * p[2];
+		}
+		bool outside = false;
+		for (int plane = 0; plane < 5 && !outside; plane++) {
+			outside = true;
+			for (int corner = 0; corner < 8 && outside; corner++)
+				outside = planes[plane][0] * corners[corner][0] + planes[plane][1] * corners[corner][1] + planes[plane][2] * corners[corner][2] > 0;
+		}
+		if (outside)
+			continue;
+
+		float distance = 0;
+		for (int i = 0; i < 3; i++) {
+			float d = (b[i] + 0.5f) * brickSize - eye[i];
+			distance += d * d;
+		}
+		visible.push_back(std::make_pair(distance, brick));
+	}
+	std::sort(visible.begin(), visible.end());
+	bricks.resize(visible.size());
+	for (std::size_t i = 0; i < visible.size(); i++)
+		bricks[i] = visible[i].second;
+}
+
+// LRU assignment of bricks to a fixed number of slots. Slots used by the
+// current frame are pinned and not evicted until the next frame.
+class BrickSlots {
+	std::vector<int> slotOfBrick; // -1 if not resident
+	std::vector<std::ptrdiff_t> brickOfSlot; // -1 if free
+	std::vector<std::size_t> pinFrame;
+	std::size_t frame;
+	std::list<int> lru; // most recently used first
+	std::vector<std::list<int>::iterator> position;
+
+public:
+	BrickSlots(std::size_t brickCount, std::size_t slotCount) : slotOfBrick(brickCount, -1), brickOfSlot(slotCount, -1), pinFrame(slotCount, 0), frame(1), position(slotCount) {
+		for (std::size_t slot = 0; slot < slotCount; slot++)
+			position[slot] = lru.insert(lru.end(), slot);
+	}
+
+	std::size_t slotCount() const {
+		return brickOfSlot.size();
+	}
+	int slot(std::size_t brick) const {
+		return slotOfBrick[brick];
+	}
+	bool pinned(int slot) const {
+		return pinFrame[slot] == frame;
+	}
+
+	void nextFrame() {
+		frame++;
+	}
+	void use(int slot, bool pin) {
+		lru.splice(lru.begin(), lru, position[slot]);
+		if (pin)
+			pinFrame[slot] = frame;
+	}
+
+	// Free the least recently used slot which is not pinned, -1 if all are pinned
+	int evict() {
+		for (std::list<int>::reverse_iterator it = lru.rbegin(); it != lru.rend(); it++) {
+			int slot = *it;
+			if (pinned(slot))
+				continue;
+			if (brickOfSlot[slot] >= 0)
+				slotOfBrick[brickOfSlot[slot]] = -1;
+			brickOfSlot[slot] = -1;
+			return slot;
+		}
+		return -1;
+	}
+	void assign(int slot, std::size_t brick) {
+		ASSERT(brickOfSlot[slot] < 0 && slotOfBrick[brick] < 0);
+		brickOfSlot[slot] = brick;
+		slotOfBrick[brick] = slot;
+	}
+};
+
+// Host brick cache with a loader thread. The loader is the only thread
+// reading the file and it only writes to slots which are not pinned.
+class BrickCache {
+	const BrickReader& reader;
+	BrickSlots slots;
+	std::vector<float> data;
+	boost::mutex mutex;
+	boost::condition_variable changed;
+	std::deque<std::size_t> demand; // bricks the current frame waits for
+	std::deque<std::size_t> prefetchQueue;
+	std::size_t pendingDemand;
+	int loadingSlot;
+	bool stop;
+	boost::thread thread;
+
+	void loader() {
+		std::vector<CTFloat> buffer;
+		boost::mutex::scoped_lock lock(mutex);
+		for (;;) {
+			while (!stop && demand.empty() && prefetchQueue.empty())
+				changed.wait(lock);
+			if (stop)
+				return;
+			bool isDemand = !demand.empty();
+			std::deque<std::size_t>& queue = isDemand ? demand : prefetchQueue;
+			std::size_t brick = queue.front();
+			queue.pop_front();
+
+			int slot = slots.slot(brick);
+			if (slot < 0) {
+				slot = slots.evict();
+				if (slot >= 0) {
+					slots.assign(slot, brick);
+					slots.use(slot, isDemand);
+					loadingSlot = slot;
+					lock.unlock();
+					reader.read(brick, buffer, &data[slot * brickVoxels]);
+					lock.lock();
+					loadingSlot = -1;
+				}
+			} else if (isDemand) {
+				// loaded by a prefetch meanwhile
+				slots.use(slot, true);
+			}
+			if (isDemand)
+				pendingDemand--;
+			changed.notify_all();
+		}
+	}
+
+public:
+	BrickCache(const BrickReader& reader, std::size_t slotCount) : reader(reader), slots(reader.brickCount(), slotCount), data(slotCount * brickVoxels), pendingDemand(0), loadingSlot(-1), stop(false) {
+		ASSERT(slotCount * brickVoxels <= (std::size_t) std::numeric_limits<int>::max());
+		thread = boost::thread(boost::bind(&BrickCache::loader, this));
+	}
+	~BrickCache() {
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			stop = true;
+			changed.notify_all();
+		}
+		thread.join();
+	}
+
+	std::size_t slotCount() const {
+		return slots.slotCount();
+	}
+
+	// Pin the given bricks for a new frame, loading the missing ones, and
+	// set up view to sample them. Returns the number of bricks which did not
+	// fit into the cache.
+	std::size_t acquire(const std::vector<std::size_t>& bricks, BrickedVolume& view) {
+		boost::mutex::scoped_lock lock(mutex);
+		slots.nextFrame();
+		demand.clear();
+		for (std::size_t i = 0; i < bricks.size(); i++) {
+			int slot = slots.slot(bricks[i]);
+			if (slot >= 0)
+				slots.use(slot, true);
+			else
+				demand.push_back(bricks[i]);
+		}
+		pendingDemand = demand.size();
+		changed.notify_all();
+		while (pendingDemand > 0 || (loadingSlot >= 0 && slots.pinned(loadingSlot)))
+			changed.wait(lock);
+
+		view.countX = reader.count[0];
+		view.countY = reader.count[1];
+		view.countZ = reader.count[2];
+		view.bricksX = reader.bricks[0];
+		view.bricksY = reader.bricks[1];
+		view.bricksZ = reader.bricks[2];
+		view.brickOffset.assign(reader.brickCount(), -1);
+		view.data = data.data();
+		std::size_t missing = 0;
+		for (std::size_t i = 0; i < bricks.size(); i++) {
+			int slot = slots.slot(bricks[i]);
+			if (slot >= 0 && slots.pinned(slot))
+				view.brickOffset[bricks[i]] = slot * brickVoxels;
+			else
+				missing++;
+		}
+		return missing;
+	}
+
+	// Load the given bricks in the background (replaces the previous requests)
+	void prefetch(const std::vector<std::size_t>& bricks) {
+		boost::mutex::scoped_lock lock(mutex);
+		prefetchQueue.clear();
+		for (std::size_t i = 0; i < bricks.size(); i++)
+			if (slots.slot(bricks[i]) < 0)
+				prefetchQueue.push_back(bricks[i]);
+		changed.notify_all();
+	}
+};
+
+// Device brick cache: an atlas image with slots of brickStride^3 texels and
+// a table with the slot of every brick (-1 if the brick is not available)
+class DeviceBrickCache {
+	boost::scoped_ptr<BrickSlots> slots;
+	std::size_t slotsX, slotsY;
+	std::vector<cl_int> h_table;
+
+public:
+	cl::Image3D atlas;
+	cl::Buffer table;
+
+	// slotCount is reduced to what the maximum image size allows
+	DeviceBrickCache(const cl::Context& context, const cl::Device& device, std::size_t brickCount, std::size_t slotCount) : h_table(brickCount) {
+		std::size_t maxX = device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>() / brickStride;
+		std::size_t maxY = device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>() / brickStride;
+		std::size_t maxZ = device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>() / brickStride;
+		slotCount = std::max((std::size_t) 1, std::min(slotCount, maxX * maxY * maxZ));
+		slotsX = std::min(slotCount, maxX);
+		slotsY = std::min((slotCount + slotsX - 1) / slotsX, maxY);
+		std::size_t slotsZ = (slotCount + slotsX * slotsY - 1) / (slotsX * slotsY);
+		slots.reset(new BrickSlots(brickCount, slotCount));
+		atlas = cl::Image3D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_FLOAT), slotsX * brickStride, slotsY * brickStride, slotsZ * brickStride);
+		table = cl::Buffer(context, CL_MEM_READ_ONLY, brickCount * sizeof (cl_int));
+	}
+
+	std::size_t slotCount() const {
+		return slots->slotCount();
+	}
+
+	// Upload the bricks of the frame which are not on the device yet and
+	// the table. Returns the number of bricks not available on the device.
+	std::size_t update(cl::CommandQueue& queue, const std::vector<std::size_t>& bricks, const BrickedVolume& view) {
+		slots->nextFrame();
+		std::fill(h_table.begin(), h_table.end(), -1);
+		std::size_t missing = 0;
+		for (std::size_t i = 0; i < bricks.size(); i++) {
+			std::size_t brick = bricks[i];
+			if (view.brickOffset[brick] < 0) {
+				missing++;
+				continue;
+			}
+			int slot = slots->slot(brick);
+			if (slot < 0) {
+				slot = slots->evict();
+				if (slot < 0) {
+					missing++;
+					continue;
+				}
+				slots->assign(slot, brick);
+				cl::size_t<3> origin;
+				origin[0] = slot % slotsX * brickStride;
+				origin[1] = slot / slotsX % slotsY * brickStride;
+				origin[2] = slot / (slotsX * slotsY) * brickStride;
+				cl::size_t<3> region;
+				region[0] = region[1] = region[2] = brickStride;
+				queue.enqueueWriteImage(atlas, true, origin, region, brickStride * sizeof (float), brickStride * brickStride * sizeof (float), (void*) (view.data + view.brickOffset[brick]));
+			}
+			slots->use(slot, true);
+			h_table[brick] = slot;
+		}
+		queue.enqueueWriteBuffer(table, true, 0, h_table.size() * sizeof (cl_int), h_table.data());
+		return missing;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Transfer function
+//////////////////////////////////////////////////////////////////////////////
+// Maps a volume value to a color and an opacity per sample. The table has
+// transferFunctionSize RGBA entries for the values from minValue to maxValue
+// and is read with linear interpolation, values outside of the range get the
+// first / last entry. On the device the table is an image read with
+// CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR, which does the same.
+const std::size_t transferFunctionSize = 256;
+
+struct TransferFunction {
+	float minValue, maxValue;
+	std::vector<float> rgba; // transferFunctionSize entries
+};
+
+// Values below 2% of maxValue (noise and air) are transparent, above that
+// the opacity rises and the color goes from dark red over orange to white
+void buildTransferFunction(float maxValue, TransferFunction& tf) {
+	tf.minValue = 0;
+	tf.maxValue = maxValue;
+	tf.rgba.resize(4 * transferFunctionSize);
+	for (std::size_t i = 0; i < transferFunctionSize; i++) {
+		float u = (i + 0.5f) / transferFunctionSize;
+		float v = std::max(0.0f, std::min(1.0f, (u - 0.02f) / 0.5f));
+		tf.rgba[4 * i + 0] = std::min(1.0f, 0.4f + 1.5f * v);
+		tf.rgba[4 * i + 1] = std::min(1.0f, 1.5f * v * v + 0.1f * v);
+		tf.rgba[4 * i + 2] = v * v * v;
+		tf.rgba[4 * i + 3] = u < 0.02f ? 0.0f : 0.02f + 0.3f * v;
+	}
+}
+
+inline void transferFunctionLookup(const TransferFunction& tf, float value, float* rgba) {
+	float x = (value - tf.minValue) / (tf.maxValue - tf.minValue) * transferFunctionSize - 0.5f;
+	float fx = std::floor(x);
+	float alpha = x - fx;
+	int i0 = std::max(0, std::min((int) transferFunctionSize - 1, (int) fx));
+	int i1 = std::max(0, std::min((int) transferFunctionSize - 1, (int) fx + 1));
+	for (int c = 0; c < 4; c++)
+		rgba[c] = (1 - alpha) * tf.rgba[4 * i0 + c] + alpha * tf.rgba[4 * i1 + c];
+}
+
+// Largest value which the lookup maps to opacity 0 (-inf if there is none),
+// macro cells whose maximum is at most this value contribute nothing
+float transferFunctionTransparentBelow(const TransferFunction& tf) {
+	std::size_t k = 0;
+	while (k < transferFunctionSize && tf.rgba[4 * k + 3] == 0)
+		k++;
+	if (k == 0)
+		return -std::numeric_limits<float>::infinity();
+	if (k == transferFunctionSize)
+		return std::numeric_limits<float>::infinity();
+	return tf.minValue + (k - 0.5f) / transferFunctionSize * (tf.maxValue - tf.minValue);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // CPU implementation
 //////////////////////////////////////////////////////////////////////////////
@@ -121,57 +945,736 @@ int intersectBox(float3 r_o, float3 r_d, float3 boxmin, float3 boxmax, float *tn
 
 	return smallest_tmax > largest_tmin;
 }
-void renderHost(const float* h_input, std::vector<float>& h_output, std::size_t countX, std::size_t countY, std::size_t countZ, std::size_t outX, std::size_t outY, const float* invViewMatrix, float tstep, float brightness) {
-	for (size_t y = 0; y < outY; y++) {
-		for (size_t x = 0; x < outX; x++) {
-			uint index = (y * outX) + x;
 
-			float u = (x / (float) (outX - 1))*2.0f-1.0f;
-			float v = (y / (float) (outY - 1))*2.0f-1.0f;
+// RENDER_SUM: the sum of all samples along the ray times brightness, as a
+// gray value (the values have to match RENDER_SUM / RENDER_COMPOSITE in the
+// .cl file)
+// RENDER_COMPOSITE: front-to-back emission-absorption of the colors and
+// opacities of the transfer function, the ray stops once its opacity is
+// above terminationOpacity
+enum RenderMode {
+	RENDER_SUM = 0,
+	RENDER_COMPOSITE = 1
+};
+
+// Parameters of one frame rendered on the host
+struct RenderHostFrame {
+	const float* h_input;
+	const BrickedVolume* bricks; // if not NULL, sampled instead of h_input
+	float* h_output; // RGBA per pixel
+	std::size_t countX, countY, countZ;
+	std::size_t outX, outY;
+	const float* invViewMatrix;
+	float tstep;
+	float brightness;
+	const MacroCellGrid* macroCells;
+	float skipMin, skipThreshold; // cells with all values in [skipMin, skipThreshold] are skipped
+	RenderMode mode;
+	const TransferFunction* transferFunction;
+	float terminationOpacity;
+	const MipPyramid* pyramid; // if NULL, only level 0 is sampled
+	float lodScale; // footprint of a pixel (in voxels) per unit of t
+	int lodBias;
+	std::size_t pixelStep; // only every pixelStep-th pixel in x and y is rendered
+	float jitter; // in [0, 1), the samples are shifted by jitter * tstep
+	SampleFilter filter;
+	bool shading; // RENDER_COMPOSITE: shade the samples using the gradient
+};
 
-			float3 boxMin = float3(0, 0, 0);
-			float3 boxMax = float3(countX, countY, countZ);
+// Number of pixels rendered in x and y
+inline std::size_t renderCountX(const RenderHostFrame& frame) {
+	return (frame.outX + frame.pixelStep - 1) / frame.pixelStep;
+}
+inline std::size_t renderCountY(const RenderHostFrame& frame) {
+	return (frame.outY + frame.pixelStep - 1) / frame.pixelStep;
+}
 
-			// calculate eye ray in world space
-			float3 eyeRay_o;
-			float3 eyeRay_d;
+// Output of rendered pixel (x, y), i.e. of pixel (x, y) * pixelStep
+inline float* outputPixel(const RenderHostFrame& frame, std::size_t x, std::size_t y) {
+	return frame.h_output + 4 * (y * frame.pixelStep * frame.outX + x * frame.pixelStep);
+}
 
-			eyeRay_o = float3(invViewMatrix[3], invViewMatrix[7], invViewMatrix[11]);
+// calculate eye ray in world space for rendered pixel (x, y)
+inline void eyeRay(const RenderHostFrame& frame, std::size_t x, std::size_t y, float3& eyeRay_o, float3& eyeRay_d) {
+	const float* invViewMatrix = frame.invViewMatrix;
+	float u = (x * frame.pixelStep / (float) (frame.outX - 1))*2.0f-1.0f;
+	float v = (y * frame.pixelStep / (float) (frame.outY - 1))*2.0f-1.0f;
 
-			float3 temp = normalize(float3(u, v, -2.0f));
-			eyeRay_d.x = dot(temp, (float3(invViewMatrix[0],invViewMatrix[1],invViewMatrix[2])));
-			eyeRay_d.y = dot(temp, (float3(invViewMatrix[4],invViewMatrix[5],invViewMatrix[6])));
-			eyeRay_d.z = dot(temp, (float3(invViewMatrix[8],invViewMatrix[9],invViewMatrix[10])));
+	eyeRay_o = float3(invViewMatrix[3], invViewMatrix[7], invViewMatrix[11]);
 
-			// find intersection with box
-			float tnear, tfar;
-			int hit = intersectBox(eyeRay_o, eyeRay_d, boxMin, boxMax, &tnear, &tfar);
-			if (!hit) {
-				// set output to 0
-				h_output[index] = 0;
-				continue;
-			}
-			if (tnear < 0.0f)
-				tnear = 0.0f;     // clamp to near plane
+	float3 temp = normalize(float3(u, v, -2.0f));
+	eyeRay_d.x = dot(temp, (float3(invViewMatrix[0],invViewMatrix[1],invViewMatrix[2])));
+	eyeRay_d.y = dot(temp, (float3(invViewMatrix[4],invViewMatrix[5],invViewMatrix[6])));
+	eyeRay_d.z = dot(temp, (float3(invViewMatrix[8],invViewMatrix[9],invViewMatrix[10])));
+}
 
-			// march along ray from back to front, accumulating color
-			float sum = 0;
-			for (float t = tfar; t >= tnear; t -= tstep) {
-				float3 pos = eyeRay_o + eyeRay_d*t;
+inline float sampleVolume(const RenderHostFrame& frame, float3 pos) {
+	if (frame.bricks)
+		return interp3(*frame.bricks, pos);
+	return interp3(frame.h_input, frame.countX, frame.countY, frame.countZ, pos);
+}
 
-				// do 3D interpolation
-				float sample = interp3(h_input, countX, countY, countZ, pos);
+// Pyramid level for the sample at t
+inline int lodLevel(const RenderHostFrame& frame, float t) {
+	if (!frame.pyramid)
+		return 0;
+	int level = frame.lodBias;
+	float footprint = t * frame.lodScale;
+	for (std::size_t l = 1; l < frame.pyramid->levelCount; l++)
+		level += footprint >= (1 << l);
+	return std::min(level, (int) frame.pyramid->levelCount - 1);
+}
 
-				// accumulate result
-				sum += sample;
-			}
+inline float sampleLevel(const RenderHostFrame& frame, int level, float3 pos) {
+	if (level == 0)
+		return sampleVolume(frame, pos);
+	const std::size_t* count = frame.pyramid->count[level];
+	return interp3(frame.pyramid->levels[level].data(), count[0], count[1], count[2], pos * float3(1.0f / (1 << level)));
+}
+
+// Weights and positions of the two linear fetches along one axis which give
+// the cubic B-spline weights of the voxels i - 1, i, i + 1 and i + 2, for
+// the fraction f of the position after voxel i: the fetch with weight g0 is
+// h0 voxels from voxel i, the one with weight g1 is h1 voxels from it
+inline void cubicFetches(float f, float& g0, float& g1, float& h0, float& h1) {
+	float f2 = f * f, f3 = f2 * f;
+	float w0 = (1 - 3 * f + 3 * f2 - f3) / 6;
+	float w1 = (4 - 6 * f2 + 3 * f3) / 6;
+	float w2 = (1 + 3 * f + 3 * f2 - 3 * f3) / 6;
+	float w3 = f3 / 6;
+	g0 = w0 + w1;
+	g1 = w2 + w3;
+	h0 = w1 / g0 - 1;
+	h1 = w3 / g1 + 1;
+}
+
+// Tricubic B-spline of a level from 8 trilinear fetches of sampleLevel()
+inline float sampleCubic(const RenderHostFrame& frame, int level, float3 pos) {
+	float3 scale = float3((float) (1 << level));
+	float3 index = pos / scale - 0.5f;
+	float3 voxel = float3(std::floor(index.x), std::floor(index.y), std::floor(index.z));
+	float3 g0, g1, h0, h1;
+	cubicFetches(index.x - voxel.x, g0.x, g1.x, h0.x, h1.x);
+	cubicFetches(index.y - voxel.y, g0.y, g1.y, h0.y, h1.y);
+	cubicFetches(index.z - voxel.z, g0.z, g1.z, h0.z, h1.z);
+	float3 p0 = (voxel + 0.5f + h0) * scale;
+	float3 p1 = (voxel + 0.5f + h1) * scale;
+	return g0.z * (g0.y * (g0.x * sampleLevel(frame, level, float3(p0.x, p0.y, p0.z)) + g1.x * sampleLevel(frame, level, float3(p1.x, p0.y, p0.z)))
+			+ g1.y * (g0.x * sampleLevel(frame, level, float3(p0.x, p1.y, p0.z)) + g1.x * sampleLevel(frame, level, float3(p1.x, p1.y, p0.z))))
+		+ g1.z * (g0.y * (g0.x * sampleLevel(frame, level, float3(p0.x, p0.y, p1.z)) + g1.x * sampleLevel(frame, level, float3(p1.x, p0.y, p1.z)))
+			+ g1.y * (g0.x * sampleLevel(frame, level, float3(p0.x, p1.y, p1.z)) + g1.x * sampleLevel(frame, level, float3(p1.x, p1.y, p1.z))));
+}
+
+inline float sampleFiltered(const RenderHostFrame& frame, int level, float3 pos) {
+	if (frame.filter == FILTER_CUBIC)
+		return sampleCubic(frame, level, pos);
+	return sampleLevel(frame, level, pos);
+}
+
+// Central differences of the filtered samples one voxel of the level apart,
+// computed on the fly instead of storing a gradient volume (3 times the
+// memory of the volume)
+inline float3 sampleGradient(const RenderHostFrame& frame, int level, float3 pos) {
+	float h = (float) (1 << level);
+	return float3(sampleFiltered(frame, level, pos + float3(h, 0, 0)) - sampleFiltered(frame, level, pos - float3(h, 0, 0)),
+			sampleFiltered(frame, level, pos + float3(0, h, 0)) - sampleFiltered(frame, level, pos - float3(0, h, 0)),
+			sampleFiltered(frame, level, pos + float3(0, 0, h)) - sampleFiltered(frame, level, pos - float3(0, 0, h))) / float3(2 * h);
+}
+
+// Blinn-Phong shading with a headlight: the light comes from the eye, so
+// the half vector is the view direction. The gradient is the normal, lit
+// from both sides, samples without a gradient stay unshaded. The values
+// have to match the SHADING_* values in the .cl file.
+const float shadingAmbient = 0.3f;
+const float shadingDiffuse = 0.7f;
+const float shadingSpecular = 0.4f;
+const int shadingShininessShift = 4; // specular exponent 2^4
 
-			// write output value
-			h_output[index] = sum * brightness;
+inline void shade(float3 gradient, float3 eyeRay_d, float* rgba) {
+	float length2 = dot(gradient, gradient);
+	if (!(length2 > 0))
+		return;
+	float cosine = std::abs(dot(gradient, eyeRay_d)) / std::sqrt(length2 * dot(eyeRay_d, eyeRay_d));
+	float specular = cosine;
+	for (int i = 0; i < shadingShininessShift; i++)
+		specular *= specular;
+	for (int c = 0; c < 3; c++)
+		rgba[c] = rgba[c] * (shadingAmbient + shadingDiffuse * cosine) + shadingSpecular * specular;
+}
+
+// One 3D-DDA step: if the macro cell of the given level containing pos can
+// be skipped, returns true and the ray parameter tExit where the ray,
+// marching towards larger t (forward) or smaller t, leaves the cell
+inline bool skipMacroCell(const RenderHostFrame& frame, int level, float3 pos, float3 eyeRay_o, float3 eyeRay_d, bool forward, float* tExit) {
+	const MacroCellGrid& grid = *frame.macroCells;
+	int cellsX = (int) macroCellCount(grid.cellsX, level);
+	int cellsY = (int) macroCellCount(grid.cellsY, level);
+	int cellsZ = (int) macroCellCount(grid.cellsZ, level);
+	int cellSize = (int) macroCellSize << level;
+	int cx = std::max(0, std::min(cellsX - 1, (int) pos.x / cellSize));
+	int cy = std::max(0, std::min(cellsY - 1, (int) pos.y / cellSize));
+	int cz = std::max(0, std::min(cellsZ - 1, (int) pos.z / cellSize));
+	std::size_t cell = macroCellOffset(grid, level, frame.filter) + cx + cellsX * (cy + cellsY * cz);
+	if (!(grid.minMax[2 * cell] >= frame.skipMin && grid.minMax[2 * cell + 1] <= frame.skipThreshold))
+		return false;
+	float3 cellMin = float3(cx, cy, cz) * float3(cellSize);
+	float3 exitPlane = float3((forward ? eyeRay_d.x > 0 : eyeRay_d.x <= 0) ? cellMin.x + cellSize : cellMin.x,
+			(forward ? eyeRay_d.y > 0 : eyeRay_d.y <= 0) ? cellMin.y + cellSize : cellMin.y,
+			(forward ? eyeRay_d.z > 0 : eyeRay_d.z <= 0) ? cellMin.z + cellSize : cellMin.z);
+	float3 t = (exitPlane - eyeRay_o) / eyeRay_d;
+	const float never = forward ? std::numeric_limits<float>::infinity() : -std::numeric_limits<float>::infinity();
+	float3 tAxis = float3(eyeRay_d.x != 0 ? t.x : never, eyeRay_d.y != 0 ? t.y : never, eyeRay_d.z != 0 ? t.z : never);
+	*tExit = forward ? std::min(std::min(tAxis.x, tAxis.y), tAxis.z) : std::max(std::max(tAxis.x, tAxis.y), tAxis.z);
+	return true;
+}
+
+// Number of samples (at least 1) to go past a cell the ray leaves after
+// the given distance (in units of t)
+inline float skipSamples(float distance, float tstep) {
+	return std::max(1.0f, std::ceil(distance / tstep));
+}
+
+// RENDER_SUM: march along ray from back to front, accumulating color. A
+// sample of level l stands for 2^l samples of level 0.
+float marchSum(const RenderHostFrame& frame, float3 eyeRay_o, float3 eyeRay_d, float tnear, float tfar) {
+	float sum = 0;
+	float step = frame.tstep; // of the current sample
+	for (float t = tfar - frame.jitter * frame.tstep; t >= tnear; t -= step) {
+		float3 pos = eyeRay_o + eyeRay_d*t;
+		int level = lodLevel(frame, t);
+		step = frame.tstep * (1 << level);
+
+		// skip empty macro cells, the sample positions stay the same
+		float tExit;
+		if (skipMacroCell(frame, level, pos, eyeRay_o, eyeRay_d, false, &tExit)) {
+			t -= (skipSamples(t - tExit, step) - 1) * step;
+			continue;
+		}
+
+		// do 3D interpolation
+		float sample = sampleFiltered(frame, level, pos);
+
+		// accumulate result
+		sum += level ? sample * (1 << level) : sample;
+	}
+	return sum * frame.brightness;
+}
+
+// RENDER_COMPOSITE: march along ray from front to back, compositing the
+// samples mapped by the transfer function. The opacity of a sample of level
+// l is corrected to that of 2^l samples of level 0: 1 - (1 - opacity)^(2^l).
+void marchComposite(const RenderHostFrame& frame, float3 eyeRay_o, float3 eyeRay_d, float tnear, float tfar, float* rgba) {
+	rgba[0] = rgba[1] = rgba[2] = rgba[3] = 0;
+	float step = frame.tstep; // of the current sample
+	for (float t = tnear + frame.jitter * frame.tstep; t <= tfar; t += step) {
+		float3 pos = eyeRay_o + eyeRay_d*t;
+		int level = lodLevel(frame, t);
+		step = frame.tstep * (1 << level);
+
+		// skip transparent macro cells
+		float tExit;
+		if (skipMacroCell(frame, level, pos, eyeRay_o, eyeRay_d, true, &tExit)) {
+			t += (skipSamples(tExit - t, step) - 1) * step;
+			continue;
 		}
+
+		float sample = sampleFiltered(frame, level, pos);
+		float value[4];
+		transferFunctionLookup(*frame.transferFunction, sample, value);
+		if (frame.shading && value[3] > 0)
+			shade(sampleGradient(frame, level, pos), eyeRay_d, value);
+		if (level) {
+			float transparency = 1 - value[3];
+			for (int l = 0; l < level; l++)
+				transparency *= transparency;
+			value[3] = 1 - transparency;
+		}
+
+		// the sample is seen through the opacity in front of it
+		float weight = (1 - rgba[3]) * value[3];
+		for (int c = 0; c < 3; c++)
+			rgba[c] += weight * value[c];
+		rgba[3] += weight;
+
+		// early ray termination
+		if (rgba[3] > frame.terminationOpacity)
+			break;
+	}
+}
+
+// RGBA value of rendered pixel (x, y)
+void renderRay(const RenderHostFrame& frame, std::size_t x, std::size_t y, float* rgba) {
+	float3 boxMin = float3(0, 0, 0);
+	float3 boxMax = float3(frame.countX, frame.countY, frame.countZ);
+
+	float3 eyeRay_o;
+	float3 eyeRay_d;
+	eyeRay(frame, x, y, eyeRay_o, eyeRay_d);
+
+	// find intersection with box
+	float tnear, tfar;
+	int hit = intersectBox(eyeRay_o, eyeRay_d, boxMin, boxMax, &tnear, &tfar);
+	if (!hit) {
+		rgba[0] = rgba[1] = rgba[2] = 0;
+		rgba[3] = frame.mode == RENDER_SUM ? 1 : 0;
+		return;
+	}
+	if (tnear < 0.0f)
+		tnear = 0.0f;     // clamp to near plane
+
+	if (frame.mode == RENDER_SUM) {
+		rgba[0] = rgba[1] = rgba[2] = marchSum(frame, eyeRay_o, eyeRay_d, tnear, tfar);
+		rgba[3] = 1;
+	} else {
+		marchComposite(frame, eyeRay_o, eyeRay_d, tnear, tfar, rgba);
 	}
 }
 
+#if defined(__AVX2__) && defined(__FMA__)
+// The AVX path follows 8 rays, the pixels (x, y), ..., (x + 7, y), in the
+// lanes of the registers of a RayPacket and does the operations of
+// renderRay() lane by lane. The packet marches until all its rays are done.
+struct RayPacket {
+	__m256 oX, oY, oZ, dX, dY, dZ;
+	__m256 tnear, tfar, hit;
+};
+
+inline void packetRays(const RenderHostFrame& frame, std::size_t x, std::size_t y, RayPacket& rays) {
+	float originX[8], originY[8], originZ[8], directionX[8], directionY[8], directionZ[8];
+	for (int i = 0; i < 8; i++) {
+		float3 eyeRay_o, eyeRay_d;
+		eyeRay(frame, x + i, y, eyeRay_o, eyeRay_d);
+		originX[i] = eyeRay_o.x; originY[i] = eyeRay_o.y; originZ[i] = eyeRay_o.z;
+		directionX[i] = eyeRay_d.x; directionY[i] = eyeRay_d.y; directionZ[i] = eyeRay_d.z;
+	}
+	rays.oX = _mm256_loadu_ps(originX); rays.oY = _mm256_loadu_ps(originY); rays.oZ = _mm256_loadu_ps(originZ);
+	rays.dX = _mm256_loadu_ps(directionX); rays.dY = _mm256_loadu_ps(directionY); rays.dZ = _mm256_loadu_ps(directionZ);
+
+	// intersectBox() with the operand order of std::min / std::max, so
+	// that NaNs are treated the same way
+	__m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+	__m256 invX = _mm256_div_ps(one, rays.dX), invY = _mm256_div_ps(one, rays.dY), invZ = _mm256_div_ps(one, rays.dZ);
+	__m256 tbotX = _mm256_mul_ps(invX, _mm256_sub_ps(zero, rays.oX));
+	__m256 tbotY = _mm256_mul_ps(invY, _mm256_sub_ps(zero, rays.oY));
+	__m256 tbotZ = _mm256_mul_ps(invZ, _mm256_sub_ps(zero, rays.oZ));
+	__m256 ttopX = _mm256_mul_ps(invX, _mm256_sub_ps(_mm256_set1_ps((float) frame.countX), rays.oX));
+	__m256 ttopY = _mm256_mul_ps(invY, _mm256_sub_ps(_mm256_set1_ps((float) frame.countY), rays.oY));
+	__m256 ttopZ = _mm256_mul_ps(invZ, _mm256_sub_ps(_mm256_set1_ps((float) frame.countZ), rays.oZ));
+	__m256 tnear = _mm256_max_ps(_mm256_min_ps(tbotZ, ttopZ), _mm256_max_ps(_mm256_min_ps(tbotY, ttopY), _mm256_min_ps(tbotX, ttopX)));
+	rays.tfar = _mm256_min_ps(_mm256_max_ps(tbotZ, ttopZ), _mm256_min_ps(_mm256_max_ps(tbotY, ttopY), _mm256_max_ps(tbotX, ttopX)));
+	rays.hit = _mm256_cmp_ps(rays.tfar, tnear, _CMP_GT_OQ);
+	rays.tnear = _mm256_blendv_ps(tnear, zero, _mm256_cmp_ps(tnear, zero, _CMP_LT_OQ));
+}
+
+// skipMacroCell(): returns the lanes of active which can skip their cell (of
+// the level of the lane and frame.filter) and sets tExit for them
+inline __m256 packetSkipMacroCell(const RenderHostFrame& frame, const RayPacket& rays, __m256i level, __m256 rayX, __m256 rayY, __m256 rayZ, __m256 active, bool forward, __m256& tExit) {
+	const MacroCellGrid& grid = *frame.macroCells;
+	__m256i zeroInt = _mm256_setzero_si256(), oneInt = _mm256_set1_epi32(1);
+	__m256i roundUp = _mm256_sub_epi32(_mm256_sllv_epi32(oneInt, level), oneInt);
+	__m256i cellsX = _mm256_srlv_epi32(_mm256_add_epi32(_mm256_set1_epi32((int) grid.cellsX), roundUp), level);
+	__m256i cellsY = _mm256_srlv_epi32(_mm256_add_epi32(_mm256_set1_epi32((int) grid.cellsY), roundUp), level);
+	__m256i cellsZ = _mm256_srlv_epi32(_mm256_add_epi32(_mm256_set1_epi32((int) grid.cellsZ), roundUp), level);
+	__m256i shift = _mm256_add_epi32(level, _mm256_set1_epi32((int) macroCellShift));
+	__m256i cX = _mm256_max_epi32(zeroInt, _mm256_min_epi32(_mm256_sub_epi32(cellsX, oneInt), _mm256_srav_epi32(_mm256_cvttps_epi32(rayX), shift)));
+	__m256i cY = _mm256_max_epi32(zeroInt, _mm256_min_epi32(_mm256_sub_epi32(cellsY, oneInt), _mm256_srav_epi32(_mm256_cvttps_epi32(rayY), shift)));
+	__m256i cZ = _mm256_max_epi32(zeroInt, _mm256_min_epi32(_mm256_sub_epi32(cellsZ, oneInt), _mm256_srav_epi32(_mm256_cvttps_epi32(rayZ), shift)));
+	__m256i cell = _mm256_add_epi32(cX, _mm256_mullo_epi32(cellsX, _mm256_add_epi32(cY, _mm256_mullo_epi32(cellsY, cZ))));
+	for (std::size_t l = 1; l < grid.levelCount; l++)
+		cell = _mm256_add_epi32(cell, _mm256_and_si256(_mm256_cmpgt_epi32(level, _mm256_set1_epi32((int) l - 1)), _mm256_set1_epi32((int) (grid.levelOffset[l] - grid.levelOffset[l - 1]))));
+	if (frame.filter == FILTER_CUBIC)
+		cell = _mm256_add_epi32(cell, _mm256_mullo_epi32(cellsX, _mm256_mullo_epi32(cellsY, cellsZ)));
+	__m256 cellMin = _mm256_i32gather_ps(&grid.minMax[0], _mm256_slli_epi32(cell, 1), 4);
+	__m256 cellMax = _mm256_i32gather_ps(&grid.minMax[1], _mm256_slli_epi32(cell, 1), 4);
+	__m256 skip = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(cellMin, _mm256_set1_ps(frame.skipMin), _CMP_GE_OQ), _mm256_cmp_ps(cellMax, _mm256_set1_ps(frame.skipThreshold), _CMP_LE_OQ)));
+	if (!_mm256_movemask_ps(skip))
+		return skip;
+
+	// the plane through which a ray leaves the cell, axes parallel to the
+	// ray never give the exit
+	__m256 zero = _mm256_setzero_ps(), cellSize = _mm256_cvtepi32_ps(_mm256_sllv_epi32(_mm256_set1_epi32((int) macroCellSize), level));
+	__m256 exitOffsetX = _mm256_and_ps(forward ? _mm256_cmp_ps(rays.dX, zero, _CMP_GT_OQ) : _mm256_cmp_ps(rays.dX, zero, _CMP_LE_OQ), cellSize);
+	__m256 exitOffsetY = _mm256_and_ps(forward ? _mm256_cmp_ps(rays.dY, zero, _CMP_GT_OQ) : _mm256_cmp_ps(rays.dY, zero, _CMP_LE_OQ), cellSize);
+	__m256 exitOffsetZ = _mm256_and_ps(forward ? _mm256_cmp_ps(rays.dZ, zero, _CMP_GT_OQ) : _mm256_cmp_ps(rays.dZ, zero, _CMP_LE_OQ), cellSize);
+	__m256 never = _mm256_set1_ps(forward ? std::numeric_limits<float>::infinity() : -std::numeric_limits<float>::infinity());
+	__m256 exitX = _mm256_blendv_ps(_mm256_div_ps(_mm256_sub_ps(_mm256_fmadd_ps(_mm256_cvtepi32_ps(cX), cellSize, exitOffsetX), rays.oX), rays.dX), never, _mm256_cmp_ps(rays.dX, zero, _CMP_EQ_OQ));
+	__m256 exitY = _mm256_blendv_ps(_mm256_div_ps(_mm256_sub_ps(_mm256_fmadd_ps(_mm256_cvtepi32_ps(cY), cellSize, exitOffsetY), rays.oY), rays.dY), never, _mm256_cmp_ps(rays.dY, zero, _CMP_EQ_OQ));
+	__m256 exitZ = _mm256_blendv_ps(_mm256_div_ps(_mm256_sub_ps(_mm256_fmadd_ps(_mm256_cvtepi32_ps(cZ), cellSize, exitOffsetZ), rays.oZ), rays.dZ), never, _mm256_cmp_ps(rays.dZ, zero, _CMP_EQ_OQ));
+	tExit = forward ? _mm256_min_ps(exitZ, _mm256_min_ps(exitY, exitX)) : _mm256_max_ps(exitZ, _mm256_max_ps(exitY, exitX));
+	return skip;
+}
+
+// interp3() on the bricked volume: the 8 neighbors are in one brick, only
+// lanes with all neighbors outside of the volume or in a missing brick are
+// masked out
+inline __m256 packetInterp3Bricked(const BrickedVolume& volume, __m256 rayX, __m256 rayY, __m256 rayZ) {
+	__m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f);
+	__m256i zeroInt = _mm256_setzero_si256(), minusOne = _mm256_set1_epi32(-1), localEnd = _mm256_set1_epi32((int) brickSize + 1);
+	__m256 posX = _mm256_sub_ps(rayX, half);
+	__m256 posY = _mm256_sub_ps(rayY, half);
+	__m256 posZ = _mm256_sub_ps(rayZ, half);
+	__m256i iX = _mm256_cvttps_epi32(_mm256_floor_ps(posX)), iY = _mm256_cvttps_epi32(_mm256_floor_ps(posY)), iZ = _mm256_cvttps_epi32(_mm256_floor_ps(posZ));
+	__m256 alphaX = _mm256_sub_ps(posX, _mm256_cvtepi32_ps(iX));
+	__m256 alphaY = _mm256_sub_ps(posY, _mm256_cvtepi32_ps(iY));
+	__m256 alphaZ = _mm256_sub_ps(posZ, _mm256_cvtepi32_ps(iZ));
+	__m256 betaX = _mm256_sub_ps(one, alphaX), betaY = _mm256_sub_ps(one, alphaY), betaZ = _mm256_sub_ps(one, alphaZ);
+	__m256i bX = _mm256_max_epi32(zeroInt, _mm256_min_epi32(_mm256_set1_epi32((int) volume.bricksX - 1), _mm256_srai_epi32(iX, brickShift)));
+	__m256i bY = _mm256_max_epi32(zeroInt, _mm256_min_epi32(_mm256_set1_epi32((int) volume.bricksY - 1), _mm256_srai_epi32(iY, brickShift)));
+	__m256i bZ = _mm256_max_epi32(zeroInt, _mm256_min_epi32(_mm256_set1_epi32((int) volume.bricksZ - 1), _mm256_srai_epi32(iZ, brickShift)));
+	__m256i lX = _mm256_sub_epi32(iX, _mm256_sub_epi32(_mm256_slli_epi32(bX, brickShift), _mm256_set1_epi32(1)));
+	__m256i lY = _mm256_sub_epi32(iY, _mm256_sub_epi32(_mm256_slli_epi32(bY, brickShift), _mm256_set1_epi32(1)));
+	__m256i lZ = _mm256_sub_epi32(iZ, _mm256_sub_epi32(_mm256_slli_epi32(bZ, brickShift), _mm256_set1_epi32(1)));
+	__m256i in = _mm256_and_si256(_mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpgt_epi32(lX, minusOne), _mm256_cmpgt_epi32(localEnd, lX)),
+			_mm256_and_si256(_mm256_cmpgt_epi32(lY, minusOne), _mm256_cmpgt_epi32(localEnd, lY))),
+			_mm256_and_si256(_mm256_cmpgt_epi32(lZ, minusOne), _mm256_cmpgt_epi32(localEnd, lZ)));
+	__m256i brick = _mm256_add_epi32(bX, _mm256_add_epi32(_mm256_mullo_epi32(bY, _mm256_set1_epi32((int) volume.bricksX)), _mm256_mullo_epi32(bZ, _mm256_set1_epi32((int) (volume.bricksX * volume.bricksY)))));
+	__m256i offset = _mm256_mask_i32gather_epi32(minusOne, volume.brickOffset.data(), brick, in, 4);
+	in = _mm256_and_si256(in, _mm256_cmpgt_epi32(offset, minusOne));
+	__m256i index = _mm256_add_epi32(offset,
+			_mm256_add_epi32(lX, _mm256_add_epi32(_mm256_mullo_epi32(lY, _mm256_set1_epi32((int) brickStride)), _mm256_mullo_epi32(lZ, _mm256_set1_epi32((int) (brickStride * brickStride))))));
+
+	__m256 sample = _mm256_setzero_ps();
+	for (int corner = 0; corner < 8; corner++) {
+		bool cx = corner & 1, cy = corner & 2, cz = corner & 4;
+		__m256i cornerOffset = _mm256_set1_epi32((cx ? 1 : 0) + (cy ? (int) brickStride : 0) + (cz ? (int) (brickStride * brickStride) : 0));
+		__m256 value = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), volume.data, _mm256_add_epi32(index, cornerOffset), _mm256_castsi256_ps(in), 4);
+		__m256 weight = _mm256_mul_ps(_mm256_mul_ps(cx ? alphaX : betaX, cy ? alphaY : betaY), cz ? alphaZ : betaZ);
+		sample = _mm256_fmadd_ps(weight, value, sample);
+	}
+	return sample;
+}
+
+// interp3() on the linear layout: the 8 neighbors outside of the volume are 0
+inline __m256 packetInterp3Linear(const float* data, int countX, int countY, int countZ, __m256 rayX, __m256 rayY, __m256 rayZ) {
+	__m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f);
+	__m256i minusOne = _mm256_set1_epi32(-1), oneInt = _mm256_set1_epi32(1);
+	__m256i sizeX = _mm256_set1_epi32(countX), sizeY = _mm256_set1_epi32(countY), sizeZ = _mm256_set1_epi32(countZ);
+	__m256 posX = _mm256_sub_ps(rayX, half);
+	__m256 posY = _mm256_sub_ps(rayY, half);
+	__m256 posZ = _mm256_sub_ps(rayZ, half);
+	__m256i iX = _mm256_cvttps_epi32(_mm256_floor_ps(posX)), iY = _mm256_cvttps_epi32(_mm256_floor_ps(posY)), iZ = _mm256_cvttps_epi32(_mm256_floor_ps(posZ));
+	__m256 alphaX = _mm256_sub_ps(posX, _mm256_cvtepi32_ps(iX));
+	__m256 alphaY = _mm256_sub_ps(posY, _mm256_cvtepi32_ps(iY));
+	__m256 alphaZ = _mm256_sub_ps(posZ, _mm256_cvtepi32_ps(iZ));
+	__m256 betaX = _mm256_sub_ps(one, alphaX), betaY = _mm256_sub_ps(one, alphaY), betaZ = _mm256_sub_ps(one, alphaZ);
+	__m256i iX1 = _mm256_add_epi32(iX, oneInt), iY1 = _mm256_add_epi32(iY, oneInt), iZ1 = _mm256_add_epi32(iZ, oneInt);
+	__m256i inX0 = _mm256_and_si256(_mm256_cmpgt_epi32(iX, minusOne), _mm256_cmpgt_epi32(sizeX, iX));
+	__m256i inX1 = _mm256_and_si256(_mm256_cmpgt_epi32(iX1, minusOne), _mm256_cmpgt_epi32(sizeX, iX1));
+	__m256i inY0 = _mm256_and_si256(_mm256_cmpgt_epi32(iY, minusOne), _mm256_cmpgt_epi32(sizeY, iY));
+	__m256i inY1 = _mm256_and_si256(_mm256_cmpgt_epi32(iY1, minusOne), _mm256_cmpgt_epi32(sizeY, iY1));
+	__m256i inZ0 = _mm256_and_si256(_mm256_cmpgt_epi32(iZ, minusOne), _mm256_cmpgt_epi32(sizeZ, iZ));
+	__m256i inZ1 = _mm256_and_si256(_mm256_cmpgt_epi32(iZ1, minusOne), _mm256_cmpgt_epi32(sizeZ, iZ1));
+	__m256i index = _mm256_add_epi32(iX, _mm256_add_epi32(_mm256_mullo_epi32(iY, sizeX), _mm256_mullo_epi32(iZ, _mm256_set1_epi32(countX * countY))));
+
+	__m256 sample = _mm256_setzero_ps();
+	for (int corner = 0; corner < 8; corner++) {
+		bool cx = corner & 1, cy = corner & 2, cz = corner & 4;
+		__m256i in = _mm256_and_si256(_mm256_and_si256(cx ? inX1 : inX0, cy ? inY1 : inY0), cz ? inZ1 : inZ0);
+		__m256i offset = _mm256_set1_epi32((cx ? 1 : 0) + (cy ? countX : 0) + (cz ? countX * countY : 0));
+		__m256 value = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), data, _mm256_add_epi32(index, offset), _mm256_castsi256_ps(in), 4);
+		__m256 weight = _mm256_mul_ps(_mm256_mul_ps(cx ? alphaX : betaX, cy ? alphaY : betaY), cz ? alphaZ : betaZ);
+		sample = _mm256_fmadd_ps(weight, value, sample);
+	}
+	return sample;
+}
+
+inline __m256 packetInterp3(const RenderHostFrame& frame, __m256 rayX, __m256 rayY, __m256 rayZ) {
+	if (frame.bricks)
+		return packetInterp3Bricked(*frame.bricks, rayX, rayY, rayZ);
+	return packetInterp3Linear(frame.h_input, (int) frame.countX, (int) frame.countY, (int) frame.countZ, rayX, rayY, rayZ);
+}
+
+// lodLevel() for the lanes at t
+inline __m256i packetLodLevel(const RenderHostFrame& frame, __m256 t) {
+	if (!frame.pyramid)
+		return _mm256_setzero_si256();
+	__m256i level = _mm256_set1_epi32(frame.lodBias);
+	__m256 footprint = _mm256_mul_ps(t, _mm256_set1_ps(frame.lodScale));
+	for (std::size_t l = 1; l < frame.pyramid->levelCount; l++)
+		level = _mm256_sub_epi32(level, _mm256_castps_si256(_mm256_cmp_ps(footprint, _mm256_set1_ps((float) (1 << l)), _CMP_GE_OQ)));
+	return _mm256_min_epi32(level, _mm256_set1_epi32((int) frame.pyramid->levelCount - 1));
+}
+
+// sampleLevel() for the lanes in sampling, every level used by them is sampled once
+inline __m256 packetSampleLevel(const RenderHostFrame& frame, __m256i level, __m256 sampling, __m256 rayX, __m256 rayY, __m256 rayZ) {
+	__m256 sample = _mm256_setzero_ps();
+	for (int l = 0; l < (frame.pyramid ? (int) frame.pyramid->levelCount : 1); l++) {
+		__m256 lanes = _mm256_and_ps(sampling, _mm256_castsi256_ps(_mm256_cmpeq_epi32(level, _mm256_set1_epi32(l))));
+		if (!_mm256_movemask_ps(lanes))
+			continue;
+		if (l == 0) {
+			sample = _mm256_blendv_ps(sample, packetInterp3(frame, rayX, rayY, rayZ), lanes);
+		} else {
+			const std::size_t* count = frame.pyramid->count[l];
+			__m256 scale = _mm256_set1_ps(1.0f / (1 << l));
+			sample = _mm256_blendv_ps(sample, packetInterp3Linear(frame.pyramid->levels[l].data(), (int) count[0], (int) count[1], (int) count[2],
+					_mm256_mul_ps(rayX, scale), _mm256_mul_ps(rayY, scale), _mm256_mul_ps(rayZ, scale)), lanes);
+		}
+	}
+	return sample;
+}
+
+// 2^level as float
+inline __m256 packetLevelScale(__m256i level) {
+	return _mm256_cvtepi32_ps(_mm256_sllv_epi32(_mm256_set1_epi32(1), level));
+}
+
+// cubicFetches() for the lanes
+inline void packetCubicFetches(__m256 f, __m256& g0, __m256& g1, __m256& h0, __m256& h1) {
+	__m256 one = _mm256_set1_ps(1.0f), three = _mm256_set1_ps(3.0f), sixth = _mm256_set1_ps(1.0f / 6);
+	__m256 f2 = _mm256_mul_ps(f, f), f3 = _mm256_mul_ps(f2, f);
+	__m256 w0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(three, _mm256_sub_ps(f2, f), one), f3), sixth);
+	__m256 w1 = _mm256_mul_ps(_mm256_fmadd_ps(three, f3, _mm256_fnmadd_ps(_mm256_set1_ps(6.0f), f2, _mm256_set1_ps(4.0f))), sixth);
+	__m256 w2 = _mm256_mul_ps(_mm256_fmadd_ps(three, _mm256_sub_ps(_mm256_add_ps(f, f2), f3), one), sixth);
+	__m256 w3 = _mm256_mul_ps(f3, sixth);
+	g0 = _mm256_add_ps(w0, w1);
+	g1 = _mm256_add_ps(w2, w3);
+	h0 = _mm256_sub_ps(_mm256_div_ps(w1, g0), one);
+	h1 = _mm256_add_ps(_mm256_div_ps(w3, g1), one);
+}
+
+// sampleCubic() for the lanes in sampling
+inline __m256 packetSampleCubic(const RenderHostFrame& frame, __m256i level, __m256 sampling, __m256 rayX, __m256 rayY, __m256 rayZ) {
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 scale = packetLevelScale(level), invScale = _mm256_div_ps(_mm256_set1_ps(1.0f), scale);
+	__m256 ray[3] = { rayX, rayY, rayZ };
+	__m256 g0[3], g1[3], p0[3], p1[3];
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 index = _mm256_fmsub_ps(ray[axis], invScale, half);
+		__m256 voxel = _mm256_floor_ps(index);
+		__m256 h0, h1;
+		packetCubicFetches(_mm256_sub_ps(index, voxel), g0[axis], g1[axis], h0, h1);
+		__m256 center = _mm256_add_ps(voxel, half);
+		p0[axis] = _mm256_mul_ps(_mm256_add_ps(center, h0), scale);
+		p1[axis] = _mm256_mul_ps(_mm256_add_ps(center, h1), scale);
+	}
+	__m256 sample = _mm256_setzero_ps();
+	for (int corner = 0; corner < 8; corner++) {
+		bool cx = corner & 1, cy = corner & 2, cz = corner & 4;
+		__m256 weight = _mm256_mul_ps(_mm256_mul_ps(cx ? g1[0] : g0[0], cy ? g1[1] : g0[1]), cz ? g1[2] : g0[2]);
+		sample = _mm256_fmadd_ps(weight, packetSampleLevel(frame, level, sampling, cx ? p1[0] : p0[0], cy ? p1[1] : p0[1], cz ? p1[2] : p0[2]), sample);
+	}
+	return sample;
+}
+
+inline __m256 packetSampleFiltered(const RenderHostFrame& frame, __m256i level, __m256 sampling, __m256 rayX, __m256 rayY, __m256 rayZ) {
+	if (frame.filter == FILTER_CUBIC)
+		return packetSampleCubic(frame, level, sampling, rayX, rayY, rayZ);
+	return packetSampleLevel(frame, level, sampling, rayX, rayY, rayZ);
+}
+
+// sampleGradient() for the lanes in sampling
+inline void packetGradient(const RenderHostFrame& frame, __m256i level, __m256 sampling, __m256 rayX, __m256 rayY, __m256 rayZ, __m256& gradientX, __m256& gradientY, __m256& gradientZ) {
+	__m256 h = packetLevelScale(level), scale = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(h, h));
+	gradientX = _mm256_mul_ps(_mm256_sub_ps(packetSampleFiltered(frame, level, sampling, _mm256_add_ps(rayX, h), rayY, rayZ), packetSampleFiltered(frame, level, sampling, _mm256_sub_ps(rayX, h), rayY, rayZ)), scale);
+	gradientY = _mm256_mul_ps(_mm256_sub_ps(packetSampleFiltered(frame, level, sampling, rayX, _mm256_add_ps(rayY, h), rayZ), packetSampleFiltered(frame, level, sampling, rayX, _mm256_sub_ps(rayY, h), rayZ)), scale);
+	gradientZ = _mm256_mul_ps(_mm256_sub_ps(packetSampleFiltered(frame, level, sampling, rayX, rayY, _mm256_add_ps(rayZ, h)), packetSampleFiltered(frame, level, sampling, rayX, rayY, _mm256_sub_ps(rayZ, h))), scale);
+}
+
+// shade() for the lanes in shading
+inline void packetShade(const RenderHostFrame& frame, const RayPacket& rays, __m256i level, __m256 shading, __m256 rayX, __m256 rayY, __m256 rayZ, __m256* rgba) {
+	__m256 zero = _mm256_setzero_ps();
+	__m256 gradientX, gradientY, gradientZ;
+	packetGradient(frame, level, shading, rayX, rayY, rayZ, gradientX, gradientY, gradientZ);
+	__m256 length2 = _mm256_fmadd_ps(gradientZ, gradientZ, _mm256_fmadd_ps(gradientY, gradientY, _mm256_mul_ps(gradientX, gradientX)));
+	__m256 direction2 = _mm256_fmadd_ps(rays.dZ, rays.dZ, _mm256_fmadd_ps(rays.dY, rays.dY, _mm256_mul_ps(rays.dX, rays.dX)));
+	__m256 cosine = _mm256_fmadd_ps(gradientZ, rays.dZ, _mm256_fmadd_ps(gradientY, rays.dY, _mm256_mul_ps(gradientX, rays.dX)));
+	cosine = _mm256_div_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), cosine), _mm256_sqrt_ps(_mm256_mul_ps(length2, direction2)));
+	__m256 specular = cosine;
+	for (int i = 0; i < shadingShininessShift; i++)
+		specular = _mm256_mul_ps(specular, specular);
+	specular = _mm256_mul_ps(specular, _mm256_set1_ps(shadingSpecular));
+	__m256 diffuse = _mm256_fmadd_ps(_mm256_set1_ps(shadingDiffuse), cosine, _mm256_set1_ps(shadingAmbient));
+	__m256 shaded = _mm256_and_ps(shading, _mm256_cmp_ps(length2, zero, _CMP_GT_OQ));
+	for (int c = 0; c < 3; c++)
+		rgba[c] = _mm256_blendv_ps(rgba[c], _mm256_fmadd_ps(rgba[c], diffuse, specular), shaded);
+}
+
+// transferFunctionLookup(), rgba[c] gets channel c of the 8 lanes
+inline void packetTransferFunction(const TransferFunction& tf, __m256 value, __m256* rgba) {
+	__m256 x = _mm256_sub_ps(_mm256_mul_ps(_mm256_div_ps(_mm256_sub_ps(value, _mm256_set1_ps(tf.minValue)), _mm256_set1_ps(tf.maxValue - tf.minValue)), _mm256_set1_ps((float) transferFunctionSize)), _mm256_set1_ps(0.5f));
+	__m256 fx = _mm256_floor_ps(x);
+	__m256 alpha = _mm256_sub_ps(x, fx), beta = _mm256_sub_ps(_mm256_set1_ps(1.0f), alpha);
+	__m256i last = _mm256_set1_epi32((int) transferFunctionSize - 1), i = _mm256_cvttps_epi32(fx);
+	__m256i i0 = _mm256_max_epi32(_mm256_setzero_si256(), _mm256_min_epi32(last, i));
+	__m256i i1 = _mm256_max_epi32(_mm256_setzero_si256(), _mm256_min_epi32(last, _mm256_add_epi32(i, _mm256_set1_epi32(1))));
+	i0 = _mm256_slli_epi32(i0, 2);
+	i1 = _mm256_slli_epi32(i1, 2);
+	for (int c = 0; c < 4; c++) {
+		__m256 v0 = _mm256_i32gather_ps(&tf.rgba[c], i0, 4);
+		__m256 v1 = _mm256_i32gather_ps(&tf.rgba[c], i1, 4);
+		rgba[c] = _mm256_add_ps(_mm256_mul_ps(beta, v0), _mm256_mul_ps(alpha, v1));
+	}
+}
+
+// marchSum() for the packet
+inline __m256 packetSum(const RenderHostFrame& frame, const RayPacket& rays) {
+	__m256 t = _mm256_sub_ps(rays.tfar, _mm256_set1_ps(frame.jitter * frame.tstep));
+	__m256 active = _mm256_and_ps(rays.hit, _mm256_cmp_ps(t, rays.tnear, _CMP_GE_OQ));
+	__m256 sum = _mm256_setzero_ps();
+	while (_mm256_movemask_ps(active)) {
+		__m256 rayX = _mm256_add_ps(rays.oX, _mm256_mul_ps(rays.dX, t));
+		__m256 rayY = _mm256_add_ps(rays.oY, _mm256_mul_ps(rays.dY, t));
+		__m256 rayZ = _mm256_add_ps(rays.oZ, _mm256_mul_ps(rays.dZ, t));
+		__m256i level = packetLodLevel(frame, t);
+		__m256 levelScale = packetLevelScale(level);
+		__m256 tstep = _mm256_mul_ps(_mm256_set1_ps(frame.tstep), levelScale);
+
+		// skip empty macro cells, lanes in an empty cell jump to the first sample after it
+		__m256 tExit;
+		__m256 skip = packetSkipMacroCell(frame, rays, level, rayX, rayY, rayZ, active, false, tExit);
+		if (_mm256_movemask_ps(skip)) {
+			__m256 samples = _mm256_max_ps(_mm256_set1_ps(1.0f), _mm256_ceil_ps(_mm256_div_ps(_mm256_sub_ps(t, tExit), tstep)));
+			t = _mm256_blendv_ps(t, _mm256_sub_ps(t, _mm256_mul_ps(samples, tstep)), skip);
+		}
+		__m256 sampling = _mm256_andnot_ps(skip, active);
+		if (_mm256_movemask_ps(sampling)) {
+			sum = _mm256_fmadd_ps(_mm256_and_ps(sampling, packetSampleFiltered(frame, level, sampling, rayX, rayY, rayZ)), levelScale, sum);
+			t = _mm256_blendv_ps(t, _mm256_sub_ps(t, tstep), sampling);
+		}
+		active = _mm256_and_ps(active, _mm256_cmp_ps(t, rays.tnear, _CMP_GE_OQ));
+	}
+	return _mm256_mul_ps(sum, _mm256_set1_ps(frame.brightness));
+}
+
+// marchComposite() for the packet, a lane stops at its own termination
+inline void packetComposite(const RenderHostFrame& frame, const RayPacket& rays, __m256* rgba) {
+	__m256 one = _mm256_set1_ps(1.0f), terminationOpacity = _mm256_set1_ps(frame.terminationOpacity);
+	__m256 t = _mm256_add_ps(rays.tnear, _mm256_set1_ps(frame.jitter * frame.tstep));
+	__m256 active = _mm256_and_ps(rays.hit, _mm256_cmp_ps(t, rays.tfar, _CMP_LE_OQ));
+	rgba[0] = rgba[1] = rgba[2] = rgba[3] = _mm256_setzero_ps();
+	while (_mm256_movemask_ps(active)) {
+		__m256 rayX = _mm256_add_ps(rays.oX, _mm256_mul_ps(rays.dX, t));
+		__m256 rayY = _mm256_add_ps(rays.oY, _mm256_mul_ps(rays.dY, t));
+		__m256 rayZ = _mm256_add_ps(rays.oZ, _mm256_mul_ps(rays.dZ, t));
+		__m256i level = packetLodLevel(frame, t);
+		__m256 tstep = _mm256_mul_ps(_mm256_set1_ps(frame.tstep), packetLevelScale(level));
+
+		// skip transparent macro cells
+		__m256 tExit;
+		__m256 skip = packetSkipMacroCell(frame, rays, level, rayX, rayY, rayZ, active, true, tExit);
+		if (_mm256_movemask_ps(skip)) {
+			__m256 samples = _mm256_max_ps(one, _mm256_ceil_ps(_mm256_div_ps(_mm256_sub_ps(tExit, t), tstep)));
+			t = _mm256_blendv_ps(t, _mm256_add_ps(t, _mm256_mul_ps(samples, tstep)), skip);
+		}
+		__m256 sampling = _mm256_andnot_ps(skip, active);
+		if (_mm256_movemask_ps(sampling)) {
+			__m256 value[4];
+			packetTransferFunction(*frame.transferFunction, packetSampleFiltered(frame, level, sampling, rayX, rayY, rayZ), value);
+			if (frame.shading) {
+				__m256 shading = _mm256_and_ps(sampling, _mm256_cmp_ps(value[3], _mm256_setzero_ps(), _CMP_GT_OQ));
+				if (_mm256_movemask_ps(shading))
+					packetShade(frame, rays, level, shading, rayX, rayY, rayZ, value);
+			}
+			if (frame.pyramid) {
+				__m256 transparency = _mm256_sub_ps(one, value[3]);
+				for (int l = 1; l < (int) frame.pyramid->levelCount; l++)
+					transparency = _mm256_blendv_ps(transparency, _mm256_mul_ps(transparency, transparency), _mm256_castsi256_ps(_mm256_cmpgt_epi32(level, _mm256_set1_epi32(l - 1))));
+				value[3] = _mm256_blendv_ps(value[3], _mm256_sub_ps(one, transparency), _mm256_castsi256_ps(_mm256_cmpgt_epi32(level, _mm256_setzero_si256())));
+			}
+			__m256 weight = _mm256_and_ps(sampling, _mm256_mul_ps(_mm256_sub_ps(one, rgba[3]), value[3]));
+			for (int c = 0; c < 3; c++)
+				rgba[c] = _mm256_add_ps(rgba[c], _mm256_mul_ps(weight, value[c]));
+			rgba[3] = _mm256_add_ps(rgba[3], weight);
+			t = _mm256_blendv_ps(t, _mm256_add_ps(t, tstep), sampling);
+		}
+		active = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(t, rays.tfar, _CMP_LE_OQ), _mm256_cmp_ps(rgba[3], terminationOpacity, _CMP_LE_OQ)));
+	}
+}
+
+// Same as renderRay() for the 8 rendered pixels (x, y), ..., (x + 7, y)
+void renderPacket(const RenderHostFrame& frame, std::size_t x, std::size_t y) {
+	RayPacket rays;
+	packetRays(frame, x, y, rays);
+	__m256 rgba[4];
+	if (frame.mode == RENDER_SUM) {
+		rgba[0] = rgba[1] = rgba[2] = packetSum(frame, rays);
+		rgba[3] = _mm256_set1_ps(1.0f);
+	} else {
+		packetComposite(frame, rays, rgba);
+	}
+
+	// interleave the channels
+	float channels[4][8];
+	for (int c = 0; c < 4; c++)
+		_mm256_storeu_ps(channels[c], rgba[c]);
+	for (int i = 0; i < 8; i++) {
+		float* output = outputPixel(frame, x + i, y);
+		for (int c = 0; c < 4; c++)
+			output[c] = channels[c][i];
+	}
+}
+const std::size_t renderPacketSize = 8;
+#else
+void renderPacket(const RenderHostFrame& frame, std::size_t x, std::size_t y) {
+	renderRay(frame, x, y, outputPixel(frame, x, y));
+}
+const std::size_t renderPacketSize = 1;
+#endif
+
+// The image is split into tiles of renderTileX x renderTileY pixels. Every
+// thread starts with a contiguous range of tiles, takes tiles from the front
+// of its own range and, once it is empty, steals from the back of the ranges
+// of the other threads, so that threads with cheap tiles (rays missing the
+// volume) help the others.
+const std::size_t renderTileX = 32;
+const std::size_t renderTileY = 8;
+
+struct RenderTileRange {
+	boost::mutex mutex;
+	std::size_t begin;
+	std::size_t end;
+};
+
+bool renderNextTile(RenderTileRange& range, bool steal, std::size_t& tile) {
+	boost::mutex::scoped_lock lock(range.mutex);
+	if (range.begin >= range.end)
+		return false;
+	tile = steal ? --range.end : range.begin++;
+	return true;
+}
+
+void renderTile(const RenderHostFrame& frame, std::size_t tile) {
+	std::size_t tilesX = (renderCountX(frame) + renderTileX - 1) / renderTileX;
+	std::size_t x0 = tile % tilesX * renderTileX, x1 = std::min(renderCountX(frame), x0 + renderTileX);
+	std::size_t y0 = tile / tilesX * renderTileY, y1 = std::min(renderCountY(frame), y0 + renderTileY);
+	for (std::size_t y = y0; y < y1; y++) {
+		std::size_t x = x0;
+		for (; x + renderPacketSize <= x1; x += renderPacketSize)
+			renderPacket(frame, x, y);
+		for (; x < x1; x++)
+			renderRay(frame, x, y, outputPixel(frame, x, y));
+	}
+}
+
+void renderHostThread(const RenderHostFrame* frame, RenderTileRange* ranges, std::size_t threadCount, std::size_t thread) {
+	std::size_t tile;
+	while (renderNextTile(ranges[thread], false, tile))
+		renderTile(*frame, tile);
+	for (std::size_t i = 1; i < threadCount; i++)
+		while (renderNextTile(ranges[(thread + i) % threadCount], true, tile))
+			renderTile(*frame, tile);
+}
+
+void renderHost(const RenderHostFrame& frame, std::size_t threadCount) {
+	std::size_t tileCount = (renderCountX(frame) + renderTileX - 1) / renderTileX * ((renderCountY(frame) + renderTileY - 1) / renderTileY);
+	boost::scoped_array<RenderTileRange> ranges(new RenderTileRange[threadCount]);
+	for (std::size_t t = 0; t < threadCount; t++) {
+		ranges[t].begin = tileCount * t / threadCount;
+		ranges[t].end = tileCount * (t + 1) / threadCount;
+	}
+	boost::thread_group threads;
+	for (std::size_t t = 1; t < threadCount; t++)
+		threads.create_thread(boost::bind(renderHostThread, &frame, ranges.get(), threadCount, t));
+	renderHostThread(&frame, ranges.get(), threadCount, 0);
+	threads.join_all();
+}
+
+std::size_t renderThreadCount() {
+	return std::max(1u, boost::thread::hardware_concurrency());
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Variables used by render function
 //////////////////////////////////////////////////////////////////////////////
@@ -180,11 +1683,38 @@ cl::CommandQueue queue;
 cl::Buffer d_output;
 cl::Buffer d_invViewMatrix;
 cl::Image3D d_input;
+cl::Buffer d_macroCells;
+cl::Image2D d_transferFunction;
+cl::Buffer d_brickTable;
+cl::Image3D d_pyramid;
 cl::Kernel renderKernel;
 std::size_t outX;
 std::size_t outY;
 std::size_t sizeOutput;
 const float* h_input;
+BrickedVolume h_inputBricks; // in streaming mode the bricks of the current frame
+bool streaming = false;
+boost::scoped_ptr<BrickReader> brickReader;
+std::vector<float> brickMinMax; // (min, max) of the macro cells sampled from each brick
+boost::scoped_ptr<BrickCache> brickCache;
+boost::scoped_ptr<DeviceBrickCache> deviceBrickCache;
+MacroCellGrid macroCells;
+MipPyramid mipPyramid; // only level 0 in streaming mode
+const int lodInteractionBias = 1; // while rotating
+// Progressive refinement: after the view changes, a preview with every
+// previewPixelStep-th pixel (and previewLodBias), then full resolution passes
+// with jittered samples which are averaged until progressivePasses are done
+const std::size_t previewPixelStep = 4;
+const int previewLodBias = 2;
+const std::size_t progressivePasses = 16;
+std::size_t progressivePass = 0; // 0: preview, 1 to progressivePasses: refinement
+float progressiveAlpha = 0; // view of the passes
+std::vector<float> h_accumulationCpu;
+std::vector<float> h_accumulationGpu;
+TransferFunction transferFunction;
+RenderMode renderMode = RENDER_COMPOSITE;
+SampleFilter sampleFilter = FILTER_LINEAR;
+const float terminationOpacity = 0.99f;
 std::vector<float> h_outputCpu;
 std::vector<float> h_outputGpu;
 cl::Event copyToDev;
@@ -195,32 +1725,52 @@ std::size_t countZ;
 GLuint pbo = 0;
 bool animate = true;
 float alpha = 0; // Current angle
+float alphaStep = 0.03f; // per frame
 
 //////////////////////////////////////////////////////////////////////////////
-// Main function
+// Volume loading self test
 //////////////////////////////////////////////////////////////////////////////
-int main(int argc, char** argv) {
-	outX = 1024;
-	outY = 768;
-
-	ASSERT(runCpu || runGpu);
-	ASSERT(runGpu || !displayGpu);
-	ASSERT(runCpu || displayGpu);
-
-	// Load input data
-	//TODO: Run the code with different input files
-	boost::shared_ptr<Volume> volumeFile = HDF5::matlabDeserialize<Volume> ("rpi-16.hdf5");
-	//boost::shared_ptr<Volume> volumeFile = HDF5::matlabDeserialize<Volume> ("/usr/local.nfs/pas/teaching/gpulab/2016-1/rpi-2.hdf5");
-	boost::shared_ptr<const Math::Array<float, 3> > volumeData = volumeFile->transformedTransposedVolume ();
-	countX = volumeData->size<0> ();
-	countY = volumeData->size<1> ();
-	countZ = volumeData->size<2> ();
-	h_input = volumeData->data ();
+// transformedTransposedVolume() copies and scales in tiles on several threads
+// unless x is stored first. lazyTransformedVolume() reads the same values
+// through the strides of the reordered view without a copy, so it is the
+// reference for the copy.
+void checkTransformedVolume(const Volume& volume, const Math::Array<CTFloat, 3>& data) {
+	Volume::LazyVolume lazy = volume.lazyTransformedVolume();
+	std::size_t countX = lazy.size<0>(), countY = lazy.size<1>(), countZ = lazy.size<2>();
+	ASSERT(data.size<0>() == countX && data.size<1>() == countY && data.size<2>() == countZ);
+	for (std::size_t z = 0; z < countZ; z++)
+		for (std::size_t y = 0; y < countY; y++)
+			for (std::size_t x = 0; x < countX; x++)
+				ASSERT(data.data()[x + countX * (y + countY * z)] == lazy(x, y, z));
+}
 
-	// Calculate some values
-	countOutput = outX * outY;
-	sizeOutput = countOutput * sizeof (float);
+// All mirrored and permuted storage orders of a small scaled volume whose
+// size is not a multiple of the tile size
+void checkVolumeTransform() {
+	const std::size_t shape[3] = { 37, 21, 18 };
+	Volume volume;
+	volume.Volume.recreate(shape);
+	for (std::size_t i = 0; i < shape[0] * shape[1] * shape[2]; i++)
+		volume.Volume.data()[i] = (CTFloat) i;
+	volume.VolumeScalingFactor = 0.5;
+	const int32_t permutations[6][3] = { { 1, 2, 3 }, { 1, 3, 2 }, { 2, 1, 3 }, { 2, 3, 1 }, { 3, 1, 2 }, { 3, 2, 1 } };
+	for (int p = 0; p < 6; p++) {
+		for (int mirrored = 0; mirrored < 8; mirrored++) {
+			std::vector<int32_t> order(3);
+			for (int i = 0; i < 3; i++)
+				order[i] = mirrored >> i & 1 ? -permutations[p][i] : permutations[p][i];
+			volume.VolumeStorageOrder = order;
+			checkTransformedVolume(volume, *volume.transformedTransposedVolume());
+		}
+	}
+	std::cout << "Volume transform: all 48 storage orders correct" << std::endl;
+}
 
+//////////////////////////////////////////////////////////////////////////////
+// Main function
+//////////////////////////////////////////////////////////////////////////////
+// Window, callbacks and PBO
+void initGL(int& argc, char** argv) {
 	// initialize GLUT
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
@@ -255,6 +1805,110 @@ int main(int argc, char** argv) {
 	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
 	glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, sizeOutput, 0, GL_STREAM_DRAW_ARB);
 	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+}
+
+// The next optional argument after argument i of a mode (stream / headless /
+// benchmark / selftest), NULL if the next argument is the next mode or there
+// is none
+const char* modeArgument(int argc, char** argv, int& i) {
+	if (i + 1 >= argc || std::string(argv[i + 1]) == "stream" || std::string(argv[i + 1]) == "headless" || std::string(argv[i + 1]) == "benchmark" || std::string(argv[i + 1]) == "selftest")
+		return NULL;
+	return argv[++i];
+}
+
+int main(int argc, char** argv) {
+	outX = 1024;
+	outY = 768;
+	ASSERT(outX % (16 * previewPixelStep) == 0 && outY % (16 * previewPixelStep) == 0); // work group size of the preview
+
+	ASSERT(runCpu || runGpu);
+	ASSERT(runGpu || !displayGpu);
+	ASSERT(runCpu || displayGpu);
+
+	// Arguments: [device] [stream [file] [host cache MB] [device cache MB]] [headless [frames] [check]] [benchmark [samples]] [selftest]
+	std::string inputFile = "rpi-16.hdf5";
+	std::size_t hostCacheSize = (std::size_t) 1024 * 1024 * 1024;
+	std::size_t deviceCacheSize = (std::size_t) 512 * 1024 * 1024;
+	std::size_t headlessFrames = 0;
+	std::size_t benchmarkSamples = 0;
+	for (int i = 2; i < argc; i++) {
+		std::string mode = argv[i];
+		if (mode == "stream") {
+			streaming = true;
+			if (const char* arg = modeArgument(argc, argv, i))
+				inputFile = arg;
+			if (const char* arg = modeArgument(argc, argv, i))
+				hostCacheSize = atoi(arg) * (std::size_t) 1024 * 1024;
+			if (const char* arg = modeArgument(argc, argv, i))
+				deviceCacheSize = atoi(arg) * (std::size_t) 1024 * 1024;
+		} else if (mode == "headless") {
+			headless = true;
+			animate = false; // full detail
+			headlessFrames = 36;
+			checkResults = false;
+			while (const char* arg = modeArgument(argc, argv, i)) {
+				if (std::string(arg) == "check")
+					checkResults = true;
+				else
+					headlessFrames = atoi(arg);
+			}
+			ASSERT(headlessFrames > 0);
+		} else if (mode == "benchmark") {
+			benchmark = true;
+			benchmarkSamples = 1 << 20;
+			if (const char* arg = modeArgument(argc, argv, i))
+				benchmarkSamples = atoi(arg);
+			ASSERT(benchmarkSamples > 0);
+		} else if (mode == "selftest") {
+			selfTest = true;
+		} else {
+			std::cerr << "Unknown argument '" << mode << "'" << std::endl;
+			return 1;
+		}
+	}
+
+	// Load input data
+	//TODO: Run the code with different input files
+	//boost::shared_ptr<Volume> volumeFile = HDF5::matlabDeserialize<Volume> ("/usr/local.nfs/pas/teaching/gpulab/2016-1/rpi-2.hdf5");
+	boost::shared_ptr<const Math::Array<float, 3> > volumeData;
+	if (selfTest)
+		checkVolumeTransform();
+	if (streaming) {
+		// Only the metadata is loaded here, the data is read brick by brick
+		brickReader.reset(new BrickReader(HDF5::matlabDeserialize<VolumeD> (inputFile)));
+		countX = brickReader->count[0];
+		countY = brickReader->count[1];
+		countZ = brickReader->count[2];
+		float maxValue;
+		scanBricks(*brickReader, macroCells, brickMinMax, maxValue);
+		buildTransferFunction(maxValue, transferFunction);
+		mipPyramid.levelCount = 1;
+		brickCache.reset(new BrickCache(*brickReader, std::max((std::size_t) 1, hostCacheSize / (brickVoxels * sizeof (float)))));
+		std::cout << "Streaming " << countX << "x" << countY << "x" << countZ << " voxels in " << brickReader->brickCount() << " bricks, host cache " << brickCache->slotCount() << " bricks" << std::endl;
+	} else {
+		boost::shared_ptr<Volume> volumeFile = HDF5::matlabDeserialize<Volume> (inputFile);
+		volumeData = volumeFile->transformedTransposedVolume ();
+		if (selfTest)
+			checkTransformedVolume(*volumeFile, *volumeData);
+		countX = volumeData->size<0> ();
+		countY = volumeData->size<1> ();
+		countZ = volumeData->size<2> ();
+		h_input = volumeData->data ();
+		buildBrickedVolume(h_input, countX, countY, countZ, h_inputBricks);
+		buildMacroCellGrid(h_input, countX, countY, countZ, macroCells);
+		buildTransferFunction(*std::max_element(h_input, h_input + countX * countY * countZ), transferFunction);
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		buildMipPyramid(h_input, countX, countY, countZ, mipPyramid, renderThreadCount());
+		addMacroCellLevels(mipPyramid, macroCells);
+		std::cout << "Mip pyramid with " << mipPyramid.levelCount << " levels, time " << (Core::getCurrentTime() - time1) << std::endl;
+	}
+
+	// Calculate some values
+	countOutput = outX * outY;
+	sizeOutput = countOutput * 4 * sizeof (float); // RGBA
+
+	if (!headless && !benchmark)
+		initGL(argc, argv);
 
 	// Create a context
 	//context = cl::Context(CL_DEVICE_TYPE_GPU);
@@ -273,7 +1927,7 @@ int main(int argc, char** argv) {
 	}
 	cl_context_properties prop[4] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[platformId] (), 0, 0 };
 	std::cout << "Using platform '" << platforms[platformId].getInfo<CL_PLATFORM_NAME>() << "' from '" << platforms[platformId].getInfo<CL_PLATFORM_VENDOR>() << "'" << std::endl;
-	cl::Context context(CL_DEVICE_TYPE_GPU, prop);
+	context = cl::Context(CL_DEVICE_TYPE_GPU, prop);
 
 	// Get a device of the context
 	int deviceNr = argc < 2 ? 1 : atoi(argv[1]);
@@ -291,29 +1945,63 @@ int main(int argc, char** argv) {
 	// Load the source code
 	cl::Program program = OpenCL::loadProgramSource(context, "src/OpenCLExercise5_VolumeRendering.cl");
 	// Compile the source code. This is similar to program.build(devices) but will print more detailed error messages
-	OpenCL::buildProgram(program, devices);
+	OpenCL::buildProgram(program, devices, "-DMACRO_CELL_SIZE=" + boost::lexical_cast<std::string>(macroCellSize) + " -DBRICK_SIZE=" + boost::lexical_cast<std::string>(brickSize) + " -DPYRAMID_PADDING=" + boost::lexical_cast<std::string>(pyramidPadding));
 
 	// Allocate space for output data from CPU and GPU on the host
-	h_outputCpu.resize (countOutput);
-	h_outputGpu.resize (countOutput);
+	h_outputCpu.resize (4 * countOutput);
+	h_outputGpu.resize (4 * countOutput);
 
 	// Allocate space for input and output data on the device
-	//TODO d_output = cl::Buffer(...);
-	//TODO d_invViewMatrix = cl::Buffer(...);
-	//TODO d_input = cl::Image3D(...);
+	d_output = cl::Buffer(context, CL_MEM_READ_WRITE, sizeOutput);
+	d_invViewMatrix = cl::Buffer(context, CL_MEM_READ_ONLY, 16 * sizeof (float));
+	if (streaming) {
+		deviceBrickCache.reset(new DeviceBrickCache(context, device, brickReader->brickCount(), std::max((std::size_t) 1, deviceCacheSize / (brickVoxels * sizeof (float)))));
+		std::cout << "Device cache " << deviceBrickCache->slotCount() << " bricks" << std::endl;
+	} else {
+		d_input = cl::Image3D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_FLOAT), countX, countY, countZ);
+		d_brickTable = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof (cl_int)); // not used
+	}
+	std::vector<float> h_pyramid;
+	std::size_t pyramidSize[3];
+	packMipPyramid(mipPyramid, h_pyramid, pyramidSize);
+	d_pyramid = cl::Image3D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_FLOAT), pyramidSize[0], pyramidSize[1], pyramidSize[2]);
+	d_macroCells = cl::Buffer(context, CL_MEM_READ_ONLY, macroCells.minMax.size() * sizeof (float));
+	d_transferFunction = cl::Image2D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT), transferFunctionSize, 1);
 
 	// Initialize memory to 0xff (useful for debugging because otherwise GPU memory will contain information from last execution)
 	memset(h_outputCpu.data(), 255, sizeOutput);
 	memset(h_outputGpu.data(), 255, sizeOutput);
-	//TODO GPU
+	queue.enqueueWriteBuffer(d_output, true, 0, sizeOutput, h_outputGpu.data());
 
 	// Create a kernel object
-	//TODO
+	renderKernel = cl::Kernel(program, "renderKernel");
 
 	// Copy input data to device
-	//TODO
+	cl::size_t<3> origin;
+	if (!streaming) {
+		cl::size_t<3> region;
+		region[0] = countX;
+		region[1] = countY;
+		region[2] = countZ;
+		queue.enqueueWriteImage(d_input, true, origin, region, countX * sizeof (float), countX * countY * sizeof (float), (void*) h_input, NULL, &copyToDev);
+	}
+	cl::size_t<3> pyramidRegion;
+	for (int i = 0; i < 3; i++)
+		pyramidRegion[i] = pyramidSize[i];
+	queue.enqueueWriteImage(d_pyramid, true, origin, pyramidRegion, pyramidSize[0] * sizeof (float), pyramidSize[0] * pyramidSize[1] * sizeof (float), h_pyramid.data());
+	queue.enqueueWriteBuffer(d_macroCells, true, 0, macroCells.minMax.size() * sizeof (float), macroCells.minMax.data());
+	cl::size_t<3> transferFunctionRegion;
+	transferFunctionRegion[0] = transferFunctionSize;
+	transferFunctionRegion[1] = 1;
+	transferFunctionRegion[2] = 1;
+	queue.enqueueWriteImage(d_transferFunction, true, origin, transferFunctionRegion, transferFunctionSize * 4 * sizeof (float), 0, transferFunction.rgba.data());
 
-	glutMainLoop ();
+	if (benchmark)
+		benchmarkSamplers(program, benchmarkSamples);
+	else if (headless)
+		renderHeadless(headlessFrames);
+	else
+		glutMainLoop ();
 
 	return 0;
 }
@@ -321,66 +2009,302 @@ int main(int argc, char** argv) {
 //////////////////////////////////////////////////////////////////////////////
 // Render function
 //////////////////////////////////////////////////////////////////////////////
-void render () {
+// Write the RGB channels of an RGBA image
+void writeImageRGBA(const char* filename, const std::vector<float>& rgba, std::size_t width, std::size_t height) {
+	std::vector<float> rgb(3 * width * height);
+	for (std::size_t i = 0; i < width * height; i++)
+		for (int c = 0; c < 3; c++)
+			rgb[3 * i + c] = rgba[4 * i + c];
+	std::vector<uint8_t> data;
+	Core::imageFloatToByte(rgb, data);
+	Core::writeImagePPM(filename, data, width, height);
+}
+
+// Writes images from a background thread, so that rendering does not wait
+// for the conversion and the disk. write() blocks while maxQueued images
+// are waiting.
+class ImageWriter {
+	struct Image {
+		std::string filename;
+		std::vector<float> rgba;
+		bool gray;
+	};
+	std::size_t width, height, maxQueued;
+	std::deque<Image> images;
+	boost::mutex mutex;
+	boost::condition_variable changed;
+	bool stop;
+	boost::thread thread;
+
+	void writer() {
+		boost::mutex::scoped_lock lock(mutex);
+		for (;;) {
+			while (!stop && images.empty())
+				changed.wait(lock);
+			if (images.empty())
+				return;
+			Image image;
+			image.filename.swap(images.front().filename);
+			image.rgba.swap(images.front().rgba);
+			image.gray = images.front().gray;
+			images.pop_front();
+			changed.notify_all();
+			lock.unlock();
+			if (image.gray) {
+				std::vector<float> gray(width * height);
+				for (std::size_t i = 0; i < width * height; i++)
+					gray[i] = image.rgba[4 * i];
+				Core::writeImagePGM(image.filename, gray, width, height);
+			} else {
+				writeImageRGBA(image.filename.c_str(), image.rgba, width, height);
+			}
+			lock.lock();
+		}
+	}
+
+public:
+	ImageWriter(std::size_t width, std::size_t height, std::size_t maxQueued) : width(width), height(height), maxQueued(maxQueued), stop(false) {
+		thread = boost::thread(boost::bind(&ImageWriter::writer, this));
+	}
+	// Writes the remaining images
+	~ImageWriter() {
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			stop = true;
+			changed.notify_all();
+		}
+		thread.join();
+	}
+
+	// Write the RGBA image as PGM (the R channel, if gray) or as PPM
+	void write(const std::string& filename, const std::vector<float>& rgba, bool gray) {
+		boost::mutex::scoped_lock lock(mutex);
+		while (images.size() >= maxQueued)
+			changed.wait(lock);
+		images.push_back(Image());
+		images.back().filename = filename;
+		images.back().rgba = rgba;
+		images.back().gray = gray;
+		changed.notify_all();
+	}
+};
+
+// Van der Corput sequence 0, 1/2, 1/4, 3/4, 1/8, ...: the jitter of
+// refinement pass i + 1, every prefix of it covers [0, 1) evenly
+inline float radicalInverse(std::size_t i) {
+	float value = 0;
+	for (float digit = 0.5f; i; i >>= 1, digit *= 0.5f)
+		if (i & 1)
+			value += digit;
+	return value;
+}
+
+// Fill every pixel of a preview with the rendered pixel of its block
+void fillPreview(std::vector<float>& rgba, std::size_t width, std::size_t height, std::size_t pixelStep) {
+	for (std::size_t y = 0; y < height; y++)
+		for (std::size_t x = 0; x < width; x++)
+			for (int c = 0; c < 4; c++)
+				rgba[4 * (x + y * width) + c] = rgba[4 * (x - x % pixelStep + (y - y % pixelStep) * width) + c];
+}
+
+// Add refinement pass number pass (1, 2, ...) to accumulation and replace
+// output by the mean of all passes so far
+void accumulatePass(std::vector<float>& accumulation, std::vector<float>& output, std::size_t pass) {
+	if (pass == 1)
+		accumulation = output;
+	else
+		for (std::size_t i = 0; i < output.size(); i++)
+			accumulation[i] += output[i];
+	for (std::size_t i = 0; i < output.size(); i++)
+		output[i] = accumulation[i] / pass;
+}
+
+// Draw the image in the PBO
+void drawOutput() {
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_DEPTH_TEST);
+	glRasterPos2i(0, 0);
+	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
+	glDrawPixels(outX, outY, GL_RGBA, GL_FLOAT, 0);
+	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+	// flip backbuffer to screen
+	glutSwapBuffers();
+}
+
+void viewMatrix(float alpha, float* invViewMatrix) {
 	float s = std::sin(alpha);
 	float c = std::cos(alpha);
 	float dist = 1.0f * std::max(countX, std::max(countY, countZ));
-	float invViewMatrix[16] = {
+	float matrix[16] = {
 		c*1.0f, 0.0f, -s*1.0f, -s*dist + countX/2.0f,
 		0.0f, 1.0f, 0.0f, countY/2.0f,
 		s*1.0f, 0.0f, c*1.0f, c*dist + countZ/2.0f,
 		0.0f, 0.0f, 0.0f, 1.0f
 	};
+	std::copy(matrix, matrix + 16, invViewMatrix);
+}
+
+void render () {
+	// Progressive refinement: start over with a preview when the view has
+	// changed, once all passes are done only the result is drawn again
+	if (progressive && alpha != progressiveAlpha) {
+		progressivePass = 0;
+		progressiveAlpha = alpha;
+	}
+	if (progressive && progressivePass > progressivePasses) {
+		if (!headless)
+			drawOutput();
+		return;
+	}
+	bool preview = progressive && progressivePass == 0;
+	std::size_t pixelStep = preview ? previewPixelStep : 1;
+	float jitter = progressive && !preview ? radicalInverse(progressivePass - 1) : 0;
+
+	float invViewMatrix[16];
+	viewMatrix(alpha, invViewMatrix);
 	float tstep = 1;
 	float brightness = 0.2f * tstep / std::max(countX, std::max(countY, countZ));
+	float maxError = 1e-2;
 
-	// Do calculation on the host side
-	if (runCpu) {
-		renderHost(h_input, h_outputCpu, countX, countY, countZ, outX, outY, invViewMatrix, tstep, brightness);
+	// Macro cells whose values are all in [skipMin, skipThreshold] are
+	// skipped. For RENDER_SUM these are the values of magnitude at most
+	// skipThreshold: a ray takes at most diagonal / tstep + 1 samples, so this
+	// changes no output value by more than maxError / 2. For RENDER_COMPOSITE
+	// the skipped cells are transparent. The kernel derives skipMin the same
+	// way from the render mode.
+	float diagonal = std::sqrt((float) (countX * countX + countY * countY + countZ * countZ));
+	float skipThreshold = -std::numeric_limits<float>::infinity();
+	if (skipEmptySpace)
+		skipThreshold = renderMode == RENDER_SUM ? maxError / 2 / ((diagonal / tstep + 1) * brightness) : transferFunctionTransparentBelow(transferFunction);
+	float skipMin = renderMode == RENDER_SUM ? -skipThreshold : -std::numeric_limits<float>::infinity();
+
+	// Level of detail: coarser levels while rotating, the next frame after
+	// the rotation stops is rendered at full detail again
+	const MipPyramid* pyramid = useLod && mipPyramid.levelCount > 1 ? &mipPyramid : NULL;
+	float lodScale = 1.0f / (std::min(outX, outY) - 1);
+	int lodBias = preview ? previewLodBias : animate ? lodInteractionBias : 0;
+
+	// Streaming: make the bricks of this frame resident, then let the
+	// loader read the bricks of the next frame in the background
+	std::vector<std::size_t> bricks;
+	if (streaming) {
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		visibleBricks(*brickReader, brickMinMax, sampleFilter, skipMin, skipThreshold, invViewMatrix, bricks);
+		std::size_t missing = brickCache->acquire(bricks, h_inputBricks);
+		std::cout << "Bricks: " << bricks.size() << " visible, " << missing << " not in the host cache, time " << (Core::getCurrentTime() - time1) << std::endl;
+		if (animate || headless) {
+			float nextViewMatrix[16];
+			viewMatrix(alpha + alphaStep, nextViewMatrix);
+			std::vector<std::size_t> nextBricks;
+			visibleBricks(*brickReader, brickMinMax, sampleFilter, skipMin, skipThreshold, nextViewMatrix, nextBricks);
+			brickCache->prefetch(nextBricks);
+		}
+	}
+
+	// Do calculation on the host side, unless only the GPU image is used
+	// (e.g. headless without check)
+	bool renderCpu = runCpu && (checkResults || !displayGpu);
+	Core::TimeSpan cpuTime = Core::TimeSpan::fromSeconds(0);
+	if (renderCpu) {
+		Core::TimeSpan time1 = Core::getCurrentTime();
+		RenderHostFrame frame = { h_input, useBricks || streaming ? &h_inputBricks : NULL, h_outputCpu.data(), countX, countY, countZ, outX, outY, invViewMatrix, tstep, brightness, &macroCells, skipMin, skipThreshold, renderMode, &transferFunction, terminationOpacity, pyramid, lodScale, lodBias, pixelStep, jitter, sampleFilter, useShading };
+		renderHost(frame, renderThreadCount());
+		cpuTime = Core::getCurrentTime() - time1;
 	}
 
 	cl::Event kernelExecution;
 	if (runGpu) {
 		// Copy invViewMatrix to GPU
-		//TODO
+		queue.enqueueWriteBuffer(d_invViewMatrix, true, 0, 16 * sizeof (float), invViewMatrix);
+
+		cl_int4 volumeSize = { { (cl_int) countX, (cl_int) countY, (cl_int) countZ, streaming } };
+		if (streaming) {
+			std::size_t missing = deviceBrickCache->update(queue, bricks, h_inputBricks);
+			if (missing)
+				std::cout << "Bricks: " << missing << " not on the device" << std::endl;
+		}
 
 		// Call the kernel
-		//TODO
+		renderKernel.setArg<cl::Image3D>(0, streaming ? deviceBrickCache->atlas : d_input);
+		renderKernel.setArg<cl::Buffer>(1, d_output);
+		renderKernel.setArg<cl::Buffer>(2, d_invViewMatrix);
+		renderKernel.setArg<cl_float>(3, tstep);
+		renderKernel.setArg<cl_float>(4, brightness);
+		renderKernel.setArg<cl::Buffer>(5, d_macroCells);
+		renderKernel.setArg<cl_uint>(6, macroCells.cellsX);
+		renderKernel.setArg<cl_uint>(7, macroCells.cellsY);
+		renderKernel.setArg<cl_uint>(8, macroCells.cellsZ);
+		renderKernel.setArg<cl_float>(9, skipThreshold);
+		renderKernel.setArg<cl_int>(10, renderMode);
+		renderKernel.setArg<cl::Image2D>(11, d_transferFunction);
+		renderKernel.setArg<cl_float>(12, transferFunction.minValue);
+		renderKernel.setArg<cl_float>(13, transferFunction.maxValue);
+		renderKernel.setArg<cl_float>(14, terminationOpacity);
+		renderKernel.setArg<cl::Buffer>(15, streaming ? deviceBrickCache->table : d_brickTable);
+		renderKernel.setArg<cl_int4>(16, volumeSize);
+		renderKernel.setArg<cl::Image3D>(17, d_pyramid);
+		renderKernel.setArg<cl_int>(18, pyramid ? pyramid->levelCount : 1);
+		renderKernel.setArg<cl_float>(19, lodScale);
+		renderKernel.setArg<cl_int>(20, lodBias);
+		renderKernel.setArg<cl_uint>(21, pixelStep);
+		renderKernel.setArg<cl_float>(22, jitter);
+		renderKernel.setArg<cl_int>(23, sampleFilter);
+		renderKernel.setArg<cl_int>(24, useShading);
+		queue.enqueueNDRangeKernel(renderKernel, cl::NullRange, cl::NDRange(outX / pixelStep, outY / pixelStep), cl::NDRange(16, 16), NULL, &kernelExecution);
 
 		// Copy output data back to host
-		//TODO
+		queue.enqueueReadBuffer(d_output, true, 0, sizeOutput, h_outputGpu.data());
 	}
 
-	// map the PBO to copy the data into it
-	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
-	// map the buffer object into client's memory
-	float* ptr = (float*)glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
-	ASSERT (ptr);
-	memcpy(ptr, displayGpu ? h_outputGpu.data() : h_outputCpu.data(), sizeOutput);
-	glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB);
+	if (progressive) {
+		if (preview) {
+			fillPreview(h_outputCpu, outX, outY, pixelStep);
+			fillPreview(h_outputGpu, outX, outY, pixelStep);
+		} else {
+			accumulatePass(h_accumulationCpu, h_outputCpu, progressivePass);
+			accumulatePass(h_accumulationGpu, h_outputGpu, progressivePass);
+		}
+		std::cout << (preview ? "Preview" : "Refinement pass " + boost::lexical_cast<std::string>(progressivePass)) << std::endl;
+		progressivePass++;
+	}
+
+	if (!headless) {
+		// map the PBO to copy the data into it
+		glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
+		// map the buffer object into client's memory
+		float* ptr = (float*)glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+		ASSERT (ptr);
+		memcpy(ptr, displayGpu ? h_outputGpu.data() : h_outputCpu.data(), sizeOutput);
+		glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB);
+	}
 
 	if (writeImages) {
-		Core::writeImagePGM("output_volume_cpu.pgm", h_outputCpu, outX, outY);
-		Core::writeImagePGM("output_volume_gpu.pgm", h_outputGpu, outX, outY);
+		writeImageRGBA("output_volume_cpu.ppm", h_outputCpu, outX, outY);
+		writeImageRGBA("output_volume_gpu.ppm", h_outputGpu, outX, outY);
 	}
 
 	// Print performance data
-	//TODO
+	if (renderCpu)
+		std::cout << "CPU time: " << cpuTime << std::endl;
+	if (runGpu)
+		std::cout << "GPU time: " << OpenCL::getElapsedTime(kernelExecution) << std::endl;
 
-	if (runCpu && runGpu) {
+	if (renderCpu && runGpu && checkResults) {
 		// Check whether results are correct
-		float maxError = 1e-2;
 		std::size_t errorCount = 0;
 		for (size_t y = 0; y < outY; y++) {
 			for (size_t x = 0; x < outX; x++) {
-				size_t index = x + y * outX;
-				// Allow small differences between CPU and GPU results (due to different rounding behavior)
-				if (!(std::abs (h_outputCpu[index] - h_outputGpu[index]) <= maxError)) {
-					if (errorCount < 15)
-						std::cout << "Result for " << x << "," << y << " is incorrect: GPU value is " << h_outputGpu[index] << ", CPU value is " << h_outputCpu[index] << std::endl;
-					else if (errorCount == 15)
-						std::cout << "..." << std::endl;
-					errorCount++;
+				for (size_t c = 0; c < 4; c++) {
+					size_t index = 4 * (x + y * outX) + c;
+					// Allow small differences between CPU and GPU results (due to different rounding behavior)
+					if (!(std::abs (h_outputCpu[index] - h_outputGpu[index]) <= maxError)) {
+						if (errorCount < 15)
+							std::cout << "Result for " << x << "," << y << " channel " << c << " is incorrect: GPU value is " << h_outputGpu[index] << ", CPU value is " << h_outputCpu[index] << std::endl;
+						else if (errorCount == 15)
+							std::cout << "..." << std::endl;
+						errorCount++;
+					}
 				}
 			}
 		}
@@ -390,19 +2314,139 @@ void render () {
 	}
 
 	// draw image from PBO
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDisable(GL_DEPTH_TEST);
-	glRasterPos2i(0, 0);
-	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
-	glDrawPixels(outX, outY, GL_LUMINANCE, GL_FLOAT, 0);
-	glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
-
-	// flip backbuffer to screen
-	glutSwapBuffers();
+	if (!headless)
+		drawOutput();
 
 	std::cout << "Done" << std::endl;
 }
 
+// Render frames views on a circle around the volume without OpenGL and write
+// them to output_volume_NNNN.pgm (sum) / .ppm (composite)
+void renderHeadless(std::size_t frames) {
+	alphaStep = 2 * M_PI / frames;
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	{
+		ImageWriter writer(outX, outY, 4);
+		for (std::size_t frame = 0; frame < frames; frame++) {
+			alpha = frame * alphaStep;
+			render();
+			std::ostringstream filename;
+			filename << "output_volume_" << std::setw(4) << std::setfill('0') << frame << (renderMode == RENDER_SUM ? ".pgm" : ".ppm");
+			writer.write(filename.str(), displayGpu ? h_outputGpu : h_outputCpu, renderMode == RENDER_SUM);
+		}
+	}
+	Core::TimeSpan time = Core::getCurrentTime() - time1;
+	std::cout << frames << " frames in " << time << ", " << frames / time.getSeconds() << " frames/s" << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sampler benchmark
+//////////////////////////////////////////////////////////////////////////////
+// The value at pos and, with gradient, the length of the gradient added
+inline float benchmarkSample(const RenderHostFrame& frame, bool gradient, float3 pos) {
+	float result = sampleFiltered(frame, 0, pos);
+	if (gradient) {
+		float3 g = sampleGradient(frame, 0, pos);
+		result += std::sqrt(dot(g, g));
+	}
+	return result;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+// benchmarkSample() for the 8 positions (x, y, z, unused) at positions
+inline __m256 packetBenchmarkSample(const RenderHostFrame& frame, bool gradient, const float* positions) {
+	__m256i index = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28), level = _mm256_setzero_si256();
+	__m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	__m256 posX = _mm256_i32gather_ps(positions, index, 4);
+	__m256 posY = _mm256_i32gather_ps(positions + 1, index, 4);
+	__m256 posZ = _mm256_i32gather_ps(positions + 2, index, 4);
+	__m256 result = packetSampleFiltered(frame, level, all, posX, posY, posZ);
+	if (gradient) {
+		__m256 gradientX, gradientY, gradientZ;
+		packetGradient(frame, level, all, posX, posY, posZ, gradientX, gradientY, gradientZ);
+		result = _mm256_add_ps(result, _mm256_sqrt_ps(_mm256_fmadd_ps(gradientZ, gradientZ, _mm256_fmadd_ps(gradientY, gradientY, _mm256_mul_ps(gradientX, gradientX)))));
+	}
+	return result;
+}
+#endif
+
+// Samples per second of the host (one thread) and of the device at random
+// positions in the volume, for both filters with and without the gradient.
+// The results of host and device are compared.
+void benchmarkSamplers(const cl::Program& program, std::size_t samples) {
+	ASSERT(!streaming); // every position needs the whole volume
+
+	std::vector<float> positions(4 * samples);
+	uint32_t random = 1;
+	for (std::size_t i = 0; i < samples; i++) {
+		for (int c = 0; c < 3; c++) {
+			random = random * 1664525u + 1013904223u;
+			positions[4 * i + c] = (random >> 8) / 16777216.0f * (c == 0 ? countX : c == 1 ? countY : countZ);
+		}
+		positions[4 * i + 3] = 0;
+	}
+
+	cl::Buffer d_positions;
+	cl::Buffer d_result;
+	cl::Kernel benchmarkKernel;
+	if (runGpu) {
+		d_positions = cl::Buffer(context, CL_MEM_READ_ONLY, positions.size() * sizeof (float));
+		d_result = cl::Buffer(context, CL_MEM_WRITE_ONLY, samples * sizeof (float));
+		queue.enqueueWriteBuffer(d_positions, true, 0, positions.size() * sizeof (float), positions.data());
+		benchmarkKernel = cl::Kernel(program, "benchmarkSamplerKernel");
+	}
+
+	std::vector<float> resultCpu(samples);
+	std::vector<float> resultGpu(samples);
+	for (int config = 0; config < 4; config++) {
+		SampleFilter filter = config < 2 ? FILTER_LINEAR : FILTER_CUBIC;
+		bool gradient = config % 2;
+		std::cout << (filter == FILTER_LINEAR ? "Trilinear" : "Tricubic") << (gradient ? " + gradient" : "") << ":";
+
+		if (runCpu) {
+			RenderHostFrame frame = { h_input, useBricks ? &h_inputBricks : NULL, NULL, countX, countY, countZ, outX, outY, NULL, 1, 1, &macroCells, 0, 0, RENDER_COMPOSITE, &transferFunction, terminationOpacity, NULL, 0, 0, 1, 0, filter, false };
+			Core::TimeSpan time1 = Core::getCurrentTime();
+			std::size_t i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+			for (; i + 8 <= samples; i += 8)
+				_mm256_storeu_ps(&resultCpu[i], packetBenchmarkSample(frame, gradient, &positions[4 * i]));
+#endif
+			for (; i < samples; i++)
+				resultCpu[i] = benchmarkSample(frame, gradient, float3(positions[4 * i], positions[4 * i + 1], positions[4 * i + 2]));
+			Core::TimeSpan time = Core::getCurrentTime() - time1;
+			std::cout << " host " << samples / time.getSeconds() / 1e6 << " Msamples/s";
+		}
+
+		if (runGpu) {
+			cl_int4 volumeSize = { { (cl_int) countX, (cl_int) countY, (cl_int) countZ, 0 } };
+			benchmarkKernel.setArg<cl::Image3D>(0, d_input);
+			benchmarkKernel.setArg<cl::Buffer>(1, d_brickTable);
+			benchmarkKernel.setArg<cl_int4>(2, volumeSize);
+			benchmarkKernel.setArg<cl::Image3D>(3, d_pyramid);
+			benchmarkKernel.setArg<cl::Buffer>(4, d_positions);
+			benchmarkKernel.setArg<cl::Buffer>(5, d_result);
+			benchmarkKernel.setArg<cl_int>(6, filter);
+			benchmarkKernel.setArg<cl_int>(7, gradient);
+			// the first run includes the setup of the kernel
+			cl::Event kernelExecution;
+			for (int run = 0; run < 2; run++)
+				queue.enqueueNDRangeKernel(benchmarkKernel, cl::NullRange, cl::NDRange(samples), cl::NullRange, NULL, &kernelExecution);
+			queue.enqueueReadBuffer(d_result, true, 0, samples * sizeof (float), resultGpu.data());
+			std::cout << ", device " << samples / OpenCL::getElapsedTime(kernelExecution).getSeconds() / 1e6 << " Msamples/s";
+		}
+
+		if (runCpu && runGpu) {
+			float maxDifference = 0, maxResult = 0;
+			for (std::size_t i = 0; i < samples; i++) {
+				maxDifference = std::max(maxDifference, std::abs(resultCpu[i] - resultGpu[i]));
+				maxResult = std::max(maxResult, std::abs(resultCpu[i]));
+			}
+			std::cout << ", max. difference " << maxDifference / maxResult << " of the max. result";
+		}
+		std::cout << std::endl;
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // OpenGL callbacks
 //////////////////////////////////////////////////////////////////////////////
@@ -411,19 +2455,34 @@ void displayGL() {
 }
 
 void idleGL() {
-	alpha += 0.03;
+	alpha += alphaStep;
 	if (alpha >= 2 * M_PI)
 		alpha -= 2 * M_PI;
 	render();
 }
 
+// The next progressive pass while the view does not change
+void refineGL() {
+	render();
+	setIdle();
+}
+
 void setIdle() {
 	if (animate)
 		glutIdleFunc(idleGL);
+	else if (progressive && progressivePass <= progressivePasses)
+		glutIdleFunc(refineGL);
 	else
 		glutIdleFunc(NULL);
 }
 
+// Start the progressive passes again after a setting has changed
+void restartProgressive() {
+	progressivePass = 0;
+	setIdle();
+	glutPostRedisplay();
+}
+
 void keyboardGL(unsigned char key, int x, int y) {
 	switch(key) {
 	case 'Q': case 'q': case '\e':
@@ -432,6 +2491,43 @@ void keyboardGL(unsigned char key, int x, int y) {
 	case ' ':
 		animate = !animate;
 		setIdle();
+		glutPostRedisplay(); // full detail once the rotation stops
+		break;
+	case 'L': case 'l':
+		useLod = !useLod;
+		std::cout << "Level of detail " << (useLod ? "on" : "off") << std::endl;
+		restartProgressive();
+		break;
+	case 'S': case 's':
+		skipEmptySpace = !skipEmptySpace;
+		std::cout << "Empty space skipping " << (skipEmptySpace ? "on" : "off") << std::endl;
+		restartProgressive();
+		break;
+	case 'B': case 'b':
+		useBricks = !useBricks;
+		std::cout << "Bricked volume on the host " << (useBricks ? "on" : "off") << std::endl;
+		restartProgressive();
+		break;
+	case 'C': case 'c':
+		renderMode = renderMode == RENDER_SUM ? RENDER_COMPOSITE : RENDER_SUM;
+		std::cout << "Render mode " << (renderMode == RENDER_SUM ? "sum" : "composite") << std::endl;
+		restartProgressive();
+		break;
+	case 'F': case 'f':
+		sampleFilter = sampleFilter == FILTER_LINEAR ? FILTER_CUBIC : FILTER_LINEAR;
+		std::cout << "Filter " << (sampleFilter == FILTER_LINEAR ? "trilinear" : "tricubic B-spline") << std::endl;
+		restartProgressive();
+		break;
+	case 'G': case 'g':
+		useShading = !useShading;
+		std::cout << "Gradient shading " << (useShading ? "on" : "off") << std::endl;
+		restartProgressive();
+		break;
+	case 'P': case 'p':
+		progressive = !progressive;
+		std::cout << "Progressive refinement " << (progressive ? "on" : "off") << std::endl;
+		progressiveAlpha = alpha;
+		restartProgressive();
 		break;
 	default:
 		break;
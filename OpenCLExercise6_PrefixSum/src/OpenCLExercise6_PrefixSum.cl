@@ -2,12 +2,497 @@
 #include <OpenCL/OpenCLKernel.hpp> // Hack to make syntax highlighting in Eclipse work
 #endif
 
+// Element type, associative operator and its identity. The defaults give the
+// integer sum of the exercise, the scan library (buildScanProgram) prepends
+// its own definitions. SCAN_OP does not have to be commutative.
+#ifndef SCAN_TYPE
+#define SCAN_TYPE int
+#endif
+#ifndef SCAN_OP
+#define SCAN_OP(a, b) ((a) + (b))
+#endif
+#ifndef SCAN_IDENTITY
+#define SCAN_IDENTITY 0
+#endif
+// If SCAN_SEGMENTED is defined, a nonzero value in d_flags marks the first
+// value of a segment and the scan restarts there. Internally the scan then
+// works on pairs (flag, value) with
+//   (f1, v1) o (f2, v2) = (f1 | f2, f2 ? v2 : SCAN_OP(v1, v2))
+// Without SCAN_SEGMENTED all flag arguments are ignored.
+
+// Every work group scans SCAN_BLOCK_SIZE values (2 per work item), WG_SIZE has to be a power of 2
+#define SCAN_BLOCK_SIZE (2 * WG_SIZE)
+// Padding of the local memory index to avoid bank conflicts in the up- and down-sweep
+#define BANK_OFFSET(i) ((i) >> 5)
+
+// l_data[j] = l_data[i] o l_data[j]
+void combineLocal(__local SCAN_TYPE* l_data, __local uchar* l_flags, uint i, uint j) {
+#ifdef SCAN_SEGMENTED
+	if (!l_flags[j])
+		l_data[j] = SCAN_OP(l_data[i], l_data[j]);
+	l_flags[j] |= l_flags[i];
+#else
+	l_data[j] = SCAN_OP(l_data[i], l_data[j]);
+#endif
+}
+
+// Exclusive scan of the SCAN_BLOCK_SIZE values in l_data (work-efficient
+// up-sweep / down-sweep). Returns the reduction of all values to every work
+// item, and in *totalFlag whether the block contains a segment head.
+SCAN_TYPE exclusiveScanLocal(__local SCAN_TYPE* l_data, __local uchar* l_flags, uchar* totalFlag) {
+	uint lid = get_local_id(0);
+
+	// Up-sweep: build the reductions of 2, 4, 8, ... values in place
+	uint offset = 1;
+	for (uint d = SCAN_BLOCK_SIZE / 2; d > 0; d /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint i = offset * (2 * lid + 1) - 1;
+			uint j = offset * (2 * lid + 2) - 1;
+			combineLocal(l_data, l_flags, i + BANK_OFFSET(i), j + BANK_OFFSET(j));
+		}
+		offset *= 2;
+	}
+
+	// The last value is now the reduction of the block
+	uint last = SCAN_BLOCK_SIZE - 1 + BANK_OFFSET(SCAN_BLOCK_SIZE - 1);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	SCAN_TYPE total = l_data[last];
+	*totalFlag = l_flags[last];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid == 0) {
+		l_data[last] = SCAN_IDENTITY;
+		l_flags[last] = 0;
+	}
+
+	// Down-sweep: the left child gets the prefix of the parent, the right child
+	// the prefix of the parent combined with the reduction of the left child
+	for (uint d = 1; d < SCAN_BLOCK_SIZE; d *= 2) {
+		offset /= 2;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint i = offset * (2 * lid + 1) - 1;
+			uint j = offset * (2 * lid + 2) - 1;
+			i += BANK_OFFSET(i);
+			j += BANK_OFFSET(j);
+			SCAN_TYPE t = l_data[i];
+			l_data[i] = l_data[j];
+#ifdef SCAN_SEGMENTED
+			uchar tf = l_flags[i];
+			l_flags[i] = l_flags[j];
+			l_data[j] = tf ? t : SCAN_OP(l_data[j], t);
+			l_flags[j] |= tf;
+#else
+			l_data[j] = SCAN_OP(l_data[j], t);
+#endif
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return total;
+}
+
+// Load the values (and flags) at blockBegin + lid and blockBegin + lid + WG_SIZE into local memory
+void loadBlock(__global const SCAN_TYPE* d_input, __global const uchar* d_flags, uint blockBegin, uint count,
+		__local SCAN_TYPE* l_data, __local uchar* l_flags, SCAN_TYPE* value, uchar* flag) {
+	uint lid = get_local_id(0);
+	for (uint k = 0; k < 2; k++) {
+		uint i = lid + k * WG_SIZE;
+		value[k] = blockBegin + i < count ? d_input[blockBegin + i] : SCAN_IDENTITY;
+#ifdef SCAN_SEGMENTED
+		flag[k] = blockBegin + i < count ? (d_flags[blockBegin + i] != 0) : 0;
+#else
+		flag[k] = 0;
+#endif
+		l_data[i + BANK_OFFSET(i)] = value[k];
+		l_flags[i + BANK_OFFSET(i)] = flag[k];
+	}
+}
+
+// Result for one value from the exclusive prefix in local memory
+SCAN_TYPE scanResult(SCAN_TYPE prefix, uchar prefixFlag, SCAN_TYPE value, uchar flag, uint exclusive) {
+#ifdef SCAN_SEGMENTED
+	if (exclusive)
+		return flag ? SCAN_IDENTITY : prefix;
+	return flag ? value : SCAN_OP(prefix, value);
+#else
+	return exclusive ? prefix : SCAN_OP(prefix, value);
+#endif
+}
+
+// Inclusive (exclusive = 0) or exclusive scan of every block of
+// SCAN_BLOCK_SIZE values. Values beyond count are treated as the identity.
+// The reduction of block i is written to d_blockSums[i] (and whether it
+// contains a segment head to d_blockFlags[i]). d_input and d_output may be
+// the same buffer.
 __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
-__kernel void prefixSumKernel(/*...*/) {
-	//TODO
+__kernel void prefixSumKernel(__global const SCAN_TYPE* d_input, __global const uchar* d_flags, __global SCAN_TYPE* d_output,
+		__global SCAN_TYPE* d_blockSums, __global uchar* d_blockFlags, uint count, uint exclusive) {
+	__local SCAN_TYPE l_data[SCAN_BLOCK_SIZE + BANK_OFFSET(SCAN_BLOCK_SIZE)];
+	__local uchar l_flags[SCAN_BLOCK_SIZE + BANK_OFFSET(SCAN_BLOCK_SIZE)];
+	uint lid = get_local_id(0);
+	uint blockBegin = get_group_id(0) * SCAN_BLOCK_SIZE;
+	SCAN_TYPE value[2];
+	uchar flag[2];
+	loadBlock(d_input, d_flags, blockBegin, count, l_data, l_flags, value, flag);
+
+	uchar totalFlag;
+	SCAN_TYPE total = exclusiveScanLocal(l_data, l_flags, &totalFlag);
+	if (lid == 0) {
+		d_blockSums[get_group_id(0)] = total;
+#ifdef SCAN_SEGMENTED
+		d_blockFlags[get_group_id(0)] = totalFlag;
+#endif
+	}
+
+	for (uint k = 0; k < 2; k++) {
+		uint i = lid + k * WG_SIZE;
+		if (blockBegin + i < count)
+			d_output[blockBegin + i] = scanResult(l_data[i + BANK_OFFSET(i)], l_flags[i + BANK_OFFSET(i)], value[k], flag[k], exclusive);
+	}
+}
+
+// Combine the inclusive scan of the reductions of all previous blocks, i.e.
+// d_scannedBlockSums[i - 1], with every value of block i. In a segmented scan
+// only the values before the first segment head of the block are affected.
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void blockAddKernel(__global SCAN_TYPE* d_data, __global const uchar* d_flags, __global const SCAN_TYPE* d_scannedBlockSums, uint count) {
+	uint block = get_group_id(0);
+	if (block == 0)
+		return;
+	SCAN_TYPE carry = d_scannedBlockSums[block - 1];
+	uint lid = get_local_id(0);
+	uint blockBegin = block * SCAN_BLOCK_SIZE;
+	uint end = SCAN_BLOCK_SIZE;
+#ifdef SCAN_SEGMENTED
+	__local uint l_firstHead;
+	if (lid == 0)
+		l_firstHead = SCAN_BLOCK_SIZE;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint k = 0; k < 2; k++) {
+		uint i = lid + k * WG_SIZE;
+		if (blockBegin + i < count && d_flags[blockBegin + i])
+			atomic_min(&l_firstHead, i);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	end = l_firstHead;
+#endif
+	for (uint k = 0; k < 2; k++) {
+		uint i = lid + k * WG_SIZE;
+		if (i < end && blockBegin + i < count)
+			d_data[blockBegin + i] = SCAN_OP(carry, d_data[blockBegin + i]);
+	}
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Single-pass scan with decoupled look-back
+//////////////////////////////////////////////////////////////////////////////
+
+// Status of a tile descriptor
+#define TILE_INVALID 0
+#define TILE_AGGREGATE 1 // d_tileAggregate is valid (reduction of the tile only)
+#define TILE_PREFIX 2 // d_tileInclusive is valid (reduction of all tiles up to this one)
+
+// Has to run before every prefixSumSinglePassKernel launch
+__kernel void prefixSumSinglePassInitKernel(__global int* d_tileStatus, __global uint* d_tileCounter, uint tileCount) {
+	uint i = get_global_id(0);
+	if (i < tileCount)
+		d_tileStatus[i] = TILE_INVALID;
+	if (i == 0)
+		*d_tileCounter = 0;
+}
+
+// Every work group scans one tile of SCAN_BLOCK_SIZE values. Tiles are
+// numbered in the order in which the work groups start (atomic counter), so
+// all predecessors of a tile are running or finished and the look-back
+// cannot deadlock. The tile publishes its reduction as soon as it is known,
+// then work item 0 walks back over the predecessors: it combines their
+// aggregates until it finds one with an inclusive prefix, publishes its own
+// inclusive prefix and the tile is written. Input and output are accessed
+// only once. A tile containing a segment head does not depend on its
+// predecessors for its own prefix, so it publishes TILE_PREFIX immediately.
 __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
-__kernel void blockAddKernel(/*...*/) {
-	//TODO
+__kernel void prefixSumSinglePassKernel(__global const SCAN_TYPE* d_input, __global const uchar* d_flags, __global SCAN_TYPE* d_output,
+		__global volatile int* d_tileStatus, __global volatile SCAN_TYPE* d_tileAggregate, __global volatile SCAN_TYPE* d_tileInclusive,
+		__global volatile uint* d_tileCounter, uint count, uint exclusive) {
+	__local SCAN_TYPE l_data[SCAN_BLOCK_SIZE + BANK_OFFSET(SCAN_BLOCK_SIZE)];
+	__local uchar l_flags[SCAN_BLOCK_SIZE + BANK_OFFSET(SCAN_BLOCK_SIZE)];
+	__local uint l_tile;
+	__local SCAN_TYPE l_exclusivePrefix;
+	uint lid = get_local_id(0);
+	if (lid == 0)
+		l_tile = atomic_inc(d_tileCounter);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint tile = l_tile;
+
+	uint tileBegin = tile * SCAN_BLOCK_SIZE;
+	SCAN_TYPE value[2];
+	uchar flag[2];
+	loadBlock(d_input, d_flags, tileBegin, count, l_data, l_flags, value, flag);
+	uchar totalFlag;
+	SCAN_TYPE total = exclusiveScanLocal(l_data, l_flags, &totalFlag);
+
+	if (lid == 0) {
+		SCAN_TYPE exclusivePrefix = SCAN_IDENTITY;
+		if (tile == 0 || totalFlag) {
+			d_tileInclusive[tile] = total;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&d_tileStatus[tile], TILE_PREFIX);
+		} else {
+			d_tileAggregate[tile] = total;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&d_tileStatus[tile], TILE_AGGREGATE);
+		}
+
+		// Look back until a predecessor with an inclusive prefix is found
+		if (tile != 0) {
+			for (uint p = tile - 1;; p--) {
+				int status;
+				do {
+					status = atomic_or(&d_tileStatus[p], 0);
+				} while (status == TILE_INVALID);
+				read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+				if (status == TILE_PREFIX) {
+					exclusivePrefix = SCAN_OP(d_tileInclusive[p], exclusivePrefix);
+					break;
+				}
+				exclusivePrefix = SCAN_OP(d_tileAggregate[p], exclusivePrefix);
+			}
+			if (!totalFlag) {
+				d_tileInclusive[tile] = SCAN_OP(exclusivePrefix, total);
+				write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+				atomic_xchg(&d_tileStatus[tile], TILE_PREFIX);
+			}
+		}
+		l_exclusivePrefix = exclusivePrefix;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The prefix of the previous tiles applies to all values before the first segment head
+	SCAN_TYPE exclusivePrefix = l_exclusivePrefix;
+	for (uint k = 0; k < 2; k++) {
+		uint i = lid + k * WG_SIZE;
+		SCAN_TYPE prefix = l_data[i + BANK_OFFSET(i)];
+		uchar prefixFlag = l_flags[i + BANK_OFFSET(i)];
+		if (!prefixFlag)
+			prefix = SCAN_OP(exclusivePrefix, prefix);
+		if (tileBegin + i < count)
+			d_output[tileBegin + i] = scanResult(prefix, prefixFlag, value[k], flag[k], exclusive);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Out-of-core scan
+//////////////////////////////////////////////////////////////////////////////
+
+// Combine the inclusive prefix of all previous chunks (*d_carry) with the
+// first value of the next chunk before the chunk is scanned (inclusive, not
+// segmented). Runs as a single work item.
+__kernel void prefixSumCarryKernel(__global SCAN_TYPE* d_data, __global const SCAN_TYPE* d_carry) {
+	d_data[0] = SCAN_OP(*d_carry, d_data[0]);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Stream compaction and radix sort
+//////////////////////////////////////////////////////////////////////////////
+// These kernels scan int counts with the kernels above, so they have to be
+// used with the default SCAN_TYPE / SCAN_OP (integer sum).
+
+// Values for which the predicate is true are kept
+#ifndef COMPACT_PREDICATE
+#define COMPACT_PREDICATE(x) ((x) > 0)
+#endif
+
+// d_flags[i] = 1 if d_input[i] is kept, 0 otherwise
+__kernel void compactFlagsKernel(__global const int* d_input, __global int* d_flags, uint count) {
+	uint i = get_global_id(0);
+	if (i < count)
+		d_flags[i] = COMPACT_PREDICATE(d_input[i]) ? 1 : 0;
+}
+
+// d_positions is the inclusive scan of the flags, so a kept value i goes to d_positions[i] - 1
+__kernel void compactScatterKernel(__global const int* d_input, __global const int* d_positions, __global int* d_output, uint count) {
+	uint i = get_global_id(0);
+	if (i < count) {
+		int value = d_input[i];
+		if (COMPACT_PREDICATE(value))
+			d_output[d_positions[i] - 1] = value;
+	}
+}
+
+// Number of key bits sorted per pass
+#define RADIX_BITS 4
+#define RADIX_DIGITS (1 << RADIX_BITS)
+// Every work group handles a tile of RADIX_ITEMS * WG_SIZE keys
+#define RADIX_ITEMS 4
+#define RADIX_TILE_SIZE (RADIX_ITEMS * WG_SIZE)
+
+// Exclusive scan of one value per work item (Hillis-Steele, WG_SIZE does not
+// have to be a power of 2). The sum of all values is returned in *total.
+uint radixScanLocal(__local uint* l_scan, uint value, uint* total) {
+	uint lid = get_local_id(0);
+	l_scan[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < WG_SIZE; offset *= 2) {
+		uint t = lid >= offset ? l_scan[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		l_scan[lid] += t;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	uint inclusive = l_scan[lid];
+	*total = l_scan[WG_SIZE - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return inclusive - value;
+}
+
+// Digit counts of every tile. d_histogram[digit * groupCount + group], so an
+// exclusive scan of d_histogram gives the first output position of the keys
+// with this digit from this tile.
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void radixSortHistogramKernel(__global const uint* d_keys, __global int* d_histogram, uint count, uint shift) {
+	__local uint l_histogram[RADIX_DIGITS];
+	uint lid = get_local_id(0);
+	uint group = get_group_id(0);
+	for (uint d = lid; d < RADIX_DIGITS; d += WG_SIZE)
+		l_histogram[d] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint tileBegin = group * RADIX_TILE_SIZE;
+	for (uint k = 0; k < RADIX_ITEMS; k++) {
+		uint i = tileBegin + k * WG_SIZE + lid;
+		if (i < count)
+			atomic_inc(&l_histogram[(d_keys[i] >> shift) & (RADIX_DIGITS - 1)]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint d = lid; d < RADIX_DIGITS; d += WG_SIZE)
+		d_histogram[d * get_num_groups(0) + group] = l_histogram[d];
+}
+
+// Stable scatter of one tile to the positions in d_offsets (the scanned
+// histogram). The tile is processed in chunks of WG_SIZE keys: every chunk is
+// sorted by the digit in local memory with RADIX_BITS stable 1-bit splits,
+// then the rank of a key among the keys with the same digit is its position
+// in the sorted chunk minus the start of the digit. Keys beyond count are
+// replaced by 0xffffffff, which sorts them after all valid keys of the chunk.
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void radixSortScatterKernel(__global const uint* d_keysIn, __global const uint* d_valuesIn, __global uint* d_keysOut, __global uint* d_valuesOut,
+		__global const int* d_offsets, uint count, uint shift, uint hasValues) {
+	__local uint l_scan[WG_SIZE];
+	__local uint l_keys[WG_SIZE];
+	__local uint l_values[WG_SIZE];
+	__local uint l_offset[RADIX_DIGITS];
+	__local uint l_count[RADIX_DIGITS];
+	__local uint l_start[RADIX_DIGITS];
+	uint lid = get_local_id(0);
+	uint group = get_group_id(0);
+	for (uint d = lid; d < RADIX_DIGITS; d += WG_SIZE)
+		l_offset[d] = d_offsets[d * get_num_groups(0) + group];
+
+	uint tileBegin = group * RADIX_TILE_SIZE;
+	for (uint k = 0; k < RADIX_ITEMS; k++) {
+		uint i = tileBegin + k * WG_SIZE + lid;
+		uint key = i < count ? d_keysIn[i] : 0xffffffff;
+		uint value = hasValues && i < count ? d_valuesIn[i] : 0;
+		uint valid = i < count;
+		for (uint d = lid; d < RADIX_DIGITS; d += WG_SIZE)
+			l_count[d] = 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (valid)
+			atomic_inc(&l_count[(key >> shift) & (RADIX_DIGITS - 1)]);
+
+		// Local split by every bit of the digit, zeros first
+		for (uint b = 0; b < RADIX_BITS; b++) {
+			uint bit = (key >> (shift + b)) & 1;
+			uint zeros;
+			uint zerosBefore = radixScanLocal(l_scan, 1 - bit, &zeros);
+			uint position = bit ? zeros + lid - zerosBefore : zerosBefore;
+			l_keys[position] = key;
+			l_values[position] = value;
+			l_scan[position] = valid;
+			barrier(CLK_LOCAL_MEM_FENCE);
+			key = l_keys[lid];
+			value = l_values[lid];
+			valid = l_scan[lid];
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		uint digit = (key >> shift) & (RADIX_DIGITS - 1);
+		l_keys[lid] = digit;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid == 0 || l_keys[lid - 1] != digit)
+			l_start[digit] = lid;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (valid) {
+			uint position = l_offset[digit] + lid - l_start[digit];
+			d_keysOut[position] = key;
+			if (hasValues)
+				d_valuesOut[position] = value;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint d = lid; d < RADIX_DIGITS; d += WG_SIZE)
+			l_offset[d] += l_count[d];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Histogram
+//////////////////////////////////////////////////////////////////////////////
+
+// Input type and number of bins. The defaults give 256 bins of uint values,
+// buildHistogramProgram prepends its own definitions.
+#ifndef HISTOGRAM_TYPE
+#define HISTOGRAM_TYPE uint
+#endif
+#ifndef HISTOGRAM_BINS
+#define HISTOGRAM_BINS 256
+#endif
+// Number of copies of the bins in local memory. Work item lid counts in copy
+// lid % HISTOGRAM_COPIES, so work items hitting the same bin use different
+// addresses (and banks) and fewer local atomics collide.
+#ifndef HISTOGRAM_COPIES
+#define HISTOGRAM_COPIES 1
+#endif
+
+// Value x falls into bin (x - minValue) / binWidth, values outside of the
+// HISTOGRAM_BINS bins are ignored. Every work group counts the values
+// get_global_id(0), + get_global_size(0), ... in its private copies of the
+// bins in local memory, merges the copies and writes its counts to
+// d_partial[group * HISTOGRAM_BINS + bin].
+__attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+__kernel void histogramKernel(__global const HISTOGRAM_TYPE* d_input, uint count, HISTOGRAM_TYPE minValue, HISTOGRAM_TYPE binWidth, __global uint* d_partial) {
+	__local uint l_bins[HISTOGRAM_BINS * HISTOGRAM_COPIES];
+	uint lid = get_local_id(0);
+	for (uint i = lid; i < HISTOGRAM_BINS * HISTOGRAM_COPIES; i += WG_SIZE)
+		l_bins[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint copy = lid % HISTOGRAM_COPIES;
+	for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+		HISTOGRAM_TYPE x = d_input[i];
+		if (x >= minValue) {
+			HISTOGRAM_TYPE bin = (x - minValue) / binWidth;
+			if (bin < HISTOGRAM_BINS)
+				atomic_inc(&l_bins[(uint) bin * HISTOGRAM_COPIES + copy]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint bin = lid; bin < HISTOGRAM_BINS; bin += WG_SIZE) {
+		uint sum = 0;
+		for (uint c = 0; c < HISTOGRAM_COPIES; c++)
+			sum += l_bins[bin * HISTOGRAM_COPIES + c];
+		d_partial[get_group_id(0) * HISTOGRAM_BINS + bin] = sum;
+	}
+}
+
+// Sum of the counts of all work groups, one work item per bin
+__kernel void histogramMergeKernel(__global const uint* d_partial, uint groupCount, __global uint* d_histogram) {
+	uint bin = get_global_id(0);
+	if (bin < HISTOGRAM_BINS) {
+		uint sum = 0;
+		for (uint g = 0; g < groupCount; g++)
+			sum += d_partial[g * HISTOGRAM_BINS + bin];
+		d_histogram[bin] = sum;
+	}
 }
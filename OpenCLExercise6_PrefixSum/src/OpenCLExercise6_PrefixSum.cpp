@@ -4,8 +4,13 @@
 
 // includes
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <Core/Assert.hpp>
+#include <Core/Error.hpp>
 #include <Core/Time.hpp>
 #include <Core/Image.hpp>
 #include <OpenCL/cl-patched.hpp>
@@ -18,9 +23,19 @@
 #include <iostream>
 #include <cmath>
 #include <iomanip>
+#include <algorithm>
 #include <sstream>
 
+#include <limits>
+
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind/bind.hpp>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 //////////////////////////////////////////////////////////////////////////////
 // CPU implementation
@@ -36,6 +51,1167 @@ void prefixSumHost(const std::vector<cl_int>& h_input, std::vector<cl_int>& h_ou
 	}
 }
 
+// Sum of h_input[begin, end)
+void prefixSumHostReduceChunk(const std::vector<cl_int>* h_input, std::size_t begin, std::size_t end, cl_int* total) {
+	const cl_int* in = h_input->data();
+	std::size_t i = begin;
+	cl_int sum = 0;
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	for (; i + 8 <= end; i += 8)
+		acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i*) (in + i)));
+	__m128i acc4 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	acc4 = _mm_add_epi32(acc4, _mm_shuffle_epi32(acc4, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc4 = _mm_add_epi32(acc4, _mm_shuffle_epi32(acc4, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum = _mm_cvtsi128_si32(acc4);
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 4 <= end; i += 4)
+		acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*) (in + i)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum = _mm_cvtsi128_si32(acc);
+#endif
+	for (; i < end; i++)
+		sum += in[i];
+	*total = sum;
+}
+
+// Inclusive scan of h_input[begin, end) starting with offset. The vectors are
+// scanned in registers (log2(width) shift + add steps), the running sum is
+// broadcast and added to the next vector.
+void prefixSumHostChunk(const std::vector<cl_int>* h_input, std::vector<cl_int>* h_output, std::size_t begin, std::size_t end, cl_int offset) {
+	const cl_int* in = h_input->data();
+	cl_int* out = h_output->data();
+	std::size_t i = begin;
+#if defined(__AVX2__)
+	__m256i carry = _mm256_set1_epi32(offset);
+	for (; i + 8 <= end; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (in + i));
+		// Scan of both 128 bit lanes, then the total of the lower lane is added to the upper lane
+		x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+		x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+		__m256i lowTotal = _mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+		x = _mm256_add_epi32(x, _mm256_permute2x128_si256(lowTotal, lowTotal, 0x08));
+		x = _mm256_add_epi32(x, carry);
+		_mm256_storeu_si256((__m256i*) (out + i), x);
+		carry = _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7));
+	}
+	offset = _mm_cvtsi128_si32(_mm256_castsi256_si128(carry));
+#elif defined(__SSE2__)
+	__m128i carry = _mm_set1_epi32(offset);
+	for (; i + 4 <= end; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (in + i));
+		x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi32(x, carry);
+		_mm_storeu_si128((__m128i*) (out + i), x);
+		carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	offset = _mm_cvtsi128_si32(carry);
+#endif
+	for (; i < end; i++) {
+		offset += in[i];
+		out[i] = offset;
+	}
+}
+
+// Multithreaded version of prefixSumHost: the threads compute the sums of
+// their chunks, the chunk sums are scanned sequentially and the threads scan
+// their chunks starting with the sum of all previous chunks.
+void prefixSumHostParallel(const std::vector<cl_int>& h_input, std::vector<cl_int>& h_output, std::size_t threadCount) {
+	std::size_t count = h_input.size();
+	if (threadCount <= 1) {
+		// No chunk sums needed, a single pass over the data
+		prefixSumHostChunk(&h_input, &h_output, 0, count, 0);
+		return;
+	}
+	// Chunk boundaries are multiples of 16 values (one cache line)
+	std::size_t chunk = ((count + threadCount - 1) / threadCount + 15) / 16 * 16;
+	std::vector<cl_int> totals (threadCount);
+
+	boost::thread_group reduceThreads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		reduceThreads.create_thread(boost::bind(prefixSumHostReduceChunk, &h_input, std::min(count, t * chunk), std::min(count, (t + 1) * chunk), &totals[t]));
+	reduceThreads.join_all();
+
+	std::vector<cl_int> offsets (threadCount);
+	cl_int offset = 0;
+	for (std::size_t t = 0; t < threadCount; t++) {
+		offsets[t] = offset;
+		offset += totals[t];
+	}
+
+	boost::thread_group scanThreads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		scanThreads.create_thread(boost::bind(prefixSumHostChunk, &h_input, &h_output, std::min(count, t * chunk), std::min(count, (t + 1) * chunk), offsets[t]));
+	scanThreads.join_all();
+}
+
+// Example of a user-defined operator for the generic scan
+cl_int scanXorOp(cl_int a, cl_int b) {
+	return a ^ b;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// GPU implementation: multi-level scan
+//////////////////////////////////////////////////////////////////////////////
+// Block reductions of every level of the scan. Level 0 is the input, level
+// l + 1 contains one value per block of SCAN_BLOCK_SIZE (2 * wgSize) values
+// of level l. The last level fits into a single block, its reduction (the
+// total) is written to the one-element buffer d_sums.back().
+struct PrefixSumLevels {
+	std::size_t wgSize;
+	bool segmented;
+	std::vector<std::size_t> counts; // counts[l] = number of values on level l
+	std::vector<cl::Buffer> d_sums; // d_sums[l] = block reductions of level l (counts[l + 1] values)
+	std::vector<cl::Buffer> d_flags; // d_flags[l] = whether the blocks of level l contain a segment head
+};
+
+void createPrefixSumLevels(const cl::Context& context, std::size_t wgSize, std::size_t count, std::size_t elementSize, bool segmented, PrefixSumLevels& levels) {
+	std::size_t blockSize = 2 * wgSize;
+	levels.wgSize = wgSize;
+	levels.segmented = segmented;
+	levels.counts.clear();
+	levels.d_sums.clear();
+	levels.d_flags.clear();
+	levels.counts.push_back(count);
+	while (levels.counts.back() > blockSize)
+		levels.counts.push_back((levels.counts.back() + blockSize - 1) / blockSize);
+	for (std::size_t l = 0; l < levels.counts.size(); l++) {
+		std::size_t countSums = l + 1 < levels.counts.size() ? levels.counts[l + 1] : 1;
+		levels.d_sums.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, countSums * elementSize));
+		// The flag arguments are not used by unsegmented scans
+		levels.d_flags.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, segmented ? countSums : 1));
+	}
+}
+
+// Inclusive or exclusive scan of levels.counts[0] values from d_input to
+// d_output (which may be the same buffer). For a segmented scan d_flags
+// contains the segment heads, otherwise it can be NULL. All intermediate
+// values stay on the device, the events of all kernel launches are appended
+// to events.
+void prefixSumDevice(const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& d_input, const cl::Buffer* d_flags, const cl::Buffer& d_output, const PrefixSumLevels& levels, bool exclusive, std::vector<cl::Event>& events) {
+	std::size_t wgSize = levels.wgSize;
+	std::size_t blockSize = 2 * wgSize;
+	std::size_t levelCount = levels.counts.size();
+	ASSERT (!levels.segmented || d_flags);
+	if (levels.counts[0] == 0)
+		return;
+	const cl::Buffer& d_inputFlags = d_flags ? *d_flags : levels.d_flags[0];
+	cl::Kernel prefixSumKernel(program, "prefixSumKernel");
+	cl::Kernel blockAddKernel(program, "blockAddKernel");
+
+	// Scan every level, the block reductions of level l are the input of
+	// level l + 1 (scanned inclusively and in place)
+	for (std::size_t l = 0; l < levelCount; l++) {
+		std::size_t groups = (levels.counts[l] + blockSize - 1) / blockSize;
+		cl::Event event;
+		prefixSumKernel.setArg<cl::Buffer>(0, l == 0 ? d_input : levels.d_sums[l - 1]);
+		prefixSumKernel.setArg<cl::Buffer>(1, l == 0 ? d_inputFlags : levels.d_flags[l - 1]);
+		prefixSumKernel.setArg<cl::Buffer>(2, l == 0 ? d_output : levels.d_sums[l - 1]);
+		prefixSumKernel.setArg<cl::Buffer>(3, levels.d_sums[l]);
+		prefixSumKernel.setArg<cl::Buffer>(4, levels.d_flags[l]);
+		prefixSumKernel.setArg<cl_uint>(5, levels.counts[l]);
+		prefixSumKernel.setArg<cl_uint>(6, l == 0 && exclusive ? 1 : 0);
+		queue.enqueueNDRangeKernel(prefixSumKernel, cl::NullRange, cl::NDRange(groups * wgSize), cl::NDRange(wgSize), NULL, &event);
+		events.push_back(event);
+	}
+
+	// Add the scanned block reductions, from the coarsest level down to the output
+	for (std::size_t l = levelCount - 1; l-- > 0;) {
+		std::size_t groups = (levels.counts[l] + blockSize - 1) / blockSize;
+		cl::Event event;
+		blockAddKernel.setArg<cl::Buffer>(0, l == 0 ? d_output : levels.d_sums[l - 1]);
+		blockAddKernel.setArg<cl::Buffer>(1, l == 0 ? d_inputFlags : levels.d_flags[l - 1]);
+		blockAddKernel.setArg<cl::Buffer>(2, levels.d_sums[l]);
+		blockAddKernel.setArg<cl_uint>(3, levels.counts[l]);
+		queue.enqueueNDRangeKernel(blockAddKernel, cl::NullRange, cl::NDRange(groups * wgSize), cl::NDRange(wgSize), NULL, &event);
+		events.push_back(event);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// GPU implementation: single-pass scan with decoupled look-back
+//////////////////////////////////////////////////////////////////////////////
+// One descriptor (status, aggregate, inclusive prefix) per tile of 2 * wgSize values
+struct PrefixSumTiles {
+	std::size_t wgSize;
+	std::size_t count;
+	std::size_t tileCount;
+	cl::Buffer d_tileStatus, d_tileAggregate, d_tileInclusive, d_tileCounter, d_noFlags;
+};
+
+void createPrefixSumTiles(const cl::Context& context, std::size_t wgSize, std::size_t count, std::size_t elementSize, PrefixSumTiles& tiles) {
+	tiles.wgSize = wgSize;
+	tiles.count = count;
+	tiles.tileCount = (count + 2 * wgSize - 1) / (2 * wgSize);
+	std::size_t tileCount = std::max<std::size_t>(tiles.tileCount, 1);
+	tiles.d_tileStatus = cl::Buffer(context, CL_MEM_READ_WRITE, tileCount * sizeof (cl_int));
+	tiles.d_tileAggregate = cl::Buffer(context, CL_MEM_READ_WRITE, tileCount * elementSize);
+	tiles.d_tileInclusive = cl::Buffer(context, CL_MEM_READ_WRITE, tileCount * elementSize);
+	tiles.d_tileCounter = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof (cl_uint));
+	tiles.d_noFlags = cl::Buffer(context, CL_MEM_READ_ONLY, 1);
+}
+
+// Inclusive or exclusive scan of tiles.count values, the input is read and
+// the output written only once. d_flags as for prefixSumDevice.
+void prefixSumSinglePassDevice(const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& d_input, const cl::Buffer* d_flags, const cl::Buffer& d_output, const PrefixSumTiles& tiles, bool exclusive, std::vector<cl::Event>& events) {
+	std::size_t wgSize = tiles.wgSize;
+	if (tiles.count == 0)
+		return;
+	cl::Event initEvent, scanEvent;
+	cl::Kernel initKernel(program, "prefixSumSinglePassInitKernel");
+	initKernel.setArg<cl::Buffer>(0, tiles.d_tileStatus);
+	initKernel.setArg<cl::Buffer>(1, tiles.d_tileCounter);
+	initKernel.setArg<cl_uint>(2, tiles.tileCount);
+	queue.enqueueNDRangeKernel(initKernel, cl::NullRange, cl::NDRange((tiles.tileCount + wgSize - 1) / wgSize * wgSize), cl::NDRange(wgSize), NULL, &initEvent);
+	events.push_back(initEvent);
+
+	cl::Kernel scanKernel(program, "prefixSumSinglePassKernel");
+	scanKernel.setArg<cl::Buffer>(0, d_input);
+	scanKernel.setArg<cl::Buffer>(1, d_flags ? *d_flags : tiles.d_noFlags);
+	scanKernel.setArg<cl::Buffer>(2, d_output);
+	scanKernel.setArg<cl::Buffer>(3, tiles.d_tileStatus);
+	scanKernel.setArg<cl::Buffer>(4, tiles.d_tileAggregate);
+	scanKernel.setArg<cl::Buffer>(5, tiles.d_tileInclusive);
+	scanKernel.setArg<cl::Buffer>(6, tiles.d_tileCounter);
+	scanKernel.setArg<cl_uint>(7, tiles.count);
+	scanKernel.setArg<cl_uint>(8, exclusive ? 1 : 0);
+	queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(tiles.tileCount * wgSize), cl::NDRange(wgSize), NULL, &scanEvent);
+	events.push_back(scanEvent);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Out-of-core scan: the input is streamed through the device in chunks
+//////////////////////////////////////////////////////////////////////////////
+// Input and output chunks are double buffered. Chunk k is uploaded on
+// uploadQueue, scanned on scanQueue and downloaded on downloadQueue, so the
+// upload of chunk k + 1, the scan of chunk k and the download of chunk k - 1
+// can run at the same time. The inclusive prefix of the previous chunks
+// (carry) stays on the device: it is copied from the last output value and
+// combined with the first input value of the next chunk.
+// The transfers go through pinned (CL_MEM_ALLOC_HOST_PTR, mapped once)
+// staging buffers, which the driver can copy with DMA and without locking
+// the pages of the pageable user memory for every transfer.
+struct PrefixSumStream {
+	cl::Context context;
+	std::size_t wgSize;
+	std::size_t chunkSize; // values per chunk, multiple of 2 * wgSize
+	cl::Buffer d_input[2], d_output[2], d_carry;
+	cl::Buffer pinnedInput[2], pinnedOutput[2];
+	void* h_pinnedInput[2];
+	void* h_pinnedOutput[2];
+	PrefixSumLevels levels; // for full chunks
+	cl::CommandQueue uploadQueue, scanQueue, downloadQueue;
+
+	PrefixSumStream() {
+		for (std::size_t b = 0; b < 2; b++)
+			h_pinnedInput[b] = h_pinnedOutput[b] = NULL;
+	}
+	~PrefixSumStream() {
+		if (!h_pinnedInput[0])
+			return;
+		for (std::size_t b = 0; b < 2; b++) {
+			uploadQueue.enqueueUnmapMemObject(pinnedInput[b], h_pinnedInput[b]);
+			downloadQueue.enqueueUnmapMemObject(pinnedOutput[b], h_pinnedOutput[b]);
+		}
+		uploadQueue.finish();
+		downloadQueue.finish();
+	}
+
+private:
+	PrefixSumStream(const PrefixSumStream&);
+	PrefixSumStream& operator=(const PrefixSumStream&);
+};
+
+// Largest chunk for which the 4 chunk buffers (and the block sums) fit into device memory
+std::size_t prefixSumStreamChunkSize(const cl::Device& device, std::size_t wgSize, std::size_t elementSize) {
+	cl_ulong globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	cl_ulong maxAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	cl_ulong bytes = std::min(maxAllocSize, globalMemSize / 5);
+	std::size_t blockSize = 2 * wgSize;
+	return std::max<std::size_t>(bytes / elementSize / blockSize * blockSize, blockSize);
+}
+
+void createPrefixSumStream(const cl::Context& context, const cl::Device& device, std::size_t wgSize, std::size_t chunkSize, std::size_t elementSize, PrefixSumStream& stream) {
+	std::size_t blockSize = 2 * wgSize;
+	stream.context = context;
+	stream.wgSize = wgSize;
+	stream.chunkSize = std::max<std::size_t>((chunkSize + blockSize - 1) / blockSize * blockSize, blockSize);
+	for (std::size_t b = 0; b < 2; b++) {
+		stream.d_input[b] = cl::Buffer(context, CL_MEM_READ_WRITE, stream.chunkSize * elementSize);
+		stream.d_output[b] = cl::Buffer(context, CL_MEM_READ_WRITE, stream.chunkSize * elementSize);
+	}
+	stream.d_carry = cl::Buffer(context, CL_MEM_READ_WRITE, elementSize);
+	createPrefixSumLevels(context, wgSize, stream.chunkSize, elementSize, false, stream.levels);
+	stream.uploadQueue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	stream.scanQueue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	stream.downloadQueue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	std::size_t bytes = stream.chunkSize * elementSize;
+	for (std::size_t b = 0; b < 2; b++) {
+		stream.pinnedInput[b] = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes);
+		stream.pinnedOutput[b] = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes);
+		stream.h_pinnedInput[b] = stream.uploadQueue.enqueueMapBuffer(stream.pinnedInput[b], true, CL_MAP_WRITE, 0, bytes);
+		stream.h_pinnedOutput[b] = stream.downloadQueue.enqueueMapBuffer(stream.pinnedOutput[b], true, CL_MAP_READ, 0, bytes);
+	}
+}
+
+// Inclusive scan of count values from h_input to h_output (e.g. memory
+// mapped files), count is not limited by the device memory. Returns when
+// all chunks have been downloaded. The events of the three stages are
+// appended to uploadEvents, scanEvents and downloadEvents. The host copies
+// chunk k + 1 into and chunk k - 1 out of the pinned buffers while the
+// device works on chunk k.
+template <typename T> void prefixSumStreamDevice(const cl::Program& program, const T* h_input, T* h_output, std::size_t count, const PrefixSumStream& stream,
+		std::vector<cl::Event>& uploadEvents, std::vector<cl::Event>& scanEvents, std::vector<cl::Event>& downloadEvents) {
+	std::size_t chunkCount = (count + stream.chunkSize - 1) / stream.chunkSize;
+	std::vector<cl::Event> uploadDone (chunkCount), scanDone (chunkCount), downloadDone (chunkCount);
+	cl::Kernel carryKernel(program, "prefixSumCarryKernel");
+
+	// Block sums for the last, partial chunk, allocated before the first transfer
+	PrefixSumLevels tailLevels;
+	std::size_t tailCount = count % stream.chunkSize;
+	if (tailCount != 0)
+		createPrefixSumLevels(stream.context, stream.wgSize, tailCount, sizeof (T), false, tailLevels);
+
+	for (std::size_t k = 0; k < chunkCount; k++) {
+		std::size_t b = k % 2;
+		std::size_t begin = k * stream.chunkSize;
+		std::size_t n = std::min(stream.chunkSize, count - begin);
+
+		// pinnedInput[b] is free when the upload of chunk k - 2 is done,
+		// d_input[b] when the scan of chunk k - 2 is done
+		if (k >= 2)
+			uploadDone[k - 2].wait();
+		std::copy(h_input + begin, h_input + begin + n, (T*) stream.h_pinnedInput[b]);
+		std::vector<cl::Event> uploadWait;
+		if (k >= 2)
+			uploadWait.push_back(scanDone[k - 2]);
+		stream.uploadQueue.enqueueWriteBuffer(stream.d_input[b], false, 0, n * sizeof (T), stream.h_pinnedInput[b], &uploadWait, &uploadDone[k]);
+		stream.uploadQueue.flush();
+		uploadEvents.push_back(uploadDone[k]);
+
+		// d_output[b] is free when the download of chunk k - 2 is done
+		std::vector<cl::Event> scanWait (1, uploadDone[k]);
+		if (k >= 2)
+			scanWait.push_back(downloadDone[k - 2]);
+		stream.scanQueue.enqueueWaitForEvents(scanWait);
+		if (k > 0) {
+			cl::Event event;
+			carryKernel.setArg<cl::Buffer>(0, stream.d_input[b]);
+			carryKernel.setArg<cl::Buffer>(1, stream.d_carry);
+			stream.scanQueue.enqueueNDRangeKernel(carryKernel, cl::NullRange, cl::NDRange(1), cl::NDRange(1), NULL, &event);
+			scanEvents.push_back(event);
+		}
+		prefixSumDevice(stream.scanQueue, program, stream.d_input[b], NULL, stream.d_output[b], n == stream.chunkSize ? stream.levels : tailLevels, false, scanEvents);
+		stream.scanQueue.enqueueCopyBuffer(stream.d_output[b], stream.d_carry, (n - 1) * sizeof (T), 0, sizeof (T), NULL, &scanDone[k]);
+		stream.scanQueue.flush();
+		scanEvents.push_back(scanDone[k]);
+
+		// pinnedOutput[b] has been copied out (chunk k - 2) in the last iteration
+		std::vector<cl::Event> downloadWait (1, scanDone[k]);
+		stream.downloadQueue.enqueueReadBuffer(stream.d_output[b], false, 0, n * sizeof (T), stream.h_pinnedOutput[b], &downloadWait, &downloadDone[k]);
+		stream.downloadQueue.flush();
+		downloadEvents.push_back(downloadDone[k]);
+
+		if (k >= 1) {
+			downloadDone[k - 1].wait();
+			std::size_t prevBegin = begin - stream.chunkSize;
+			const T* pinned = (const T*) stream.h_pinnedOutput[1 - b];
+			std::copy(pinned, pinned + stream.chunkSize, h_output + prevBegin);
+		}
+	}
+	if (chunkCount != 0) {
+		std::size_t k = chunkCount - 1;
+		std::size_t begin = k * stream.chunkSize;
+		downloadDone[k].wait();
+		const T* pinned = (const T*) stream.h_pinnedOutput[k % 2];
+		std::copy(pinned, pinned + (count - begin), h_output + begin);
+	}
+}
+
+// Read-only mapping of a whole file, used as input of the out-of-core scan
+class MappedFile {
+	int fd;
+	void* data_;
+	std::size_t size_;
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+public:
+	MappedFile(const std::string& filename) : fd(-1), data_(NULL), size_(0) {
+		fd = Core::Error::check("open", open(filename.c_str(), O_RDONLY));
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			int errnum = errno;
+			close(fd);
+			throw Core::Error("fstat", errnum);
+		}
+		size_ = st.st_size;
+		if (size_ != 0) {
+			data_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data_ == MAP_FAILED) {
+				int errnum = errno;
+				close(fd);
+				throw Core::Error("mmap", errnum);
+			}
+			// The file is read once from the beginning to the end
+			madvise(data_, size_, MADV_SEQUENTIAL);
+		}
+	}
+	~MappedFile() {
+		if (data_)
+			munmap(data_, size_);
+		close(fd);
+	}
+
+	const void* data() const { return data_; }
+	std::size_t size() const { return size_; }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Stream compaction and radix sort on top of the multi-level scan
+//////////////////////////////////////////////////////////////////////////////
+// Both use the program built from the .cl file with the default integer sum.
+struct StreamCompaction {
+	std::size_t wgSize;
+	std::size_t count;
+	cl::Buffer d_flags, d_positions;
+	PrefixSumLevels levels;
+};
+void createStreamCompaction(const cl::Context& context, std::size_t wgSize, std::size_t count, StreamCompaction& compaction) {
+	compaction.wgSize = wgSize;
+	compaction.count = count;
+	compaction.d_flags = cl::Buffer(context, CL_MEM_READ_WRITE, std::max<std::size_t>(count, 1) * sizeof (cl_int));
+	compaction.d_positions = cl::Buffer(context, CL_MEM_READ_WRITE, std::max<std::size_t>(count, 1) * sizeof (cl_int));
+	createPrefixSumLevels(context, wgSize, count, sizeof (cl_int), false, compaction.levels);
+}
+
+// Writes the values of d_input for which COMPACT_PREDICATE is true to the
+// beginning of d_output (in their original order) and returns their number
+std::size_t compactDevice(const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& d_input, const cl::Buffer& d_output, const StreamCompaction& compaction, std::vector<cl::Event>& events) {
+	std::size_t count = compaction.count;
+	if (count == 0)
+		return 0;
+	std::size_t globalSize = (count + compaction.wgSize - 1) / compaction.wgSize * compaction.wgSize;
+
+	cl::Kernel flagsKernel(program, "compactFlagsKernel");
+	cl::Event flagsEvent;
+	flagsKernel.setArg<cl::Buffer>(0, d_input);
+	flagsKernel.setArg<cl::Buffer>(1, compaction.d_flags);
+	flagsKernel.setArg<cl_uint>(2, count);
+	queue.enqueueNDRangeKernel(flagsKernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(compaction.wgSize), NULL, &flagsEvent);
+	events.push_back(flagsEvent);
+
+	prefixSumDevice(queue, program, compaction.d_flags, NULL, compaction.d_positions, compaction.levels, false, events);
+
+	cl::Kernel scatterKernel(program, "compactScatterKernel");
+	cl::Event scatterEvent;
+	scatterKernel.setArg<cl::Buffer>(0, d_input);
+	scatterKernel.setArg<cl::Buffer>(1, compaction.d_positions);
+	scatterKernel.setArg<cl::Buffer>(2, d_output);
+	scatterKernel.setArg<cl_uint>(3, count);
+	queue.enqueueNDRangeKernel(scatterKernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(compaction.wgSize), NULL, &scatterEvent);
+	events.push_back(scatterEvent);
+
+	// The last inclusive prefix is the number of kept values
+	cl_int keptCount;
+	queue.enqueueReadBuffer(compaction.d_positions, true, (count - 1) * sizeof (cl_int), sizeof (cl_int), &keptCount);
+	return keptCount;
+}
+
+// Has to match RADIX_BITS / RADIX_ITEMS in the .cl file
+const std::size_t radixBits = 4;
+const std::size_t radixItems = 4;
+
+struct RadixSort {
+	std::size_t wgSize;
+	std::size_t count;
+	std::size_t groupCount; // tiles of radixItems * wgSize keys
+	bool values;
+	cl::Buffer d_histogram; // (1 << radixBits) * groupCount digit counts, scanned in place
+	cl::Buffer d_keysTemp, d_valuesTemp;
+	PrefixSumLevels levels;
+};
+void createRadixSort(const cl::Context& context, std::size_t wgSize, std::size_t count, bool values, RadixSort& sort) {
+	std::size_t tileSize = radixItems * wgSize;
+	sort.wgSize = wgSize;
+	sort.count = count;
+	sort.groupCount = std::max<std::size_t>((count + tileSize - 1) / tileSize, 1);
+	sort.values = values;
+	std::size_t histogramCount = (1 << radixBits) * sort.groupCount;
+	sort.d_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, histogramCount * sizeof (cl_int));
+	sort.d_keysTemp = cl::Buffer(context, CL_MEM_READ_WRITE, std::max<std::size_t>(count, 1) * sizeof (cl_uint));
+	sort.d_valuesTemp = cl::Buffer(context, CL_MEM_READ_WRITE, values ? std::max<std::size_t>(count, 1) * sizeof (cl_uint) : 1);
+	createPrefixSumLevels(context, wgSize, histogramCount, sizeof (cl_int), false, sort.levels);
+}
+
+// Stable LSD radix sort of the 32 bit keys in d_keys, radixBits per pass.
+// Every pass counts the digits of every tile, scans the counts (exclusive,
+// ordered by digit, then by tile) and scatters the keys to the scanned
+// positions. If d_values is not NULL the values are moved with their keys.
+// The number of passes is even, so the result ends up in d_keys / d_values.
+void radixSortDevice(const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& d_keys, const cl::Buffer* d_values, const RadixSort& sort, std::vector<cl::Event>& events) {
+	ASSERT (!d_values || sort.values);
+	if (sort.count == 0)
+		return;
+	cl::Kernel histogramKernel(program, "radixSortHistogramKernel");
+	cl::Kernel scatterKernel(program, "radixSortScatterKernel");
+	cl::NDRange globalSize(sort.groupCount * sort.wgSize), localSize(sort.wgSize);
+	const cl::Buffer* keys[2] = { &d_keys, &sort.d_keysTemp };
+	const cl::Buffer* values[2] = { d_values ? d_values : &sort.d_valuesTemp, &sort.d_valuesTemp };
+
+	for (std::size_t pass = 0; pass < 32 / radixBits; pass++) {
+		std::size_t in = pass % 2, out = 1 - in;
+		cl::Event histogramEvent, scatterEvent;
+		histogramKernel.setArg<cl::Buffer>(0, *keys[in]);
+		histogramKernel.setArg<cl::Buffer>(1, sort.d_histogram);
+		histogramKernel.setArg<cl_uint>(2, sort.count);
+		histogramKernel.setArg<cl_uint>(3, pass * radixBits);
+		queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, globalSize, localSize, NULL, &histogramEvent);
+		events.push_back(histogramEvent);
+
+		prefixSumDevice(queue, program, sort.d_histogram, NULL, sort.d_histogram, sort.levels, true, events);
+
+		scatterKernel.setArg<cl::Buffer>(0, *keys[in]);
+		scatterKernel.setArg<cl::Buffer>(1, *values[in]);
+		scatterKernel.setArg<cl::Buffer>(2, *keys[out]);
+		scatterKernel.setArg<cl::Buffer>(3, *values[out]);
+		scatterKernel.setArg<cl::Buffer>(4, sort.d_histogram);
+		scatterKernel.setArg<cl_uint>(5, sort.count);
+		scatterKernel.setArg<cl_uint>(6, pass * radixBits);
+		scatterKernel.setArg<cl_uint>(7, d_values ? 1 : 0);
+		queue.enqueueNDRangeKernel(scatterKernel, cl::NullRange, globalSize, localSize, NULL, &scatterEvent);
+		events.push_back(scatterEvent);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Generic scan: element type, operator, inclusive / exclusive, segmented
+//////////////////////////////////////////////////////////////////////////////
+// OpenCL names and limits of the supported element types
+template <typename T> struct ScanType;
+template <> struct ScanType<cl_int> {
+	static const char* name() { return "int"; }
+	static const char* clMin() { return "INT_MIN"; }
+	static const char* clMax() { return "INT_MAX"; }
+	static cl_int min() { return std::numeric_limits<cl_int>::min(); }
+	static cl_int max() { return std::numeric_limits<cl_int>::max(); }
+};
+template <> struct ScanType<cl_uint> {
+	static const char* name() { return "uint"; }
+	static const char* clMin() { return "0"; }
+	static const char* clMax() { return "UINT_MAX"; }
+	static cl_uint min() { return 0; }
+	static cl_uint max() { return std::numeric_limits<cl_uint>::max(); }
+};
+template <> struct ScanType<cl_float> {
+	static const char* name() { return "float"; }
+	static const char* clMin() { return "(-INFINITY)"; }
+	static const char* clMax() { return "INFINITY"; }
+	static cl_float min() { return -std::numeric_limits<cl_float>::infinity(); }
+	static cl_float max() { return std::numeric_limits<cl_float>::infinity(); }
+};
+template <> struct ScanType<cl_long> {
+	static const char* name() { return "long"; }
+	static const char* clMin() { return "LONG_MIN"; }
+	static const char* clMax() { return "LONG_MAX"; }
+	static cl_long min() { return std::numeric_limits<cl_long>::min(); }
+	static cl_long max() { return std::numeric_limits<cl_long>::max(); }
+};
+
+// An associative operator, given once as OpenCL C expression of a and b (for
+// the device) and once as function (for the host). A user-defined operator
+// fills in all fields.
+template <typename T> struct ScanOperator {
+	std::string name;
+	std::string clExpression;
+	std::string clIdentity;
+	T (*apply)(T a, T b);
+	T identity;
+};
+
+template <typename T> T scanAddOp(T a, T b) { return a + b; }
+template <typename T> T scanMaxOp(T a, T b) { return a < b ? b : a; }
+template <typename T> T scanMinOp(T a, T b) { return b < a ? b : a; }
+
+template <typename T> ScanOperator<T> scanAdd() {
+	ScanOperator<T> op;
+	op.name = "add";
+	op.clExpression = "a + b";
+	op.clIdentity = "0";
+	op.apply = scanAddOp<T>;
+	op.identity = 0;
+	return op;
+}
+template <typename T> ScanOperator<T> scanMax() {
+	ScanOperator<T> op;
+	op.name = "max";
+	op.clExpression = "max(a, b)";
+	op.clIdentity = ScanType<T>::clMin();
+	op.apply = scanMaxOp<T>;
+	op.identity = ScanType<T>::min();
+	return op;
+}
+template <typename T> ScanOperator<T> scanMin() {
+	ScanOperator<T> op;
+	op.name = "min";
+	op.clExpression = "min(a, b)";
+	op.clIdentity = ScanType<T>::clMax();
+	op.apply = scanMinOp<T>;
+	op.identity = ScanType<T>::max();
+	return op;
+}
+
+// Builds the .cl file with the given #define lines in front of it
+cl::Program buildProgramWithDefines(const cl::Context& context, const std::vector<cl::Device>& devices, std::size_t wgSize, const std::string& defines) {
+	std::ifstream in ("src/OpenCLExercise6_PrefixSum.cl");
+	Core::Error::check("open", in);
+	std::stringstream source;
+	source << defines;
+	source << "#line 1\n";
+	source << in.rdbuf();
+	std::string sourceString = source.str();
+	std::vector<std::pair<const char*, size_t> > sources;
+	sources.push_back(std::make_pair(sourceString.data(), sourceString.length()));
+	cl::Program program(context, sources);
+	OpenCL::buildProgram(program, devices, "-DWG_SIZE=" + boost::lexical_cast<std::string>(wgSize));
+	return program;
+}
+
+// Build the scan kernels for one element type / operator. The definitions
+// of SCAN_TYPE, SCAN_OP, SCAN_IDENTITY (and SCAN_SEGMENTED) are put in front
+// of the kernel source.
+template <typename T> cl::Program buildScanProgram(const cl::Context& context, const std::vector<cl::Device>& devices, std::size_t wgSize, const ScanOperator<T>& op, bool segmented) {
+	std::stringstream defines;
+	defines << "#define SCAN_TYPE " << ScanType<T>::name() << "\n";
+	defines << "#define SCAN_OP(a, b) (" << op.clExpression << ")\n";
+	defines << "#define SCAN_IDENTITY ((SCAN_TYPE) (" << op.clIdentity << "))\n";
+	if (segmented)
+		defines << "#define SCAN_SEGMENTED\n";
+	return buildProgramWithDefines(context, devices, wgSize, defines.str());
+}
+
+// Reference implementation. h_flags is NULL for an unsegmented scan.
+template <typename T> void scanHost(const std::vector<T>& h_input, const std::vector<cl_uchar>* h_flags, std::vector<T>& h_output, const ScanOperator<T>& op, bool exclusive) {
+	T value = op.identity;
+	for (std::size_t i = 0; i < h_input.size(); i++) {
+		if (h_flags && (*h_flags)[i])
+			value = op.identity;
+		if (exclusive) {
+			h_output[i] = value;
+			value = op.apply(value, h_input[i]);
+		} else {
+			value = op.apply(value, h_input[i]);
+			h_output[i] = value;
+		}
+	}
+}
+
+// Reduction of [begin, end) as (flag, value) pair, see the .cl file
+template <typename T> void scanHostReduceChunk(const std::vector<T>* h_input, const std::vector<cl_uchar>* h_flags, const ScanOperator<T>* op, std::size_t begin, std::size_t end, T* total, cl_uchar* totalFlag) {
+	T value = op->identity;
+	cl_uchar flag = 0;
+	for (std::size_t i = begin; i < end; i++) {
+		if (h_flags && (*h_flags)[i]) {
+			value = op->identity;
+			flag = 1;
+		}
+		value = op->apply(value, (*h_input)[i]);
+	}
+	*total = value;
+	*totalFlag = flag;
+}
+
+template <typename T> void scanHostChunk(const std::vector<T>* h_input, const std::vector<cl_uchar>* h_flags, std::vector<T>* h_output, const ScanOperator<T>* op, bool exclusive, std::size_t begin, std::size_t end, T carry) {
+	T value = carry;
+	for (std::size_t i = begin; i < end; i++) {
+		if (h_flags && (*h_flags)[i])
+			value = op->identity;
+		if (exclusive) {
+			(*h_output)[i] = value;
+			value = op->apply(value, (*h_input)[i]);
+		} else {
+			value = op->apply(value, (*h_input)[i]);
+			(*h_output)[i] = value;
+		}
+	}
+}
+
+// Multithreaded version: every thread reduces one chunk, the chunk
+// reductions are scanned sequentially and every thread scans its chunk
+// starting with the prefix of the previous chunks.
+template <typename T> void scanHostParallel(const std::vector<T>& h_input, const std::vector<cl_uchar>* h_flags, std::vector<T>& h_output, const ScanOperator<T>& op, bool exclusive, std::size_t threadCount) {
+	std::size_t count = h_input.size();
+	std::size_t chunk = (count + threadCount - 1) / threadCount;
+	std::vector<T> totals (threadCount);
+	std::vector<cl_uchar> totalFlags (threadCount);
+
+	boost::thread_group reduceThreads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		reduceThreads.create_thread(boost::bind(scanHostReduceChunk<T>, &h_input, h_flags, &op, std::min(count, t * chunk), std::min(count, (t + 1) * chunk), &totals[t], &totalFlags[t]));
+	reduceThreads.join_all();
+
+	std::vector<T> carries (threadCount);
+	T carry = op.identity;
+	for (std::size_t t = 0; t < threadCount; t++) {
+		carries[t] = carry;
+		carry = totalFlags[t] ? totals[t] : op.apply(carry, totals[t]);
+	}
+
+	boost::thread_group scanThreads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		scanThreads.create_thread(boost::bind(scanHostChunk<T>, &h_input, h_flags, &h_output, &op, exclusive, std::min(count, t * chunk), std::min(count, (t + 1) * chunk), carries[t]));
+	scanThreads.join_all();
+}
+
+// The test inputs are chosen so that every partial result is exact (also
+// for cl_float), so the results have to be identical
+template <typename T> bool scanValuesEqual(T a, T b) {
+	return a == b;
+}
+
+template <typename T> std::size_t countScanErrors(const std::vector<T>& h_expected, const std::vector<T>& h_actual, const std::string& name) {
+	std::size_t errorCount = 0;
+	for (std::size_t i = 0; i < h_expected.size(); i++) {
+		if (!scanValuesEqual(h_expected[i], h_actual[i])) {
+			if (errorCount < 5)
+				std::cout << name << ": result at " << i << " is incorrect: " << h_actual[i] << " instead of " << h_expected[i] << std::endl;
+			errorCount++;
+		}
+	}
+	return errorCount;
+}
+
+// Run all variants (inclusive / exclusive, unsegmented / segmented, both
+// device strategies, multithreaded host) of one type and operator against
+// scanHost. Returns the number of failed variants.
+template <typename T> std::size_t testScan(const cl::Context& context, const cl::CommandQueue& queue, const std::vector<cl::Device>& devices, std::size_t wgSize, const ScanOperator<T>& op, const std::vector<T>& h_input, const std::vector<cl_uchar>& h_flags) {
+	std::size_t count = h_input.size();
+	std::size_t size = count * sizeof (T);
+	std::size_t threadCount = std::max(1u, boost::thread::hardware_concurrency());
+	std::size_t failed = 0;
+	std::vector<T> h_expected (count), h_output (count);
+
+	cl::Buffer d_input(context, CL_MEM_READ_ONLY, size);
+	cl::Buffer d_flags(context, CL_MEM_READ_ONLY, count);
+	cl::Buffer d_output(context, CL_MEM_READ_WRITE, size);
+	queue.enqueueWriteBuffer(d_input, true, 0, size, h_input.data());
+	queue.enqueueWriteBuffer(d_flags, true, 0, count, h_flags.data());
+
+	for (int segmented = 0; segmented <= 1; segmented++) {
+		cl::Program program = buildScanProgram(context, devices, wgSize, op, segmented != 0);
+		PrefixSumLevels levels;
+		createPrefixSumLevels(context, wgSize, count, sizeof (T), segmented != 0, levels);
+		PrefixSumTiles tiles;
+		createPrefixSumTiles(context, wgSize, count, sizeof (T), tiles);
+		const std::vector<cl_uchar>* h_flagsPtr = segmented ? &h_flags : NULL;
+		const cl::Buffer* d_flagsPtr = segmented ? &d_flags : NULL;
+
+		for (int exclusive = 0; exclusive <= 1; exclusive++) {
+			std::string variant = std::string(ScanType<T>::name()) + " " + op.name + (exclusive ? " exclusive" : " inclusive") + (segmented ? " segmented" : "");
+			scanHost(h_input, h_flagsPtr, h_expected, op, exclusive != 0);
+
+			scanHostParallel(h_input, h_flagsPtr, h_output, op, exclusive != 0, threadCount);
+			std::size_t errors = countScanErrors(h_expected, h_output, variant + " (CPU parallel)");
+
+			for (int impl = 1; impl <= 2; impl++) {
+				std::vector<cl::Event> events;
+				if (impl == 1)
+					prefixSumDevice(queue, program, d_input, d_flagsPtr, d_output, levels, exclusive != 0, events);
+				else
+					prefixSumSinglePassDevice(queue, program, d_input, d_flagsPtr, d_output, tiles, exclusive != 0, events);
+				queue.enqueueReadBuffer(d_output, true, 0, size, h_output.data());
+				errors += countScanErrors(h_expected, h_output, variant + (impl == 1 ? " (GPU multilevel)" : " (GPU singlepass)"));
+			}
+			std::cout << std::setiosflags(std::ios::left) << std::setw(36) << variant << std::resetiosflags(std::ios::left) << (errors == 0 ? "ok" : "FAILED") << std::endl;
+			if (errors != 0)
+				failed++;
+		}
+	}
+	return failed;
+}
+
+// Test the generic scan for all types and operators (and one user-defined operator)
+int runGenericScanTests(const cl::Context& context, const cl::CommandQueue& queue, const std::vector<cl::Device>& devices, std::size_t wgSize, std::size_t count) {
+	std::vector<cl_int> h_int (count);
+	std::vector<cl_uint> h_uint (count);
+	std::vector<cl_float> h_float (count);
+	std::vector<cl_long> h_long (count);
+	std::vector<cl_uchar> h_flags (count);
+	// Small integers with mean 0 as floats: all partial sums stay far below
+	// 2^24 and are exact in any order of the additions. The longs are
+	// bounded so that no partial sum overflows (count * max |x| < 2^63).
+	cl_long longRange = std::numeric_limits<cl_long>::max() / 2 / std::max<std::size_t>(count, 1);
+	for (std::size_t i = 0; i < count; i++) {
+		h_int[i] = rand() % 100 - 40;
+		h_uint[i] = rand();
+		h_float[i] = (float) (rand() % 9 - 4);
+		h_long[i] = (((cl_long) rand() << 31) | rand()) % (2 * longRange + 1) - longRange;
+		h_flags[i] = rand() % 1000 == 0;
+	}
+
+	// Example of a user-defined operator
+	ScanOperator<cl_int> xorOp;
+	xorOp.name = "xor";
+	xorOp.clExpression = "a ^ b";
+	xorOp.clIdentity = "0";
+	xorOp.apply = scanXorOp;
+	xorOp.identity = 0;
+
+	std::size_t failed = 0;
+
+	// SIMD host prefix sum with different thread counts (chunks with and without a vector remainder)
+	std::vector<cl_int> h_expected (count), h_actual (count);
+	prefixSumHost(h_int, h_expected);
+	for (std::size_t threadCount = 1; threadCount <= 7; threadCount += 3) {
+		prefixSumHostParallel(h_int, h_actual, threadCount);
+		if (countScanErrors(h_expected, h_actual, "prefixSumHostParallel " + boost::lexical_cast<std::string>(threadCount) + " threads") != 0)
+			failed++;
+	}
+
+	failed += testScan(context, queue, devices, wgSize, scanAdd<cl_int>(), h_int, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMax<cl_int>(), h_int, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMin<cl_int>(), h_int, h_flags);
+	failed += testScan(context, queue, devices, wgSize, xorOp, h_int, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanAdd<cl_uint>(), h_uint, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMax<cl_uint>(), h_uint, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMin<cl_uint>(), h_uint, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanAdd<cl_float>(), h_float, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMax<cl_float>(), h_float, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMin<cl_float>(), h_float, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanAdd<cl_long>(), h_long, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMax<cl_long>(), h_long, h_flags);
+	failed += testScan(context, queue, devices, wgSize, scanMin<cl_long>(), h_long, h_flags);
+	if (failed != 0) {
+		std::cout << failed << " variants failed" << std::endl;
+		return 1;
+	}
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Stream compaction and radix sort: check against the host and timing
+//////////////////////////////////////////////////////////////////////////////
+Core::TimeSpan sumElapsedTime(const std::vector<cl::Event>& events) {
+	Core::TimeSpan time = Core::TimeSpan::fromSeconds(0);
+	for (std::size_t i = 0; i < events.size(); i++)
+		time = time + OpenCL::getElapsedTime(events[i]);
+	return time;
+}
+
+int runCompaction(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize, std::size_t count) {
+	std::size_t size = count * sizeof (cl_int);
+	std::vector<cl_int> h_input (count);
+	for (std::size_t i = 0; i < count; i++)
+		h_input[i] = rand() % 100 - 40;
+
+	// Host version of the default COMPACT_PREDICATE
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	std::vector<cl_int> h_expected;
+	h_expected.reserve(count);
+	for (std::size_t i = 0; i < count; i++)
+		if (h_input[i] > 0)
+			h_expected.push_back(h_input[i]);
+	Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
+
+	cl::Buffer d_input(context, CL_MEM_READ_ONLY, std::max<std::size_t>(size, 1));
+	cl::Buffer d_output(context, CL_MEM_READ_WRITE, std::max<std::size_t>(size, 1));
+	queue.enqueueWriteBuffer(d_input, true, 0, size, h_input.data());
+	StreamCompaction compaction;
+	createStreamCompaction(context, wgSize, count, compaction);
+	std::vector<cl::Event> events;
+	std::size_t keptCount = compactDevice(queue, program, d_input, d_output, compaction, events);
+	Core::TimeSpan gpuTime = sumElapsedTime(events);
+	std::cout << "Compaction of " << count << " values: " << keptCount << " kept, CPU Time: " << cpuTime << ", GPU Time: " << gpuTime << " (" << events.size() << " kernel launches, speedup = " << (cpuTime.getSeconds() / gpuTime.getSeconds()) << ")" << std::endl;
+
+	if (keptCount != h_expected.size()) {
+		std::cout << "Kept " << keptCount << " values instead of " << h_expected.size() << std::endl;
+		return 1;
+	}
+	std::vector<cl_int> h_output (keptCount);
+	queue.enqueueReadBuffer(d_output, true, 0, keptCount * sizeof (cl_int), h_output.data());
+	if (countScanErrors(h_expected, h_output, "Compaction") != 0)
+		return 1;
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+int runRadixSort(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, std::size_t wgSize, std::size_t count) {
+	std::size_t size = count * sizeof (cl_uint);
+	std::vector<cl_uint> h_keys (count), h_values (count);
+	for (std::size_t i = 0; i < count; i++) {
+		h_keys[i] = ((cl_uint) rand() << 16) ^ (cl_uint) rand();
+		// Some duplicates to check the stability
+		if (i % 4 == 0)
+			h_keys[i] %= 1000;
+		h_values[i] = i;
+	}
+
+	// Sorting (key, index) pairs gives the result of a stable sort by key
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	std::vector<std::pair<cl_uint, cl_uint> > h_pairs (count);
+	for (std::size_t i = 0; i < count; i++)
+		h_pairs[i] = std::make_pair(h_keys[i], h_values[i]);
+	std::sort(h_pairs.begin(), h_pairs.end());
+	Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
+	std::vector<cl_uint> h_expectedKeys (count), h_expectedValues (count);
+	for (std::size_t i = 0; i < count; i++) {
+		h_expectedKeys[i] = h_pairs[i].first;
+		h_expectedValues[i] = h_pairs[i].second;
+	}
+
+	cl::Buffer d_keys(context, CL_MEM_READ_WRITE, std::max<std::size_t>(size, 1));
+	cl::Buffer d_values(context, CL_MEM_READ_WRITE, std::max<std::size_t>(size, 1));
+	RadixSort sort;
+	createRadixSort(context, wgSize, count, true, sort);
+	std::vector<cl_uint> h_outputKeys (count), h_outputValues (count);
+	std::size_t errors = 0;
+	for (int withValues = 0; withValues <= 1; withValues++) {
+		queue.enqueueWriteBuffer(d_keys, true, 0, size, h_keys.data());
+		queue.enqueueWriteBuffer(d_values, true, 0, size, h_values.data());
+		std::vector<cl::Event> events;
+		radixSortDevice(queue, program, d_keys, withValues ? &d_values : NULL, sort, events);
+		Core::TimeSpan gpuTime = sumElapsedTime(events);
+		double keysPerSecond = count / gpuTime.getSeconds();
+		std::cout << "Radix sort of " << count << (withValues ? " key-value pairs" : " keys") << ": CPU Time (std::sort): " << cpuTime << ", GPU Time: " << gpuTime << " (" << events.size() << " kernel launches, " << (keysPerSecond * 1e-6) << " Mkeys/s, speedup = " << (cpuTime.getSeconds() / gpuTime.getSeconds()) << ")" << std::endl;
+
+		queue.enqueueReadBuffer(d_keys, true, 0, size, h_outputKeys.data());
+		errors += countScanErrors(h_expectedKeys, h_outputKeys, "Radix sort keys");
+		if (withValues) {
+			queue.enqueueReadBuffer(d_values, true, 0, size, h_outputValues.data());
+			errors += countScanErrors(h_expectedValues, h_outputValues, "Radix sort values");
+		}
+	}
+	if (errors != 0)
+		return 1;
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Out-of-core scan: throughput and check
+//////////////////////////////////////////////////////////////////////////////
+// Scans count random values or, if filename is not empty, the cl_int values
+// of a memory mapped file. chunkSize == 0 selects the chunk size from the
+// device memory. The result is checked with a running sum, so no second
+// copy of the data is needed on the host.
+int runStreamScan(const cl::Context& context, const cl::Device& device, const cl::Program& program, std::size_t wgSize, std::size_t count, std::size_t chunkSize, const std::string& filename) {
+	std::vector<cl_int> h_data;
+	const cl_int* h_input;
+	boost::scoped_ptr<MappedFile> file;
+	if (!filename.empty()) {
+		file.reset(new MappedFile(filename));
+		count = file->size() / sizeof (cl_int);
+		h_input = (const cl_int*) file->data();
+		std::cout << "Input file '" << filename << "'" << std::endl;
+	} else {
+		h_data.resize(count);
+		for (std::size_t i = 0; i < count; i++)
+			h_data[i] = rand() % 100 - 40;
+		h_input = h_data.data();
+	}
+	std::vector<cl_int> h_output (count);
+
+	if (chunkSize == 0)
+		chunkSize = prefixSumStreamChunkSize(device, wgSize, sizeof (cl_int));
+	PrefixSumStream stream;
+	createPrefixSumStream(context, device, wgSize, chunkSize, sizeof (cl_int), stream);
+	std::size_t chunkCount = (count + stream.chunkSize - 1) / stream.chunkSize;
+	std::cout << count << " values (" << (count * sizeof (cl_int) / 1e9) << " GB) in " << chunkCount << " chunks of " << stream.chunkSize << " values" << std::endl;
+
+	std::vector<cl::Event> uploadEvents, scanEvents, downloadEvents;
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	prefixSumStreamDevice(program, h_input, h_output.data(), count, stream, uploadEvents, scanEvents, downloadEvents);
+	Core::TimeSpan wallTime = Core::getCurrentTime() - time1;
+
+	// Without overlap the wall time would be the sum of the three stages
+	Core::TimeSpan uploadTime = sumElapsedTime(uploadEvents);
+	Core::TimeSpan scanTime = sumElapsedTime(scanEvents);
+	Core::TimeSpan downloadTime = sumElapsedTime(downloadEvents);
+	double bytes = count * sizeof (cl_int);
+	std::cout << "Upload: " << uploadTime << " (" << (bytes / uploadTime.getSeconds() * 1e-9) << " GB/s), scan: " << scanTime << ", download: " << downloadTime << " (" << (bytes / downloadTime.getSeconds() * 1e-9) << " GB/s)" << std::endl;
+	std::cout << "Wall time: " << wallTime << " (" << (bytes / wallTime.getSeconds() * 1e-9) << " GB/s of input, stages sum up to " << (uploadTime + scanTime + downloadTime) << ")" << std::endl;
+
+	cl_int sum = 0;
+	std::size_t errorCount = 0;
+	for (std::size_t i = 0; i < count; i++) {
+		sum += h_input[i];
+		if (h_output[i] != sum) {
+			if (errorCount < 15)
+				std::cout << "Result at " << i << " is incorrect: GPU value is " << h_output[i] << ", CPU value is " << sum << std::endl;
+			errorCount++;
+		}
+	}
+	if (errorCount != 0) {
+		std::cout << "Found " << errorCount << " incorrect results" << std::endl;
+		return 1;
+	}
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Histogram: privatized bins in local memory on the device, per-thread bins on the host
+//////////////////////////////////////////////////////////////////////////////
+// Value x falls into bin (x - minValue) / binWidth (integer division for
+// integer types), values outside of the bins are ignored.
+template <typename T> bool histogramBin(T x, T minValue, T binWidth, std::size_t binCount, std::size_t& bin) {
+	if (!(x >= minValue))
+		return false;
+	T b = (x - minValue) / binWidth;
+	if (!(b < (T) binCount))
+		return false;
+	bin = (std::size_t) b;
+	return true;
+}
+
+// Compiles the histogram kernels for element type T and binCount bins. As
+// many copies of the bins as fit into half of the local memory (at most 16)
+// are used per work group.
+template <typename T> cl::Program buildHistogramProgram(const cl::Context& context, const cl::Device& device, std::size_t wgSize, std::size_t binCount) {
+	std::size_t localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	std::size_t binsSize = binCount * sizeof (cl_uint);
+	ASSERT (binsSize <= localMemSize);
+	std::size_t copies = std::max<std::size_t>(1, std::min<std::size_t>(16, localMemSize / 2 / binsSize));
+	std::stringstream defines;
+	defines << "#define HISTOGRAM_TYPE " << ScanType<T>::name() << "\n";
+	defines << "#define HISTOGRAM_BINS " << binCount << "\n";
+	defines << "#define HISTOGRAM_COPIES " << copies << "\n";
+	return buildProgramWithDefines(context, std::vector<cl::Device>(1, device), wgSize, defines.str());
+}
+
+struct Histogram {
+	std::size_t wgSize;
+	std::size_t binCount;
+	std::size_t groupCount;
+	cl::Buffer d_partial; // groupCount * binCount counts of the work groups
+	cl::Buffer d_histogram; // binCount counts
+};
+void createHistogram(const cl::Context& context, const cl::Device& device, std::size_t wgSize, std::size_t binCount, Histogram& histogram) {
+	histogram.wgSize = wgSize;
+	histogram.binCount = binCount;
+	// Enough work groups to fill the device, every additional group adds a partial histogram to merge
+	histogram.groupCount = 8 * device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+	histogram.d_partial = cl::Buffer(context, CL_MEM_READ_WRITE, histogram.groupCount * binCount * sizeof (cl_uint));
+	histogram.d_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, binCount * sizeof (cl_uint));
+}
+
+// Histogram of count values of d_input (program from buildHistogramProgram<T>)
+// in histogram.d_histogram. Counting in the local bins of every work group,
+// merging the copies of a work group and merging the work groups are the
+// three levels; the only global writes are the partial histograms.
+template <typename T> void histogramDevice(const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& d_input, std::size_t count, T minValue, T binWidth, const Histogram& histogram, std::vector<cl::Event>& events) {
+	cl::Kernel histogramKernel(program, "histogramKernel");
+	cl::Event histogramEvent;
+	histogramKernel.setArg<cl::Buffer>(0, d_input);
+	histogramKernel.setArg<cl_uint>(1, count);
+	histogramKernel.setArg<T>(2, minValue);
+	histogramKernel.setArg<T>(3, binWidth);
+	histogramKernel.setArg<cl::Buffer>(4, histogram.d_partial);
+	queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(histogram.groupCount * histogram.wgSize), cl::NDRange(histogram.wgSize), NULL, &histogramEvent);
+	events.push_back(histogramEvent);
+
+	cl::Kernel mergeKernel(program, "histogramMergeKernel");
+	cl::Event mergeEvent;
+	mergeKernel.setArg<cl::Buffer>(0, histogram.d_partial);
+	mergeKernel.setArg<cl_uint>(1, histogram.groupCount);
+	mergeKernel.setArg<cl::Buffer>(2, histogram.d_histogram);
+	std::size_t globalSize = (histogram.binCount + histogram.wgSize - 1) / histogram.wgSize * histogram.wgSize;
+	queue.enqueueNDRangeKernel(mergeKernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(histogram.wgSize), NULL, &mergeEvent);
+	events.push_back(mergeEvent);
+}
+
+template <typename T> void histogramHostChunk(const std::vector<T>* h_input, std::size_t begin, std::size_t end, T minValue, T binWidth, std::vector<cl_uint>* h_bins) {
+	std::size_t binCount = h_bins->size();
+	for (std::size_t i = begin; i < end; i++) {
+		std::size_t bin;
+		if (histogramBin((*h_input)[i], minValue, binWidth, binCount, bin))
+			(*h_bins)[bin]++;
+	}
+}
+
+template <typename T> void histogramHost(const std::vector<T>& h_input, T minValue, T binWidth, std::vector<cl_uint>& h_histogram) {
+	std::fill(h_histogram.begin(), h_histogram.end(), 0);
+	histogramHostChunk(&h_input, 0, h_input.size(), minValue, binWidth, &h_histogram);
+}
+
+// Multithreaded version: every thread counts one chunk in its own bins, the bins are added up afterwards
+template <typename T> void histogramHostParallel(const std::vector<T>& h_input, T minValue, T binWidth, std::vector<cl_uint>& h_histogram, std::size_t threadCount) {
+	std::size_t count = h_input.size();
+	std::size_t chunk = (count + threadCount - 1) / threadCount;
+	std::vector<std::vector<cl_uint> > bins (threadCount, std::vector<cl_uint>(h_histogram.size()));
+	boost::thread_group threads;
+	for (std::size_t t = 0; t < threadCount; t++)
+		threads.create_thread(boost::bind(histogramHostChunk<T>, &h_input, std::min(count, t * chunk), std::min(count, (t + 1) * chunk), minValue, binWidth, &bins[t]));
+	threads.join_all();
+	for (std::size_t b = 0; b < h_histogram.size(); b++) {
+		cl_uint sum = 0;
+		for (std::size_t t = 0; t < threadCount; t++)
+			sum += bins[t][b];
+		h_histogram[b] = sum;
+	}
+}
+
+template <typename T> std::size_t testHistogram(const cl::Context& context, const cl::CommandQueue& queue, const cl::Device& device, std::size_t wgSize, const std::vector<T>& h_input, T minValue, T binWidth, std::size_t binCount) {
+	std::size_t count = h_input.size();
+	std::size_t threadCount = std::max(1u, boost::thread::hardware_concurrency());
+	std::string variant = std::string(ScanType<T>::name()) + ", " + boost::lexical_cast<std::string>(binCount) + " bins";
+	std::vector<cl_uint> h_expected (binCount), h_output (binCount);
+	histogramHost(h_input, minValue, binWidth, h_expected);
+
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	histogramHostParallel(h_input, minValue, binWidth, h_output, threadCount);
+	Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
+	std::size_t errors = countScanErrors(h_expected, h_output, variant + " (CPU parallel)");
+
+	cl::Program program = buildHistogramProgram<T>(context, device, wgSize, binCount);
+	Histogram histogram;
+	createHistogram(context, device, wgSize, binCount, histogram);
+	cl::Buffer d_input(context, CL_MEM_READ_ONLY, std::max<std::size_t>(count, 1) * sizeof (T));
+	queue.enqueueWriteBuffer(d_input, true, 0, count * sizeof (T), h_input.data());
+	std::vector<cl::Event> events;
+	histogramDevice(queue, program, d_input, count, minValue, binWidth, histogram, events);
+	queue.enqueueReadBuffer(histogram.d_histogram, true, 0, binCount * sizeof (cl_uint), h_output.data());
+	Core::TimeSpan gpuTime = sumElapsedTime(events);
+	errors += countScanErrors(h_expected, h_output, variant + " (GPU)");
+
+	std::cout << std::setiosflags(std::ios::left) << std::setw(20) << variant << std::resetiosflags(std::ios::left) << (errors == 0 ? "ok" : "FAILED")
+			<< ", CPU Time (" << threadCount << " threads): " << cpuTime << ", GPU Time: " << gpuTime << " (" << (count * sizeof (T) / gpuTime.getSeconds() * 1e-9) << " GB/s)" << std::endl;
+	return errors != 0 ? 1 : 0;
+}
+
+// Different input types, a few bins (contended atomics) and many bins
+int runHistogramTests(const cl::Context& context, const cl::CommandQueue& queue, const cl::Device& device, std::size_t wgSize, std::size_t count) {
+	std::vector<cl_uint> h_uint (count);
+	std::vector<cl_int> h_int (count);
+	std::vector<cl_float> h_float (count);
+	std::vector<cl_long> h_long (count);
+	for (std::size_t i = 0; i < count; i++) {
+		h_uint[i] = rand() % 256;
+		h_int[i] = rand() % 100 - 40;
+		h_float[i] = (rand() % 400 - 160) / 4.0f;
+		h_long[i] = ((cl_long) rand() << 20) - ((cl_long) rand() << 19);
+	}
+
+	std::size_t failed = 0;
+	failed += testHistogram<cl_uint>(context, queue, device, wgSize, h_uint, 0, 1, 256);
+	failed += testHistogram<cl_uint>(context, queue, device, wgSize, h_uint, 0, 16, 16);
+	failed += testHistogram<cl_uint>(context, queue, device, wgSize, h_uint, 0, 64, 4);
+	failed += testHistogram<cl_int>(context, queue, device, wgSize, h_int, -40, 3, 20);
+	failed += testHistogram<cl_float>(context, queue, device, wgSize, h_float, -32.0f, 0.25f, 4096);
+	failed += testHistogram<cl_long>(context, queue, device, wgSize, h_long, 0, (cl_long) 1 << 40, 1000);
+	if (failed != 0) {
+		std::cout << failed << " variants failed" << std::endl;
+		return 1;
+	}
+	std::cout << "Success" << std::endl;
+	return 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Main function
 //////////////////////////////////////////////////////////////////////////////
@@ -74,7 +1250,14 @@ int main(int argc, char** argv) {
 
 	// Declare some values
 	std::size_t wgSize = 256; // Number of work items per work group
-	std::size_t count = wgSize * wgSize * wgSize; // Number of values
+	std::size_t count = argc < 3 ? 10000000 : boost::lexical_cast<std::size_t>(argv[2]); // Number of values, does not have to be a multiple of anything
+	// "multilevel", "singlepass", "all", "generic" (test of all types / operators), "compact" or "sort" (primitives built on the scan)
+	// or "stream" (out-of-core scan, optional arguments: chunk size in values, input file with cl_int values) or "histogram"
+	std::string strategy = argc < 4 ? "all" : argv[3];
+	if (strategy != "multilevel" && strategy != "singlepass" && strategy != "all" && strategy != "generic" && strategy != "compact" && strategy != "sort" && strategy != "stream" && strategy != "histogram") {
+		std::cerr << "Unknown scan strategy '" << strategy << "', use multilevel, singlepass, all, generic, compact, sort, stream or histogram" << std::endl;
+		return 1;
+	}
 
 	std::size_t size = count * sizeof (cl_int);
 
@@ -84,23 +1267,36 @@ int main(int argc, char** argv) {
 	// This will pass the value of wgSize as a preprocessor constant "WG_SIZE" to the OpenCL C compiler
 	OpenCL::buildProgram(program, devices, "-DWG_SIZE=" + boost::lexical_cast<std::string>(wgSize));
 
+	if (strategy == "generic")
+		return runGenericScanTests(context, queue, devices, wgSize, count);
+	if (strategy == "compact")
+		return runCompaction(context, queue, program, wgSize, count);
+	if (strategy == "sort")
+		return runRadixSort(context, queue, program, wgSize, count);
+	if (strategy == "histogram")
+		return runHistogramTests(context, queue, device, wgSize, count);
+	if (strategy == "stream")
+		return runStreamScan(context, device, program, wgSize, count, argc < 5 ? 0 : boost::lexical_cast<std::size_t>(argv[4]), argc < 6 ? "" : argv[5]);
+
 	// Allocate space for output data from CPU and GPU on the host
 	std::vector<cl_int> h_input (count);
 	std::vector<cl_int> h_outputCpu (count);
-	std::vector<cl_int> h_temp1 (wgSize * wgSize);
-	std::vector<cl_int> h_temp2 (wgSize);
 	std::vector<cl_int> h_outputGpu (count);
 
-	// Allocate space for input and output data on the device
-	//TODO
+	// Allocate space for input and output data on the device (and for the block sums of all levels)
+	cl::Buffer d_input(context, CL_MEM_READ_WRITE, size);
+	cl::Buffer d_output(context, CL_MEM_READ_WRITE, size);
+	PrefixSumLevels levels;
+	createPrefixSumLevels(context, wgSize, count, sizeof (cl_int), false, levels);
+	PrefixSumTiles tiles;
+	createPrefixSumTiles(context, wgSize, count, sizeof (cl_int), tiles);
 
 	// Initialize memory to 0xff (useful for debugging because otherwise GPU memory will contain information from last execution)
 	memset(h_input.data(), 255, size);
-	memset(h_temp1.data(), 255, wgSize * wgSize * sizeof (cl_int));
-	memset(h_temp2.data(), 255, wgSize * sizeof (cl_int));
 	memset(h_outputCpu.data(), 255, size);
 	memset(h_outputGpu.data(), 255, size);
-	//TODO: GPU
+	queue.enqueueWriteBuffer(d_input, true, 0, size, h_input.data());
+	queue.enqueueWriteBuffer(d_output, true, 0, size, h_outputGpu.data());
 
 	//////// Generate input data ////////////////////////////////
 	// Use random input data
@@ -112,38 +1308,73 @@ int main(int argc, char** argv) {
 		h_input[i] = i;
 	// */
 
-	// Do calculation on the host side
-	prefixSumHost(h_input, h_outputCpu);
+	// Do calculation on the host side (multithreaded, the result is the reference for the device)
+	std::size_t threadCount = std::max(1u, boost::thread::hardware_concurrency());
+	Core::TimeSpan time1 = Core::getCurrentTime();
+	prefixSumHostParallel(h_input, h_outputCpu, threadCount);
+	Core::TimeSpan cpuTime = Core::getCurrentTime() - time1;
 
-	// Create kernels
-	//TODO
+	std::cout << count << " values, CPU Time (" << threadCount << " threads): " << cpuTime << std::endl;
 
 	// Copy input data to device
-	//TODO
+	cl::Event copy1;
+	queue.enqueueWriteBuffer(d_input, true, 0, size, h_input.data(), NULL, &copy1);
 
-	// Call the kernels
-	//TODO
+	// Reference for the bandwidth: device to device copy of the input
+	cl::Event copyEvent;
+	queue.enqueueCopyBuffer(d_input, d_output, 0, 0, size, NULL, &copyEvent);
+	copyEvent.wait();
+	Core::TimeSpan deviceCopyTime = OpenCL::getElapsedTime(copyEvent);
+	double copyBandwidth = 2.0 * size / deviceCopyTime.getSeconds() * 1e-9;
+	std::cout << "Device copy: " << deviceCopyTime << " (" << copyBandwidth << " GB/s)" << std::endl;
 
-	// Copy output data back to host
-	//TODO
+	for (int impl = 1; impl <= 2; impl++) {
+		std::string name = impl == 1 ? "multilevel" : "singlepass";
+		if (strategy != "all" && strategy != name)
+			continue;
+		std::cout << std::endl << "Strategy " << name << ":" << std::endl;
 
-	// Print performance data
-	//TODO
+		// Reinitialize output memory to 0xff
+		memset(h_outputGpu.data(), 255, size);
+		queue.enqueueWriteBuffer(d_output, true, 0, size, h_outputGpu.data());
 
-	// Check whether results are correct
-	std::size_t errorCount = 0;
-	for (size_t i = 0; i < count; i = i + 1) {
-		if (h_outputCpu[i] != h_outputGpu[i]) {
-			if (errorCount < 15)
-				std::cout << "Result at " << i << " is incorrect: GPU value is " << h_outputGpu[i] << ", CPU value is " << h_outputCpu[i] << std::endl;
-			else if (errorCount == 15)
-				std::cout << "..." << std::endl;
-			errorCount++;
+		// Call the kernels
+		std::vector<cl::Event> events;
+		if (impl == 1) {
+			prefixSumDevice(queue, program, d_input, NULL, d_output, levels, false, events);
+			std::cout << levels.counts.size() << " levels, " << events.size() << " kernel launches" << std::endl;
+		} else {
+			prefixSumSinglePassDevice(queue, program, d_input, NULL, d_output, tiles, false, events);
+			std::cout << tiles.tileCount << " tiles, " << events.size() << " kernel launches" << std::endl;
+		}
+
+		// Copy output data back to host
+		cl::Event copy2;
+		queue.enqueueReadBuffer(d_output, true, 0, size, h_outputGpu.data(), NULL, &copy2);
+
+		// Print performance data. The bandwidth counts reading the input and writing the output once.
+		Core::TimeSpan gpuTime = sumElapsedTime(events);
+		Core::TimeSpan copyTime = OpenCL::getElapsedTime(copy1) + OpenCL::getElapsedTime(copy2);
+		double bandwidth = 2.0 * size / gpuTime.getSeconds() * 1e-9;
+		std::cout << "Memory copy Time: " << copyTime << std::endl;
+		std::cout << "GPU Time w/o memory copy: " << gpuTime << " (speedup = " << (cpuTime.getSeconds() / gpuTime.getSeconds()) << ", " << bandwidth << " GB/s = " << (100 * bandwidth / copyBandwidth) << "% of device copy)" << std::endl;
+		std::cout << "GPU Time with memory copy: " << (gpuTime + copyTime) << " (speedup = " << (cpuTime.getSeconds() / (gpuTime + copyTime).getSeconds()) << ")" << std::endl;
+
+		// Check whether results are correct
+		std::size_t errorCount = 0;
+		for (size_t i = 0; i < count; i = i + 1) {
+			if (h_outputCpu[i] != h_outputGpu[i]) {
+				if (errorCount < 15)
+					std::cout << "Result at " << i << " is incorrect: GPU value is " << h_outputGpu[i] << ", CPU value is " << h_outputCpu[i] << std::endl;
+				else if (errorCount == 15)
+					std::cout << "..." << std::endl;
+				errorCount++;
+			}
+		}
+		if (errorCount != 0) {
+			std::cout << "Found " << errorCount << " incorrect results" << std::endl;
+			return 1;
 		}
-	}
-	if (errorCount != 0) {
-		std::cout << "Found " << errorCount << " incorrect results" << std::endl;
-		return 1;
 	}
 
 	std::cout << "Success" << std::endl;